@@ -0,0 +1,280 @@
+/**
+  ******************************************************************************
+  * @file           : bench_main.c
+  * @brief          : Host benchmarks of the firmware logic modules
+  ******************************************************************************
+  * @attention
+  *
+  * Copyright (c) 2023 Nicolò Campanini.
+  * All rights reserved.
+  *
+  * This software is licensed under terms that can be found in the LICENSE file
+  * in the root directory of this software component.
+  * If no LICENSE file comes with this software, it is provided AS-IS.
+  *
+  ******************************************************************************
+  */
+
+#include "sim.h"
+#include "gps_parser.h"
+#include "timezone_dst.h"
+#include "nixie_display.h"
+#include "config.h"
+#include "prng.h"
+#include "deferred.h"
+#include "scheduler.h"
+#include "nixie_usage.h"
+#include <time.h>
+
+
+
+
+
+// The modules are the firmware ones, built for the host: the times are
+// for comparing two versions of the code, not cycles of the target. One
+// line per benchmark:
+//   bench <name> n=<iterations> ns=<nanoseconds per iteration>
+
+#define BENCH_ITERATIONS 1000000
+// Runs of each benchmark: the fastest is kept, the others met interruptions
+#define BENCH_REPEATS 5
+
+// Burst of the receiver for one second, as the DMA leaves it
+#define BENCH_GPS_BURST "$GPRMC,083015.000,A,4527.600,N,00911.400,E,0.00,0.00,150626,,,A*68\r\n" \
+                        "$GPGGA,083015.000,4527.600,N,00911.400,E,1,08,1.0,120.0,M,47.0,M,,*55\r\n" \
+                        "$GPZDA,083015.000,15,06,2026,00,00*5D\r\n"
+
+typedef struct{
+  const char *name;
+  uint32_t iterations;
+  void (*run)(uint32_t _iterations);
+} Bench_case_t;
+
+// Not in gps_parser.h: the buffers are filled by the UART callback
+extern GPS_buffer_struct_t GPS_buffer_struct;
+
+// Handles and display tick work of main.c, not in a header
+extern RTC_HandleTypeDef hrtc;
+extern SPI_HandleTypeDef hspi2;
+extern TIM_HandleTypeDef htim1;
+extern TIM_HandleTypeDef htim11;
+extern volatile uint8_t Deferred_head;
+extern volatile uint8_t Deferred_tail;
+void Display_tick_work(uint32_t _arg);
+
+// Results read back, so that nothing is optimized out
+volatile uint32_t Bench_sink = 0;
+
+
+
+
+
+void Bench_gps_burst(uint32_t _iterations)
+{
+  // Scan of a burst and parse of its ZDA sentence
+  for (uint32_t i = 0; i < _iterations; i++) {
+    memcpy(GPS_buffer_struct.buffer[0], BENCH_GPS_BURST, sizeof(BENCH_GPS_BURST));
+    GPS_buffer_struct.buffer_size[0] = sizeof(BENCH_GPS_BURST);
+    GPS_buffer_struct.whole[0] = 1;
+    GPS_buffer_struct.buffer_status[0] = 1;
+    GPS_Update_Data();
+    Bench_sink += GPS_Read_Datetime().time.Seconds;
+  }
+}
+
+
+
+
+
+void Bench_timezone(uint32_t _iterations)
+{
+  // One conversion per display tick, across days and the DST changes
+  RTC_TimeTypeDef time = {0};
+  RTC_DateTypeDef date = {0};
+
+  for (uint32_t i = 0; i < _iterations; i++) {
+    uint32_t seconds = i * 37;
+    time.Hours = (seconds / 3600) % 24;
+    time.Minutes = (seconds / 60) % 60;
+    time.Seconds = seconds % 60;
+    date.Date = 1 + (i / 4096) % 28;
+    date.Month = 1 + (i / 16384) % 12;
+    date.Year = 26;
+    Apply_timezone_dst(&time, &date);
+    Bench_sink += time.Hours + date.Date;
+  }
+}
+
+
+
+
+
+void Bench_frame_encode(uint32_t _iterations)
+{
+  // Time to digits to SPI frame, as Nixie_update_display()
+  uint8_t digits[NIXIE_TUBES];
+  uint8_t spi[SPI_BUFFER_SIZE];
+
+  for (uint32_t i = 0; i < _iterations; i++) {
+    Nixie_time_to_digits((i / 3600) % 24, (i / 60) % 60, i % 60, digits);
+    Nixie_encode_frame(digits, spi);
+    Bench_sink += spi[i % SPI_BUFFER_SIZE];
+  }
+}
+
+
+
+
+
+void Bench_prng(uint32_t _iterations)
+{
+  // One draw of the generator of the animations
+  PRNG_state_t prng;
+
+  PRNG_seed(&prng, PRNG_DEFAULT_SEED);
+  for (uint32_t i = 0; i < _iterations; i++) {
+    Bench_sink += PRNG_next(&prng);
+  }
+}
+
+
+
+
+
+void Bench_rand(uint32_t _iterations)
+{
+  // The C library rand() that PRNG_next() replaced, for comparison: the
+  // host one, the newlib one is not linked in the image any more
+  srand(PRNG_DEFAULT_SEED);
+  for (uint32_t i = 0; i < _iterations; i++) {
+    Bench_sink += (uint32_t) rand();
+  }
+}
+
+
+
+
+
+void Bench_tick_inline(uint32_t _iterations)
+{
+  // The TIM11 handler as it was before the PendSV queue: the whole display
+  // tick work in the interrupt, each tick sending its frame. Masked, as no
+  // handler of the simulation is to run in between.
+  __disable_irq();
+  for (uint32_t i = 0; i < _iterations; i++) {
+    hspi2.State = HAL_SPI_STATE_READY;
+    Display_tick_work(0);
+  }
+  Bench_sink += hspi2.State;
+}
+
+
+
+
+
+void Bench_tick_deferred(uint32_t _iterations)
+{
+  // The TIM11 handler now: the work posted to PendSV, the housekeeping
+  // task woken. Masked, PendSV is not to run: the queue is emptied as is.
+  __disable_irq();
+  for (uint32_t i = 0; i < _iterations; i++) {
+    HAL_TIM_PeriodElapsedCallback(&htim11);
+    Deferred_tail = Deferred_head;
+  }
+  Bench_sink += Deferred_head;
+}
+
+
+
+
+
+const Bench_case_t Bench_cases[] = {
+  {"gps_burst", BENCH_ITERATIONS / 4, Bench_gps_burst},
+  {"timezone", BENCH_ITERATIONS, Bench_timezone},
+  {"frame_encode", BENCH_ITERATIONS * 4, Bench_frame_encode},
+  {"prng", BENCH_ITERATIONS * 4, Bench_prng},
+  {"rand", BENCH_ITERATIONS * 4, Bench_rand},
+  {"tick_inline", BENCH_ITERATIONS / 4, Bench_tick_inline},
+  {"tick_deferred", BENCH_ITERATIONS, Bench_tick_deferred}
+};
+
+#define BENCH_CASES (sizeof(Bench_cases) / sizeof(Bench_cases[0]))
+
+
+
+
+
+uint64_t Bench_now_ns()
+{
+  struct timespec now;
+
+  // Time of this thread on the CPU: the other processes do not count
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+  return((uint64_t) now.tv_sec * SIM_NS_PER_S + (uint64_t) now.tv_nsec);
+}
+
+
+
+
+
+int main(int argc, char **argv)
+{
+  const char *only = NULL;
+  double scale = 1.0;
+  int run = 0;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--bench") == 0 && i + 1 < argc) {
+      only = argv[++i];
+    } else if (strcmp(argv[i], "--scale") == 0 && i + 1 < argc) {
+      scale = atof(argv[++i]);
+    } else {
+      fprintf(stderr, "usage: %s [--bench NAME] [--scale FACTOR]\n", argv[0]);
+      return(2);
+    }
+  }
+
+  // The probes of the modules read the DWT counter, the parser the tick
+  Sim_map_memory();
+  Config.timezone_offset_s = TIMEZONE_OFFSET_S;
+  Config.dst_offset_s = DST_OFFSET_S;
+  // The peripherals of the display tick, as main() leaves them
+  hrtc.Instance = RTC;
+  hspi2.Instance = SPI2;
+  htim1.Instance = TIM1;
+  htim11.Instance = TIM11;
+  Sched_init();
+  Deferred_init();
+  Nixie_init(&hspi2, &htim1, TIM_CHANNEL_1);
+  KV_init();
+  Nixie_usage_init(&hrtc);
+
+  for (uint8_t b = 0; b < BENCH_CASES; b++) {
+    if (only != NULL && strcmp(only, Bench_cases[b].name) != 0) {
+      continue;
+    }
+    uint32_t iterations = (uint32_t) (Bench_cases[b].iterations * scale);
+    if (iterations == 0) {
+      iterations = 1;
+    }
+    // Warm the caches, then measure
+    Bench_cases[b].run(iterations / 10 + 1);
+    uint64_t best = UINT64_MAX;
+    for (uint8_t r = 0; r < BENCH_REPEATS; r++) {
+      uint64_t start = Bench_now_ns();
+      Bench_cases[b].run(iterations);
+      uint64_t elapsed = Bench_now_ns() - start;
+      if (elapsed < best) {
+        best = elapsed;
+      }
+    }
+    printf("bench %s n=%u ns=%.2f\n", Bench_cases[b].name, iterations, (double) best / iterations);
+    run++;
+  }
+
+  if (run == 0) {
+    fprintf(stderr, "bench: no benchmark named %s\n", only);
+    return(2);
+  }
+  return(0);
+}
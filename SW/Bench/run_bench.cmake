@@ -0,0 +1,246 @@
+##############################################################################
+# Benchmark runner: measures, compares with a baseline file, writes results
+#
+#   cmake [-DBENCH=<nixie_bench>] [-DSIM=<nixie_sim>] [-DSIZE_REPORT=<report>]
+#         -DBASELINE=<file> -DRESULTS=<json> [-DUPDATE=ON] -P run_bench.cmake
+#
+# Metrics, all lower is better:
+#   bench.<name>.ns       host time of one iteration of nixie_bench
+#   sim.day.s             host time of one simulated day (soak scenario)
+#   image.<section>.bytes sections of the image, from the size report
+#   image.<flash|ram|stack>.bytes
+#
+# The delta of the image from the origin of the size report, if it has
+# one (cmake/origin_image.cmake), is shown and written with the results:
+# it is not compared.
+#
+# Baseline lines are "<metric> <value> <tolerance>%". A metric above its
+# baseline by more than the tolerance plus the floor of its unit fails the
+# run; one below it by as much is reported, for the baseline to be
+# updated. A missing baseline file, or a metric missing from it, fails the
+# run too. UPDATE rewrites the baseline with the values just measured.
+#
+# Copyright (c) 2023 Nicolò Campanini.
+##############################################################################
+
+cmake_minimum_required(VERSION 3.21)
+
+foreach(variable BASELINE RESULTS)
+  if(NOT DEFINED ${variable})
+    message(FATAL_ERROR "run_bench: ${variable} not set")
+  endif()
+endforeach()
+
+# Tolerance of a metric new to the baseline, percent
+set(default_tolerance_ns 25)
+set(default_tolerance_s 25)
+set(default_tolerance_bytes 2)
+# Fixed margin added to the tolerance, in the unit of the metric: the
+# shortest timings move by a few ns with the cache and the load alone
+set(floor_ns 5)
+set(floor_s 1)
+set(floor_bytes 0)
+# Runs of nixie_bench and of the simulated day: the lowest time of each
+# metric is kept, and the runs go on up to the last one while a metric is
+# above its band. The host can run slow for tens of seconds, longer than
+# the repeats inside a run smooth out.
+set(runs_min 2)
+set(runs_max 8)
+
+# Value with up to two decimals to an integer in hundredths
+macro(to_hundredths _value _out)
+  if("${_value}" MATCHES "^([0-9]+)\\.([0-9])([0-9])?")
+    if("${CMAKE_MATCH_3}" STREQUAL "")
+      set(CMAKE_MATCH_3 0)
+    endif()
+    math(EXPR ${_out} "${CMAKE_MATCH_1} * 100 + ${CMAKE_MATCH_2} * 10 + ${CMAKE_MATCH_3}")
+  else()
+    math(EXPR ${_out} "${_value} * 100")
+  endif()
+endmacro()
+
+# A metric measured again keeps its lowest value
+set(metrics "")
+macro(add_metric _name _value)
+  if(DEFINED value_${_name})
+    to_hundredths(${_value} new_value)
+    to_hundredths(${value_${_name}} old_value)
+    if(new_value LESS old_value)
+      set(value_${_name} ${_value})
+    endif()
+  else()
+    list(APPEND metrics ${_name})
+    set(value_${_name} ${_value})
+  endif()
+endmacro()
+
+# Status of a metric against the baseline: ok, regressed, improved or missing
+macro(compare_metric _name _status)
+  string(REGEX MATCH "[a-z]+$" unit ${_name})
+  if(NOT DEFINED tolerance_${_name})
+    set(tolerance_${_name} ${default_tolerance_${unit}})
+  endif()
+  if(DEFINED baseline_${_name})
+    to_hundredths(${value_${_name}} value)
+    to_hundredths(${baseline_${_name}} base)
+    math(EXPR value "${value} * 100")
+    math(EXPR upper "${base} * (100 + ${tolerance_${_name}}) + ${floor_${unit}} * 10000")
+    math(EXPR lower "${base} * (100 - ${tolerance_${_name}}) - ${floor_${unit}} * 10000")
+    if(value GREATER upper)
+      set(${_status} regressed)
+    elseif(value LESS lower)
+      set(${_status} improved)
+    else()
+      set(${_status} ok)
+    endif()
+  else()
+    set(${_status} missing)
+  endif()
+endmacro()
+
+# Whether a metric starting with the prefix is above its band
+macro(any_regressed _prefix _out)
+  set(${_out} 0)
+  foreach(name IN LISTS metrics)
+    if(name MATCHES "^${_prefix}")
+      compare_metric(${name} any_status)
+      if(any_status STREQUAL "regressed")
+        set(${_out} 1)
+      endif()
+    endif()
+  endforeach()
+endmacro()
+
+# Baseline
+set(baseline_header "")
+if(NOT EXISTS ${BASELINE} AND NOT UPDATE)
+  message(FATAL_ERROR "run_bench: no baseline ${BASELINE}, record it with the bench_update or size_update target")
+endif()
+if(EXISTS ${BASELINE})
+  file(STRINGS ${BASELINE} lines)
+  foreach(line IN LISTS lines)
+    if(line MATCHES "^#")
+      string(APPEND baseline_header "${line}\n")
+    elseif(line MATCHES "^([^ ]+) +([0-9.]+) +([0-9]+)%$")
+      set(baseline_${CMAKE_MATCH_1} ${CMAKE_MATCH_2})
+      set(tolerance_${CMAKE_MATCH_1} ${CMAKE_MATCH_3})
+    endif()
+  endforeach()
+endif()
+
+set(failed 0)
+
+# Host benchmarks of the modules
+if(DEFINED BENCH)
+  foreach(run RANGE 1 ${runs_max})
+    execute_process(COMMAND ${BENCH} OUTPUT_VARIABLE output RESULT_VARIABLE result)
+    if(NOT result EQUAL 0)
+      message(FATAL_ERROR "run_bench: ${BENCH} failed")
+    endif()
+    string(REPLACE "\n" ";" lines "${output}")
+    foreach(line IN LISTS lines)
+      if(line MATCHES "^bench ([a-z_]+) n=[0-9]+ ns=([0-9.]+)$")
+        add_metric(bench.${CMAKE_MATCH_1}.ns ${CMAKE_MATCH_2})
+      endif()
+    endforeach()
+    any_regressed("bench\\." slow)
+    if(NOT run LESS runs_min AND NOT slow)
+      break()
+    endif()
+  endforeach()
+endif()
+
+# A day of the whole firmware on the simulated hardware, which must pass
+if(DEFINED SIM)
+  foreach(run RANGE 1 ${runs_max})
+    execute_process(COMMAND ${SIM} --scenario soak --days 1 OUTPUT_VARIABLE output RESULT_VARIABLE result)
+    if(NOT result EQUAL 0)
+      message(SEND_ERROR "run_bench: the simulated day failed\n${output}")
+      set(failed 1)
+      break()
+    endif()
+    if(output MATCHES "virtual in +([0-9.]+) s")
+      add_metric(sim.day.s ${CMAKE_MATCH_1})
+    endif()
+    any_regressed("sim\\." slow)
+    if(NOT run LESS runs_min AND NOT slow)
+      break()
+    endif()
+  endforeach()
+endif()
+
+# Sections of the image
+if(DEFINED SIZE_REPORT)
+  file(STRINGS ${SIZE_REPORT} lines)
+  foreach(line IN LISTS lines)
+    if(line MATCHES "^section \\.([^ ]+) ([0-9]+)$")
+      add_metric(image.${CMAKE_MATCH_1}.bytes ${CMAKE_MATCH_2})
+    elseif(line MATCHES "^total flash=([0-9]+) ram=([0-9]+) stack=([0-9]+)$")
+      add_metric(image.flash.bytes ${CMAKE_MATCH_1})
+      add_metric(image.ram.bytes ${CMAKE_MATCH_2})
+      add_metric(image.stack.bytes ${CMAKE_MATCH_3})
+    elseif(line MATCHES "^origin (.+)$")
+      set(origin_commit ${CMAKE_MATCH_1})
+    elseif(line MATCHES "^delta flash=([-+0-9]+) ram=([-+0-9]+) stack=([-+0-9]+)$")
+      set(origin_flash ${CMAKE_MATCH_1})
+      set(origin_ram ${CMAKE_MATCH_2})
+      set(origin_stack ${CMAKE_MATCH_3})
+    endif()
+  endforeach()
+endif()
+
+if(metrics STREQUAL "")
+  message(FATAL_ERROR "run_bench: nothing measured, give BENCH, SIM or SIZE_REPORT")
+endif()
+
+# Compare
+set(json "{\n  \"baseline\": \"${BASELINE}\",\n  \"metrics\": [")
+set(separator "")
+foreach(metric IN LISTS metrics)
+  compare_metric(${metric} status)
+  string(REGEX MATCH "[a-z]+$" unit ${metric})
+  set(tolerance ${tolerance_${metric}})
+  set(floor ${floor_${unit}})
+  if(status STREQUAL "missing")
+    set(failed 1)
+    set(json_baseline null)
+    message(STATUS "${metric} ${value_${metric}} (not in the baseline) missing")
+  else()
+    if(status STREQUAL "regressed")
+      set(failed 1)
+    endif()
+    set(json_baseline ${baseline_${metric}})
+    message(STATUS "${metric} ${value_${metric}} (baseline ${baseline_${metric}} +${tolerance}% +${floor}) ${status}")
+  endif()
+  string(APPEND json "${separator}\n    {\"name\": \"${metric}\", \"value\": ${value_${metric}}, "
+                     "\"baseline\": ${json_baseline}, \"tolerance_percent\": ${tolerance}, \"floor\": ${floor}, "
+                     "\"status\": \"${status}\"}")
+  set(separator ",")
+endforeach()
+string(APPEND json "\n  ],")
+if(DEFINED origin_flash)
+  message(STATUS "image against ${origin_commit}: flash ${origin_flash} ram ${origin_ram} stack ${origin_stack} bytes")
+  foreach(kind flash ram stack)
+    string(REPLACE "+" "" origin_${kind} ${origin_${kind}})
+  endforeach()
+  string(APPEND json "\n  \"origin\": {\"commit\": \"${origin_commit}\", \"delta_flash\": ${origin_flash}, "
+                     "\"delta_ram\": ${origin_ram}, \"delta_stack\": ${origin_stack}},")
+endif()
+string(APPEND json "\n  \"passed\": ")
+if(failed)
+  string(APPEND json "false\n}\n")
+else()
+  string(APPEND json "true\n}\n")
+endif()
+file(WRITE ${RESULTS} "${json}")
+
+if(UPDATE)
+  set(baseline "${baseline_header}")
+  foreach(metric IN LISTS metrics)
+    string(APPEND baseline "${metric} ${value_${metric}} ${tolerance_${metric}}%\n")
+  endforeach()
+  file(WRITE ${BASELINE} "${baseline}")
+  message(STATUS "Baseline updated: ${BASELINE}")
+elseif(failed)
+  message(FATAL_ERROR "Benchmarks regressed or missing from ${BASELINE}, see ${RESULTS}")
+endif()
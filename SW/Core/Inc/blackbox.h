@@ -0,0 +1,102 @@
+/**
+  ******************************************************************************
+  * @file           : blackbox.h
+  * @brief          : Header for blackbox.c file.
+  ******************************************************************************
+  * @attention
+  *
+  * Copyright (c) 2023 Nicolò Campanini.
+  * All rights reserved.
+  *
+  * This software is licensed under terms that can be found in the LICENSE file
+  * in the root directory of this software component.
+  * If no LICENSE file comes with this software, it is provided AS-IS.
+  *
+  ******************************************************************************
+  */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __BLACKBOX_H
+#define __BLACKBOX_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Includes ------------------------------------------------------------------*/
+#include "main.h"
+#include "text_format.h"
+
+
+/* Types ---------------------------------------------------------------------*/
+// Events kept in the ring, a power of two. 12 bytes each.
+#define BLACKBOX_EVENTS 128
+
+// The RAM is random after a power-on: the magic numbers tell a ring (and a
+// fault record) written before a reset
+#define BLACKBOX_MAGIC 0xB1AC0B0CUL
+#define BLACKBOX_FAULT_MAGIC 0xFA017ED0UL
+
+
+
+typedef enum {
+  BLACKBOX_NONE,                // Slot claimed but not written yet
+  BLACKBOX_BOOT,                // Payload: RCC_CSR (reset flags)
+  BLACKBOX_ERROR,               // Error_Handler(), payload: caller
+  BLACKBOX_HARDFAULT,           // Payload: faulting PC
+  BLACKBOX_RTC_STEP,            // RTC moved by the GPS, payload: signed seconds
+  BLACKBOX_GPS_STALE,           // GPS datetime expired, payload: age in ms
+  BLACKBOX_UART_ERROR,          // GPS reception aborted, payload: HAL error code
+  BLACKBOX_HV,                  // Payload: 1 on, 0 off
+  BLACKBOX_CLOCK,               // Base profile switch, payload: profile; bursts: profile | count since << 8
+  BLACKBOX_STACK,               // Stack overflow into the guard, payload: faulting address
+  BLACKBOX_WATCHDOG,            // Subsystems late to the watchdog, payload: bits of Watchdog_subsystem_t
+  BLACKBOX_RTC_SYNC,            // No RSF after Stop (LSE failing), payload: timeout in us
+  BLACKBOX_USAGE,               // Usage commit refused, payload: HAL status; at boot USAGE_LOG_SATURATED | cathodes
+  BLACKBOX_IDS
+} Blackbox_id_t;
+
+
+
+typedef struct{
+  uint32_t tick;                // HAL tick
+  uint32_t payload;
+  uint16_t id;                  // Blackbox_id_t
+  uint16_t boot;                // Boot count, tells the runs apart
+} Blackbox_event_t;
+
+
+
+// Stacked frame and fault status of the last HardFault (or Error_Handler)
+typedef struct{
+  uint32_t magic;
+  uint32_t pc;
+  uint32_t lr;
+  uint32_t psr;
+  uint32_t cfsr;
+  uint32_t hfsr;
+  uint32_t mmfar;
+  uint32_t bfar;
+} Blackbox_fault_t;
+
+
+
+/* Functions -----------------------------------------------------------------*/
+void Blackbox_init();
+void Blackbox_log(Blackbox_id_t _id, uint32_t _payload);
+void Blackbox_dump(Text_write_t _write);
+uint8_t Blackbox_warm_boot();
+uint32_t Blackbox_reset_cause();
+void Blackbox_save_fault(uint32_t _pc, uint32_t _lr, uint32_t _psr);
+void Blackbox_error(uint32_t _caller);
+void Blackbox_fault(uint32_t *_frame);
+
+
+
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,103 @@
+/**
+  ******************************************************************************
+  * @file           : clock_profile.h
+  * @brief          : Header for clock_profile.c file.
+  ******************************************************************************
+  * @attention
+  *
+  * Copyright (c) 2023 Nicolò Campanini.
+  * All rights reserved.
+  *
+  * This software is licensed under terms that can be found in the LICENSE file
+  * in the root directory of this software component.
+  * If no LICENSE file comes with this software, it is provided AS-IS.
+  *
+  ******************************************************************************
+  */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __CLOCK_PROFILE_H
+#define __CLOCK_PROFILE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Includes ------------------------------------------------------------------*/
+#include "main.h"
+#include "text_format.h"
+
+
+/* Types ---------------------------------------------------------------------*/
+// Output rates kept on every profile
+#define CLOCK_PWM_HZ 20000              // TIM1, unprescaled
+#define CLOCK_TICK_BASE_HZ 10000        // TIM11 counter clock
+#define CLOCK_TICK_PERIOD 400           // 25 Hz display tick
+#define CLOCK_ADC_TRIGGER_BASE_HZ 1000000
+#define CLOCK_ADC_TRIGGER_PERIOD 250    // 4 kHz ADC trigger
+// ADC clock limit (datasheet)
+#define CLOCK_ADC_MAX_HZ 36000000
+
+// Workload of Clock_benchmark(), CRC of the first flash bytes
+#define CLOCK_BENCHMARK_BYTES 4096
+
+// The bursts (every GPS parse, every animation) go to the blackbox at most
+// this often, with their count since the last one; base profile changes
+// always do
+#define CLOCK_BURST_LOG_MS 3600000
+
+
+
+typedef enum {
+  CLOCK_LOW,                    // HSI 16 MHz, PLL off
+  CLOCK_NORMAL,                 // HSE + PLL 60 MHz
+  CLOCK_BURST,                  // HSE + PLL 84 MHz
+  CLOCK_PROFILES
+} Clock_profile_t;
+
+
+
+typedef struct{
+  const char *name;
+  uint32_t sysclk_hz;
+  uint32_t source;              // RCC_SYSCLKSOURCE_xxx
+  uint32_t pllm;
+  uint32_t plln;
+  uint32_t pllp;
+  uint32_t pllq;
+  uint32_t flash_latency;
+  uint32_t apb1_divider;
+  uint32_t run_uA;              // Typical supply current, datasheet
+  uint32_t sleep_uA;
+} Clock_profile_struct_t;
+
+
+
+typedef struct{
+  Clock_profile_t from;         // Profile switched from
+  uint32_t switch_us;           // Profile switch, oscillator and PLL lock included
+  uint32_t workload_us;         // Fixed workload run at the profile
+} Clock_benchmark_t;
+
+
+
+/* Functions -----------------------------------------------------------------*/
+void Clock_init(TIM_HandleTypeDef *_htim_pwm, TIM_HandleTypeDef *_htim_tick, TIM_HandleTypeDef *_htim_adc, UART_HandleTypeDef *_huart, UART_HandleTypeDef *_huart_console);
+HAL_StatusTypeDef Clock_set_profile(Clock_profile_t _profile);
+Clock_profile_t Clock_get_profile();
+void Clock_set_base_profile(Clock_profile_t _profile);
+void Clock_burst_begin();
+void Clock_burst_end();
+void Clock_benchmark(Clock_profile_t _profile, Clock_benchmark_t *_result);
+void Clock_dump(Text_write_t _write);
+void Clock_benchmark_dump(Text_write_t _write);
+
+
+
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,83 @@
+/**
+  ******************************************************************************
+  * @file           : config.h
+  * @brief          : Header for config.c file.
+  ******************************************************************************
+  * @attention
+  *
+  * Copyright (c) 2023 Nicolò Campanini.
+  * All rights reserved.
+  *
+  * This software is licensed under terms that can be found in the LICENSE file
+  * in the root directory of this software component.
+  * If no LICENSE file comes with this software, it is provided AS-IS.
+  *
+  ******************************************************************************
+  */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __CONFIG_H
+#define __CONFIG_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Includes ------------------------------------------------------------------*/
+#include "main.h"
+
+
+/* Types ---------------------------------------------------------------------*/
+// Settings that can change at run time. The defaults are the #defines of
+// each module, the saved values come from the key/value store at boot and
+// the modules read them from Config.
+typedef struct{
+  uint16_t rtc_update_cnt;      // Display ticks between RTC updates from the GPS
+  int32_t timezone_offset_s;
+  int32_t dst_offset_s;
+  uint8_t brightness;           // Level at the boot fade-in
+  uint8_t animation_trigger;    // Nixie_animation_trigger_t
+  uint8_t antipoison_hour;      // ANTIPOISON_HOURLY = every hour
+  uint8_t antipoison_minute;
+  int16_t night_on_minute;      // Set: the same fixed night window on every day
+  int16_t night_off_minute;
+  uint16_t gps_latency_ms;      // Receiver output latency, UTC second to burst
+  int16_t latitude_cdeg;        // For the sunrise/sunset edges, 0.01 degree
+  int16_t longitude_cdeg;
+} Config_struct_t;
+
+
+
+typedef struct{
+  const char *name;
+  uint16_t key;                 // In the store, KV_KEY_CONFIG + n: never reuse
+  void *value;                  // Field of Config
+  uint8_t size;                 // 1, 2 or 4 bytes
+  uint8_t is_signed;
+  int32_t min;
+  int32_t max;
+  void (*apply)(void);          // Called after a change, NULL = read when used
+} Config_entry_t;
+
+
+
+/* Functions -----------------------------------------------------------------*/
+void Config_init();
+uint8_t Config_count();
+const Config_entry_t *Config_entry(uint8_t _index);
+const Config_entry_t *Config_find(const char *_name);
+int32_t Config_get(const Config_entry_t *_entry);
+uint8_t Config_set(const Config_entry_t *_entry, int32_t _value);
+HAL_StatusTypeDef Config_save();
+
+extern Config_struct_t Config;
+
+
+
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
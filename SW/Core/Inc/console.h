@@ -0,0 +1,64 @@
+/**
+  ******************************************************************************
+  * @file           : console.h
+  * @brief          : Header for console.c file.
+  ******************************************************************************
+  * @attention
+  *
+  * Copyright (c) 2023 Nicolò Campanini.
+  * All rights reserved.
+  *
+  * This software is licensed under terms that can be found in the LICENSE file
+  * in the root directory of this software component.
+  * If no LICENSE file comes with this software, it is provided AS-IS.
+  *
+  ******************************************************************************
+  */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __CONSOLE_H
+#define __CONSOLE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Includes ------------------------------------------------------------------*/
+#include "main.h"
+
+
+/* Types ---------------------------------------------------------------------*/
+// Rings between the UART interrupt and the console task (powers of two)
+#define CONSOLE_RX_SIZE 64
+#define CONSOLE_TX_SIZE 2048
+// Longest command line, and the words of a command
+#define CONSOLE_LINE_SIZE 80
+#define CONSOLE_ARGS 5
+
+// Awake (no Stop) this long after a received character. USART2 has no
+// clock in Stop: with the tubes off for the night the console only hears
+// while the core is awake, the first command may be lost.
+#define CONSOLE_AWAKE_MS 30000
+
+// Frames of "test digits": each digit on every tube, one second each
+#define CONSOLE_TEST_TICKS NIXIE_TICKS_PER_SECOND
+
+
+
+/* Functions -----------------------------------------------------------------*/
+void Console_init(UART_HandleTypeDef *_huart);
+void Console_task();
+void Console_write(const char *_text, uint16_t _length);
+void Console_print(const char *_text);
+void Console_uart_error(UART_HandleTypeDef *_huart);
+uint32_t Console_dropped();
+
+
+
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,117 @@
+/**
+  ******************************************************************************
+  * @file           : cpu_load.h
+  * @brief          : Header for cpu_load.c file.
+  ******************************************************************************
+  * @attention
+  *
+  * Copyright (c) 2023 Nicolò Campanini.
+  * All rights reserved.
+  *
+  * This software is licensed under terms that can be found in the LICENSE file
+  * in the root directory of this software component.
+  * If no LICENSE file comes with this software, it is provided AS-IS.
+  *
+  ******************************************************************************
+  */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __CPU_LOAD_H
+#define __CPU_LOAD_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Includes ------------------------------------------------------------------*/
+#include "main.h"
+#include "text_format.h"
+#include "cycle_counter.h"
+#include "scheduler.h"
+
+
+/* Types ---------------------------------------------------------------------*/
+// Every cycle of the DWT counter is charged to the context running: the
+// idle loop in WFI, the thread, a task or an interrupt handler (its own
+// cycles, not the ones of the handlers nested in it). Stop freezes the
+// counter: its time comes from the RTC, converted to cycles. The RTC
+// wakeup closes a window every second and folds it into the averages.
+
+// Exponential averages over 1 and 15 minutes of 1 s samples, as Q16
+// weights of the new sample: 1 - e^(-1/60) and 1 - e^(-1/900)
+#define LOAD_WEIGHT_1M 1083
+#define LOAD_WEIGHT_15M 73
+
+
+
+typedef enum {
+  LOAD_IDLE,                    // WFI, with the clocks on
+  LOAD_STOP,                    // Stop, from the RTC
+  LOAD_THREAD,                  // Main loop outside the tasks
+  LOAD_TASKS,                   // One per scheduler event, LOAD_TASKS + event
+  LOAD_SYSTICK = LOAD_TASKS + SCHED_EVENTS,
+  LOAD_PENDSV,                  // Deferred work
+  LOAD_RTC_WKUP,
+  LOAD_EXTI,
+  LOAD_TIM1,
+  LOAD_TIM11,
+  LOAD_SPI2,
+  LOAD_USART1,
+  LOAD_USART2,
+  LOAD_DMA_ADC,
+  LOAD_DMA_GPS,
+  LOAD_CONTEXTS
+} Load_context_t;
+
+
+
+// Shares of the time, Q24 (1 << 24 = all of it)
+typedef struct{
+  uint32_t second;              // Last window
+  uint32_t minute;
+  uint32_t quarter;             // 15 minutes
+} Load_average_t;
+
+
+
+/* Functions -----------------------------------------------------------------*/
+void Load_init();
+void Load_account_stop(uint32_t _ms);
+void Load_tick();
+void Load_get(Load_context_t _context, Load_average_t *_average);
+void Load_get_cpu(Load_average_t *_average);
+uint16_t Load_permille(uint32_t _share);
+void Load_dump(Text_write_t _write);
+
+extern volatile uint8_t Load_current;
+extern uint32_t Load_last;
+extern uint32_t Load_cycles[LOAD_CONTEXTS];
+
+
+
+// Charge the cycles so far to the running context and switch to another,
+// returning the one left, to switch back on exit:
+//   uint8_t load = Load_switch(LOAD_SPI2); ... Load_switch(load);
+// A dozen instructions, masked against the handlers nesting in between
+static inline uint8_t Load_switch(uint8_t _context)
+{
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  uint32_t now = Cycles_now();
+  uint8_t previous = Load_current;
+  Load_cycles[previous] += now - Load_last;
+  Load_last = now;
+  Load_current = _context;
+  __set_PRIMASK(primask);
+  return(previous);
+}
+
+
+
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,54 @@
+/**
+  ******************************************************************************
+  * @file           : cycle_counter.h
+  * @brief          : Cortex-M4 DWT cycle counter helpers.
+  ******************************************************************************
+  * @attention
+  *
+  * Copyright (c) 2023 Nicolò Campanini.
+  * All rights reserved.
+  *
+  * This software is licensed under terms that can be found in the LICENSE file
+  * in the root directory of this software component.
+  * If no LICENSE file comes with this software, it is provided AS-IS.
+  *
+  ******************************************************************************
+  */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __CYCLE_COUNTER_H
+#define __CYCLE_COUNTER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Includes ------------------------------------------------------------------*/
+#include "main.h"
+
+
+/* Functions -----------------------------------------------------------------*/
+// Enable the DWT cycle counter (safe to call more than once)
+static inline void Cycles_init(void)
+{
+  CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+  DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+}
+
+
+
+// Current value of the free running 32 bit cycle counter
+static inline uint32_t Cycles_now(void)
+{
+  return(DWT->CYCCNT);
+}
+
+
+
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
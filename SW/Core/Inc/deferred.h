@@ -0,0 +1,71 @@
+/**
+  ******************************************************************************
+  * @file           : deferred.h
+  * @brief          : Header for deferred.c file.
+  ******************************************************************************
+  * @attention
+  *
+  * Copyright (c) 2023 Nicolò Campanini.
+  * All rights reserved.
+  *
+  * This software is licensed under terms that can be found in the LICENSE file
+  * in the root directory of this software component.
+  * If no LICENSE file comes with this software, it is provided AS-IS.
+  *
+  ******************************************************************************
+  */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __DEFERRED_H
+#define __DEFERRED_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Includes ------------------------------------------------------------------*/
+#include "main.h"
+
+
+/* Types ---------------------------------------------------------------------*/
+// Work queue length, power of two
+#define DEFERRED_QUEUE_SIZE 8
+
+
+
+typedef void (*Deferred_work_t)(uint32_t _arg);
+
+
+
+typedef struct{
+  Deferred_work_t work;
+  uint32_t arg;
+  uint32_t posted;              // Cycle counter at the post
+} Deferred_item_t;
+
+
+
+typedef struct{
+  uint32_t runs;
+  uint32_t dropped;             // Posts lost with the queue full
+  uint32_t max_wait_cycles;     // Post to start of the work
+  uint32_t max_run_cycles;
+} Deferred_stats_t;
+
+
+
+/* Functions -----------------------------------------------------------------*/
+void Deferred_init();
+uint8_t Deferred_post(Deferred_work_t _work, uint32_t _arg);
+void Deferred_run();
+void Deferred_get_stats(Deferred_stats_t *_stats);
+
+
+
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
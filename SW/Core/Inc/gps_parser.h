@@ -25,12 +25,26 @@ extern "C" {
 
 /* Includes ------------------------------------------------------------------*/
 #include "main.h"
-#include "time.h"
 
 
 /* Types ---------------------------------------------------------------------*/
 /* Types ---------------------------------------------------------------------*/
 #define RTC_UPDATE_CNT 250
+// A datetime older than this is stale: the receiver went silent
+#define GPS_DATETIME_MAX_AGE_MS 1100
+// Receiver output latency: from the UTC second of a fix to the first byte
+// of its burst. The sentences of the burst follow back to back.
+#define GPS_LATENCY_MS 100
+// Fixes in a row, one second apart, before one sets the RTC: more of them
+// for a fix further than GPS_RTC_AGREE_S from an RTC holding a confirmed time
+#define GPS_CONSENSUS_FIXES 3
+#define GPS_CONSENSUS_STEP_FIXES 10
+#define GPS_RTC_AGREE_S 2
+
+// Sentences of a burst found and in range, GPS_fix_t flags
+#define GPS_FIX_ZDA (1U << 0)
+#define GPS_FIX_RMC (1U << 1)
+#define GPS_FIX_ACTIVE (1U << 2)        // RMC status 'A'
 
 
 
@@ -41,13 +55,32 @@ typedef struct{
   uint8_t active_buffer;
   uint8_t buffer_status[2]; 
   uint16_t buffer_size[2];
+  uint32_t capture[2];          // Trace timestamp of the idle line
+  uint32_t idle_us[2];          // Local time of the idle line, Power_time_us()
+  uint8_t whole[2];             // Core awake from the first byte on
 }GPS_buffer_struct_t;
 
 
 
+// One burst, parsed: the consensus works on these, not on the text
+typedef struct{
+  uint8_t flags;                // GPS_FIX_xxx
+  uint32_t zda_s;               // ZDA date and time, seconds since 2000-01-01
+  uint32_t rmc_s;               // RMC date and time
+  uint32_t start_us;            // Local time of the '$' of the ZDA sentence
+  uint32_t edge_us;             // Local time of the UTC second of the fix
+} GPS_fix_t;
+
+
+
 typedef struct{
   RTC_TimeTypeDef time;
   RTC_DateTypeDef date;
+  uint32_t tick;
+  uint32_t capture;             // Trace timestamps: idle line of the burst,
+  uint32_t parsed;              // end of the parse
+  uint32_t start_us;            // Local time of the '$' of the ZDA sentence
+  uint32_t edge_us;             // Local time of the UTC second of the fix
   uint8_t valid;
 } GPS_datetime_struct_t;
 
@@ -62,10 +95,15 @@ typedef enum {
 
 
 
-void GPS_Init(UART_HandleTypeDef *_huart, DMA_HandleTypeDef *_hdma_usart_rx);
+void GPS_Init(UART_HandleTypeDef *_huart, DMA_HandleTypeDef *_hdma_usart_rx, RTC_HandleTypeDef *_hrtc,
+              uint8_t _rtc_trusted);
 void GPS_Start();
 GPS_datetime_struct_t GPS_Read_Datetime();
+void GPS_Clear_Datetime();
+void GPS_Datetime_now(const GPS_datetime_struct_t *_datetime, uint32_t _prediv_s,
+                      RTC_TimeTypeDef *_time, RTC_DateTypeDef *_date, uint32_t *_fraction);
 
+uint8_t GPS_Consensus(const GPS_fix_t *_fix);
 void GPS_Update_Data();
 
 GPS_RTC_update_t GPS_RTC_check_update();
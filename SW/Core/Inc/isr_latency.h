@@ -0,0 +1,79 @@
+/**
+  ******************************************************************************
+  * @file           : isr_latency.h
+  * @brief          : Header for isr_latency.c file.
+  ******************************************************************************
+  * @attention
+  *
+  * Copyright (c) 2023 Nicolò Campanini.
+  * All rights reserved.
+  *
+  * This software is licensed under terms that can be found in the LICENSE file
+  * in the root directory of this software component.
+  * If no LICENSE file comes with this software, it is provided AS-IS.
+  *
+  ******************************************************************************
+  */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __ISR_LATENCY_H
+#define __ISR_LATENCY_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Includes ------------------------------------------------------------------*/
+#include "main.h"
+#include "text_format.h"
+
+
+/* Types ---------------------------------------------------------------------*/
+// Development builds only (NIXIE_LATENCY_PROBE, defines LATENCY_PROBE):
+// TIM5 runs free at SYSCLK and its CC1 match, every LATENCY_PROBE_PERIOD_MS,
+// pends the USART1 interrupt from a priority 0 handler. The USART1 handler
+// measures from the match time latched in CCR1, not from when the pend was
+// done: critical sections (PRIMASK) and the handlers at or above USART1
+// priority show up in the worst case, in SYSCLK cycles.
+#define LATENCY_PROBE_PERIOD_MS 10
+#define LATENCY_PROBE_IRQ_PRIORITY 0
+
+
+
+// Display tick work while sampling: posted to PendSV (the firmware), or
+// run in the TIM11 handler for the comparison
+typedef enum {
+  LATENCY_TICK_DEFERRED,
+  LATENCY_TICK_INLINE,
+  LATENCY_TICK_MODES
+} Latency_tick_mode_t;
+
+
+
+typedef struct{
+  uint32_t samples;
+  uint32_t last_cycles;
+  uint32_t max_cycles;
+} Latency_stats_t;
+
+
+
+/* Functions -----------------------------------------------------------------*/
+void Latency_init();
+void Latency_probe_trigger();
+void Latency_probe_enter();
+void Latency_set_tick_mode(Latency_tick_mode_t _mode);
+uint8_t Latency_tick_inline();
+void Latency_get_stats(Latency_tick_mode_t _mode, Latency_stats_t *_stats);
+void Latency_reset();
+void Latency_dump(Text_write_t _write);
+
+
+
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
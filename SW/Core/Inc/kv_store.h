@@ -0,0 +1,108 @@
+/**
+  ******************************************************************************
+  * @file           : kv_store.h
+  * @brief          : Header for kv_store.c file.
+  ******************************************************************************
+  * @attention
+  *
+  * Copyright (c) 2023 Nicolò Campanini.
+  * All rights reserved.
+  *
+  * This software is licensed under terms that can be found in the LICENSE file
+  * in the root directory of this software component.
+  * If no LICENSE file comes with this software, it is provided AS-IS.
+  *
+  ******************************************************************************
+  */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __KV_STORE_H
+#define __KV_STORE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Includes ------------------------------------------------------------------*/
+#include "main.h"
+
+
+/* Types ---------------------------------------------------------------------*/
+// Two 16K sectors reserved in the linker script (STORAGE). One holds the
+// log, the other receives the live records when it is full.
+#define KV_SECTOR_ADDR_0 0x08004000
+#define KV_SECTOR_0 FLASH_SECTOR_1
+#define KV_SECTOR_ADDR_1 0x08008000
+#define KV_SECTOR_1 FLASH_SECTOR_2
+#define KV_SECTOR_SIZE 0x4000
+#define KV_SECTOR_MAGIC 0x4B565331
+
+// Keys are small numbers: the RAM index is a table of the last record of
+// each key, filled by one scan of the log at boot
+#define KV_KEYS 32
+#define KV_VALUE_MAX 256
+
+// Flash endurance: a burst of writes, then one more every refill period.
+// A write of an unchanged value costs nothing.
+#define KV_WRITE_BURST 16
+#define KV_WRITE_REFILL_MS 60000
+
+
+
+// Key map, never reuse a number
+typedef enum {
+  KV_KEY_USAGE = 1,             // Cathode on-time counters
+  KV_KEY_NIGHT = 2,             // Night schedule, window of each weekday
+  KV_KEY_CONFIG = 16            // First of the settings, one key each
+} KV_key_t;
+
+
+
+// Sector header, programmed after the live records were copied: a sector
+// without it is not in use
+typedef struct{
+  uint32_t magic;
+  uint32_t generation;
+} KV_sector_header_t;
+
+
+
+// Record: key and length, the value padded to words, then the CRC of the
+// three. The CRC goes last: a record cut by a reset reads as invalid.
+typedef struct{
+  uint16_t key;
+  uint16_t length;
+} KV_record_header_t;
+
+
+
+typedef struct{
+  uint32_t generation;
+  uint32_t records;             // Live keys
+  uint32_t used_bytes;          // Of the active sector, with the old records
+  uint32_t writes;
+  uint32_t unchanged;           // Writes skipped, same value
+  uint32_t throttled;           // Writes refused by the rate limit
+  uint32_t compactions;
+  uint32_t errors;
+  uint32_t load_cycles;         // Boot scan of the log
+} KV_stats_t;
+
+
+
+/* Functions -----------------------------------------------------------------*/
+void KV_init();
+uint16_t KV_get(uint16_t _key, void *_value, uint16_t _size);
+HAL_StatusTypeDef KV_set(uint16_t _key, const void *_value, uint16_t _length);
+void KV_get_stats(KV_stats_t *_stats);
+uint32_t KV_crc32(uint32_t _crc, const uint8_t *_data, uint32_t _length);
+
+
+
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,91 @@
+/**
+  ******************************************************************************
+  * @file           : latency_trace.h
+  * @brief          : Header for latency_trace.c file.
+  ******************************************************************************
+  * @attention
+  *
+  * Copyright (c) 2023 Nicolò Campanini.
+  * All rights reserved.
+  *
+  * This software is licensed under terms that can be found in the LICENSE file
+  * in the root directory of this software component.
+  * If no LICENSE file comes with this software, it is provided AS-IS.
+  *
+  ******************************************************************************
+  */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __LATENCY_TRACE_H
+#define __LATENCY_TRACE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Includes ------------------------------------------------------------------*/
+#include "main.h"
+#include "text_format.h"
+
+
+/* Types ---------------------------------------------------------------------*/
+// End to end delays of the GPS fix and of the second change, from the cycle
+// counter. Comment out to remove the tracer (the functions stay, empty).
+#define LATENCY_TRACE
+// Last records kept, oldest overwritten
+#define TRACE_RING_SIZE 64
+
+
+
+typedef enum {
+  TRACE_IDLE_TO_PARSE,          // USART1 idle line to the ZDA sentence parsed
+  TRACE_PARSE_TO_RTC,           // ZDA parsed to the RTC set from it
+  TRACE_EDGE_TO_LATCH,          // RTC second edge to the new digits latched
+  TRACE_KINDS
+} Trace_kind_t;
+
+
+
+typedef struct{
+  uint32_t tick;                // HAL tick when recorded
+  uint32_t latency_us;
+  uint8_t kind;                 // Trace_kind_t
+} Trace_record_t;
+
+
+
+typedef struct{
+  uint32_t count;
+  uint32_t last_us;
+  uint32_t max_us;
+  uint64_t total_us;
+} Trace_stats_t;
+
+
+
+/* Functions -----------------------------------------------------------------*/
+void Trace_init();
+uint32_t Trace_now_us();
+void Trace_clock_changed();
+uint32_t Trace_timestamp();
+void Trace_record(Trace_kind_t _kind, uint32_t _from);
+void Trace_rtc_read(const RTC_TimeTypeDef *_time);
+void Trace_rtc_shift();
+void Trace_sequence_frame();
+void Trace_display_update();
+void Trace_latch();
+uint16_t Trace_read(Trace_record_t *_records, uint16_t _max);
+void Trace_get_stats(Trace_kind_t _kind, Trace_stats_t *_stats);
+uint32_t Trace_avg_us(Trace_stats_t *_stats);
+void Trace_dump(Text_write_t _write);
+void Trace_reset();
+
+
+
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
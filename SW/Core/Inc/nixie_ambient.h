@@ -0,0 +1,89 @@
+/**
+  ******************************************************************************
+  * @file           : nixie_ambient.h
+  * @brief          : Header for nixie_ambient.c file.
+  ******************************************************************************
+  * @attention
+  *
+  * Copyright (c) 2023 Nicolò Campanini.
+  * All rights reserved.
+  *
+  * This software is licensed under terms that can be found in the LICENSE file
+  * in the root directory of this software component.
+  * If no LICENSE file comes with this software, it is provided AS-IS.
+  *
+  ******************************************************************************
+  */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __NIXIE_AMBIENT_H
+#define __NIXIE_AMBIENT_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Includes ------------------------------------------------------------------*/
+#include "main.h"
+#include "nixie_brightness.h"
+
+
+/* Types ---------------------------------------------------------------------*/
+// 12 bit samples summed 4^4 times and shifted by 4: 16 bit result.
+// TIM2 triggers at 4 kHz, so a new 16 bit value every 64 ms.
+#define AMBIENT_OVERSAMPLE 256
+#define AMBIENT_OVERSAMPLE_SHIFT 4
+#define AMBIENT_BUFFER_SIZE (2 * AMBIENT_OVERSAMPLE)
+
+// Light (16 bit) to brightness level curve, linear between the points
+#define AMBIENT_CURVE_POINTS 5
+#define AMBIENT_CURVE_LIGHT {0, 2000, 8000, 30000, 65535}
+#define AMBIENT_CURVE_LEVEL {20, 60, 123, 200, 255}
+
+// Default tuning: ~1 s filter time constant, fade of the brightness steps
+#define AMBIENT_IIR_SHIFT 4
+#define AMBIENT_HYSTERESIS 800
+#define AMBIENT_FADE_MS 1500
+
+
+
+typedef struct{
+  uint8_t enabled;                              // Drive the brightness (0 = manual)
+  uint8_t iir_shift;                            // Low-pass time constant, 2^shift values
+  uint16_t hysteresis;                          // Light change needed for a new level
+  uint16_t fade_ms;                             // Fade time of each level change
+  uint16_t curve_light[AMBIENT_CURVE_POINTS];   // Increasing light values
+  uint8_t curve_level[AMBIENT_CURVE_POINTS];    // Brightness level at each point
+} Nixie_ambient_config_t;
+
+
+
+typedef struct{
+  uint16_t raw;                 // Last oversampled value
+  uint16_t filtered;            // Low-pass output
+  uint16_t applied;             // Light value of the last brightness change
+  uint8_t level;                // Last level sent to the brightness
+  uint8_t valid;                // At least one value applied
+} Nixie_ambient_state_t;
+
+
+
+/* Functions -----------------------------------------------------------------*/
+void Nixie_ambient_init(ADC_HandleTypeDef *_hadc, TIM_HandleTypeDef *_htim);
+void Nixie_ambient_start();
+void Nixie_ambient_get_config(Nixie_ambient_config_t *_config);
+void Nixie_ambient_set_config(Nixie_ambient_config_t *_config);
+void Nixie_ambient_get_state(Nixie_ambient_state_t *_state);
+uint8_t Nixie_ambient_map(uint16_t _light);
+void Nixie_ambient_process_block(volatile uint16_t *_samples);
+void Nixie_ambient_process();
+
+
+
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,72 @@
+/**
+  ******************************************************************************
+  * @file           : nixie_animation.h
+  * @brief          : Header for nixie_animation.c file.
+  ******************************************************************************
+  * @attention
+  *
+  * Copyright (c) 2023 Nicolò Campanini.
+  * All rights reserved.
+  *
+  * This software is licensed under terms that can be found in the LICENSE file
+  * in the root directory of this software component.
+  * If no LICENSE file comes with this software, it is provided AS-IS.
+  *
+  ******************************************************************************
+  */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __NIXIE_ANIMATION_H
+#define __NIXIE_ANIMATION_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Includes ------------------------------------------------------------------*/
+#include "main.h"
+#include "nixie_display.h"
+#include "prng.h"
+
+
+/* Types ---------------------------------------------------------------------*/
+// Tick at which the first tube (hours dec) lands, delay between tubes and
+// random jitter added to each landing
+#define ANIMATION_BASE_TICKS 20
+#define ANIMATION_STAGGER_TICKS 6
+#define ANIMATION_JITTER_TICKS 3
+#define ANIMATION_LENGTH_TICKS (ANIMATION_BASE_TICKS + (NIXIE_TUBES - 1) * ANIMATION_STAGGER_TICKS + ANIMATION_JITTER_TICKS + 1)
+#define ANIMATION_MAX_SECONDS ((ANIMATION_LENGTH_TICKS / NIXIE_TICKS_PER_SECOND) + 1)
+
+// Ticks between the last digit changes before landing, from the landing back.
+// Earlier changes happen every tick.
+#define ANIMATION_DECEL_STEPS 6
+#define ANIMATION_DECEL_PROFILE {8, 5, 4, 3, 2, 2}
+
+
+typedef enum {
+  ANIMATION_NEVER,
+  ANIMATION_ON_MINUTE,
+  ANIMATION_ON_HOUR
+} Nixie_animation_trigger_t;
+
+#define ANIMATION_TRIGGER ANIMATION_ON_MINUTE
+
+
+
+/* Functions -----------------------------------------------------------------*/
+void Nixie_animation_init(uint32_t _seed);
+void Nixie_animation_request();
+uint8_t Nixie_animation_check_trigger(RTC_TimeTypeDef *_local_time);
+void Nixie_animation_process();
+uint16_t Nixie_animation_build(RTC_TimeTypeDef *_local_time);
+
+
+
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,65 @@
+/**
+  ******************************************************************************
+  * @file           : nixie_antipoison.h
+  * @brief          : Header for nixie_antipoison.c file.
+  ******************************************************************************
+  * @attention
+  *
+  * Copyright (c) 2023 Nicolò Campanini.
+  * All rights reserved.
+  *
+  * This software is licensed under terms that can be found in the LICENSE file
+  * in the root directory of this software component.
+  * If no LICENSE file comes with this software, it is provided AS-IS.
+  *
+  ******************************************************************************
+  */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __NIXIE_ANTIPOISON_H
+#define __NIXIE_ANTIPOISON_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Includes ------------------------------------------------------------------*/
+#include "main.h"
+#include "nixie_display.h"
+#include "nixie_usage.h"
+
+
+/* Types ---------------------------------------------------------------------*/
+// Local hour of the run, ANTIPOISON_HOURLY runs it every hour
+#define ANTIPOISON_HOURLY 0xFF
+#define ANTIPOISON_HOUR 3
+#define ANTIPOISON_MINUTE 30
+
+// Length of one run and minimum dwell of each cathode, in display ticks (25 Hz)
+#define ANTIPOISON_CYCLE_TICKS 750
+#define ANTIPOISON_DWELL_MIN_TICKS 5
+
+// Measured on-time (seconds per tube) needed before replacing the estimate
+#define ANTIPOISON_MEASURED_MIN_S 86400
+
+// Worst case: every cathode of every tube starts a new frame
+#define ANTIPOISON_MAX_FRAMES (NIXIE_TUBES * NIXIE_DIGITS)
+
+
+
+/* Functions -----------------------------------------------------------------*/
+void Nixie_antipoison_init();
+void Nixie_antipoison_check_schedule(RTC_TimeTypeDef *_local_time);
+void Nixie_antipoison_request();
+void Nixie_antipoison_process();
+uint32_t Nixie_antipoison_usage(uint8_t _tube, uint8_t _digit);
+
+
+
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
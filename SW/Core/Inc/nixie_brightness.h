@@ -0,0 +1,68 @@
+/**
+  ******************************************************************************
+  * @file           : nixie_brightness.h
+  * @brief          : Header for nixie_brightness.c file.
+  ******************************************************************************
+  * @attention
+  *
+  * Copyright (c) 2023 Nicolò Campanini.
+  * All rights reserved.
+  *
+  * This software is licensed under terms that can be found in the LICENSE file
+  * in the root directory of this software component.
+  * If no LICENSE file comes with this software, it is provided AS-IS.
+  *
+  ******************************************************************************
+  */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __NIXIE_BRIGHTNESS_H
+#define __NIXIE_BRIGHTNESS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Includes ------------------------------------------------------------------*/
+#include "main.h"
+
+
+/* Types ---------------------------------------------------------------------*/
+// Perceptual brightness levels (0 = off, 255 = full duty)
+#define BRIGHTNESS_LEVELS 256
+#define BRIGHTNESS_MAX 255
+// Same duty cycle as the old Nixie_set_brightness(20) on the 0-99 scale
+#define BRIGHTNESS_DEFAULT 123
+// Gamma LUT output scale (Q16 fraction of the PWM period)
+#define BRIGHTNESS_LUT_SHIFT 16
+// Rate of the TIM1 update event: 20 kHz PWM / (repetition counter + 1)
+#define BRIGHTNESS_UPDATE_HZ 78
+
+
+
+typedef struct{
+  uint16_t level_q8;        // Current level, 8 fractional bits
+  uint16_t target_q8;       // Level to reach
+  uint16_t step_q8;         // Level change per update event
+} Nixie_brightness_struct_t;
+
+
+
+/* Functions -----------------------------------------------------------------*/
+void Nixie_brightness_init(TIM_HandleTypeDef *_htim, uint32_t _PWM_channel);
+void Nixie_brightness_set(uint8_t _level, uint16_t _fade_ms);
+uint8_t Nixie_brightness_get();
+uint8_t Nixie_brightness_fading();
+void Nixie_brightness_update();
+void Nixie_brightness_refresh();
+uint32_t Nixie_brightness_to_compare(uint16_t _level_q8, uint32_t _period);
+
+
+
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -25,20 +25,35 @@ extern "C" {
 
 /* Includes ------------------------------------------------------------------*/
 #include "main.h"
-#include "time.h"
 
 
 /* Types ---------------------------------------------------------------------*/
 #define SPI_BUFFER_SIZE 8
-#define SCRAMBLE_PROBABILITY 1
-#define SCRAMBLE_CALLS 25
-#define RANDOM_RANGE 1000
 
+#define NIXIE_TUBES 6
+#define NIXIE_DIGITS 10
+#define NIXIE_BLANK 0xFF
+#define NIXIE_TICKS_PER_SECOND 25
 
-typedef enum {
-  NORMAL,
-  SCRAMBLE
-} Nixie_mode_enum_t;
+
+// One entry of a frame table: the encoded SPI buffer and how many display
+// ticks (TIM11 periods) it has to stay on the tubes.
+typedef struct{
+  uint8_t spi[SPI_BUFFER_SIZE];
+  uint16_t ticks;
+} Nixie_frame_t;
+
+
+
+// State of the frame table player, advanced once per display tick. Set
+// from the thread, stepped from the display tick.
+typedef struct{
+  const Nixie_frame_t *frames;
+  uint16_t length;
+  uint16_t index;
+  uint16_t ticks_left;
+  volatile uint8_t active;
+} Nixie_sequence_struct_t;
 
 
 
@@ -48,9 +63,16 @@ void Nixie_init(SPI_HandleTypeDef *_hspi, TIM_HandleTypeDef *_htim, uint32_t _PW
 void Nixie_enable_HV();
 void Nixie_disable_HV();
 void Nixie_update_display(uint8_t _hours, uint8_t _minutes, uint8_t _seconds);
-void Nixie_set_brightness(uint8_t _brightness);
-Nixie_mode_enum_t Nixie_get_mode();
-void Nixie_get_random(uint8_t *_value_h, uint8_t *_value_m, uint8_t *_value_s);
+void Nixie_time_to_digits(uint8_t _hours, uint8_t _minutes, uint8_t _seconds, uint8_t *_digits);
+void Nixie_encode_frame(const uint8_t *_digits, uint8_t *_spi_buffer);
+void Nixie_decode_frame(const uint8_t *_spi_buffer, uint8_t *_digits);
+const uint8_t *Nixie_get_framebuffer();
+uint8_t Nixie_is_lit();
+void Nixie_send_frame(const uint8_t *_spi_buffer);
+void Nixie_sequence_start(const Nixie_frame_t *_frames, uint16_t _length);
+void Nixie_sequence_stop();
+uint8_t Nixie_sequence_active();
+uint8_t Nixie_sequence_step();
 
 
 
@@ -0,0 +1,122 @@
+/**
+  ******************************************************************************
+  * @file           : nixie_night.h
+  * @brief          : Header for nixie_night.c file.
+  ******************************************************************************
+  * @attention
+  *
+  * Copyright (c) 2023 Nicolò Campanini.
+  * All rights reserved.
+  *
+  * This software is licensed under terms that can be found in the LICENSE file
+  * in the root directory of this software component.
+  * If no LICENSE file comes with this software, it is provided AS-IS.
+  *
+  ******************************************************************************
+  */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __NIXIE_NIGHT_H
+#define __NIXIE_NIGHT_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Includes ------------------------------------------------------------------*/
+#include "main.h"
+#include "nixie_display.h"
+#include "text_format.h"
+
+
+/* Types ---------------------------------------------------------------------*/
+// Default window, every day: tubes on from 07:00 to 23:30 local time
+#define NIGHT_ON_MINUTE (7 * 60)
+#define NIGHT_OFF_MINUTE (23 * 60 + 30)
+
+// Default location for the sunrise/sunset edges, in hundredths of a
+// degree (north and east positive): the latitude and longitude settings
+#define NIGHT_LATITUDE_CDEG 4546
+#define NIGHT_LONGITUDE_CDEG 919
+// Official zenith, sun center 50' below the horizon
+#define NIGHT_ZENITH 90.833f
+
+// Brightness ramp before cutting the HV and after enabling it
+#define NIGHT_RAMP_MS 3000
+
+// Tube-minutes saved, kept across resets in the backup domain
+#define NIGHT_BKP_SAVED RTC_BKP_DR17
+
+#define NIGHT_DAYS 7
+// Largest offset of an edge from the sunrise or the sunset
+#define NIGHT_SUN_OFFSET_MAX 720
+
+
+
+typedef enum {
+  NIGHT_EDGE_FIXED,             // minutes = minute of the day
+  NIGHT_EDGE_SUNRISE,           // minutes = offset from the sunrise
+  NIGHT_EDGE_SUNSET             // minutes = offset from the sunset
+} Nixie_night_edge_type_t;
+
+
+
+typedef struct{
+  Nixie_night_edge_type_t type;
+  int16_t minutes;
+} Nixie_night_edge_t;
+
+
+
+typedef struct{
+  uint8_t enabled;              // 0 = tubes on all day
+  Nixie_night_edge_t on;
+  Nixie_night_edge_t off;       // Before "on": the window crosses midnight
+} Nixie_night_window_t;
+
+
+
+// Value of KV_KEY_NIGHT
+typedef struct{
+  uint8_t enabled;
+  Nixie_night_window_t days[NIGHT_DAYS];        // Index 0 = Sunday
+} Nixie_night_config_t;
+
+
+
+typedef enum {
+  NIGHT_ON,
+  NIGHT_RAMP_DOWN,
+  NIGHT_OFF,
+  NIGHT_RAMP_UP
+} Nixie_night_state_t;
+
+
+
+/* Functions -----------------------------------------------------------------*/
+void Nixie_night_init(RTC_HandleTypeDef *_hrtc);
+void Nixie_night_check_schedule(RTC_TimeTypeDef *_local_time, RTC_DateTypeDef *_local_date, int16_t _utc_offset_min);
+void Nixie_night_process();
+void Nixie_night_get_config(Nixie_night_config_t *_config);
+void Nixie_night_set_config(Nixie_night_config_t *_config);
+HAL_StatusTypeDef Nixie_night_save();
+uint8_t Nixie_night_edge_valid(const Nixie_night_edge_t *_edge);
+uint8_t Nixie_night_parse_day(const char *_name, uint8_t *_day);
+uint8_t Nixie_night_parse_edge(const char *_name, Nixie_night_edge_type_t *_type);
+Nixie_night_state_t Nixie_night_get_state();
+uint32_t Nixie_night_tube_minutes_saved();
+void Nixie_night_dump(Text_write_t _write);
+uint8_t Nixie_night_weekday(uint16_t _year, uint8_t _month, uint8_t _day);
+int16_t Nixie_night_sun_minute(uint16_t _day_of_year, uint8_t _rising, int16_t _utc_offset_min);
+
+extern uint8_t Nixie_night_saved_level;
+
+
+
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,95 @@
+/**
+  ******************************************************************************
+  * @file           : nixie_usage.h
+  * @brief          : Header for nixie_usage.c file.
+  ******************************************************************************
+  * @attention
+  *
+  * Copyright (c) 2023 Nicolò Campanini.
+  * All rights reserved.
+  *
+  * This software is licensed under terms that can be found in the LICENSE file
+  * in the root directory of this software component.
+  * If no LICENSE file comes with this software, it is provided AS-IS.
+  *
+  ******************************************************************************
+  */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __NIXIE_USAGE_H
+#define __NIXIE_USAGE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Includes ------------------------------------------------------------------*/
+#include "main.h"
+#include "nixie_display.h"
+#include "kv_store.h"
+#include "text_format.h"
+
+
+/* Types ---------------------------------------------------------------------*/
+// Pending minutes are checkpointed as one byte per cathode in DR1..DR15,
+// DR16 holds a marker with the sequence of the matching flash record
+#define USAGE_BKP_FIRST RTC_BKP_DR1
+#define USAGE_BKP_COUNT 15
+#define USAGE_BKP_MARKER RTC_BKP_DR16
+#define USAGE_BKP_MAGIC 0xC0DE0000
+#define USAGE_TICKS_PER_MINUTE (60 * NIXIE_TICKS_PER_SECOND)
+
+// Flash commit period, must stay below 255 minutes (one byte per cathode)
+#define USAGE_FLASH_PERIOD_MIN 240
+// Commit refused by the store (throttled, flash error): again this much
+// later, before the checkpoint fills up
+#define USAGE_RETRY_MIN 1
+// Payload of BLACKBOX_USAGE at boot, with the number of full checkpoint bytes
+#define USAGE_LOG_SATURATED 0x100
+
+
+
+// Value of KV_KEY_USAGE
+typedef struct{
+  uint32_t sequence;
+  uint32_t seconds[NIXIE_TUBES][NIXIE_DIGITS];
+} Nixie_usage_record_t;
+
+
+
+typedef struct{
+  // On-time stored in flash, in seconds
+  uint32_t base[NIXIE_TUBES][NIXIE_DIGITS];
+  // On-time accumulated since the last flash commit, in display ticks
+  uint32_t pending[NIXIE_TUBES][NIXIE_DIGITS];
+  uint32_t sequence;
+  uint8_t ticks;
+  uint8_t seconds;
+  uint16_t minutes;
+  uint32_t commits;             // Records written to the store
+  uint32_t failures;            // Commits refused by the store
+  uint8_t failing;              // Last commit refused, logged once per streak
+  uint8_t saturated;            // Cathodes with a full checkpoint byte at boot: time lost
+} Nixie_usage_struct_t;
+
+
+
+/* Functions -----------------------------------------------------------------*/
+void Nixie_usage_init(RTC_HandleTypeDef *_hrtc);
+void Nixie_usage_tick();
+void Nixie_usage_process();
+void Nixie_usage_commit();
+uint32_t Nixie_usage_get(uint8_t _tube, uint8_t _digit);
+void Nixie_usage_read_all(uint32_t *_seconds);
+uint32_t Nixie_usage_tube_total(uint8_t _tube);
+void Nixie_usage_dump(Text_write_t _write);
+
+
+
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,112 @@
+/**
+  ******************************************************************************
+  * @file           : power.h
+  * @brief          : Header for power.c file.
+  ******************************************************************************
+  * @attention
+  *
+  * Copyright (c) 2023 Nicolò Campanini.
+  * All rights reserved.
+  *
+  * This software is licensed under terms that can be found in the LICENSE file
+  * in the root directory of this software component.
+  * If no LICENSE file comes with this software, it is provided AS-IS.
+  *
+  ******************************************************************************
+  */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __POWER_H
+#define __POWER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Includes ------------------------------------------------------------------*/
+#include "main.h"
+#include "text_format.h"
+
+
+/* Types ---------------------------------------------------------------------*/
+// Stop mode halts every clock but LSE: TIM1 (HV PWM), TIM11 (display tick),
+// SPI and DMA included. A module needing them holds a lock; with no lock
+// the idle loop uses Stop instead of Sleep.
+#define POWER_LOCK_DISPLAY (1UL << 0)
+#define POWER_LOCK_GPS_SYNC (1UL << 1)  // Calendar lost, awake until the GPS sets it
+#define POWER_LOCK_CONSOLE (1UL << 2)   // Console output in progress
+
+// Wake-up sources from Stop
+#define POWER_WAKE_RTC (1UL << 0)       // RTC wakeup timer
+#define POWER_WAKE_RX (1UL << 1)        // USART1 RX start bit (EXTI7 on PB7)
+#define POWER_WAKE_PPS (1UL << 2)       // GPS PPS, only if the board has it
+// GPS bursts arrive every second: waking on RX would keep the core awake,
+// so by default only the RTC wakes it (the RTC keeps the time on LSE)
+#define POWER_WAKE_DEFAULT POWER_WAKE_RTC
+
+// RTC wakeup period, and how long to stay awake after a wake so the
+// display tick runs (RTC) or the next GPS burst is received whole (RX)
+#define POWER_RTC_WAKE_S 1
+#define POWER_RTC_AWAKE_MS 50
+#define POWER_RX_AWAKE_MS 1500
+
+// Bound of the RTC shadow register resync after Stop: RSF comes within two
+// RTCCLK periods (61 us on LSE), a longer wait means the LSE has failed
+#define POWER_RSF_TIMEOUT_US 1000
+
+// Typical supply currents in uA used for the estimate (datasheet values at
+// 60 MHz, calibrate against a meter on the real board). The clock profiles
+// change the run and sleep ones with Power_set_currents().
+#define POWER_RUN_UA 12000
+#define POWER_SLEEP_UA 5000
+#define POWER_STOP_UA 40
+
+
+
+typedef enum {
+  POWER_RUN,
+  POWER_SLEEP,
+  POWER_STOP
+} Power_state_t;
+
+
+
+typedef struct{
+  uint64_t run_us;              // CPU active (cycle counter)
+  uint64_t sleep_us;            // WFI with clocks on
+  uint64_t charge_uAus;         // Current integrated over run and sleep time
+  uint64_t stop_us;             // Stop mode, measured with the RTC (ms steps)
+  uint32_t stops;
+  uint32_t wakes_rtc;
+  uint32_t wakes_rx;
+  uint32_t wakes_pps;
+} Power_stats_t;
+
+
+
+/* Functions -----------------------------------------------------------------*/
+void Power_init(RTC_HandleTypeDef *_hrtc);
+void Power_lock(uint32_t _lock);
+void Power_unlock(uint32_t _lock);
+void Power_hold(uint32_t _ms);
+void Power_set_wake_sources(uint32_t _sources);
+void Power_set_currents(uint32_t _run_uA, uint32_t _sleep_uA);
+void Power_idle();
+uint32_t Power_time_us();
+uint32_t Power_last_wake_us();
+void Power_restore_clocks(uint32_t _source);
+void Power_rx_wakeup();
+void Power_get_stats(Power_stats_t *_stats);
+uint32_t Power_average_current_uA();
+uint16_t Power_duty_permille();
+void Power_dump(Text_write_t _write);
+
+
+
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
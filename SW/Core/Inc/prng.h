@@ -0,0 +1,64 @@
+/**
+  ******************************************************************************
+  * @file           : prng.h
+  * @brief          : Header for prng.c file.
+  ******************************************************************************
+  * @attention
+  *
+  * Copyright (c) 2023 Nicolò Campanini.
+  * All rights reserved.
+  *
+  * This software is licensed under terms that can be found in the LICENSE file
+  * in the root directory of this software component.
+  * If no LICENSE file comes with this software, it is provided AS-IS.
+  *
+  ******************************************************************************
+  */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __PRNG_H
+#define __PRNG_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Includes ------------------------------------------------------------------*/
+#include "main.h"
+
+
+/* Types ---------------------------------------------------------------------*/
+// Define PRNG_DETERMINISTIC_SEED (e.g. -DPRNG_DETERMINISTIC_SEED=1234) to
+// ignore the hardware entropy and get the same sequence at every boot.
+
+// Seed used when the hardware gives no entropy (xorshift state can't be zero)
+#define PRNG_DEFAULT_SEED 0x9E3779B9
+#define PRNG_ADC_SAMPLES 16
+
+// Threshold for PRNG_chance(): true with probability _num/_den
+#define PRNG_PROBABILITY(_num, _den) ((uint32_t) ((((uint64_t) (_num)) << 32) / (_den)))
+
+
+
+typedef struct{
+  uint32_t state;
+} PRNG_state_t;
+
+
+
+/* Functions -----------------------------------------------------------------*/
+void PRNG_seed(PRNG_state_t *_prng, uint32_t _seed);
+uint32_t PRNG_hardware_seed(ADC_HandleTypeDef *_hadc, RTC_HandleTypeDef *_hrtc);
+uint32_t PRNG_next(PRNG_state_t *_prng);
+uint32_t PRNG_range(PRNG_state_t *_prng, uint32_t _range);
+uint8_t PRNG_chance(PRNG_state_t *_prng, uint32_t _threshold);
+
+
+
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
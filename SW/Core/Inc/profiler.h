@@ -0,0 +1,118 @@
+/**
+  ******************************************************************************
+  * @file           : profiler.h
+  * @brief          : Header for profiler.c file.
+  ******************************************************************************
+  * @attention
+  *
+  * Copyright (c) 2023 Nicolò Campanini.
+  * All rights reserved.
+  *
+  * This software is licensed under terms that can be found in the LICENSE file
+  * in the root directory of this software component.
+  * If no LICENSE file comes with this software, it is provided AS-IS.
+  *
+  ******************************************************************************
+  */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __PROFILER_H
+#define __PROFILER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Includes ------------------------------------------------------------------*/
+#include "main.h"
+#include "text_format.h"
+#include "cycle_counter.h"
+
+
+/* Types ---------------------------------------------------------------------*/
+// Cycle counter probes around the stages of the GPS to tubes pipeline.
+// Comment out to compile every probe out of the firmware.
+#define PROFILER
+
+// Histogram bucket b counts the durations in [2^(b-1), 2^b) cycles, the
+// last one everything longer
+#define PROF_BUCKETS 16
+
+
+
+// One probe per stage. Each probe must be used from a single context
+// (thread, PendSV or one interrupt): the records are not locked.
+typedef enum {
+  PROF_GPS_SCAN,        // Search of the sentences in a received buffer
+  PROF_GPS_PARSE,       // Parse of the ZDA and RMC sentences
+  PROF_RTC_READ,        // RTC time and date read
+  PROF_TIMEZONE,        // Timezone and DST conversion
+  PROF_FRAME_ENCODE,    // Time to digits to SPI frame
+  PROF_SPI_START,       // Start of the SPI transmission
+  PROF_LATCH,           // Latch pulse at the end of the SPI transmission
+  PROF_PROBES
+} Prof_probe_t;
+
+
+
+typedef struct{
+  uint32_t count;
+  uint32_t min_cycles;
+  uint32_t max_cycles;
+  uint64_t total_cycles;
+  uint32_t histogram[PROF_BUCKETS];
+} Prof_stats_t;
+
+
+
+/* Functions -----------------------------------------------------------------*/
+void Prof_init();
+void Prof_get_stats(Prof_probe_t _probe, Prof_stats_t *_stats);
+uint32_t Prof_avg_cycles(Prof_stats_t *_stats);
+void Prof_dump(Text_write_t _write);
+void Prof_reset();
+
+extern Prof_stats_t Prof_stats[PROF_PROBES];
+
+
+
+// Record one duration: a handful of instructions, no call
+static inline void Prof_record(Prof_probe_t _probe, uint32_t _cycles)
+{
+  Prof_stats_t *stats = &Prof_stats[_probe];
+  uint32_t bucket = 32 - __CLZ(_cycles);
+
+  stats->count++;
+  stats->total_cycles += _cycles;
+  if (_cycles < stats->min_cycles) {
+    stats->min_cycles = _cycles;
+  }
+  if (_cycles > stats->max_cycles) {
+    stats->max_cycles = _cycles;
+  }
+  stats->histogram[(bucket < PROF_BUCKETS) ? bucket : (PROF_BUCKETS - 1)]++;
+}
+
+
+
+// Probe around a block of code, in the same scope:
+//   PROF_START(PROF_RTC_READ);
+//   ...
+//   PROF_STOP(PROF_RTC_READ);
+#ifdef PROFILER
+#define PROF_START(_probe) uint32_t Prof_start_##_probe = Cycles_now()
+#define PROF_STOP(_probe) Prof_record(_probe, Cycles_now() - Prof_start_##_probe)
+#else
+#define PROF_START(_probe)
+#define PROF_STOP(_probe)
+#endif
+
+
+
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
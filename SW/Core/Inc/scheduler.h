@@ -0,0 +1,73 @@
+/**
+  ******************************************************************************
+  * @file           : scheduler.h
+  * @brief          : Header for scheduler.c file.
+  ******************************************************************************
+  * @attention
+  *
+  * Copyright (c) 2023 Nicolò Campanini.
+  * All rights reserved.
+  *
+  * This software is licensed under terms that can be found in the LICENSE file
+  * in the root directory of this software component.
+  * If no LICENSE file comes with this software, it is provided AS-IS.
+  *
+  ******************************************************************************
+  */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __SCHEDULER_H
+#define __SCHEDULER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Includes ------------------------------------------------------------------*/
+#include "main.h"
+
+
+/* Types ---------------------------------------------------------------------*/
+// One event per task, the event number is also the priority (0 = highest).
+// Posting an event already pending is merged with it.
+typedef enum {
+  SCHED_EVENT_GPS_RX,
+  SCHED_EVENT_ADC,
+  SCHED_EVENT_DISPLAY_TICK,
+  SCHED_EVENT_CONSOLE,
+  SCHED_EVENTS
+} Sched_event_t;
+
+
+
+typedef void (*Sched_task_t)(void);
+
+
+
+typedef struct{
+  const char *name;
+  uint32_t runs;
+  uint32_t max_cycles;
+  uint64_t total_cycles;
+} Sched_stats_t;
+
+
+
+/* Functions -----------------------------------------------------------------*/
+void Sched_init();
+void Sched_register(Sched_event_t _event, Sched_task_t _task, const char *_name);
+void Sched_post(Sched_event_t _event);
+void Sched_run();
+void Sched_get_stats(Sched_event_t _event, Sched_stats_t *_stats);
+uint32_t Sched_avg_cycles(Sched_stats_t *_stats);
+void Sched_reset_stats();
+
+
+
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,62 @@
+/**
+  ******************************************************************************
+  * @file           : stack_guard.h
+  * @brief          : Header for stack_guard.c file.
+  ******************************************************************************
+  * @attention
+  *
+  * Copyright (c) 2023 Nicolò Campanini.
+  * All rights reserved.
+  *
+  * This software is licensed under terms that can be found in the LICENSE file
+  * in the root directory of this software component.
+  * If no LICENSE file comes with this software, it is provided AS-IS.
+  *
+  ******************************************************************************
+  */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __STACK_GUARD_H
+#define __STACK_GUARD_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Includes ------------------------------------------------------------------*/
+#include "main.h"
+#include "text_format.h"
+
+
+/* Types ---------------------------------------------------------------------*/
+// The stack grows down from the end of the RAM to the guard, which the
+// linker script places right after the variables (.stack_guard). The guard
+// is an MPU region with no access: an overflow faults into
+// MemManage_Handler(), which records it in the blackbox and resets.
+
+// Size and alignment of the guard, as in the linker script
+#define STACK_GUARD_SIZE 256
+
+// Paint of the unused stack, for the high-water mark
+#define STACK_PAINT 0xA5A5A5A5UL
+// Left unpainted below the frame of Stack_init()
+#define STACK_PAINT_MARGIN 64
+
+
+
+/* Functions -----------------------------------------------------------------*/
+void Stack_init();
+uint32_t Stack_size();
+uint32_t Stack_used();
+void Stack_dump(Text_write_t _write);
+void Stack_overflow(uint32_t *_frame);
+
+
+
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,59 @@
+/**
+  ******************************************************************************
+  * @file           : text_format.h
+  * @brief          : Header for text_format.c file.
+  ******************************************************************************
+  * @attention
+  *
+  * Copyright (c) 2023 Nicolò Campanini.
+  * All rights reserved.
+  *
+  * This software is licensed under terms that can be found in the LICENSE file
+  * in the root directory of this software component.
+  * If no LICENSE file comes with this software, it is provided AS-IS.
+  *
+  ******************************************************************************
+  */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __TEXT_FORMAT_H
+#define __TEXT_FORMAT_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Includes ------------------------------------------------------------------*/
+#include "main.h"
+
+
+/* Types ---------------------------------------------------------------------*/
+// Longest Text_append_u32() output
+#define TEXT_U32_DIGITS 10
+
+
+
+// Output of the text dumps: a blocking UART at boot, the console later
+typedef void (*Text_write_t)(const char *_text, uint16_t _length);
+
+
+
+/* Functions -----------------------------------------------------------------*/
+// Append to _out and return the new end, no terminator is written: the
+// caller sizes the buffer for its longest line
+char *Text_append(char *_out, const char *_text);
+char *Text_append_u32(char *_out, uint32_t _value);
+char *Text_append_hex32(char *_out, uint32_t _value);
+char *Text_append_i32(char *_out, int32_t _value);
+uint8_t Text_parse_i32(const char *_text, int32_t *_value);
+uint8_t Text_parse_digits(const char *_text, uint8_t _count, uint32_t *_value);
+
+
+
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -25,7 +25,6 @@ extern "C" {
 
 /* Includes ------------------------------------------------------------------*/
 #include "main.h"
-#include "time.h"
 
 
 /* Types ---------------------------------------------------------------------*/
@@ -38,6 +37,8 @@ extern "C" {
 /* Functions -----------------------------------------------------------------*/
 
 void Apply_timezone_dst(RTC_TimeTypeDef *timeTypeDef, RTC_DateTypeDef *dateTypeDef);
+uint32_t RTC_to_days(RTC_DateTypeDef *dateTypeDef);
+void days_to_RTC(uint32_t days, RTC_DateTypeDef *dateTypeDef);
 
 
 
@@ -0,0 +1,79 @@
+/**
+  ******************************************************************************
+  * @file           : watchdog.h
+  * @brief          : Header for watchdog.c file.
+  ******************************************************************************
+  * @attention
+  *
+  * Copyright (c) 2023 Nicolò Campanini.
+  * All rights reserved.
+  *
+  * This software is licensed under terms that can be found in the LICENSE file
+  * in the root directory of this software component.
+  * If no LICENSE file comes with this software, it is provided AS-IS.
+  *
+  ******************************************************************************
+  */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __WATCHDOG_H
+#define __WATCHDOG_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Includes ------------------------------------------------------------------*/
+#include "main.h"
+#include "text_format.h"
+
+
+/* Types ---------------------------------------------------------------------*/
+// The IWDG runs on the LSI (32 kHz nominal, 17 to 47 kHz) and keeps
+// counting in Stop. 32 kHz / 64 * 2000 = 4 s, 2.7 s with the fastest LSI:
+// well above the 1 s of the RTC wakeup that runs the supervision.
+#define WATCHDOG_PRESCALER IWDG_PR_PR_2 // /64
+#define WATCHDOG_RELOAD 2000
+
+// Deadlines of the subsystems. The loop checks in at every pass, at least
+// every RTC wakeup in Stop. The GPS bursts and the display frames are
+// expected back within the deadline once handed over: a frame started
+// right before a Stop completes after the next wakeup.
+#define WATCHDOG_LOOP_MS 3000
+#define WATCHDOG_GPS_MS 2000
+#define WATCHDOG_DISPLAY_MS 2000
+
+// Backup registers: the subsystems late at the last watchdog reset (with
+// the magic in the upper half), and the count of watchdog resets
+#define WATCHDOG_BKP_REASON RTC_BKP_DR18
+#define WATCHDOG_BKP_RESETS RTC_BKP_DR19
+#define WATCHDOG_BKP_MAGIC 0xD06D0000UL
+
+
+
+typedef enum {
+  WATCHDOG_LOOP,                // Scheduler loop, periodic
+  WATCHDOG_GPS,                 // GPS burst received, until parsed
+  WATCHDOG_DISPLAY,             // SPI frame started, until latched
+  WATCHDOG_SUBSYSTEMS
+} Watchdog_subsystem_t;
+
+
+
+/* Functions -----------------------------------------------------------------*/
+void Watchdog_init(RTC_HandleTypeDef *_hrtc);
+void Watchdog_checkin(Watchdog_subsystem_t _subsystem);
+void Watchdog_expect(Watchdog_subsystem_t _subsystem);
+void Watchdog_done(Watchdog_subsystem_t _subsystem);
+void Watchdog_tick();
+void Watchdog_dump(Text_write_t _write);
+
+
+
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
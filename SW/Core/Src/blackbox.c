@@ -0,0 +1,244 @@
+/**
+  ******************************************************************************
+  * @file           : blackbox.c
+  * @brief          : Event ring kept across a reset, with the fault record
+  ******************************************************************************
+  * @attention
+  *
+  * Copyright (c) 2023 Nicolò Campanini.
+  * All rights reserved.
+  *
+  * This software is licensed under terms that can be found in the LICENSE file
+  * in the root directory of this software component.
+  * If no LICENSE file comes with this software, it is provided AS-IS.
+  *
+  ******************************************************************************
+  */
+
+#include "blackbox.h"
+
+
+
+
+
+typedef struct{
+  uint32_t magic;
+  volatile uint32_t next;       // Free running index of the next slot
+  uint16_t boots;
+  Blackbox_event_t events[BLACKBOX_EVENTS];
+  Blackbox_fault_t fault;
+} Blackbox_t;
+
+// Not cleared by the startup code: survives a reset, not a power loss
+Blackbox_t Blackbox __attribute__((section(".noinit")));
+// Reset flags of this boot, and whether the ring comes from before it
+uint32_t Blackbox_reset_flags = 0;
+uint8_t Blackbox_warm = 0;
+
+const char *Blackbox_names[BLACKBOX_IDS] = {
+  "none",
+  "boot",
+  "error",
+  "hardfault",
+  "rtc_step",
+  "gps_stale",
+  "uart_error",
+  "hv",
+  "clock",
+  "stack",
+  "watchdog",
+  "rtc_sync",
+  "usage"
+};
+
+
+
+
+
+void Blackbox_init()
+{
+  // Reset flags, then clear them: the next reset must find only its own
+  Blackbox_reset_flags = RCC->CSR;
+  RCC->CSR |= RCC_CSR_RMVF;
+
+  // After a power-on the RAM is random: start an empty ring
+  Blackbox_warm = (Blackbox.magic == BLACKBOX_MAGIC) &&
+                  ((Blackbox_reset_flags & (RCC_CSR_PORRSTF | RCC_CSR_BORRSTF)) == 0);
+  if (!Blackbox_warm) {
+    Blackbox.next = 0;
+    Blackbox.boots = 0;
+    for (uint16_t i = 0; i < BLACKBOX_EVENTS; i++) {
+      Blackbox.events[i].id = BLACKBOX_NONE;
+    }
+    Blackbox.fault.magic = 0;
+    Blackbox.magic = BLACKBOX_MAGIC;
+  }
+  Blackbox.boots++;
+  Blackbox_log(BLACKBOX_BOOT, Blackbox_reset_flags);
+}
+
+
+
+
+
+void Blackbox_log(Blackbox_id_t _id, uint32_t _payload)
+{
+  Blackbox_event_t *event = NULL;
+  uint32_t index = 0;
+
+  // Claim a slot without masking the interrupts: an exception between
+  // LDREX and STREX clears the monitor and the claim is retried
+  do {
+    index = __LDREXW(&Blackbox.next);
+  } while (__STREXW(index + 1, &Blackbox.next) != 0);
+
+  // The id goes last: a slot cut by a reset reads as BLACKBOX_NONE
+  event = &Blackbox.events[index % BLACKBOX_EVENTS];
+  event->id = BLACKBOX_NONE;
+  event->tick = HAL_GetTick();
+  event->payload = _payload;
+  event->boot = Blackbox.boots;
+  __DMB();
+  event->id = _id;
+}
+
+
+
+
+
+void Blackbox_dump(Text_write_t _write)
+{
+  // Fault record (once) and ring, oldest event first:
+  //   bbox reset=<RCC_CSR> boot=<count>
+  //   bbox fault pc=<pc> lr=<lr> psr=<psr> cfsr=<cfsr> hfsr=<hfsr> mmfar=<mmfar> bfar=<bfar>
+  //   bbox <boot> <tick> <event> <payload>
+  // From the thread context only
+  char line[128];
+  char *out = NULL;
+  uint32_t first = 0;
+
+  out = Text_append(line, "bbox reset=");
+  out = Text_append_hex32(out, Blackbox_reset_flags);
+  out = Text_append(out, " boot=");
+  out = Text_append_u32(out, Blackbox.boots);
+  out = Text_append(out, "\r\n");
+  _write(line, out - line);
+
+  if (Blackbox.fault.magic == BLACKBOX_FAULT_MAGIC) {
+    out = Text_append(line, "bbox fault pc=");
+    out = Text_append_hex32(out, Blackbox.fault.pc);
+    out = Text_append(out, " lr=");
+    out = Text_append_hex32(out, Blackbox.fault.lr);
+    out = Text_append(out, " psr=");
+    out = Text_append_hex32(out, Blackbox.fault.psr);
+    out = Text_append(out, " cfsr=");
+    out = Text_append_hex32(out, Blackbox.fault.cfsr);
+    out = Text_append(out, " hfsr=");
+    out = Text_append_hex32(out, Blackbox.fault.hfsr);
+    out = Text_append(out, " mmfar=");
+    out = Text_append_hex32(out, Blackbox.fault.mmfar);
+    out = Text_append(out, " bfar=");
+    out = Text_append_hex32(out, Blackbox.fault.bfar);
+    out = Text_append(out, "\r\n");
+    _write(line, out - line);
+    // Reported once
+    Blackbox.fault.magic = 0;
+  }
+
+  first = (Blackbox.next > BLACKBOX_EVENTS) ? Blackbox.next - BLACKBOX_EVENTS : 0;
+  for (uint32_t i = first; i < Blackbox.next; i++) {
+    Blackbox_event_t event = Blackbox.events[i % BLACKBOX_EVENTS];
+    if (event.id == BLACKBOX_NONE || event.id >= BLACKBOX_IDS) {
+      continue;
+    }
+    out = Text_append(line, "bbox ");
+    out = Text_append_u32(out, event.boot);
+    out = Text_append(out, " ");
+    out = Text_append_u32(out, event.tick);
+    out = Text_append(out, " ");
+    out = Text_append(out, Blackbox_names[event.id]);
+    out = Text_append(out, " ");
+    out = Text_append_hex32(out, event.payload);
+    out = Text_append(out, "\r\n");
+    _write(line, out - line);
+  }
+}
+
+
+
+
+
+uint8_t Blackbox_warm_boot()
+{
+  // The ring holds the runs before this reset
+  return(Blackbox_warm);
+}
+
+
+
+
+
+uint32_t Blackbox_reset_cause()
+{
+  // RCC_CSR of this boot: Blackbox_init() clears the flags in the register
+  return(Blackbox_reset_flags);
+}
+
+
+
+
+
+void Blackbox_save_fault(uint32_t _pc, uint32_t _lr, uint32_t _psr)
+{
+  Blackbox.fault.pc = _pc;
+  Blackbox.fault.lr = _lr;
+  Blackbox.fault.psr = _psr;
+  Blackbox.fault.cfsr = SCB->CFSR;
+  Blackbox.fault.hfsr = SCB->HFSR;
+  Blackbox.fault.mmfar = SCB->MMFAR;
+  Blackbox.fault.bfar = SCB->BFAR;
+  Blackbox.fault.magic = BLACKBOX_FAULT_MAGIC;
+}
+
+
+
+
+
+void Blackbox_error(uint32_t _caller)
+{
+  // From Error_Handler(), interrupts masked: record and restart
+  Blackbox_save_fault(_caller, 0, 0);
+  Blackbox_log(BLACKBOX_ERROR, _caller);
+  NVIC_SystemReset();
+}
+
+
+
+
+
+void Blackbox_fault(uint32_t *_frame)
+{
+  // Exception frame: R0-R3, R12, LR, PC, xPSR
+  Blackbox_save_fault(_frame[6], _frame[5], _frame[7]);
+  Blackbox_log(BLACKBOX_HARDFAULT, _frame[6]);
+  NVIC_SystemReset();
+}
+
+
+
+
+
+#if defined(__arm__)
+// The hard fault vector (not generated by CubeMX). Naked: the stacked frame
+// is taken from MSP or PSP, as EXC_RETURN says, before any prologue.
+__attribute__((naked)) void HardFault_Handler(void)
+{
+  __asm volatile(
+    "tst lr, #4         \n"
+    "ite eq             \n"
+    "mrseq r0, msp      \n"
+    "mrsne r0, psp      \n"
+    "b Blackbox_fault   \n"
+  );
+}
+#endif
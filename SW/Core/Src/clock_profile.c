@@ -0,0 +1,335 @@
+/**
+  ******************************************************************************
+  * @file           : clock_profile.c
+  * @brief          : Run time clock profiles keeping the peripheral timings
+  ******************************************************************************
+  * @attention
+  *
+  * Copyright (c) 2023 Nicolò Campanini.
+  * All rights reserved.
+  *
+  * This software is licensed under terms that can be found in the LICENSE file
+  * in the root directory of this software component.
+  * If no LICENSE file comes with this software, it is provided AS-IS.
+  *
+  ******************************************************************************
+  */
+
+#include "clock_profile.h"
+#include "cycle_counter.h"
+#include "nixie_brightness.h"
+#include "power.h"
+#include "blackbox.h"
+#include "latency_trace.h"
+
+
+
+
+
+// Profiles, voltage scale 2 (up to 84 MHz). HSE is 25 MHz, PLLQ keeps 48 MHz
+// where it can. APB1 stays at SYSCLK/2 so every timer runs at SYSCLK.
+const Clock_profile_struct_t Clock_profiles[CLOCK_PROFILES] = {
+  [CLOCK_LOW] = {"low", 16000000, RCC_SYSCLKSOURCE_HSI, 0, 0, 0, 0, FLASH_LATENCY_0, RCC_HCLK_DIV2, 4200, 1900},
+  [CLOCK_NORMAL] = {"normal", 60000000, RCC_SYSCLKSOURCE_PLLCLK, 15, 144, RCC_PLLP_DIV4, 5, FLASH_LATENCY_1, RCC_HCLK_DIV2, 12000, 5000},
+  [CLOCK_BURST] = {"burst", 84000000, RCC_SYSCLKSOURCE_PLLCLK, 25, 336, RCC_PLLP_DIV4, 7, FLASH_LATENCY_2, RCC_HCLK_DIV2, 16000, 6500}
+};
+
+// Peripherals re-timed at each switch
+TIM_HandleTypeDef *Clock_htim_pwm;
+TIM_HandleTypeDef *Clock_htim_tick;
+TIM_HandleTypeDef *Clock_htim_adc;
+UART_HandleTypeDef *Clock_huart;
+UART_HandleTypeDef *Clock_huart_console;
+// Profile in use, profile outside the bursts, nesting of the bursts
+Clock_profile_t Clock_profile = CLOCK_NORMAL;
+Clock_profile_t Clock_base_profile = CLOCK_NORMAL;
+uint8_t Clock_burst_depth = 0;
+// Bursts run, and the count and HAL tick of the last one logged
+uint32_t Clock_bursts = 0;
+uint32_t Clock_bursts_logged = 0;
+uint32_t Clock_burst_logged_at = 0;
+
+
+
+
+
+void Clock_init(TIM_HandleTypeDef *_htim_pwm, TIM_HandleTypeDef *_htim_tick, TIM_HandleTypeDef *_htim_adc, UART_HandleTypeDef *_huart, UART_HandleTypeDef *_huart_console)
+{
+  Clock_htim_pwm = _htim_pwm;
+  Clock_htim_tick = _htim_tick;
+  Clock_htim_adc = _htim_adc;
+  Clock_huart = _huart;
+  Clock_huart_console = _huart_console;
+
+  // SystemClock_Config() starts on the normal profile
+  Clock_profile = CLOCK_NORMAL;
+  Clock_base_profile = CLOCK_NORMAL;
+  Clock_burst_depth = 0;
+  Clock_bursts = 0;
+  Clock_bursts_logged = 0;
+  Clock_burst_logged_at = HAL_GetTick() - CLOCK_BURST_LOG_MS;
+}
+
+
+
+
+
+void Clock_retime_peripherals(uint32_t _sysclk_hz)
+{
+  // TIM1: same PWM frequency, the period (duty resolution) follows the clock.
+  // ARR and CCR are preloaded: write both, then force the update event.
+  __HAL_TIM_SET_AUTORELOAD(Clock_htim_pwm, (_sysclk_hz / CLOCK_PWM_HZ) - 1);
+  Nixie_brightness_refresh();
+  Clock_htim_pwm->Instance->EGR = TIM_EGR_UG;
+
+  // TIM11: 25 Hz display tick. The prescaler is preloaded and taken at the
+  // next tick: an update event here would restart the period and raise a
+  // tick of its own, one more at each burst (the period in progress runs
+  // on the new clock, off by the burst length times the clock ratio)
+  __HAL_TIM_SET_PRESCALER(Clock_htim_tick, (_sysclk_hz / CLOCK_TICK_BASE_HZ) - 1);
+  __HAL_TIM_SET_AUTORELOAD(Clock_htim_tick, CLOCK_TICK_PERIOD - 1);
+
+  // TIM2: 4 kHz ADC trigger
+  __HAL_TIM_SET_PRESCALER(Clock_htim_adc, (_sysclk_hz / CLOCK_ADC_TRIGGER_BASE_HZ) - 1);
+  __HAL_TIM_SET_AUTORELOAD(Clock_htim_adc, CLOCK_ADC_TRIGGER_PERIOD - 1);
+  Clock_htim_adc->Instance->EGR = TIM_EGR_UG;
+
+  // ADC clock is PCLK2 / 2 or 4, below its limit
+  if (_sysclk_hz / 2 > CLOCK_ADC_MAX_HZ) {
+    MODIFY_REG(ADC1_COMMON->CCR, ADC_CCR_ADCPRE, ADC_CLOCK_SYNC_PCLK_DIV4);
+  } else {
+    MODIFY_REG(ADC1_COMMON->CCR, ADC_CCR_ADCPRE, ADC_CLOCK_SYNC_PCLK_DIV2);
+  }
+
+  // USART1 on APB2 (= SYSCLK): same baud rate
+  Clock_huart->Instance->BRR = UART_BRR_SAMPLING16(HAL_RCC_GetPCLK2Freq(), Clock_huart->Init.BaudRate);
+  // USART2 on APB1: same baud rate
+  Clock_huart_console->Instance->BRR = UART_BRR_SAMPLING16(HAL_RCC_GetPCLK1Freq(), Clock_huart_console->Init.BaudRate);
+}
+
+
+
+
+
+HAL_StatusTypeDef Clock_set_profile(Clock_profile_t _profile)
+{
+  const Clock_profile_struct_t *profile = &Clock_profiles[_profile];
+  RCC_OscInitTypeDef RCC_OscInitStruct = {0};
+  RCC_ClkInitTypeDef RCC_ClkInitStruct = {0};
+
+  if (_profile == Clock_profile) {
+    return(HAL_OK);
+  }
+
+  // Must run in thread context (scheduler task): the HAL timeouts need the tick
+  RCC_ClkInitStruct.ClockType = RCC_CLOCKTYPE_HCLK|RCC_CLOCKTYPE_SYSCLK
+                              |RCC_CLOCKTYPE_PCLK1|RCC_CLOCKTYPE_PCLK2;
+  RCC_ClkInitStruct.AHBCLKDivider = RCC_SYSCLK_DIV1;
+  RCC_ClkInitStruct.APB2CLKDivider = RCC_HCLK_DIV1;
+
+  // Move to HSI first: the PLL can't be changed while it clocks the core
+  if (__HAL_RCC_GET_SYSCLK_SOURCE() == RCC_SYSCLKSOURCE_STATUS_PLLCLK) {
+    RCC_ClkInitStruct.SYSCLKSource = RCC_SYSCLKSOURCE_HSI;
+    RCC_ClkInitStruct.APB1CLKDivider = RCC_HCLK_DIV2;
+    if (HAL_RCC_ClockConfig(&RCC_ClkInitStruct, FLASH_LATENCY_2) != HAL_OK) {
+      return(HAL_ERROR);
+    }
+    Trace_clock_changed();
+  }
+
+  if (profile->source == RCC_SYSCLKSOURCE_PLLCLK) {
+    // Oscillator and PLL for the profile
+    RCC_OscInitStruct.OscillatorType = RCC_OSCILLATORTYPE_HSE;
+    RCC_OscInitStruct.HSEState = RCC_HSE_ON;
+    RCC_OscInitStruct.PLL.PLLState = RCC_PLL_ON;
+    RCC_OscInitStruct.PLL.PLLSource = RCC_PLLSOURCE_HSE;
+    RCC_OscInitStruct.PLL.PLLM = profile->pllm;
+    RCC_OscInitStruct.PLL.PLLN = profile->plln;
+    RCC_OscInitStruct.PLL.PLLP = profile->pllp;
+    RCC_OscInitStruct.PLL.PLLQ = profile->pllq;
+  } else {
+    // HSI only: stop the PLL and the HSE, they are the bulk of the saving
+    RCC_OscInitStruct.OscillatorType = RCC_OSCILLATORTYPE_HSE;
+    RCC_OscInitStruct.HSEState = RCC_HSE_OFF;
+    RCC_OscInitStruct.PLL.PLLState = RCC_PLL_OFF;
+  }
+  if (HAL_RCC_OscConfig(&RCC_OscInitStruct) != HAL_OK) {
+    return(HAL_ERROR);
+  }
+
+  RCC_ClkInitStruct.SYSCLKSource = profile->source;
+  RCC_ClkInitStruct.APB1CLKDivider = profile->apb1_divider;
+  if (HAL_RCC_ClockConfig(&RCC_ClkInitStruct, profile->flash_latency) != HAL_OK) {
+    return(HAL_ERROR);
+  }
+  Trace_clock_changed();
+
+  // HAL_RCC_ClockConfig() updated SystemCoreClock and the SysTick
+  Clock_retime_peripherals(profile->sysclk_hz);
+  Power_set_currents(profile->run_uA, profile->sleep_uA);
+  Clock_profile = _profile;
+
+  return(HAL_OK);
+}
+
+
+
+
+
+Clock_profile_t Clock_get_profile()
+{
+  return(Clock_profile);
+}
+
+
+
+
+
+void Clock_set_base_profile(Clock_profile_t _profile)
+{
+  // Applied now unless a burst is running, then at its end
+  if (_profile != Clock_base_profile) {
+    Blackbox_log(BLACKBOX_CLOCK, _profile);
+  }
+  Clock_base_profile = _profile;
+  if (Clock_burst_depth == 0) {
+    Clock_set_profile(Clock_base_profile);
+  }
+}
+
+
+
+
+
+void Clock_burst_begin()
+{
+  // Nested bursts keep the fast clock until the outer one ends
+  if (Clock_burst_depth++ == 0) {
+    Clock_set_profile(CLOCK_BURST);
+    Clock_bursts++;
+    if (HAL_GetTick() - Clock_burst_logged_at >= CLOCK_BURST_LOG_MS) {
+      Blackbox_log(BLACKBOX_CLOCK, CLOCK_BURST | ((Clock_bursts - Clock_bursts_logged) << 8));
+      Clock_bursts_logged = Clock_bursts;
+      Clock_burst_logged_at = HAL_GetTick();
+    }
+  }
+}
+
+
+
+
+
+void Clock_burst_end()
+{
+  if (Clock_burst_depth > 0 && --Clock_burst_depth == 0) {
+    Clock_set_profile(Clock_base_profile);
+  }
+}
+
+
+
+
+
+uint32_t Clock_benchmark_workload()
+{
+  // Bitwise CRC32 of the start of the flash: memory and ALU bound
+  const uint8_t *data = (const uint8_t *) FLASH_BASE;
+  uint32_t crc = 0xFFFFFFFF;
+
+  for (uint32_t i = 0; i < CLOCK_BENCHMARK_BYTES; i++) {
+    crc ^= data[i];
+    for (uint8_t b = 0; b < 8; b++) {
+      crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+    }
+  }
+  return(~crc);
+}
+
+
+
+
+
+void Clock_benchmark(Clock_profile_t _profile, Clock_benchmark_t *_result)
+{
+  // From the thread context, outside any burst
+  Clock_profile_t previous = Clock_profile;
+  volatile uint32_t sink = 0;
+  uint32_t start = 0;
+
+  Cycles_init();
+
+  // Switch time into the profile, from another one: Power_time_us() goes
+  // on across the switch, the cycle counter would mix the clocks
+  _result->from = (_profile == previous) ? ((_profile == CLOCK_LOW) ? CLOCK_NORMAL : CLOCK_LOW) : previous;
+  Clock_set_profile(_result->from);
+  start = Power_time_us();
+  Clock_set_profile(_profile);
+  _result->switch_us = Power_time_us() - start;
+
+  // Latency of a fixed workload at this clock
+  start = Cycles_now();
+  sink = Clock_benchmark_workload();
+  _result->workload_us = (Cycles_now() - start) / (SystemCoreClock / 1000000);
+
+  Clock_set_profile(previous);
+  (void) sink;
+}
+
+
+
+
+
+void Clock_dump(Text_write_t _write)
+{
+  // Profile in use and outside the bursts, bursts run:
+  //   clock profile=<name> base=<name> bursts=<count>
+  char line[80];
+  char *out = NULL;
+
+  out = Text_append(line, "clock profile=");
+  out = Text_append(out, Clock_profiles[Clock_profile].name);
+  out = Text_append(out, " base=");
+  out = Text_append(out, Clock_profiles[Clock_base_profile].name);
+  out = Text_append(out, " bursts=");
+  out = Text_append_u32(out, Clock_bursts);
+  out = Text_append(out, "\r\n");
+  _write(line, out - line);
+}
+
+
+
+
+
+void Clock_benchmark_dump(Text_write_t _write)
+{
+  // Every profile in turn, then back to the one in use, before any output:
+  // the switches retime the console USART. The currents are the typical
+  // ones of the table: a meter on the board while the profile is held
+  // calibrates them.
+  //   clock <name> sysclk=<Hz> from=<name> switch_us=<us> workload_us=<us> typ_run_uA=<uA> typ_sleep_uA=<uA>
+  char line[128];
+  char *out = NULL;
+  Clock_benchmark_t results[CLOCK_PROFILES];
+
+  for (uint8_t p = 0; p < CLOCK_PROFILES; p++) {
+    Clock_benchmark((Clock_profile_t) p, &results[p]);
+  }
+  for (uint8_t p = 0; p < CLOCK_PROFILES; p++) {
+    out = Text_append(line, "clock ");
+    out = Text_append(out, Clock_profiles[p].name);
+    out = Text_append(out, " sysclk=");
+    out = Text_append_u32(out, Clock_profiles[p].sysclk_hz);
+    out = Text_append(out, " from=");
+    out = Text_append(out, Clock_profiles[results[p].from].name);
+    out = Text_append(out, " switch_us=");
+    out = Text_append_u32(out, results[p].switch_us);
+    out = Text_append(out, " workload_us=");
+    out = Text_append_u32(out, results[p].workload_us);
+    out = Text_append(out, " typ_run_uA=");
+    out = Text_append_u32(out, Clock_profiles[p].run_uA);
+    out = Text_append(out, " typ_sleep_uA=");
+    out = Text_append_u32(out, Clock_profiles[p].sleep_uA);
+    out = Text_append(out, "\r\n");
+    _write(line, out - line);
+  }
+}
@@ -0,0 +1,228 @@
+/**
+  ******************************************************************************
+  * @file           : config.c
+  * @brief          : Run time settings, with a table for the console
+  ******************************************************************************
+  * @attention
+  *
+  * Copyright (c) 2023 Nicolò Campanini.
+  * All rights reserved.
+  *
+  * This software is licensed under terms that can be found in the LICENSE file
+  * in the root directory of this software component.
+  * If no LICENSE file comes with this software, it is provided AS-IS.
+  *
+  ******************************************************************************
+  */
+
+#include "config.h"
+#include "kv_store.h"
+#include "gps_parser.h"
+#include "timezone_dst.h"
+#include "nixie_brightness.h"
+#include "nixie_animation.h"
+#include "nixie_antipoison.h"
+#include "nixie_night.h"
+#include <string.h>
+
+
+
+
+
+Config_struct_t Config;
+
+void Config_apply_brightness(void);
+void Config_apply_night(void);
+void Config_apply_location(void);
+
+const Config_entry_t Config_table[] = {
+  {"rtc_update",  KV_KEY_CONFIG + 0,  &Config.rtc_update_cnt,    2, 0, 1, 65535, NULL},
+  {"tz_offset",   KV_KEY_CONFIG + 1,  &Config.timezone_offset_s, 4, 1, -12 * 3600, 14 * 3600, NULL},
+  {"dst_offset",  KV_KEY_CONFIG + 2,  &Config.dst_offset_s,      4, 1, 0, 7200, NULL},
+  {"brightness",  KV_KEY_CONFIG + 3,  &Config.brightness,        1, 0, 0, BRIGHTNESS_MAX, Config_apply_brightness},
+  {"animation",   KV_KEY_CONFIG + 4,  &Config.animation_trigger, 1, 0, ANIMATION_NEVER, ANIMATION_ON_HOUR, NULL},
+  {"poison_hour", KV_KEY_CONFIG + 5,  &Config.antipoison_hour,   1, 0, 0, ANTIPOISON_HOURLY, NULL},
+  {"poison_min",  KV_KEY_CONFIG + 6,  &Config.antipoison_minute, 1, 0, 0, 59, NULL},
+  {"night_on",    KV_KEY_CONFIG + 7,  &Config.night_on_minute,   2, 1, 0, 1439, Config_apply_night},
+  {"night_off",   KV_KEY_CONFIG + 8,  &Config.night_off_minute,  2, 1, 0, 1439, Config_apply_night},
+  {"gps_latency", KV_KEY_CONFIG + 9,  &Config.gps_latency_ms,    2, 0, 0, 999, NULL},
+  {"latitude",    KV_KEY_CONFIG + 10, &Config.latitude_cdeg,     2, 1, -9000, 9000, Config_apply_location},
+  {"longitude",   KV_KEY_CONFIG + 11, &Config.longitude_cdeg,    2, 1, -18000, 18000, Config_apply_location}
+};
+#define CONFIG_ENTRIES (sizeof(Config_table) / sizeof(Config_table[0]))
+
+
+
+
+
+void Config_init()
+{
+  // Defaults: before the init of the modules that read them
+  Config.rtc_update_cnt = RTC_UPDATE_CNT;
+  Config.timezone_offset_s = TIMEZONE_OFFSET_S;
+  Config.dst_offset_s = DST_OFFSET_S;
+  Config.brightness = BRIGHTNESS_DEFAULT;
+  Config.animation_trigger = ANIMATION_TRIGGER;
+  Config.antipoison_hour = ANTIPOISON_HOUR;
+  Config.antipoison_minute = ANTIPOISON_MINUTE;
+  Config.night_on_minute = NIGHT_ON_MINUTE;
+  Config.night_off_minute = NIGHT_OFF_MINUTE;
+  Config.gps_latency_ms = GPS_LATENCY_MS;
+  Config.latitude_cdeg = NIGHT_LATITUDE_CDEG;
+  Config.longitude_cdeg = NIGHT_LONGITUDE_CDEG;
+
+  // Saved values (KV_init() before), if still in range
+  for (uint8_t i = 0; i < CONFIG_ENTRIES; i++) {
+    const Config_entry_t *entry = &Config_table[i];
+    uint8_t saved[4];
+    int32_t value = 0;
+
+    if (KV_get(entry->key, saved, sizeof(saved)) != entry->size) {
+      continue;
+    }
+    switch (entry->size) {
+      case 1: value = entry->is_signed ? *(int8_t *) saved : *(uint8_t *) saved; break;
+      case 2: value = entry->is_signed ? *(int16_t *) saved : *(uint16_t *) saved; break;
+      default: value = *(int32_t *) saved; break;
+    }
+    if (value >= entry->min && value <= entry->max) {
+      memcpy(entry->value, saved, entry->size);
+    }
+  }
+}
+
+
+
+
+
+uint8_t Config_count()
+{
+  return(CONFIG_ENTRIES);
+}
+
+
+
+
+
+const Config_entry_t *Config_entry(uint8_t _index)
+{
+  if (_index >= CONFIG_ENTRIES) {
+    return(NULL);
+  }
+  return(&Config_table[_index]);
+}
+
+
+
+
+
+const Config_entry_t *Config_find(const char *_name)
+{
+  for (uint8_t i = 0; i < CONFIG_ENTRIES; i++) {
+    if (strcmp(Config_table[i].name, _name) == 0) {
+      return(&Config_table[i]);
+    }
+  }
+  return(NULL);
+}
+
+
+
+
+
+int32_t Config_get(const Config_entry_t *_entry)
+{
+  switch (_entry->size) {
+    case 1: return(_entry->is_signed ? *(int8_t *) _entry->value : *(uint8_t *) _entry->value);
+    case 2: return(_entry->is_signed ? *(int16_t *) _entry->value : *(uint16_t *) _entry->value);
+    default: return(*(int32_t *) _entry->value);
+  }
+}
+
+
+
+
+
+uint8_t Config_set(const Config_entry_t *_entry, int32_t _value)
+{
+  // Out of range: unchanged, 0 returned
+  if (_value < _entry->min || _value > _entry->max) {
+    return(0);
+  }
+
+  // The display path reads the settings from PendSV: no torn values
+  __disable_irq();
+  switch (_entry->size) {
+    case 1: *(uint8_t *) _entry->value = (uint8_t) _value; break;
+    case 2: *(uint16_t *) _entry->value = (uint16_t) _value; break;
+    default: *(int32_t *) _entry->value = _value; break;
+  }
+  __enable_irq();
+
+  if (_entry->apply != NULL) {
+    _entry->apply();
+  }
+  return(1);
+}
+
+
+
+
+
+HAL_StatusTypeDef Config_save()
+{
+  // Every setting to the store: the unchanged ones cost no write
+  HAL_StatusTypeDef status = HAL_OK;
+
+  for (uint8_t i = 0; i < CONFIG_ENTRIES && status == HAL_OK; i++) {
+    status = KV_set(Config_table[i].key, Config_table[i].value, Config_table[i].size);
+  }
+  return(status);
+}
+
+
+
+
+
+void Config_apply_brightness(void)
+{
+  // Tubes off for the night: the new level comes at the ramp up
+  if (Nixie_night_get_state() == NIGHT_ON) {
+    Nixie_brightness_set(Config.brightness, 500);
+  } else {
+    Nixie_night_saved_level = Config.brightness;
+  }
+}
+
+
+
+
+
+void Config_apply_night(void)
+{
+  // Same fixed window on every day, the console "night" command sets
+  // the windows of each weekday after
+  Nixie_night_config_t night;
+
+  Nixie_night_get_config(&night);
+  for (uint8_t d = 0; d < NIGHT_DAYS; d++) {
+    night.days[d].on.type = NIGHT_EDGE_FIXED;
+    night.days[d].on.minutes = Config.night_on_minute;
+    night.days[d].off.type = NIGHT_EDGE_FIXED;
+    night.days[d].off.minutes = Config.night_off_minute;
+  }
+  Nixie_night_set_config(&night);
+}
+
+
+
+
+
+void Config_apply_location(void)
+{
+  // Sunrise and sunset again at the next minute
+  Nixie_night_config_t night;
+
+  Nixie_night_get_config(&night);
+  Nixie_night_set_config(&night);
+}
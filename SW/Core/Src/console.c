@@ -0,0 +1,523 @@
+/**
+  ******************************************************************************
+  * @file           : console.c
+  * @brief          : Line oriented command console on the spare UART
+  ******************************************************************************
+  * @attention
+  *
+  * Copyright (c) 2023 Nicolò Campanini.
+  * All rights reserved.
+  *
+  * This software is licensed under terms that can be found in the LICENSE file
+  * in the root directory of this software component.
+  * If no LICENSE file comes with this software, it is provided AS-IS.
+  *
+  ******************************************************************************
+  */
+
+#include "console.h"
+#include "config.h"
+#include "kv_store.h"
+#include "text_format.h"
+#include "scheduler.h"
+#include "power.h"
+#include "profiler.h"
+#include "latency_trace.h"
+#include "isr_latency.h"
+#include "blackbox.h"
+#include "stack_guard.h"
+#include "watchdog.h"
+#include "cpu_load.h"
+#include "clock_profile.h"
+#include "nixie_display.h"
+#include "nixie_animation.h"
+#include "nixie_antipoison.h"
+#include "nixie_night.h"
+#include "nixie_usage.h"
+#include <string.h>
+
+
+
+
+
+UART_HandleTypeDef *Console_huart;
+
+// Received characters, from the RX interrupt to the task
+uint8_t Console_rx_byte = 0;
+uint8_t Console_rx_ring[CONSOLE_RX_SIZE];
+volatile uint16_t Console_rx_head = 0;
+uint16_t Console_rx_tail = 0;
+
+// Output, from the task to the TX interrupt. A write that doesn't fit is
+// dropped whole: the task never waits for the UART.
+uint8_t Console_tx_ring[CONSOLE_TX_SIZE];
+uint16_t Console_tx_head = 0;
+volatile uint16_t Console_tx_tail = 0;
+volatile uint16_t Console_tx_chunk = 0;
+uint32_t Console_tx_dropped = 0;
+
+// Line being typed
+char Console_line[CONSOLE_LINE_SIZE];
+uint8_t Console_line_length = 0;
+
+// Frames of "test digits"
+Nixie_frame_t Console_test_frames[NIXIE_DIGITS];
+
+void Console_execute(char *_line);
+void Console_tx_start();
+
+
+
+
+
+void Console_init(UART_HandleTypeDef *_huart)
+{
+  Console_huart = _huart;
+  Console_rx_head = 0;
+  Console_rx_tail = 0;
+  Console_tx_head = 0;
+  Console_tx_tail = 0;
+  Console_tx_chunk = 0;
+  Console_line_length = 0;
+
+  // One character per interrupt: a few per millisecond at most
+  HAL_UART_Receive_IT(Console_huart, &Console_rx_byte, 1);
+  Console_print("\r\nnixie clock console, 'help' for the commands\r\n> ");
+}
+
+
+
+
+
+void Console_task()
+{
+  // Scheduler task of SCHED_EVENT_CONSOLE: edit the line, run it at the end
+  uint32_t dropped = 0;
+  char echo[1];
+
+  while (Console_rx_tail != Console_rx_head) {
+    char c = Console_rx_ring[Console_rx_tail];
+    Console_rx_tail = (Console_rx_tail + 1) % CONSOLE_RX_SIZE;
+
+    if (c == '\r' || c == '\n') {
+      // CR LF: the LF finds an empty line
+      if (c == '\n' && Console_line_length == 0) {
+        continue;
+      }
+      Console_line[Console_line_length] = '\0';
+      Console_print("\r\n");
+      dropped = Console_tx_dropped;
+      Console_execute(Console_line);
+      if (Console_tx_dropped != dropped) {
+        Console_print("(output truncated)\r\n");
+      }
+      Console_line_length = 0;
+      Console_print("> ");
+    } else if (c == '\b' || c == 0x7F) {
+      if (Console_line_length > 0) {
+        Console_line_length--;
+        Console_print("\b \b");
+      }
+    } else if (c >= ' ' && c < 0x7F && Console_line_length < CONSOLE_LINE_SIZE - 1) {
+      Console_line[Console_line_length++] = c;
+      echo[0] = c;
+      Console_write(echo, 1);
+    }
+  }
+}
+
+
+
+
+
+void Console_write(const char *_text, uint16_t _length)
+{
+  // Text_write_t of the dumps. Thread context only.
+  uint16_t used = (uint16_t) (Console_tx_head - Console_tx_tail) % CONSOLE_TX_SIZE;
+
+  if (_length >= CONSOLE_TX_SIZE - used) {
+    Console_tx_dropped += _length;
+    return;
+  }
+  for (uint16_t i = 0; i < _length; i++) {
+    Console_tx_ring[Console_tx_head] = _text[i];
+    Console_tx_head = (Console_tx_head + 1) % CONSOLE_TX_SIZE;
+  }
+  Console_tx_start();
+}
+
+
+
+
+
+void Console_print(const char *_text)
+{
+  Console_write(_text, strlen(_text));
+}
+
+
+
+
+
+uint32_t Console_dropped()
+{
+  return(Console_tx_dropped);
+}
+
+
+
+
+
+void Console_tx_start()
+{
+  // Send the contiguous part of the ring, the TX interrupt chains the rest.
+  // From the task and from the TX interrupt.
+  uint32_t primask = __get_PRIMASK();
+  uint16_t head = 0;
+  uint16_t tail = 0;
+  uint16_t length = 0;
+
+  __disable_irq();
+  if (Console_tx_chunk == 0 && Console_tx_head != Console_tx_tail) {
+    head = Console_tx_head;
+    tail = Console_tx_tail;
+    length = (head > tail) ? head - tail : CONSOLE_TX_SIZE - tail;
+    Console_tx_chunk = length;
+  }
+  __set_PRIMASK(primask);
+
+  if (length > 0) {
+    // No Stop while the UART shifts
+    Power_lock(POWER_LOCK_CONSOLE);
+    HAL_UART_Transmit_IT(Console_huart, &Console_tx_ring[tail], length);
+  }
+}
+
+
+
+
+
+void HAL_UART_TxCpltCallback(UART_HandleTypeDef *huart)
+{
+  if (huart == Console_huart) {
+    Console_tx_tail = (Console_tx_tail + Console_tx_chunk) % CONSOLE_TX_SIZE;
+    Console_tx_chunk = 0;
+    if (Console_tx_head == Console_tx_tail) {
+      Power_unlock(POWER_LOCK_CONSOLE);
+    } else {
+      Console_tx_start();
+    }
+  }
+}
+
+
+
+
+
+void HAL_UART_RxCpltCallback(UART_HandleTypeDef *huart)
+{
+  if (huart == Console_huart) {
+    uint16_t next = (Console_rx_head + 1) % CONSOLE_RX_SIZE;
+    // Full: the character is lost, the line will be wrong anyway
+    if (next != Console_rx_tail) {
+      Console_rx_ring[Console_rx_head] = Console_rx_byte;
+      Console_rx_head = next;
+    }
+    HAL_UART_Receive_IT(Console_huart, &Console_rx_byte, 1);
+    Power_hold(CONSOLE_AWAKE_MS);
+    Sched_post(SCHED_EVENT_CONSOLE);
+  }
+}
+
+
+
+
+
+void Console_uart_error(UART_HandleTypeDef *_huart)
+{
+  // An overrun aborts the reception: receive again
+  if (_huart == Console_huart && _huart->RxState == HAL_UART_STATE_READY) {
+    HAL_UART_Receive_IT(Console_huart, &Console_rx_byte, 1);
+  }
+}
+
+
+
+
+
+void Console_print_entry(const Config_entry_t *_entry)
+{
+  char line[CONSOLE_LINE_SIZE];
+  char *out = NULL;
+
+  out = Text_append(line, _entry->name);
+  out = Text_append(out, "=");
+  out = Text_append_i32(out, Config_get(_entry));
+  out = Text_append(out, "\r\n");
+  Console_write(line, out - line);
+}
+
+
+
+
+
+void Console_print_sched()
+{
+  //   sched <task> n=<runs> avg=<cycles> max=<cycles>
+  char line[CONSOLE_LINE_SIZE];
+  Sched_stats_t stats;
+  char *out = NULL;
+
+  for (uint8_t e = 0; e < SCHED_EVENTS; e++) {
+    Sched_get_stats(e, &stats);
+    if (stats.name == NULL) {
+      continue;
+    }
+    out = Text_append(line, "sched ");
+    out = Text_append(out, stats.name);
+    out = Text_append(out, " n=");
+    out = Text_append_u32(out, stats.runs);
+    out = Text_append(out, " avg=");
+    out = Text_append_u32(out, Sched_avg_cycles(&stats));
+    out = Text_append(out, " max=");
+    out = Text_append_u32(out, stats.max_cycles);
+    out = Text_append(out, "\r\n");
+    Console_write(line, out - line);
+  }
+}
+
+
+
+
+
+void Console_print_kv()
+{
+  //   kv gen=<generation> keys=<n> used=<bytes> writes=<n> same=<n> throttled=<n> compactions=<n> errors=<n> load=<cycles>
+  char line[160];
+  KV_stats_t stats;
+  char *out = NULL;
+
+  KV_get_stats(&stats);
+  out = Text_append(line, "kv gen=");
+  out = Text_append_u32(out, stats.generation);
+  out = Text_append(out, " keys=");
+  out = Text_append_u32(out, stats.records);
+  out = Text_append(out, " used=");
+  out = Text_append_u32(out, stats.used_bytes);
+  out = Text_append(out, " writes=");
+  out = Text_append_u32(out, stats.writes);
+  out = Text_append(out, " same=");
+  out = Text_append_u32(out, stats.unchanged);
+  out = Text_append(out, " throttled=");
+  out = Text_append_u32(out, stats.throttled);
+  out = Text_append(out, " compactions=");
+  out = Text_append_u32(out, stats.compactions);
+  out = Text_append(out, " errors=");
+  out = Text_append_u32(out, stats.errors);
+  out = Text_append(out, " load=");
+  out = Text_append_u32(out, stats.load_cycles);
+  out = Text_append(out, "\r\n");
+  Console_write(line, out - line);
+}
+
+
+
+
+
+void Console_test_digits()
+{
+  // 0 to 9 on every tube, then back to the time
+  uint8_t digits[NIXIE_TUBES];
+
+  for (uint8_t d = 0; d < NIXIE_DIGITS; d++) {
+    memset(digits, d, NIXIE_TUBES);
+    Nixie_encode_frame(digits, Console_test_frames[d].spi);
+    Console_test_frames[d].ticks = CONSOLE_TEST_TICKS;
+  }
+  Nixie_sequence_start(Console_test_frames, NIXIE_DIGITS);
+}
+
+
+
+
+
+void Console_night(uint8_t _argc, char **_argv)
+{
+  // night <day> on|off <edge> <minutes>, night <day> enable|disable
+  Nixie_night_config_t night;
+  Nixie_night_edge_t edge;
+  Nixie_night_edge_t *target = NULL;
+  uint8_t day = 0;
+  int32_t value = 0;
+
+  Nixie_night_get_config(&night);
+  if (!Nixie_night_parse_day(_argv[1], &day)) {
+    Console_print("unknown day\r\n");
+    return;
+  }
+  if (_argc == 3 && strcmp(_argv[2], "enable") == 0) {
+    night.days[day].enabled = 1;
+  } else if (_argc == 3 && strcmp(_argv[2], "disable") == 0) {
+    night.days[day].enabled = 0;
+  } else if (_argc == 5 && (strcmp(_argv[2], "on") == 0 || strcmp(_argv[2], "off") == 0)) {
+    target = (_argv[2][1] == 'n') ? &night.days[day].on : &night.days[day].off;
+    if (!Nixie_night_parse_edge(_argv[3], &edge.type) || !Text_parse_i32(_argv[4], &value)) {
+      Console_print("bad value\r\n");
+      return;
+    }
+    edge.minutes = (value < INT16_MIN || value > INT16_MAX) ? INT16_MIN : (int16_t) value;
+    if (!Nixie_night_edge_valid(&edge)) {
+      Console_print("out of range\r\n");
+      return;
+    }
+    *target = edge;
+  } else {
+    Console_print("bad value\r\n");
+    return;
+  }
+  Nixie_night_set_config(&night);
+  Nixie_night_dump(Console_write);
+}
+
+
+
+
+
+void Console_execute(char *_line)
+{
+  char *argv[CONSOLE_ARGS];
+  uint8_t argc = 0;
+  const Config_entry_t *entry = NULL;
+  HAL_StatusTypeDef status = HAL_OK;
+  int32_t value = 0;
+
+  // Split the words in place
+  while (*_line != '\0' && argc < CONSOLE_ARGS) {
+    while (*_line == ' ') {
+      *_line++ = '\0';
+    }
+    if (*_line == '\0') {
+      break;
+    }
+    argv[argc++] = _line;
+    while (*_line != ' ' && *_line != '\0') {
+      _line++;
+    }
+  }
+  if (argc == 0) {
+    return;
+  }
+
+  if (strcmp(argv[0], "help") == 0) {
+    Console_print("config               all the settings\r\n"
+                  "get <name>           one setting\r\n"
+                  "set <name> <value>   change a setting\r\n"
+                  "save                 keep the settings across a power loss\r\n"
+                  "prof [reset]         pipeline stage probes\r\n"
+                  "trace [reset]        GPS to tubes latencies\r\n"
+                  "isr [reset]          USART1 entry latency, display tick queue\r\n"
+                  "isr inline|deferred  display tick work, for the latency probe\r\n"
+                  "sched [reset]        scheduler task run times\r\n"
+                  "bbox                 event log kept across resets\r\n"
+                  "kv                   flash key/value store\r\n"
+                  "stack                stack high-water mark\r\n"
+                  "wdog                 watchdog deadlines, last reset\r\n"
+                  "load                 CPU load per task and handler\r\n"
+                  "power                time per power state, average current\r\n"
+                  "clock [bench]        clock profile, switch and workload times\r\n"
+                  "usage                cathode on-time, flash commits\r\n"
+                  "night                night state, tube-minutes saved, windows\r\n"
+                  "night <day> on|off fixed|sunrise|sunset <minutes>\r\n"
+                  "night <day> enable|disable\r\n"
+                  "test digits|anim|poison\r\n");
+  } else if (strcmp(argv[0], "config") == 0) {
+    for (uint8_t i = 0; i < Config_count(); i++) {
+      Console_print_entry(Config_entry(i));
+    }
+  } else if (strcmp(argv[0], "get") == 0 || strcmp(argv[0], "set") == 0) {
+    entry = (argc > 1) ? Config_find(argv[1]) : NULL;
+    if (entry == NULL) {
+      Console_print("unknown setting\r\n");
+    } else if (argv[0][0] == 'g') {
+      Console_print_entry(entry);
+    } else if (argc < 3 || !Text_parse_i32(argv[2], &value)) {
+      Console_print("bad value\r\n");
+    } else if (!Config_set(entry, value)) {
+      Console_print("out of range\r\n");
+    } else {
+      Console_print_entry(entry);
+    }
+  } else if (strcmp(argv[0], "save") == 0) {
+    status = Config_save();
+    if (status == HAL_OK) {
+      status = Nixie_night_save();
+    }
+    Console_print((status == HAL_OK) ? "saved\r\n" : (status == HAL_BUSY) ? "busy, try later\r\n" : "flash error\r\n");
+  } else if (strcmp(argv[0], "kv") == 0) {
+    Console_print_kv();
+  } else if (strcmp(argv[0], "prof") == 0) {
+    if (argc > 1 && strcmp(argv[1], "reset") == 0) {
+      Prof_reset();
+    } else {
+      Prof_dump(Console_write);
+    }
+  } else if (strcmp(argv[0], "trace") == 0) {
+    if (argc > 1 && strcmp(argv[1], "reset") == 0) {
+      Trace_reset();
+    } else {
+      Trace_dump(Console_write);
+    }
+  } else if (strcmp(argv[0], "isr") == 0) {
+    if (argc > 1 && strcmp(argv[1], "reset") == 0) {
+      Latency_reset();
+    } else if (argc > 1 && strcmp(argv[1], "inline") == 0) {
+      Latency_set_tick_mode(LATENCY_TICK_INLINE);
+    } else if (argc > 1 && strcmp(argv[1], "deferred") == 0) {
+      Latency_set_tick_mode(LATENCY_TICK_DEFERRED);
+    } else {
+      Latency_dump(Console_write);
+    }
+  } else if (strcmp(argv[0], "sched") == 0) {
+    if (argc > 1 && strcmp(argv[1], "reset") == 0) {
+      Sched_reset_stats();
+    } else {
+      Console_print_sched();
+    }
+  } else if (strcmp(argv[0], "bbox") == 0) {
+    Blackbox_dump(Console_write);
+  } else if (strcmp(argv[0], "stack") == 0) {
+    Stack_dump(Console_write);
+  } else if (strcmp(argv[0], "wdog") == 0) {
+    Watchdog_dump(Console_write);
+  } else if (strcmp(argv[0], "load") == 0) {
+    Load_dump(Console_write);
+  } else if (strcmp(argv[0], "power") == 0) {
+    Power_dump(Console_write);
+  } else if (strcmp(argv[0], "clock") == 0) {
+    if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+      Clock_benchmark_dump(Console_write);
+    } else {
+      Clock_dump(Console_write);
+    }
+  } else if (strcmp(argv[0], "usage") == 0) {
+    Nixie_usage_dump(Console_write);
+  } else if (strcmp(argv[0], "night") == 0) {
+    if (argc > 1) {
+      Console_night(argc, argv);
+    } else {
+      Nixie_night_dump(Console_write);
+    }
+  } else if (strcmp(argv[0], "test") == 0 && argc > 1) {
+    if (strcmp(argv[1], "digits") == 0) {
+      Console_test_digits();
+    } else if (strcmp(argv[1], "anim") == 0) {
+      Nixie_animation_request();
+    } else if (strcmp(argv[1], "poison") == 0) {
+      Nixie_antipoison_request();
+    } else {
+      Console_print("unknown test\r\n");
+    }
+  } else {
+    Console_print("unknown command\r\n");
+  }
+}
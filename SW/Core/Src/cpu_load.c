@@ -0,0 +1,220 @@
+/**
+  ******************************************************************************
+  * @file           : cpu_load.c
+  * @brief          : CPU load per context, with 1 s, 1 min and 15 min averages
+  ******************************************************************************
+  * @attention
+  *
+  * Copyright (c) 2023 Nicolò Campanini.
+  * All rights reserved.
+  *
+  * This software is licensed under terms that can be found in the LICENSE file
+  * in the root directory of this software component.
+  * If no LICENSE file comes with this software, it is provided AS-IS.
+  *
+  ******************************************************************************
+  */
+
+#include "cpu_load.h"
+
+
+
+
+
+// Running context, cycle counter at its last switch, cycles of the window
+volatile uint8_t Load_current = LOAD_THREAD;
+uint32_t Load_last = 0;
+uint32_t Load_cycles[LOAD_CONTEXTS];
+// Averages per context, and of everything but idle and Stop
+Load_average_t Load_averages[LOAD_CONTEXTS];
+Load_average_t Load_cpu;
+// The first window sets the averages, they converge from there
+uint8_t Load_started = 0;
+
+// Names of the contexts, the tasks take the scheduler ones
+const char *Load_names[LOAD_CONTEXTS] = {
+  [LOAD_IDLE] = "idle",
+  [LOAD_STOP] = "stop",
+  [LOAD_THREAD] = "thread",
+  [LOAD_SYSTICK] = "systick",
+  [LOAD_PENDSV] = "pendsv",
+  [LOAD_RTC_WKUP] = "rtc_wkup",
+  [LOAD_EXTI] = "exti",
+  [LOAD_TIM1] = "tim1",
+  [LOAD_TIM11] = "tim11",
+  [LOAD_SPI2] = "spi2",
+  [LOAD_USART1] = "usart1",
+  [LOAD_USART2] = "usart2",
+  [LOAD_DMA_ADC] = "dma_adc",
+  [LOAD_DMA_GPS] = "dma_gps"
+};
+
+
+
+
+
+void Load_init()
+{
+  // After Sched_init(), which starts the cycle counter
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  for (uint8_t c = 0; c < LOAD_CONTEXTS; c++) {
+    Load_cycles[c] = 0;
+    Load_averages[c].second = 0;
+    Load_averages[c].minute = 0;
+    Load_averages[c].quarter = 0;
+  }
+  Load_cpu.second = 0;
+  Load_cpu.minute = 0;
+  Load_cpu.quarter = 0;
+  Load_started = 0;
+  Load_current = LOAD_THREAD;
+  Load_last = Cycles_now();
+  __set_PRIMASK(primask);
+}
+
+
+
+
+
+void Load_account_stop(uint32_t _ms)
+{
+  // From the idle loop, PRIMASK set: the time in Stop at the current clock
+  Load_cycles[LOAD_STOP] += _ms * (SystemCoreClock / 1000);
+}
+
+
+
+
+
+void Load_average(Load_average_t *_average, uint32_t _sample)
+{
+  // One more second into the exponential averages
+  if (!Load_started) {
+    _average->minute = _sample;
+    _average->quarter = _sample;
+  } else {
+    _average->minute += (((int64_t) _sample - _average->minute) * LOAD_WEIGHT_1M) >> 16;
+    _average->quarter += (((int64_t) _sample - _average->quarter) * LOAD_WEIGHT_15M) >> 16;
+  }
+  _average->second = _sample;
+}
+
+
+
+
+
+void Load_tick()
+{
+  // From the 1 Hz RTC wakeup: close the window, this handler included
+  uint32_t cycles[LOAD_CONTEXTS];
+  uint64_t window = 0;
+  uint32_t primask = __get_PRIMASK();
+
+  __disable_irq();
+  Load_switch(Load_current);
+  for (uint8_t c = 0; c < LOAD_CONTEXTS; c++) {
+    cycles[c] = Load_cycles[c];
+    Load_cycles[c] = 0;
+  }
+  __set_PRIMASK(primask);
+
+  for (uint8_t c = 0; c < LOAD_CONTEXTS; c++) {
+    window += cycles[c];
+  }
+  if (window == 0) {
+    return;
+  }
+
+  // Shares of the window: the clock profile may have changed in it, the
+  // cycles are then a mix of two clocks (a small error, once)
+  for (uint8_t c = 0; c < LOAD_CONTEXTS; c++) {
+    Load_average(&Load_averages[c], ((uint64_t) cycles[c] << 24) / window);
+  }
+  Load_average(&Load_cpu, ((window - cycles[LOAD_IDLE] - cycles[LOAD_STOP]) << 24) / window);
+  Load_started = 1;
+}
+
+
+
+
+
+void Load_get(Load_context_t _context, Load_average_t *_average)
+{
+  __disable_irq();
+  *_average = Load_averages[_context];
+  __enable_irq();
+}
+
+
+
+
+
+void Load_get_cpu(Load_average_t *_average)
+{
+  __disable_irq();
+  *_average = Load_cpu;
+  __enable_irq();
+}
+
+
+
+
+
+uint16_t Load_permille(uint32_t _share)
+{
+  // Q24 share to permille, rounded
+  return((uint16_t) (((uint64_t) _share * 1000 + (1UL << 23)) >> 24));
+}
+
+
+
+
+
+char *Load_append(char *_out, const char *_name, const Load_average_t *_average)
+{
+  //   load <name> 1s=<permille> 1m=<permille> 15m=<permille>
+  _out = Text_append(_out, "load ");
+  _out = Text_append(_out, _name);
+  _out = Text_append(_out, " 1s=");
+  _out = Text_append_u32(_out, Load_permille(_average->second));
+  _out = Text_append(_out, " 1m=");
+  _out = Text_append_u32(_out, Load_permille(_average->minute));
+  _out = Text_append(_out, " 15m=");
+  _out = Text_append_u32(_out, Load_permille(_average->quarter));
+  return(Text_append(_out, "\r\n"));
+}
+
+
+
+
+
+void Load_dump(Text_write_t _write)
+{
+  // The CPU (all but idle and Stop), then the contexts that ran in the
+  // last 15 minutes. From the thread context only.
+  char line[64];
+  char name[24];
+  char *out = NULL;
+  Load_average_t average;
+  Sched_stats_t stats;
+
+  Load_get_cpu(&average);
+  out = Load_append(line, "cpu", &average);
+  _write(line, out - line);
+
+  for (uint8_t c = 0; c < LOAD_CONTEXTS; c++) {
+    Load_get(c, &average);
+    if (Load_permille(average.second) == 0 && Load_permille(average.quarter) == 0) {
+      continue;
+    }
+    if (c >= LOAD_TASKS && c < LOAD_TASKS + SCHED_EVENTS) {
+      Sched_get_stats(c - LOAD_TASKS, &stats);
+      *Text_append(Text_append(name, "task_"), (stats.name != NULL) ? stats.name : "none") = '\0';
+      out = Load_append(line, name, &average);
+    } else {
+      out = Load_append(line, Load_names[c], &average);
+    }
+    _write(line, out - line);
+  }
+}
@@ -0,0 +1,112 @@
+/**
+  ******************************************************************************
+  * @file           : deferred.c
+  * @brief          : Work deferred from the interrupts to the PendSV handler
+  ******************************************************************************
+  * @attention
+  *
+  * Copyright (c) 2023 Nicolò Campanini.
+  * All rights reserved.
+  *
+  * This software is licensed under terms that can be found in the LICENSE file
+  * in the root directory of this software component.
+  * If no LICENSE file comes with this software, it is provided AS-IS.
+  *
+  ******************************************************************************
+  */
+
+#include "deferred.h"
+#include "cycle_counter.h"
+
+
+
+
+
+// Ring of pending work: written by the interrupts, read by PendSV
+Deferred_item_t Deferred_queue[DEFERRED_QUEUE_SIZE];
+volatile uint8_t Deferred_head = 0;
+volatile uint8_t Deferred_tail = 0;
+Deferred_stats_t Deferred_stats;
+
+
+
+
+
+void Deferred_init()
+{
+  Deferred_head = 0;
+  Deferred_tail = 0;
+  Deferred_stats.runs = 0;
+  Deferred_stats.dropped = 0;
+  Deferred_stats.max_wait_cycles = 0;
+  Deferred_stats.max_run_cycles = 0;
+
+  // PendSV has the lowest priority (HAL_MspInit): the work is preempted
+  // by every interrupt, SysTick included
+  Cycles_init();
+}
+
+
+
+
+
+uint8_t Deferred_post(Deferred_work_t _work, uint32_t _arg)
+{
+  uint32_t primask = __get_PRIMASK();
+  uint8_t posted = 0;
+
+  // Interrupts of different priority may post at the same time
+  __disable_irq();
+  if ((uint8_t) (Deferred_head - Deferred_tail) < DEFERRED_QUEUE_SIZE) {
+    Deferred_item_t *item = &Deferred_queue[Deferred_head % DEFERRED_QUEUE_SIZE];
+    item->work = _work;
+    item->arg = _arg;
+    item->posted = Cycles_now();
+    Deferred_head++;
+    posted = 1;
+  } else {
+    Deferred_stats.dropped++;
+  }
+  __set_PRIMASK(primask);
+
+  // Run the queue once no other interrupt is active
+  SCB->ICSR = SCB_ICSR_PENDSVSET_Msk;
+
+  return(posted);
+}
+
+
+
+
+
+void Deferred_run()
+{
+  // Only PendSV consumes, no lock needed on the tail
+  while (Deferred_tail != Deferred_head) {
+    Deferred_item_t item = Deferred_queue[Deferred_tail % DEFERRED_QUEUE_SIZE];
+    Deferred_tail++;
+
+    uint32_t start = Cycles_now();
+    item.work(item.arg);
+    uint32_t end = Cycles_now();
+
+    Deferred_stats.runs++;
+    if (start - item.posted > Deferred_stats.max_wait_cycles) {
+      Deferred_stats.max_wait_cycles = start - item.posted;
+    }
+    if (end - start > Deferred_stats.max_run_cycles) {
+      Deferred_stats.max_run_cycles = end - start;
+    }
+  }
+}
+
+
+
+
+
+void Deferred_get_stats(Deferred_stats_t *_stats)
+{
+  __disable_irq();
+  *_stats = Deferred_stats;
+  __enable_irq();
+}
@@ -16,6 +16,16 @@
   */
 
 #include "gps_parser.h"
+#include "scheduler.h"
+#include "profiler.h"
+#include "latency_trace.h"
+#include "blackbox.h"
+#include "config.h"
+#include "console.h"
+#include "text_format.h"
+#include "watchdog.h"
+#include "timezone_dst.h"
+#include "power.h"
 
 
 
@@ -29,12 +39,21 @@ DMA_HandleTypeDef *GPS_hdma_usart_rx;
 GPS_buffer_struct_t GPS_buffer_struct;
 // Global variable to hold datetime extracted from GPS.
 GPS_datetime_struct_t GPS_datetime_struct;
+// Time on the line of one byte (start, data and stop bits), ns
+uint32_t GPS_byte_ns = 0;
+// RTC checked against the fixes, once it holds a confirmed time
+RTC_HandleTypeDef *GPS_hrtc = NULL;
+uint8_t GPS_rtc_trusted = 0;
+// Consecutive consistent fixes, and the second of the last one
+uint16_t GPS_consensus_streak = 0;
+uint32_t GPS_consensus_last_s = 0;
 
 
 
 
 
-void GPS_Init(UART_HandleTypeDef *_huart, DMA_HandleTypeDef *_hdma_usart_rx)
+void GPS_Init(UART_HandleTypeDef *_huart, DMA_HandleTypeDef *_hdma_usart_rx, RTC_HandleTypeDef *_hrtc,
+              uint8_t _rtc_trusted)
 {
   // Init the GPS buffer scructure
   GPS_buffer_struct.active_buffer = 0;
@@ -42,6 +61,12 @@ void GPS_Init(UART_HandleTypeDef *_huart, DMA_HandleTypeDef *_hdma_usart_rx)
   GPS_buffer_struct.buffer_status[1] = 0;
   GPS_buffer_struct.buffer_size[0] = 0;
   GPS_buffer_struct.buffer_size[1] = 0;
+  GPS_buffer_struct.capture[0] = 0;
+  GPS_buffer_struct.capture[1] = 0;
+  GPS_buffer_struct.idle_us[0] = 0;
+  GPS_buffer_struct.idle_us[1] = 0;
+  GPS_buffer_struct.whole[0] = 0;
+  GPS_buffer_struct.whole[1] = 0;
   // Init the GPS_datetime_struct as NOT-valid
   GPS_datetime_struct.time.Hours = 0;
   GPS_datetime_struct.time.Minutes = 0;
@@ -49,10 +74,23 @@ void GPS_Init(UART_HandleTypeDef *_huart, DMA_HandleTypeDef *_hdma_usart_rx)
   GPS_datetime_struct.date.Date = 0;
   GPS_datetime_struct.date.Month = 0;
   GPS_datetime_struct.date.Year = 0;
+  GPS_datetime_struct.tick = 0;
+  GPS_datetime_struct.capture = 0;
+  GPS_datetime_struct.parsed = 0;
+  GPS_datetime_struct.start_us = 0;
+  GPS_datetime_struct.edge_us = 0;
   GPS_datetime_struct.valid = 0;
+  // No streak yet, the RTC kept across the reset is trusted
+  GPS_consensus_streak = 0;
+  GPS_consensus_last_s = 0;
+  GPS_hrtc = _hrtc;
+  GPS_rtc_trusted = _rtc_trusted;
   // Init the internal UART handler
   GPS_huart = _huart;
   GPS_hdma_usart_rx = _hdma_usart_rx;
+  // The parity bit is one of the data bits of WordLength
+  GPS_byte_ns = ((_huart->Init.WordLength == UART_WORDLENGTH_9B ? 10 : 9) +
+                 (_huart->Init.StopBits == UART_STOPBITS_2 ? 2 : 1)) * 1000000000UL / _huart->Init.BaudRate;
   // Init the Blue LED
   HAL_GPIO_WritePin(LED_BLUE_GPIO_Port, LED_BLUE_Pin, GPIO_PIN_RESET);
 }
@@ -62,7 +100,7 @@ void GPS_Init(UART_HandleTypeDef *_huart, DMA_HandleTypeDef *_hdma_usart_rx)
 
 void GPS_Start()
 {
-  HAL_UARTEx_ReceiveToIdle_DMA(GPS_huart, GPS_buffer_struct.buffer[GPS_buffer_struct.active_buffer], UART_BUFFER_SIZE-1);
+  HAL_UARTEx_ReceiveToIdle_DMA(GPS_huart, (uint8_t *) GPS_buffer_struct.buffer[GPS_buffer_struct.active_buffer], UART_BUFFER_SIZE-1);
   __HAL_DMA_DISABLE_IT(GPS_hdma_usart_rx, DMA_IT_HT);
 }
 
@@ -79,11 +117,72 @@ GPS_datetime_struct_t GPS_Read_Datetime()
 
 
 
-void GPS_Parse_ZDA_Line(char *_time_line)
+void GPS_Clear_Datetime()
 {
-  // Initialize output datetime structure as NOT-valid 
+  // The datetime was used: it must not set the RTC again if the receiver
+  // goes silent (or its bursts are lost in Stop)
   GPS_datetime_struct.valid = 0;
+  // The RTC holds a confirmed time: the next fixes are checked against it
+  GPS_rtc_trusted = 1;
+}
+
+
+
+
+
+void GPS_Datetime_now(const GPS_datetime_struct_t *_datetime, uint32_t _prediv_s,
+                      RTC_TimeTypeDef *_time, RTC_DateTypeDef *_date, uint32_t *_fraction)
+{
+  // The datetime of a fix is the UTC second at its edge: add the time since
+  // then, as whole seconds and the fraction in RTC sub-second counts
+  uint32_t elapsed_us = Power_time_us() - _datetime->edge_us;
+  uint32_t seconds = _datetime->time.Hours * 3600 + _datetime->time.Minutes * 60 + _datetime->time.Seconds +
+                     elapsed_us / 1000000;
+
+  *_time = _datetime->time;
+  *_date = _datetime->date;
+  if (seconds >= 86400) {
+    days_to_RTC(RTC_to_days(_date) + seconds / 86400, _date);
+    seconds %= 86400;
+  }
+  _time->Hours = seconds / 3600;
+  _time->Minutes = (seconds / 60) % 60;
+  _time->Seconds = seconds % 60;
+  *_fraction = ((uint64_t) (elapsed_us % 1000000) * (_prediv_s + 1)) / 1000000;
+}
+
+
+
+
+
+uint32_t GPS_Seconds(uint32_t _year, uint32_t _month, uint32_t _date,
+                     uint32_t _hours, uint32_t _minutes, uint32_t _seconds)
+{
+  // Seconds since 2000-01-01 of a UTC date and time, 0 if out of range (the
+  // RTC holds 2000 to 2099, and no leap second). Every burst goes through
+  // here twice: days before the month from a table, not a month loop.
+  static const uint16_t days_before[12] = {0, 31, 59, 90, 120, 151, 181, 212, 243, 273, 304, 334};
+  uint32_t year = _year - 2000;
+  uint32_t days = 0;
+
+  if (_year < 2000 || _year > 2099 || _month < 1 || _month > 12 || _date < 1 || _date > 31 ||
+      _hours > 23 || _minutes > 59 || _seconds > 59) {
+    return(0);
+  }
+  // 2000 is a leap year, and so every fourth one up to 2099
+  days = 365 * year + (year + 3) / 4 + days_before[_month - 1] + _date - 1;
+  if (_month > 2 && (year % 4) == 0) {
+    days++;
+  }
+  return(days * 86400 + _hours * 3600 + _minutes * 60 + _seconds);
+}
+
+
+
 
+
+void GPS_Parse_ZDA_Line(char *_time_line, GPS_fix_t *_fix)
+{
   char *line_end = NULL;
   line_end = strchr(_time_line, '\n');
   
@@ -97,35 +196,123 @@ void GPS_Parse_ZDA_Line(char *_time_line)
     return;
   }
 
-  char time_string[15] = "";
-  char date_string[15] = "";
-  unsigned int hours, minutes, seconds, date, month, year = 0;
-
-  // Extract the time line and the date line
-  strncpy(time_string, _time_line + 7, 10);
-  strncpy(date_string, _time_line + 18, 10);
-
-  // Parse the time_string using sscanf.
-  sscanf(time_string, "%2u%2u%2u",
-      &hours,
-      &minutes,
-      &seconds);
-
-  // Parse the date_string using sscanf.
-  sscanf(date_string, "%2u,%2u,%4u",
-      &date,
-      &month,
-      &year); 
-
-  // Fix the date 
-  GPS_datetime_struct.time.Hours = hours;
-  GPS_datetime_struct.time.Minutes = minutes;
-  GPS_datetime_struct.time.Seconds = seconds; 
-  GPS_datetime_struct.date.Date = date;
-  GPS_datetime_struct.date.Month = month;
-  GPS_datetime_struct.date.Year = year - 2000;
-  // Return valid flag
-  GPS_datetime_struct.valid = 1;
+  uint32_t hours, minutes, seconds, date, month, year = 0;
+
+  // Fixed width fields, hhmmss and dd,mm,yyyy: no sscanf()
+  if (!Text_parse_digits(_time_line + 7, 2, &hours) ||
+      !Text_parse_digits(_time_line + 9, 2, &minutes) ||
+      !Text_parse_digits(_time_line + 11, 2, &seconds) ||
+      !Text_parse_digits(_time_line + 18, 2, &date) ||
+      !Text_parse_digits(_time_line + 21, 2, &month) ||
+      !Text_parse_digits(_time_line + 24, 4, &year)) {
+    return;
+  }
+
+  _fix->zda_s = GPS_Seconds(year, month, date, hours, minutes, seconds);
+  if (_fix->zda_s != 0) {
+    _fix->flags |= GPS_FIX_ZDA;
+  }
+}
+
+
+
+
+
+void GPS_Parse_RMC_Line(char *_rmc_line, GPS_fix_t *_fix)
+{
+  // $--RMC,hhmmss.sss,A,llll.ll,a,yyyyy.yy,a,x.x,x.x,ddmmyy,...: the
+  // position fields change width, and are empty without a fix
+  char *field[10] = {NULL};
+  uint8_t count = 0;
+  uint32_t hours, minutes, seconds, day, month, year = 0;
+
+  // Start of the fields up to the date, in one pass
+  for (char *c = _rmc_line; count < 9 && *c != '*' && *c != '\r' && *c != '\n' && *c != '\0'; c++) {
+    if (*c == ',') {
+      field[++count] = c + 1;
+    }
+  }
+  if (count < 9) {
+    return;
+  }
+
+  // Time in field 1, date in field 9
+  if (!Text_parse_digits(field[1], 2, &hours) ||
+      !Text_parse_digits(field[1] + 2, 2, &minutes) ||
+      !Text_parse_digits(field[1] + 4, 2, &seconds) ||
+      !Text_parse_digits(field[9], 2, &day) ||
+      !Text_parse_digits(field[9] + 2, 2, &month) ||
+      !Text_parse_digits(field[9] + 4, 2, &year)) {
+    return;
+  }
+
+  _fix->rmc_s = GPS_Seconds(2000 + year, month, day, hours, minutes, seconds);
+  if (_fix->rmc_s != 0) {
+    _fix->flags |= GPS_FIX_RMC;
+  }
+  // Status in field 2: A active, V void
+  if (*field[2] == 'A') {
+    _fix->flags |= GPS_FIX_ACTIVE;
+  }
+}
+
+
+
+
+
+int32_t GPS_RTC_offset(const GPS_fix_t *_fix)
+{
+  // UTC of now from the fix, less the RTC: under PRIMASK, the display tick
+  // reads the RTC from PendSV and the shadow registers lock between reads
+  RTC_TimeTypeDef time;
+  RTC_DateTypeDef date;
+  uint32_t now = _fix->zda_s + (Power_time_us() - _fix->edge_us) / 1000000;
+  uint32_t primask = __get_PRIMASK();
+
+  __disable_irq();
+  HAL_RTC_GetTime(GPS_hrtc, &time, RTC_FORMAT_BIN);
+  HAL_RTC_GetDate(GPS_hrtc, &date, RTC_FORMAT_BIN);
+  __set_PRIMASK(primask);
+
+  return((int32_t) (now - (RTC_to_days(&date) * 86400 + time.Hours * 3600 + time.Minutes * 60 + time.Seconds)));
+}
+
+
+
+
+
+uint8_t GPS_Consensus(const GPS_fix_t *_fix)
+{
+  // A single sentence does not set the calendar: receivers send garbage
+  // dates after a cold start (week rollover, year 2080). A fix counts with
+  // both sentences, RMC active and ZDA and RMC within a second; a streak of
+  // them, one second apart, commits.
+  uint32_t needed = GPS_CONSENSUS_FIXES;
+  uint32_t apart = (_fix->zda_s > _fix->rmc_s) ? _fix->zda_s - _fix->rmc_s : _fix->rmc_s - _fix->zda_s;
+
+  if ((_fix->flags & (GPS_FIX_ZDA | GPS_FIX_RMC | GPS_FIX_ACTIVE)) != (GPS_FIX_ZDA | GPS_FIX_RMC | GPS_FIX_ACTIVE) ||
+      apart > 1) {
+    GPS_consensus_streak = 0;
+    return(0);
+  }
+  if (GPS_consensus_streak > 0 && _fix->zda_s == GPS_consensus_last_s + 1) {
+    if (GPS_consensus_streak < UINT16_MAX) {
+      GPS_consensus_streak++;
+    }
+  } else {
+    GPS_consensus_streak = 1;
+  }
+  GPS_consensus_last_s = _fix->zda_s;
+
+  // Away from an RTC holding a confirmed time: a real step (a long outage)
+  // or a receiver consistently wrong, more fixes to tell them apart
+  if (GPS_hrtc != NULL && GPS_rtc_trusted) {
+    int32_t offset = GPS_RTC_offset(_fix);
+    if (offset > GPS_RTC_AGREE_S || offset < -GPS_RTC_AGREE_S) {
+      needed = GPS_CONSENSUS_STEP_FIXES;
+    }
+  }
+  return(GPS_consensus_streak >= needed);
 }
 
 
@@ -134,6 +321,9 @@ void GPS_Parse_ZDA_Line(char *_time_line)
 
 void GPS_Update_Data()
 {
+  // The bursts are taken: from here on, a wedge stops the loop check-ins
+  Watchdog_done(WATCHDOG_GPS);
+
   // Loop in the two buffers to find the one used.
   for (uint8_t i = 0; i < 2; i++) {
 
@@ -153,9 +343,12 @@ void GPS_Update_Data()
       // Loop through the buffer looking for the different messages.
       uint8_t end_reached = 0;
       char *time_line = NULL;
+      char *rmc_line = NULL;
       char *current_pnt = GPS_buffer_struct.buffer[i];
       char *next_pnt = NULL;
+      GPS_fix_t fix = {0};
 
+      PROF_START(PROF_GPS_SCAN);
       while (end_reached == 0) {
         // Search for the message start character
         next_pnt = strchr(current_pnt, '$');
@@ -164,23 +357,61 @@ void GPS_Update_Data()
           end_reached = 1;
           // Exit
         } else {
-          // Look if the ZDA line is found
+          // Look if the ZDA or the RMC line is found
           if (strncmp(next_pnt + 3, "ZDA", 3) == 0) {
             time_line = next_pnt;
+          } else if (strncmp(next_pnt + 3, "RMC", 3) == 0) {
+            rmc_line = next_pnt;
           }
-          // TODO: Add other lines to be found 
 
           // Update pointers to advance in the buffer
           current_pnt = next_pnt+1;
         }
       }
+      PROF_STOP(PROF_GPS_SCAN);
 
-      // Parse the ZDA line if found
+      // Parse the lines found into the fix of this burst
+      PROF_START(PROF_GPS_PARSE);
       if (time_line) {
-        GPS_Parse_ZDA_Line(time_line);
+        GPS_Parse_ZDA_Line(time_line, &fix);
+      }
+      if (rmc_line) {
+        GPS_Parse_RMC_Line(rmc_line, &fix);
+      }
+      PROF_STOP(PROF_GPS_PARSE);
+
+      // Burst cut by a Stop: the place of the sentence in it, and so the
+      // time of the fix, are unknown
+      if (GPS_buffer_struct.whole[i] == 0) {
+        fix.flags = 0;
       }
 
-      // TODO: Add parsing of other lines
+      if (fix.flags & GPS_FIX_ZDA) {
+        // The burst is one run of back to back bytes (a gap would have
+        // ended it), the line then idle for one byte: its '$' went out
+        // that many bytes before the idle line, and the receiver started
+        // the burst its output latency after the UTC second
+        uint32_t before = time_line - GPS_buffer_struct.buffer[i];
+        uint32_t after = GPS_buffer_struct.buffer_size[i] - before;
+        fix.start_us = GPS_buffer_struct.idle_us[i] - ((uint64_t) after * GPS_byte_ns) / 1000;
+        fix.edge_us = fix.start_us - ((uint64_t) before * GPS_byte_ns) / 1000 - Config.gps_latency_ms * 1000;
+      }
+
+      // Carry the confirmed fix and the idle line timestamp up to the RTC set
+      if (GPS_Consensus(&fix)) {
+        uint32_t seconds = fix.zda_s % 86400;
+        days_to_RTC(fix.zda_s / 86400, &GPS_datetime_struct.date);
+        GPS_datetime_struct.time.Hours = seconds / 3600;
+        GPS_datetime_struct.time.Minutes = (seconds / 60) % 60;
+        GPS_datetime_struct.time.Seconds = seconds % 60;
+        GPS_datetime_struct.tick = HAL_GetTick();
+        GPS_datetime_struct.start_us = fix.start_us;
+        GPS_datetime_struct.edge_us = fix.edge_us;
+        GPS_datetime_struct.capture = GPS_buffer_struct.capture[i];
+        GPS_datetime_struct.parsed = Trace_timestamp();
+        GPS_datetime_struct.valid = 1;
+        Trace_record(TRACE_IDLE_TO_PARSE, GPS_datetime_struct.capture);
+      }
     }
   }
 }
@@ -195,11 +426,17 @@ GPS_RTC_update_t GPS_RTC_check_update()
   // Variabile statica per tenere traccia delle chiamate 
   static unsigned int update_calls_left = 0;
 
+  // Expire the datetime if no burst came after it
+  if (GPS_datetime_struct.valid == 1 && HAL_GetTick() - GPS_datetime_struct.tick > GPS_DATETIME_MAX_AGE_MS) {
+    GPS_datetime_struct.valid = 0;
+    Blackbox_log(BLACKBOX_GPS_STALE, HAL_GetTick() - GPS_datetime_struct.tick);
+  }
+
   // If the GPS datetime is valid perform the check
   if (GPS_datetime_struct.valid == 1) {
 
     if (update_calls_left == 0) {
-      update_calls_left = RTC_UPDATE_CNT;
+      update_calls_left = Config.rtc_update_cnt;
       return NEEDED;
     } else {
       update_calls_left--;
@@ -219,6 +456,14 @@ GPS_RTC_update_t GPS_RTC_check_update()
 void HAL_UARTEx_RxEventCallback(UART_HandleTypeDef *huart, uint16_t Size)
 {
 	if (huart == GPS_huart) {
+    // Timestamp of the idle line, the end of the burst
+    GPS_buffer_struct.capture[GPS_buffer_struct.active_buffer] = Trace_timestamp();
+    GPS_buffer_struct.idle_us[GPS_buffer_struct.active_buffer] = Power_time_us();
+    // A Stop since the first byte lost some of the burst (the head or a
+    // gap). A wake long ago can alias into the burst: one lost fix, rarely.
+    GPS_buffer_struct.whole[GPS_buffer_struct.active_buffer] =
+      (GPS_buffer_struct.idle_us[GPS_buffer_struct.active_buffer] - Power_last_wake_us()) >
+      ((uint64_t) (Size + 1) * GPS_byte_ns) / 1000;
     // Toggle LED
     HAL_GPIO_TogglePin(LED_BLUE_GPIO_Port, LED_BLUE_Pin);
     // Set the buffer size and add the termination character
@@ -230,7 +475,27 @@ void HAL_UARTEx_RxEventCallback(UART_HandleTypeDef *huart, uint16_t Size)
     GPS_buffer_struct.active_buffer = !GPS_buffer_struct.active_buffer;
     // Relaunch the UART receiver
     GPS_Start();
+    // Parse the new data in the main loop, within the watchdog deadline
+    Watchdog_expect(WATCHDOG_GPS);
+    Sched_post(SCHED_EVENT_GPS_RX);
 	}
 }
 
 
+
+
+
+
+
+void HAL_UART_ErrorCallback(UART_HandleTypeDef *huart)
+{
+	if (huart == GPS_huart) {
+    // A framing, noise or overrun error aborts the DMA reception: note it
+    // and receive again, the burst in progress is lost
+    Blackbox_log(BLACKBOX_UART_ERROR, huart->ErrorCode);
+    GPS_Start();
+	} else {
+    // The HAL has one error callback for every UART
+    Console_uart_error(huart);
+	}
+}
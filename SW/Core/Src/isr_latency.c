@@ -0,0 +1,201 @@
+/**
+  ******************************************************************************
+  * @file           : isr_latency.c
+  * @brief          : USART1 interrupt latency probe
+  ******************************************************************************
+  * @attention
+  *
+  * Copyright (c) 2023 Nicolò Campanini.
+  * All rights reserved.
+  *
+  * This software is licensed under terms that can be found in the LICENSE file
+  * in the root directory of this software component.
+  * If no LICENSE file comes with this software, it is provided AS-IS.
+  *
+  ******************************************************************************
+  */
+
+#include "isr_latency.h"
+#include "cycle_counter.h"
+#include "deferred.h"
+
+
+
+
+
+// TIM5 CC1 match being measured, and whether USART1 still has to take it
+volatile uint32_t Latency_compare_at = 0;
+volatile uint8_t Latency_pending = 0;
+// Worst case per display tick mode
+volatile Latency_stats_t Latency_stats[LATENCY_TICK_MODES];
+volatile Latency_tick_mode_t Latency_tick_mode = LATENCY_TICK_DEFERRED;
+const char *Latency_tick_names[LATENCY_TICK_MODES] = {"deferred", "inline"};
+
+
+
+
+
+void Latency_init()
+{
+  Cycles_init();
+  Latency_reset();
+#ifdef LATENCY_PROBE
+  // TIM5, 32 bit on APB1 (timers at SYSCLK): free running, CC1 interrupt
+  __HAL_RCC_TIM5_CLK_ENABLE();
+  TIM5->CR1 = 0;
+  TIM5->PSC = 0;
+  TIM5->ARR = 0xFFFFFFFF;
+  TIM5->EGR = TIM_EGR_UG;
+  TIM5->CCR1 = (SystemCoreClock / 1000) * LATENCY_PROBE_PERIOD_MS;
+  TIM5->SR = 0;
+  TIM5->DIER = TIM_DIER_CC1IE;
+  HAL_NVIC_SetPriority(TIM5_IRQn, LATENCY_PROBE_IRQ_PRIORITY, 0);
+  HAL_NVIC_EnableIRQ(TIM5_IRQn);
+  TIM5->CR1 = TIM_CR1_CEN;
+#endif
+}
+
+
+
+
+
+void Latency_probe_trigger()
+{
+#ifdef LATENCY_PROBE
+  // TIM5 interrupt: the match time stays in CCR1 however late this runs
+  uint32_t compare = TIM5->CCR1;
+
+  TIM5->SR = ~(uint32_t) TIM_SR_CC1IF;
+  TIM5->CCR1 = compare + (SystemCoreClock / 1000) * LATENCY_PROBE_PERIOD_MS;
+  if (Latency_pending == 0) {
+    Latency_compare_at = compare;
+    Latency_pending = 1;
+    NVIC_SetPendingIRQ(USART1_IRQn);
+  }
+#endif
+}
+
+
+
+
+
+void Latency_probe_enter()
+{
+#ifdef LATENCY_PROBE
+  // First thing in the USART1 handler
+  uint32_t now = TIM5->CNT;
+  volatile Latency_stats_t *stats = &Latency_stats[Latency_tick_mode];
+
+  if (Latency_pending == 0) {
+    return;
+  }
+  Latency_pending = 0;
+  stats->last_cycles = now - Latency_compare_at;
+  stats->samples++;
+  if (stats->last_cycles > stats->max_cycles) {
+    stats->max_cycles = stats->last_cycles;
+  }
+#endif
+}
+
+
+
+
+
+void Latency_set_tick_mode(Latency_tick_mode_t _mode)
+{
+  Latency_tick_mode = _mode;
+}
+
+
+
+
+
+uint8_t Latency_tick_inline()
+{
+  // Never outside the probe builds: the display tick work is deferred
+#ifdef LATENCY_PROBE
+  return(Latency_tick_mode == LATENCY_TICK_INLINE);
+#else
+  return(0);
+#endif
+}
+
+
+
+
+
+void Latency_get_stats(Latency_tick_mode_t _mode, Latency_stats_t *_stats)
+{
+  uint32_t primask = __get_PRIMASK();
+
+  __disable_irq();
+  *_stats = Latency_stats[_mode];
+  __set_PRIMASK(primask);
+}
+
+
+
+
+
+void Latency_reset()
+{
+  uint32_t primask = __get_PRIMASK();
+
+  __disable_irq();
+  Latency_pending = 0;
+  for (uint8_t m = 0; m < LATENCY_TICK_MODES; m++) {
+    Latency_stats[m].samples = 0;
+    Latency_stats[m].last_cycles = 0;
+    Latency_stats[m].max_cycles = 0;
+  }
+  __set_PRIMASK(primask);
+}
+
+
+
+
+
+void Latency_dump(Text_write_t _write)
+{
+  // The probe, worst case with the display tick deferred and inline, and
+  // the display tick queue, cycles at SYSCLK:
+  //   isr usart1 tick=<mode> n=<samples> last=<entry> max=<entry>
+  //   isr deferred runs=<count> dropped=<count> wait=<max> run=<max>
+  // From the thread context only
+  char line[96];
+  char *out = NULL;
+  Deferred_stats_t deferred;
+
+#ifdef LATENCY_PROBE
+  Latency_stats_t latency;
+  for (uint8_t m = 0; m < LATENCY_TICK_MODES; m++) {
+    Latency_get_stats((Latency_tick_mode_t) m, &latency);
+    out = Text_append(line, "isr usart1 tick=");
+    out = Text_append(out, Latency_tick_names[m]);
+    out = Text_append(out, (m == Latency_tick_mode) ? "* n=" : " n=");
+    out = Text_append_u32(out, latency.samples);
+    out = Text_append(out, " last=");
+    out = Text_append_u32(out, latency.last_cycles);
+    out = Text_append(out, " max=");
+    out = Text_append_u32(out, latency.max_cycles);
+    out = Text_append(out, "\r\n");
+    _write(line, out - line);
+  }
+#else
+  out = Text_append(line, "isr usart1 probe not built (NIXIE_LATENCY_PROBE)\r\n");
+  _write(line, out - line);
+#endif
+
+  Deferred_get_stats(&deferred);
+  out = Text_append(line, "isr deferred runs=");
+  out = Text_append_u32(out, deferred.runs);
+  out = Text_append(out, " dropped=");
+  out = Text_append_u32(out, deferred.dropped);
+  out = Text_append(out, " wait=");
+  out = Text_append_u32(out, deferred.max_wait_cycles);
+  out = Text_append(out, " run=");
+  out = Text_append_u32(out, deferred.max_run_cycles);
+  out = Text_append(out, "\r\n");
+  _write(line, out - line);
+}
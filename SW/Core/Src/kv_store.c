@@ -0,0 +1,322 @@
+/**
+  ******************************************************************************
+  * @file           : kv_store.c
+  * @brief          : Log structured key/value store in two flash sectors
+  ******************************************************************************
+  * @attention
+  *
+  * Copyright (c) 2023 Nicolò Campanini.
+  * All rights reserved.
+  *
+  * This software is licensed under terms that can be found in the LICENSE file
+  * in the root directory of this software component.
+  * If no LICENSE file comes with this software, it is provided AS-IS.
+  *
+  ******************************************************************************
+  */
+
+#include "kv_store.h"
+#include "cycle_counter.h"
+#include <string.h>
+
+
+
+
+
+// Words of a record with a value of _length bytes
+#define KV_RECORD_WORDS(_length) (2 + ((_length) + 3) / 4)
+
+const uint32_t KV_sector_addr[2] = {KV_SECTOR_ADDR_0, KV_SECTOR_ADDR_1};
+const uint32_t KV_sector_number[2] = {KV_SECTOR_0, KV_SECTOR_1};
+
+// Active sector (0xFF = none, the store is formatted at the first write),
+// its generation and the first free word
+uint8_t KV_active = 0xFF;
+uint32_t KV_generation = 0;
+uint32_t KV_free = 0;
+// Address of the last valid record of each key, 0 if none
+uint32_t KV_index[KV_KEYS];
+// Write budget of the rate limit
+uint8_t KV_tokens = KV_WRITE_BURST;
+uint32_t KV_refill_tick = 0;
+KV_stats_t KV_stats;
+
+
+
+
+
+uint32_t KV_crc32(uint32_t _crc, const uint8_t *_data, uint32_t _length)
+{
+  // CRC-32 (IEEE), chained: start from 0
+  _crc = ~_crc;
+  for (uint32_t i = 0; i < _length; i++) {
+    _crc ^= _data[i];
+    for (uint8_t b = 0; b < 8; b++) {
+      _crc = (_crc >> 1) ^ (0xEDB88320 & (0 - (_crc & 1)));
+    }
+  }
+  return(~_crc);
+}
+
+
+
+
+
+uint8_t KV_record_valid(uint32_t _address)
+{
+  const KV_record_header_t *header = (const KV_record_header_t *) (uintptr_t) _address;
+  uint32_t crc = KV_crc32(0, (const uint8_t *) (uintptr_t) _address, sizeof(KV_record_header_t) + header->length);
+
+  return(*(const uint32_t *) (uintptr_t) (_address + (KV_RECORD_WORDS(header->length) - 1) * 4) == crc);
+}
+
+
+
+
+
+void KV_scan(uint8_t _sector)
+{
+  // Index the records of a sector. Bounded by the sector size: at most
+  // 16K of CRC, about 20 ms at 60 MHz.
+  uint32_t address = KV_sector_addr[_sector] + sizeof(KV_sector_header_t);
+  uint32_t end = KV_sector_addr[_sector] + KV_SECTOR_SIZE;
+
+  memset(KV_index, 0, sizeof(KV_index));
+  while (address + 2 * 4 <= end) {
+    const KV_record_header_t *header = (const KV_record_header_t *) (uintptr_t) address;
+    // Erased: the end of the log
+    if (*(const uint32_t *) (uintptr_t) address == 0xFFFFFFFF) {
+      break;
+    }
+    // A cut header: nothing after it can be found, the sector is full
+    if (header->length > KV_VALUE_MAX || address + KV_RECORD_WORDS(header->length) * 4 > end) {
+      address = end;
+      break;
+    }
+    if (header->key < KV_KEYS && KV_record_valid(address)) {
+      KV_index[header->key] = address;
+    }
+    address += KV_RECORD_WORDS(header->length) * 4;
+  }
+  KV_free = address;
+}
+
+
+
+
+
+void KV_init()
+{
+  const KV_sector_header_t *headers[2] = {
+    (const KV_sector_header_t *) KV_SECTOR_ADDR_0,
+    (const KV_sector_header_t *) KV_SECTOR_ADDR_1
+  };
+  uint32_t start = 0;
+
+  Cycles_init();
+  start = Cycles_now();
+  memset(&KV_stats, 0, sizeof(KV_stats));
+  memset(KV_index, 0, sizeof(KV_index));
+  KV_tokens = KV_WRITE_BURST;
+  KV_refill_tick = HAL_GetTick();
+
+  // Newest sector with a header. No header at all (blank, or the records
+  // of an older firmware): nothing is erased until the first write.
+  KV_active = 0xFF;
+  KV_generation = 0;
+  for (uint8_t s = 0; s < 2; s++) {
+    if (headers[s]->magic == KV_SECTOR_MAGIC && headers[s]->generation != 0xFFFFFFFF &&
+        (KV_active == 0xFF || headers[s]->generation > KV_generation)) {
+      KV_active = s;
+      KV_generation = headers[s]->generation;
+    }
+  }
+  if (KV_active != 0xFF) {
+    KV_scan(KV_active);
+  }
+
+  KV_stats.load_cycles = Cycles_now() - start;
+}
+
+
+
+
+
+uint16_t KV_get(uint16_t _key, void *_value, uint16_t _size)
+{
+  // Copy the value, return its length (0 = not stored)
+  const KV_record_header_t *header = NULL;
+
+  if (_key >= KV_KEYS || KV_index[_key] == 0) {
+    return(0);
+  }
+  header = (const KV_record_header_t *) (uintptr_t) KV_index[_key];
+  memcpy(_value, (const uint8_t *) (uintptr_t) (KV_index[_key] + 4), (header->length < _size) ? header->length : _size);
+  return(header->length);
+}
+
+
+
+
+
+HAL_StatusTypeDef KV_program(uint32_t _address, uint16_t _key, const void *_value, uint16_t _length)
+{
+  // Header, value, then the CRC (flash unlocked by the caller)
+  HAL_StatusTypeDef status = HAL_OK;
+  KV_record_header_t header = {_key, _length};
+  uint32_t words = KV_RECORD_WORDS(_length);
+  uint32_t crc = 0;
+  uint32_t word = 0;
+
+  crc = KV_crc32(0, (const uint8_t *) &header, sizeof(header));
+  crc = KV_crc32(crc, _value, _length);
+
+  memcpy(&word, &header, sizeof(word));
+  status = HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, _address, word);
+  for (uint32_t i = 0; i < words - 2 && status == HAL_OK; i++) {
+    // Padding bytes stay erased
+    word = 0xFFFFFFFF;
+    memcpy(&word, (const uint8_t *) _value + i * 4, (_length - i * 4 < 4) ? _length - i * 4 : 4);
+    status = HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, _address + 4 + i * 4, word);
+  }
+  if (status == HAL_OK) {
+    status = HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, _address + (words - 1) * 4, crc);
+  }
+  return(status);
+}
+
+
+
+
+
+HAL_StatusTypeDef KV_compact()
+{
+  // Erase the other sector, copy the last record of every key, then the
+  // header: a reset in between leaves the old sector in use
+  uint8_t target = (KV_active == 0) ? 1 : 0;
+  uint32_t address = KV_sector_addr[target] + sizeof(KV_sector_header_t);
+  uint32_t index[KV_KEYS];
+  FLASH_EraseInitTypeDef erase;
+  uint32_t sector_error = 0;
+  HAL_StatusTypeDef status = HAL_OK;
+
+  erase.TypeErase = FLASH_TYPEERASE_SECTORS;
+  erase.Sector = KV_sector_number[target];
+  erase.NbSectors = 1;
+  erase.VoltageRange = FLASH_VOLTAGE_RANGE_3;
+  status = HAL_FLASHEx_Erase(&erase, &sector_error);
+
+  memset(index, 0, sizeof(index));
+  for (uint16_t k = 0; k < KV_KEYS && status == HAL_OK; k++) {
+    if (KV_index[k] != 0) {
+      const KV_record_header_t *header = (const KV_record_header_t *) (uintptr_t) KV_index[k];
+      status = KV_program(address, k, (const uint8_t *) (uintptr_t) (KV_index[k] + 4), header->length);
+      index[k] = address;
+      address += KV_RECORD_WORDS(header->length) * 4;
+    }
+  }
+  if (status == HAL_OK) {
+    status = HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, KV_sector_addr[target] + 4, KV_generation + 1);
+  }
+  if (status == HAL_OK) {
+    status = HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, KV_sector_addr[target], KV_SECTOR_MAGIC);
+  }
+  if (status != HAL_OK) {
+    return(status);
+  }
+
+  KV_active = target;
+  KV_generation++;
+  KV_free = address;
+  memcpy(KV_index, index, sizeof(KV_index));
+  KV_stats.compactions++;
+  return(HAL_OK);
+}
+
+
+
+
+
+uint8_t KV_take_token()
+{
+  // Token bucket, refilled from the tick
+  uint32_t now = HAL_GetTick();
+
+  while (now - KV_refill_tick >= KV_WRITE_REFILL_MS) {
+    KV_refill_tick += KV_WRITE_REFILL_MS;
+    if (KV_tokens < KV_WRITE_BURST) {
+      KV_tokens++;
+    }
+  }
+  if (KV_tokens == 0) {
+    return(0);
+  }
+  KV_tokens--;
+  return(1);
+}
+
+
+
+
+
+HAL_StatusTypeDef KV_set(uint16_t _key, const void *_value, uint16_t _length)
+{
+  // Thread context only: the flash is busy (and the core stalls on it)
+  // during the erase of a compaction
+  HAL_StatusTypeDef status = HAL_OK;
+  uint32_t size = KV_RECORD_WORDS(_length) * 4;
+  uint32_t address = 0;
+
+  if (_key >= KV_KEYS || _length > KV_VALUE_MAX) {
+    return(HAL_ERROR);
+  }
+  // Same value already stored
+  if (KV_index[_key] != 0 && ((const KV_record_header_t *) (uintptr_t) KV_index[_key])->length == _length &&
+      memcmp((const uint8_t *) (uintptr_t) (KV_index[_key] + 4), _value, _length) == 0) {
+    KV_stats.unchanged++;
+    return(HAL_OK);
+  }
+  if (!KV_take_token()) {
+    KV_stats.throttled++;
+    return(HAL_BUSY);
+  }
+
+  HAL_FLASH_Unlock();
+  // Not formatted yet, or no room left: move the live records over
+  if (KV_active == 0xFF || KV_free + size > KV_sector_addr[KV_active] + KV_SECTOR_SIZE) {
+    status = KV_compact();
+    if (status == HAL_OK && KV_free + size > KV_sector_addr[KV_active] + KV_SECTOR_SIZE) {
+      status = HAL_ERROR;
+    }
+  }
+  if (status == HAL_OK) {
+    address = KV_free;
+    status = KV_program(address, _key, _value, _length);
+    // Even a failed record uses its words
+    KV_free += size;
+  }
+  HAL_FLASH_Lock();
+
+  if (status == HAL_OK && KV_record_valid(address)) {
+    KV_index[_key] = address;
+    KV_stats.writes++;
+    return(HAL_OK);
+  }
+  KV_stats.errors++;
+  return(HAL_ERROR);
+}
+
+
+
+
+
+void KV_get_stats(KV_stats_t *_stats)
+{
+  *_stats = KV_stats;
+  _stats->generation = KV_generation;
+  _stats->records = 0;
+  for (uint16_t k = 0; k < KV_KEYS; k++) {
+    _stats->records += (KV_index[k] != 0);
+  }
+  _stats->used_bytes = (KV_active == 0xFF) ? 0 : KV_free - KV_sector_addr[KV_active];
+}
@@ -0,0 +1,336 @@
+/**
+  ******************************************************************************
+  * @file           : latency_trace.c
+  * @brief          : End to end latency tracer, UART idle line to tube latch
+  ******************************************************************************
+  * @attention
+  *
+  * Copyright (c) 2023 Nicolò Campanini.
+  * All rights reserved.
+  *
+  * This software is licensed under terms that can be found in the LICENSE file
+  * in the root directory of this software component.
+  * If no LICENSE file comes with this software, it is provided AS-IS.
+  *
+  ******************************************************************************
+  */
+
+#include "latency_trace.h"
+#include "cycle_counter.h"
+
+
+
+
+
+// Ring of the last records and the totals per kind
+Trace_record_t Trace_ring[TRACE_RING_SIZE];
+uint16_t Trace_head = 0;
+uint16_t Trace_count = 0;
+Trace_stats_t Trace_stats[TRACE_KINDS];
+
+// Microsecond time of the tags: the cycles since the base, at the clock
+// they ran at, added to it. Moved to each clock change.
+uint32_t Trace_base_us = 0;
+uint32_t Trace_base_cycles = 0;
+uint32_t Trace_base_mhz = HSI_VALUE / 1000000;
+
+// Second edge of the last RTC read, Trace_now_us(), and whether the read
+// was the first one of its second. A frame sequence in between hides the edge.
+uint32_t Trace_edge_us = 0;
+uint8_t Trace_edge_new = 0;
+uint8_t Trace_edge_hidden = 0;
+uint8_t Trace_last_seconds = 0xFF;
+// Second edge waiting for its latch (0 = none)
+volatile uint32_t Trace_latch_pending = 0;
+
+const char *Trace_names[TRACE_KINDS] = {
+  "idle_to_parse",
+  "parse_to_rtc",
+  "edge_to_latch"
+};
+
+
+
+
+
+void Trace_init()
+{
+  Cycles_init();
+  Trace_reset();
+  Trace_clock_changed();
+}
+
+
+
+
+
+uint32_t Trace_now_us()
+{
+  // Each call moves the base up to now, the remainder of a microsecond
+  // left in the cycles. The counter wraps in 51 s at 84 MHz: the display
+  // calls here every second while it counts (it stops in Stop).
+  uint32_t primask = __get_PRIMASK();
+  uint32_t us = 0;
+
+  __disable_irq();
+  us = (Cycles_now() - Trace_base_cycles) / Trace_base_mhz;
+  Trace_base_cycles += us * Trace_base_mhz;
+  Trace_base_us += us;
+  us = Trace_base_us;
+  __set_PRIMASK(primask);
+  return(us);
+}
+
+
+
+
+
+void Trace_clock_changed()
+{
+  // Right after a change of SystemCoreClock: the cycles so far at the old
+  // clock, the next ones at the new one
+  uint32_t primask = __get_PRIMASK();
+
+  __disable_irq();
+  Trace_now_us();
+  Trace_base_mhz = SystemCoreClock / 1000000;
+  __set_PRIMASK(primask);
+}
+
+
+
+
+
+uint32_t Trace_timestamp()
+{
+  // Tag of an event, for a later Trace_record(). Zero means no tag. In
+  // microseconds, not cycles: a burst between the tag and the record
+  // changes the cycles per microsecond.
+  uint32_t now = Trace_now_us();
+
+  return((now == 0) ? 1 : now);
+}
+
+
+
+
+
+void Trace_record(Trace_kind_t _kind, uint32_t _from)
+{
+#ifdef LATENCY_TRACE
+  // Untagged event: nothing to measure
+  if (_from == 0) {
+    return;
+  }
+  uint32_t us = Trace_now_us() - _from;
+  uint32_t tick = HAL_GetTick();
+
+  // Recorded from the thread, PendSV and the SPI interrupt
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  Trace_ring[Trace_head].tick = tick;
+  Trace_ring[Trace_head].latency_us = us;
+  Trace_ring[Trace_head].kind = _kind;
+  Trace_head = (Trace_head + 1) % TRACE_RING_SIZE;
+  if (Trace_count < TRACE_RING_SIZE) {
+    Trace_count++;
+  }
+  Trace_stats[_kind].count++;
+  Trace_stats[_kind].last_us = us;
+  Trace_stats[_kind].total_us += us;
+  if (us > Trace_stats[_kind].max_us) {
+    Trace_stats[_kind].max_us = us;
+  }
+  __set_PRIMASK(primask);
+#endif
+}
+
+
+
+
+
+void Trace_rtc_read(const RTC_TimeTypeDef *_time)
+{
+#ifdef LATENCY_TRACE
+  // Right after HAL_RTC_GetTime(): the sub-second counter goes down from
+  // SecondFraction at the edge, so the edge was this many us ago
+  uint32_t elapsed = _time->SecondFraction - _time->SubSeconds;
+  uint32_t us = (uint32_t) (((uint64_t) elapsed * 1000000) / (_time->SecondFraction + 1));
+
+  Trace_edge_us = Trace_now_us() - us;
+  Trace_edge_new = (_time->Seconds != Trace_last_seconds) && (Trace_edge_hidden == 0);
+  Trace_edge_hidden = 0;
+  Trace_last_seconds = _time->Seconds;
+#endif
+}
+
+
+
+
+
+void Trace_sequence_frame()
+{
+#ifdef LATENCY_TRACE
+  // A sequence frame instead of the time: its latch is not a second change,
+  // and the next second shown lands when the sequence ends
+  Trace_edge_new = 0;
+  Trace_edge_hidden = 1;
+#endif
+}
+
+
+
+
+
+void Trace_rtc_shift()
+{
+#ifdef LATENCY_TRACE
+  // The calendar was moved by a sub-second shift: a second change seen
+  // next is the step, the sub-second counter doesn't date it
+  Trace_edge_hidden = 1;
+#endif
+}
+
+
+
+
+
+void Trace_display_update()
+{
+#ifdef LATENCY_TRACE
+  // Before the frame of the time is sent: only the first frame of a second
+  // measures its edge (the frames of a sequence are not traced)
+  if (Trace_edge_new) {
+    Trace_latch_pending = (Trace_edge_us == 0) ? 1 : Trace_edge_us;
+    Trace_edge_new = 0;
+  }
+#endif
+}
+
+
+
+
+
+void Trace_latch()
+{
+#ifdef LATENCY_TRACE
+  // From the SPI transfer complete interrupt, after the latch pulse
+  uint32_t edge = Trace_latch_pending;
+
+  if (edge != 0) {
+    Trace_latch_pending = 0;
+    Trace_record(TRACE_EDGE_TO_LATCH, edge);
+  }
+#endif
+}
+
+
+
+
+
+uint16_t Trace_read(Trace_record_t *_records, uint16_t _max)
+{
+  // Copy the ring, oldest record first, return how many were copied
+  uint16_t count = 0;
+  uint32_t primask = __get_PRIMASK();
+
+  __disable_irq();
+  count = (Trace_count < _max) ? Trace_count : _max;
+  for (uint16_t i = 0; i < count; i++) {
+    _records[i] = Trace_ring[(Trace_head + TRACE_RING_SIZE - count + i) % TRACE_RING_SIZE];
+  }
+  __set_PRIMASK(primask);
+  return(count);
+}
+
+
+
+
+
+void Trace_get_stats(Trace_kind_t _kind, Trace_stats_t *_stats)
+{
+  uint32_t primask = __get_PRIMASK();
+
+  __disable_irq();
+  *_stats = Trace_stats[_kind];
+  __set_PRIMASK(primask);
+}
+
+
+
+
+
+uint32_t Trace_avg_us(Trace_stats_t *_stats)
+{
+  if (_stats->count == 0) {
+    return(0);
+  }
+  return(_stats->total_us / _stats->count);
+}
+
+
+
+
+
+void Trace_dump(Text_write_t _write)
+{
+  // Totals, then the ring oldest first, microseconds:
+  //   trace <kind> n=<count> avg=<avg> max=<max>
+  //   trace <tick> <kind> <latency>
+  // From the thread context only
+  static Trace_record_t records[TRACE_RING_SIZE];
+  char line[64];
+  Trace_stats_t stats;
+  uint16_t count = 0;
+  char *out = NULL;
+
+  for (uint8_t k = 0; k < TRACE_KINDS; k++) {
+    Trace_get_stats(k, &stats);
+    out = Text_append(line, "trace ");
+    out = Text_append(out, Trace_names[k]);
+    out = Text_append(out, " n=");
+    out = Text_append_u32(out, stats.count);
+    out = Text_append(out, " avg=");
+    out = Text_append_u32(out, Trace_avg_us(&stats));
+    out = Text_append(out, " max=");
+    out = Text_append_u32(out, stats.max_us);
+    out = Text_append(out, "\r\n");
+    _write(line, out - line);
+  }
+
+  count = Trace_read(records, TRACE_RING_SIZE);
+  for (uint16_t i = 0; i < count; i++) {
+    out = Text_append(line, "trace ");
+    out = Text_append_u32(out, records[i].tick);
+    out = Text_append(out, " ");
+    out = Text_append(out, Trace_names[records[i].kind]);
+    out = Text_append(out, " ");
+    out = Text_append_u32(out, records[i].latency_us);
+    out = Text_append(out, "\r\n");
+    _write(line, out - line);
+  }
+}
+
+
+
+
+
+void Trace_reset()
+{
+  uint32_t primask = __get_PRIMASK();
+
+  __disable_irq();
+  Trace_head = 0;
+  Trace_count = 0;
+  for (uint8_t k = 0; k < TRACE_KINDS; k++) {
+    Trace_stats[k].count = 0;
+    Trace_stats[k].last_us = 0;
+    Trace_stats[k].max_us = 0;
+    Trace_stats[k].total_us = 0;
+  }
+  Trace_edge_new = 0;
+  Trace_edge_hidden = 0;
+  Trace_last_seconds = 0xFF;
+  Trace_latch_pending = 0;
+  __set_PRIMASK(primask);
+}
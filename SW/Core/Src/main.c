@@ -21,7 +21,28 @@
 
 /* Private includes ----------------------------------------------------------*/
 /* USER CODE BEGIN Includes */
-#include "time.h"
+#include "nixie_antipoison.h"
+#include "nixie_usage.h"
+#include "nixie_animation.h"
+#include "nixie_brightness.h"
+#include "nixie_ambient.h"
+#include "scheduler.h"
+#include "deferred.h"
+#include "isr_latency.h"
+#include "power.h"
+#include "clock_profile.h"
+#include "nixie_night.h"
+#include "prng.h"
+#include "cycle_counter.h"
+#include "profiler.h"
+#include "latency_trace.h"
+#include "blackbox.h"
+#include "config.h"
+#include "kv_store.h"
+#include "console.h"
+#include "stack_guard.h"
+#include "watchdog.h"
+#include "cpu_load.h"
 
 /* USER CODE END Includes */
 
@@ -42,18 +63,23 @@
 
 /* Private variables ---------------------------------------------------------*/
 ADC_HandleTypeDef hadc1;
+DMA_HandleTypeDef hdma_adc1;
 
 RTC_HandleTypeDef hrtc;
 
 SPI_HandleTypeDef hspi2;
 
 TIM_HandleTypeDef htim1;
+TIM_HandleTypeDef htim2;
 TIM_HandleTypeDef htim11;
 
 UART_HandleTypeDef huart1;
+UART_HandleTypeDef huart2;
 DMA_HandleTypeDef hdma_usart1_rx;
 
 /* USER CODE BEGIN PV */
+// Backup domain lost at power on: the calendar is not the time yet
+uint8_t RTC_calendar_lost = 0;
 
 /* USER CODE END PV */
 
@@ -67,14 +93,25 @@ static void MX_SPI2_Init(void);
 static void MX_TIM1_Init(void);
 static void MX_ADC1_Init(void);
 static void MX_TIM11_Init(void);
+static void MX_TIM2_Init(void);
+static void MX_USART2_UART_Init(void);
 /* USER CODE BEGIN PFP */
+void Housekeeping_task(void);
+void Gps_task(void);
+void Display_tick_work(uint32_t _arg);
 void add_valid_line(void);
 void remove_valid_line(void);
+void Boot_write(const char *_text, uint16_t _length);
 
 /* USER CODE END PFP */
 
 /* Private user code ---------------------------------------------------------*/
 /* USER CODE BEGIN 0 */
+// Text_write_t before the console runs: blocking, on the console UART
+void Boot_write(const char *_text, uint16_t _length)
+{
+  HAL_UART_Transmit(&huart2, (uint8_t *) _text, _length, 100);
+}
 
 /* USER CODE END 0 */
 
@@ -85,6 +122,8 @@ void remove_valid_line(void);
 int main(void)
 {
   /* USER CODE BEGIN 1 */
+  // Before anything goes deep: paint the stack, arm its guard
+  Stack_init();
 
   /* USER CODE END 1 */
 
@@ -113,20 +152,75 @@ int main(void)
   MX_TIM1_Init();
   MX_ADC1_Init();
   MX_TIM11_Init();
+  MX_TIM2_Init();
+  MX_USART2_UART_Init();
   /* USER CODE BEGIN 2 */
 
+  // Open the event ring kept across resets, and print what the previous
+  // run left in it (after a warm reset only)
+  Blackbox_init();
+  if (Blackbox_warm_boot()) {
+    Blackbox_dump(Boot_write);
+  }
+  // Index the flash key/value store, then the settings: defaults and saved
+  // values, before the modules that read them
+  KV_init();
+  Config_init();
+  // Initialize the scheduler, the interrupts post the events to the tasks
+  Sched_init();
+  Sched_register(SCHED_EVENT_GPS_RX, Gps_task, "gps");
+  Sched_register(SCHED_EVENT_ADC, Nixie_ambient_process, "ambient");
+  Sched_register(SCHED_EVENT_DISPLAY_TICK, Housekeeping_task, "housekeeping");
+  Sched_register(SCHED_EVENT_CONSOLE, Console_task, "console");
+  // Charge the cycles to the idle loop, the tasks and the handlers from here on
+  Load_init();
+  // Initialize the power manager: Sleep or Stop when there is nothing to do
+  Power_init(&hrtc);
+  // A lost calendar would look like night: receive the GPS before any Stop
+  if (RTC_calendar_lost) {
+    Power_lock(POWER_LOCK_GPS_SYNC);
+  }
+  // Initialize the clock profiles, starting on the normal one
+  Clock_init(&htim1, &htim11, &htim2, &huart1, &huart2);
+  // Initialize the PendSV work queue for the display tick
+  Deferred_init();
+  // Measure the USART1 interrupt latency
+  Latency_init();
+  // Clear the pipeline stage probes
+  Prof_init();
+  // Clear the GPS to tubes latency tracer
+  Trace_init();
   // Initialize the GPS system.
-  GPS_Init(&huart1, &hdma_usart1_rx);
+  GPS_Init(&huart1, &hdma_usart1_rx, &hrtc, !RTC_calendar_lost);
   // Initialize the Nixie display.
   Nixie_init(&hspi2, &htim1, TIM_CHANNEL_1);
+  // Initialize the brightness fades on the same PWM
+  Nixie_brightness_init(&htim1, TIM_CHANNEL_1);
+  // Start the ADC trigger for the ambient light sensor
+  Nixie_ambient_init(&hadc1, &htim2);
+  // Initialize the slot machine animation, seeded from RTC sub-seconds and ADC noise
+  Cycles_init();
+  Nixie_animation_init(PRNG_hardware_seed(&hadc1, &hrtc));
+  // Hand the ADC over to the DMA for the auto-brightness
+  Nixie_ambient_start();
+  // Load the cathode on-time counters
+  Nixie_usage_init(&hrtc);
+  // Initialize the cathode poisoning prevention schedule
+  Nixie_antipoison_init();
+  // Initialize the night schedule of the HV supply
+  Nixie_night_init(&hrtc);
   // Start the GPS system
   GPS_Start();
   // Launch the TIM11 as interrupt. Used to update the nixie display
   HAL_TIM_Base_Start_IT(&htim11);
   // Turn-on the HV 
   Nixie_enable_HV();
-  // Set Nixie brightness to 50%
-  Nixie_set_brightness(20);
+  // Fade-in the Nixie brightness
+  Nixie_brightness_set(Config.brightness, 1000);
+  // Start the command console on USART2
+  Console_init(&huart2);
+  // Start the IWDG, kicked while the loop, the GPS and the display check in
+  Watchdog_init(&hrtc);
 
   /* USER CODE END 2 */
 
@@ -138,20 +232,8 @@ int main(void)
 
     /* USER CODE BEGIN 3 */
 
-    // Continuosly update the GPS data.
-    GPS_Update_Data();
-    
-
-    GPS_datetime_struct_t GPS_data;
-    GPS_data = GPS_Read_Datetime();
-    if (GPS_data.valid == 1) {
-      //sprintf(current_time_str, "The current date/time is: %s\r\n", ctime(&GPS_data.unixtime));
-      //CDC_Transmit_FS(current_time_str, strlen(current_time_str));
-    } else {
-      //CDC_Transmit_FS("GPS-TIME Invalid\r\n", strlen("GPS-TIME Invalid\r\n"));
-    }
-
-    HAL_Delay(500);
+    // Run the tasks as their events arrive, sleep in between. Never returns.
+    Sched_run();
   }
   /* USER CODE END 3 */
 }
@@ -228,11 +310,11 @@ static void MX_ADC1_Init(void)
   hadc1.Init.ScanConvMode = DISABLE;
   hadc1.Init.ContinuousConvMode = DISABLE;
   hadc1.Init.DiscontinuousConvMode = DISABLE;
-  hadc1.Init.ExternalTrigConvEdge = ADC_EXTERNALTRIGCONVEDGE_NONE;
-  hadc1.Init.ExternalTrigConv = ADC_SOFTWARE_START;
+  hadc1.Init.ExternalTrigConvEdge = ADC_EXTERNALTRIGCONVEDGE_RISING;
+  hadc1.Init.ExternalTrigConv = ADC_EXTERNALTRIGCONV_T2_TRGO;
   hadc1.Init.DataAlign = ADC_DATAALIGN_RIGHT;
   hadc1.Init.NbrOfConversion = 1;
-  hadc1.Init.DMAContinuousRequests = DISABLE;
+  hadc1.Init.DMAContinuousRequests = ENABLE;
   hadc1.Init.EOCSelection = ADC_EOC_SINGLE_CONV;
   if (HAL_ADC_Init(&hadc1) != HAL_OK)
   {
@@ -243,7 +325,7 @@ static void MX_ADC1_Init(void)
   */
   sConfig.Channel = ADC_CHANNEL_7;
   sConfig.Rank = 1;
-  sConfig.SamplingTime = ADC_SAMPLETIME_3CYCLES;
+  sConfig.SamplingTime = ADC_SAMPLETIME_144CYCLES;
   if (HAL_ADC_ConfigChannel(&hadc1, &sConfig) != HAL_OK)
   {
     Error_Handler();
@@ -315,6 +397,7 @@ static void MX_RTC_Init(void)
   }
   /* USER CODE BEGIN RTC_Init 2 */
 	  HAL_RTCEx_BKUPWrite(&hrtc,RTC_BKP_DR0,0x32F2);
+	  RTC_calendar_lost = 1;
   }
 
 
@@ -381,12 +464,12 @@ static void MX_TIM1_Init(void)
 
   /* USER CODE END TIM1_Init 1 */
   htim1.Instance = TIM1;
-  htim1.Init.Prescaler = 30-1;
+  htim1.Init.Prescaler = 0;
   htim1.Init.CounterMode = TIM_COUNTERMODE_UP;
-  htim1.Init.Period = 100-1;
+  htim1.Init.Period = 3000-1;
   htim1.Init.ClockDivision = TIM_CLOCKDIVISION_DIV1;
-  htim1.Init.RepetitionCounter = 0;
-  htim1.Init.AutoReloadPreload = TIM_AUTORELOAD_PRELOAD_DISABLE;
+  htim1.Init.RepetitionCounter = 255;
+  htim1.Init.AutoReloadPreload = TIM_AUTORELOAD_PRELOAD_ENABLE;
   if (HAL_TIM_Base_Init(&htim1) != HAL_OK)
   {
     Error_Handler();
@@ -435,6 +518,51 @@ static void MX_TIM1_Init(void)
 
 }
 
+/**
+  * @brief TIM2 Initialization Function
+  * @param None
+  * @retval None
+  */
+static void MX_TIM2_Init(void)
+{
+
+  /* USER CODE BEGIN TIM2_Init 0 */
+
+  /* USER CODE END TIM2_Init 0 */
+
+  TIM_ClockConfigTypeDef sClockSourceConfig = {0};
+  TIM_MasterConfigTypeDef sMasterConfig = {0};
+
+  /* USER CODE BEGIN TIM2_Init 1 */
+
+  /* USER CODE END TIM2_Init 1 */
+  htim2.Instance = TIM2;
+  htim2.Init.Prescaler = 60-1;
+  htim2.Init.CounterMode = TIM_COUNTERMODE_UP;
+  htim2.Init.Period = 250-1;
+  htim2.Init.ClockDivision = TIM_CLOCKDIVISION_DIV1;
+  htim2.Init.AutoReloadPreload = TIM_AUTORELOAD_PRELOAD_DISABLE;
+  if (HAL_TIM_Base_Init(&htim2) != HAL_OK)
+  {
+    Error_Handler();
+  }
+  sClockSourceConfig.ClockSource = TIM_CLOCKSOURCE_INTERNAL;
+  if (HAL_TIM_ConfigClockSource(&htim2, &sClockSourceConfig) != HAL_OK)
+  {
+    Error_Handler();
+  }
+  sMasterConfig.MasterOutputTrigger = TIM_TRGO_UPDATE;
+  sMasterConfig.MasterSlaveMode = TIM_MASTERSLAVEMODE_DISABLE;
+  if (HAL_TIMEx_MasterConfigSynchronization(&htim2, &sMasterConfig) != HAL_OK)
+  {
+    Error_Handler();
+  }
+  /* USER CODE BEGIN TIM2_Init 2 */
+
+  /* USER CODE END TIM2_Init 2 */
+
+}
+
 /**
   * @brief TIM11 Initialization Function
   * @param None
@@ -499,6 +627,39 @@ static void MX_USART1_UART_Init(void)
 
 }
 
+/**
+  * @brief USART2 Initialization Function
+  * @param None
+  * @retval None
+  */
+static void MX_USART2_UART_Init(void)
+{
+
+  /* USER CODE BEGIN USART2_Init 0 */
+
+  /* USER CODE END USART2_Init 0 */
+
+  /* USER CODE BEGIN USART2_Init 1 */
+
+  /* USER CODE END USART2_Init 1 */
+  huart2.Instance = USART2;
+  huart2.Init.BaudRate = 115200;
+  huart2.Init.WordLength = UART_WORDLENGTH_8B;
+  huart2.Init.StopBits = UART_STOPBITS_1;
+  huart2.Init.Parity = UART_PARITY_NONE;
+  huart2.Init.Mode = UART_MODE_TX_RX;
+  huart2.Init.HwFlowCtl = UART_HWCONTROL_NONE;
+  huart2.Init.OverSampling = UART_OVERSAMPLING_16;
+  if (HAL_UART_Init(&huart2) != HAL_OK)
+  {
+    Error_Handler();
+  }
+  /* USER CODE BEGIN USART2_Init 2 */
+
+  /* USER CODE END USART2_Init 2 */
+
+}
+
 /**
   * Enable DMA controller clock
   */
@@ -509,6 +670,9 @@ static void MX_DMA_Init(void)
   __HAL_RCC_DMA2_CLK_ENABLE();
 
   /* DMA interrupt init */
+  /* DMA2_Stream0_IRQn interrupt configuration */
+  HAL_NVIC_SetPriority(DMA2_Stream0_IRQn, 5, 0);
+  HAL_NVIC_EnableIRQ(DMA2_Stream0_IRQn);
   /* DMA2_Stream2_IRQn interrupt configuration */
   HAL_NVIC_SetPriority(DMA2_Stream2_IRQn, 2, 0);
   HAL_NVIC_EnableIRQ(DMA2_Stream2_IRQn);
@@ -557,54 +721,146 @@ static void MX_GPIO_Init(void)
 }
 
 /* USER CODE BEGIN 4 */
+// GPS bursts, parsed on the fast clock
+void Gps_task(void)
+{
+  Clock_burst_begin();
+  GPS_Update_Data();
+  Clock_burst_end();
+}
+
+
+
+// Background work woken by the display tick
+void Housekeeping_task(void)
+{
+  // Slow clock while the tubes are dark, normal one otherwise
+  Clock_set_base_profile(Nixie_is_lit() ? CLOCK_NORMAL : CLOCK_LOW);
+  // Ramp the tubes down/up and switch the HV on the night schedule
+  Nixie_night_process();
+  // Build the slot machine animation ahead of the time change
+  Nixie_animation_process();
+  // Build the cathode poisoning prevention sequence when it is due
+  Nixie_antipoison_process();
+  // Commit the cathode on-time counters to flash when it is due
+  Nixie_usage_process();
+}
+
+
+
+// Display tick work, deferred from the TIM11 interrupt to PendSV
+void Display_tick_work(uint32_t _arg)
+{
+  // Variables
+  GPS_RTC_update_t  GPS_RTC_update;
+  RTC_TimeTypeDef sTime;
+  RTC_DateTypeDef sDate;
+  int16_t utc_offset_min = 0;
+
+  (void) _arg;
+
+  // Check if RTC should be updated
+  GPS_RTC_update = GPS_RTC_check_update();
+
+  if (GPS_RTC_update == NEEDED) {
+    GPS_datetime_struct_t GPS_data;
+    // Get GPS Datetime info
+    GPS_data = GPS_Read_Datetime();
+    if (GPS_data.valid == 1) {
+      RTC_TimeTypeDef utc_time;
+      RTC_DateTypeDef utc_date;
+      uint32_t fraction = 0;
+      // Log the steps of the calendar only: the regular updates every
+      // RTC_UPDATE_CNT ticks would flush the ring
+      HAL_RTC_GetTime(&hrtc, &sTime, RTC_FORMAT_BIN);
+      HAL_RTC_GetDate(&hrtc, &sDate, RTC_FORMAT_BIN);
+      // The UTC of now, from the second of the fix and the time since it
+      GPS_Datetime_now(&GPS_data, hrtc.Init.SynchPrediv, &utc_time, &utc_date, &fraction);
+      int32_t step = (utc_time.Hours * 3600 + utc_time.Minutes * 60 + utc_time.Seconds) -
+                     (sTime.Hours * 3600 + sTime.Minutes * 60 + sTime.Seconds);
+      step = (step + 86400 + 43200) % 86400 - 43200;
+      if (step > 1 || step < -1) {
+        Blackbox_log(BLACKBOX_RTC_STEP, (uint32_t) step);
+      }
+      // Set the RTC time and date: the calendar restarts at a whole second,
+      // the shift then moves it on by the fraction (one second added, the
+      // rest of it subtracted)
+      HAL_RTC_SetTime(&hrtc, &utc_time, RTC_FORMAT_BIN);
+      HAL_RTC_SetDate(&hrtc, &utc_date, RTC_FORMAT_BIN);
+      if (fraction != 0) {
+        HAL_RTCEx_SetSynchroShift(&hrtc, RTC_SHIFTADD1S_SET, hrtc.Init.SynchPrediv + 1 - fraction);
+        Trace_rtc_shift();
+      }
+      Trace_record(TRACE_PARSE_TO_RTC, GPS_data.parsed);
+      GPS_Clear_Datetime();
+      // The calendar is right, Stop can be used again
+      Power_unlock(POWER_LOCK_GPS_SYNC);
+    }
+  }
+
+  // Account the cathode on-time of the frame on the tubes
+  Nixie_usage_tick();
+
+  // A playing frame sequence (animation, cathode poisoning prevention) owns the tubes
+  if (Nixie_sequence_step()) {
+    Trace_sequence_frame();
+    return;
+  }
+
+  // Get the time and date from RTC
+  PROF_START(PROF_RTC_READ);
+  HAL_RTC_GetTime(&hrtc, &sTime, RTC_FORMAT_BIN);
+  HAL_RTC_GetDate(&hrtc, &sDate, RTC_FORMAT_BIN);
+  PROF_STOP(PROF_RTC_READ);
+  Trace_rtc_read(&sTime);
+  // Apply timezone and DST, keeping the resulting offset from UTC
+  utc_offset_min = -(sTime.Hours * 60 + sTime.Minutes);
+  PROF_START(PROF_TIMEZONE);
+  Apply_timezone_dst(&sTime, &sDate);
+  PROF_STOP(PROF_TIMEZONE);
+  utc_offset_min = (utc_offset_min + sTime.Hours * 60 + sTime.Minutes + 1440 + 720) % 1440 - 720;
+  // Check the night schedule of the HV
+  Nixie_night_check_schedule(&sTime, &sDate, utc_offset_min);
+  // Check if the cathode poisoning prevention is due
+  Nixie_antipoison_check_schedule(&sTime);
+  // Start the slot machine animation on the time change, from this tick
+  if (Nixie_animation_check_trigger(&sTime) && Nixie_sequence_step()) {
+    Trace_sequence_frame();
+    return;
+  }
+  // Update the Nixie Display, tracing the delay from the second edge (lit
+  // tubes only: in the dark, Stop also stops the cycle counter)
+  if (Nixie_is_lit()) {
+    Trace_display_update();
+  }
+  Nixie_update_display(sTime.Hours, sTime.Minutes, sTime.Seconds);
+}
+
+
+
 // Update display callback
 void HAL_TIM_PeriodElapsedCallback(TIM_HandleTypeDef *htim)
 {
   // Check which version of the timer triggered this callback and toggle LED
 
+  if (htim == &htim1)
+  {
+    // PWM update event: step the brightness fade
+    Nixie_brightness_update();
+  }
+
   if (htim == &htim11 )
   {
-    // Variables
-    uint8_t value_h, value_m, value_s = 0;
-    GPS_RTC_update_t  GPS_RTC_update;
-    Nixie_mode_enum_t Nixie_mode;
-
-    // Check if RTC should be updated
-    GPS_RTC_update = GPS_RTC_check_update();
-
-    if (GPS_RTC_update == NEEDED) {
-      GPS_datetime_struct_t GPS_data;
-      // Get GPS Datetime info
-      GPS_data = GPS_Read_Datetime();
-      if (GPS_data.valid == 1) {
-        // Set the RTC time and date
-        HAL_RTC_SetTime(&hrtc, &(GPS_data.time), RTC_FORMAT_BIN);
-        HAL_RTC_SetDate(&hrtc, &(GPS_data.date), RTC_FORMAT_BIN);
-      }
-    }
-    
-    // Check the mode for Nixie display.
-    Nixie_mode = Nixie_get_mode();
-
-    if (Nixie_mode == NORMAL) {
-      // Variables 
-      RTC_TimeTypeDef sTime;
-      RTC_DateTypeDef sDate;
-      // Get the time and date from RTC
-      HAL_RTC_GetTime(&hrtc, &sTime, RTC_FORMAT_BIN);
-      HAL_RTC_GetDate(&hrtc, &sDate, RTC_FORMAT_BIN);
-      // Apply timezone and DST
-      Apply_timezone_dst(&sTime, &sDate);
-      // Extract hours, minutes and seconds
-      value_h = sTime.Hours;
-      value_m = sTime.Minutes;
-      value_s = sTime.Seconds;
+    // Only post the work: the RTC access and the time conversion run in
+    // PendSV, below the GPS UART and DMA interrupts. The latency probe
+    // builds can run it here instead, for the comparison.
+    if (Latency_tick_inline()) {
+      Display_tick_work(0);
     } else {
-      // Get Random values otherwise
-      Nixie_get_random(&value_h, &value_m, &value_s);
+      Deferred_post(Display_tick_work, 0);
     }
-    // Update the Nixie Display
-    Nixie_update_display(value_h, value_m, value_s);
+    // Wake the housekeeping task
+    Sched_post(SCHED_EVENT_DISPLAY_TICK);
   }
 
 
@@ -658,6 +914,8 @@ void Error_Handler(void)
   /* USER CODE BEGIN Error_Handler_Debug */
   /* User can add his own implementation to report the HAL error return state */
   __disable_irq();
+  // Keep the caller for the dump at the next boot, then reset
+  Blackbox_error((uint32_t) (uintptr_t) __builtin_return_address(0));
   while (1)
   {
   }
@@ -0,0 +1,223 @@
+/**
+  ******************************************************************************
+  * @file           : nixie_ambient.c
+  * @brief          : Ambient light auto-brightness on ADC1 channel 7
+  ******************************************************************************
+  * @attention
+  *
+  * Copyright (c) 2023 Nicolò Campanini.
+  * All rights reserved.
+  *
+  * This software is licensed under terms that can be found in the LICENSE file
+  * in the root directory of this software component.
+  * If no LICENSE file comes with this software, it is provided AS-IS.
+  *
+  ******************************************************************************
+  */
+
+#include "nixie_ambient.h"
+#include "scheduler.h"
+
+
+
+
+
+// Global ADC and trigger TIM handlers
+ADC_HandleTypeDef *Nixie_ambient_hadc;
+TIM_HandleTypeDef *Nixie_ambient_htim;
+// Circular DMA buffer, each half is one oversampling block
+volatile uint16_t Nixie_ambient_buffer[AMBIENT_BUFFER_SIZE];
+// Half of the buffer ready to be processed
+volatile uint16_t *Nixie_ambient_ready = NULL;
+// Tuning, changed at run time with Nixie_ambient_set_config()
+Nixie_ambient_config_t Nixie_ambient_config = {
+  .enabled = 1,
+  .iir_shift = AMBIENT_IIR_SHIFT,
+  .hysteresis = AMBIENT_HYSTERESIS,
+  .fade_ms = AMBIENT_FADE_MS,
+  .curve_light = AMBIENT_CURVE_LIGHT,
+  .curve_level = AMBIENT_CURVE_LEVEL
+};
+// Filter state, 8 fractional bits
+int32_t Nixie_ambient_filter_q8 = 0;
+Nixie_ambient_state_t Nixie_ambient_state;
+
+
+
+
+
+void Nixie_ambient_init(ADC_HandleTypeDef *_hadc, TIM_HandleTypeDef *_htim)
+{
+  // Save the handlers
+  Nixie_ambient_hadc = _hadc;
+  Nixie_ambient_htim = _htim;
+
+  Nixie_ambient_state.raw = 0;
+  Nixie_ambient_state.filtered = 0;
+  Nixie_ambient_state.applied = 0;
+  Nixie_ambient_state.level = 0;
+  Nixie_ambient_state.valid = 0;
+  Nixie_ambient_filter_q8 = 0;
+  Nixie_ambient_ready = NULL;
+
+  // Start the conversion trigger: from here a software read of the ADC
+  // (e.g. the PRNG seed) gets a conversion at each TIM2 update
+  HAL_TIM_Base_Start(Nixie_ambient_htim);
+}
+
+
+
+
+
+void Nixie_ambient_start()
+{
+  // From now on the conversions go to the buffer, no CPU involved until
+  // half of it is full
+  HAL_ADC_Start_DMA(Nixie_ambient_hadc, (uint32_t *) Nixie_ambient_buffer, AMBIENT_BUFFER_SIZE);
+}
+
+
+
+
+
+void Nixie_ambient_get_config(Nixie_ambient_config_t *_config)
+{
+  __disable_irq();
+  *_config = Nixie_ambient_config;
+  __enable_irq();
+}
+
+
+
+
+
+void Nixie_ambient_set_config(Nixie_ambient_config_t *_config)
+{
+  __disable_irq();
+  Nixie_ambient_config = *_config;
+  // Apply the new curve at the next block, whatever the hysteresis
+  Nixie_ambient_state.valid = 0;
+  __enable_irq();
+}
+
+
+
+
+
+void Nixie_ambient_get_state(Nixie_ambient_state_t *_state)
+{
+  __disable_irq();
+  *_state = Nixie_ambient_state;
+  __enable_irq();
+}
+
+
+
+
+
+uint8_t Nixie_ambient_map(uint16_t _light)
+{
+  uint16_t *light = Nixie_ambient_config.curve_light;
+  uint8_t *level = Nixie_ambient_config.curve_level;
+
+  // Clamp outside the curve
+  if (_light <= light[0]) {
+    return(level[0]);
+  }
+  for (uint8_t i = 1; i < AMBIENT_CURVE_POINTS; i++) {
+    if (_light <= light[i]) {
+      // Linear interpolation in the segment
+      int32_t span = light[i] - light[i - 1];
+      int32_t delta = (int32_t) level[i] - level[i - 1];
+      return(level[i - 1] + (delta * (_light - light[i - 1])) / span);
+    }
+  }
+  return(level[AMBIENT_CURVE_POINTS - 1]);
+}
+
+
+
+
+
+void Nixie_ambient_process_block(volatile uint16_t *_samples)
+{
+  uint32_t sum = 0;
+  uint16_t distance = 0;
+  uint8_t level = 0;
+
+  // Software oversampling: 256 samples of 12 bits give 16 bits
+  for (uint16_t i = 0; i < AMBIENT_OVERSAMPLE; i++) {
+    sum += _samples[i];
+  }
+  Nixie_ambient_state.raw = sum >> AMBIENT_OVERSAMPLE_SHIFT;
+
+  // First order IIR low-pass, seeded with the first value
+  if (Nixie_ambient_state.valid == 0 && Nixie_ambient_filter_q8 == 0) {
+    Nixie_ambient_filter_q8 = (int32_t) Nixie_ambient_state.raw << 8;
+  }
+  Nixie_ambient_filter_q8 += (((int32_t) Nixie_ambient_state.raw << 8) - Nixie_ambient_filter_q8) >> Nixie_ambient_config.iir_shift;
+  Nixie_ambient_state.filtered = Nixie_ambient_filter_q8 >> 8;
+
+  if (Nixie_ambient_config.enabled == 0) {
+    return;
+  }
+
+  // Hysteresis: small light changes keep the current brightness
+  if (Nixie_ambient_state.filtered > Nixie_ambient_state.applied) {
+    distance = Nixie_ambient_state.filtered - Nixie_ambient_state.applied;
+  } else {
+    distance = Nixie_ambient_state.applied - Nixie_ambient_state.filtered;
+  }
+  if (Nixie_ambient_state.valid && distance < Nixie_ambient_config.hysteresis) {
+    return;
+  }
+
+  Nixie_ambient_state.applied = Nixie_ambient_state.filtered;
+  level = Nixie_ambient_map(Nixie_ambient_state.applied);
+  if (Nixie_ambient_state.valid == 0 || level != Nixie_ambient_state.level) {
+    Nixie_brightness_set(level, Nixie_ambient_config.fade_ms);
+  }
+  Nixie_ambient_state.level = level;
+  Nixie_ambient_state.valid = 1;
+}
+
+
+
+
+
+void Nixie_ambient_process()
+{
+  volatile uint16_t *samples = Nixie_ambient_ready;
+
+  // The DMA takes 64 ms to fill the other half, plenty of time to sum this one
+  if (samples != NULL) {
+    Nixie_ambient_ready = NULL;
+    Nixie_ambient_process_block(samples);
+  }
+}
+
+
+
+
+
+void HAL_ADC_ConvHalfCpltCallback(ADC_HandleTypeDef *hadc)
+{
+  if (hadc == Nixie_ambient_hadc) {
+    // First half ready, the DMA is filling the second one
+    Nixie_ambient_ready = &Nixie_ambient_buffer[0];
+    Sched_post(SCHED_EVENT_ADC);
+  }
+}
+
+
+
+
+
+void HAL_ADC_ConvCpltCallback(ADC_HandleTypeDef *hadc)
+{
+  if (hadc == Nixie_ambient_hadc) {
+    // Second half ready, the DMA wrapped to the first one
+    Nixie_ambient_ready = &Nixie_ambient_buffer[AMBIENT_OVERSAMPLE];
+    Sched_post(SCHED_EVENT_ADC);
+  }
+}
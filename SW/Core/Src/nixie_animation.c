@@ -0,0 +1,217 @@
+/**
+  ******************************************************************************
+  * @file           : nixie_animation.c
+  * @brief          : Slot machine animation landing on the current time
+  ******************************************************************************
+  * @attention
+  *
+  * Copyright (c) 2023 Nicolò Campanini.
+  * All rights reserved.
+  *
+  * This software is licensed under terms that can be found in the LICENSE file
+  * in the root directory of this software component.
+  * If no LICENSE file comes with this software, it is provided AS-IS.
+  *
+  ******************************************************************************
+  */
+
+#include "nixie_animation.h"
+#include "clock_profile.h"
+#include "config.h"
+
+
+
+
+
+// Deceleration profile of the spinning tubes
+const uint8_t Nixie_animation_decel[ANIMATION_DECEL_STEPS] = ANIMATION_DECEL_PROFILE;
+// Frame table built by the thread for the second in Nixie_animation_start,
+// played by the display tick from that second on
+Nixie_frame_t Nixie_animation_frames[ANIMATION_LENGTH_TICKS];
+uint16_t Nixie_animation_length = 0;
+RTC_TimeTypeDef Nixie_animation_start;
+// Table wanted by the display tick, table built and not played yet
+volatile uint8_t Nixie_animation_pending = 0;
+volatile uint8_t Nixie_animation_ready = 0;
+// Set to start the animation at the next second (e.g. from a schedule)
+volatile uint8_t Nixie_animation_requested = 0;
+// Random generator for the landing jitter
+PRNG_state_t Nixie_animation_prng;
+
+
+
+
+
+void Nixie_animation_init(uint32_t _seed)
+{
+  PRNG_seed(&Nixie_animation_prng, _seed);
+  Nixie_animation_requested = 0;
+  Nixie_animation_pending = 0;
+  Nixie_animation_ready = 0;
+  Nixie_animation_length = 0;
+}
+
+
+
+
+
+void Nixie_animation_request()
+{
+  Nixie_animation_requested = 1;
+}
+
+
+
+
+
+uint32_t Nixie_animation_seconds(const RTC_TimeTypeDef *_time)
+{
+  return(_time->Hours * 3600 + _time->Minutes * 60 + _time->Seconds);
+}
+
+
+
+
+
+void Nixie_animation_time_digits(RTC_TimeTypeDef *_local_time, uint8_t _offset_s, uint8_t *_digits)
+{
+  // Add the offset to the local time, with carry
+  uint32_t seconds = _local_time->Hours * 3600 + _local_time->Minutes * 60 + _local_time->Seconds + _offset_s;
+  seconds = seconds % 86400;
+  Nixie_time_to_digits(seconds / 3600, (seconds / 60) % 60, seconds % 60, _digits);
+}
+
+
+
+
+
+uint16_t Nixie_animation_build(RTC_TimeTypeDef *_local_time)
+{
+  uint8_t real[ANIMATION_MAX_SECONDS][NIXIE_TUBES];
+  uint8_t shown[ANIMATION_LENGTH_TICKS][NIXIE_TUBES];
+  uint8_t spi[SPI_BUFFER_SIZE];
+  uint16_t length = 0;
+
+  // Digits of the real time for the seconds covered by the animation
+  for (uint8_t s = 0; s < ANIMATION_MAX_SECONDS; s++) {
+    Nixie_animation_time_digits(_local_time, s, real[s]);
+  }
+
+  for (uint8_t t = 0; t < NIXIE_TUBES; t++) {
+    // Tubes land one after the other, from left to right
+    int16_t stop = ANIMATION_BASE_TICKS + t * ANIMATION_STAGGER_TICKS +
+                   PRNG_range(&Nixie_animation_prng, ANIMATION_JITTER_TICKS + 1);
+    uint8_t target = real[stop / NIXIE_TICKS_PER_SECOND][t];
+    uint8_t step = 1;
+    int16_t boundary = stop - Nixie_animation_decel[0];
+
+    // Once landed the tube follows the real time
+    for (int16_t k = stop; k < ANIMATION_LENGTH_TICKS; k++) {
+      shown[k][t] = real[k / NIXIE_TICKS_PER_SECOND][t];
+    }
+
+    // Walk back from the landing: each step is one digit before the target,
+    // the steps get shorter going back so the tube decelerates forward
+    for (int16_t k = stop - 1; k >= 0; k--) {
+      while (k < boundary) {
+        boundary -= (step < ANIMATION_DECEL_STEPS) ? Nixie_animation_decel[step] : 1;
+        step++;
+      }
+      shown[k][t] = (target + NIXIE_DIGITS - (step % NIXIE_DIGITS)) % NIXIE_DIGITS;
+    }
+  }
+
+  // Encode the ticks, merging the consecutive identical frames
+  for (uint16_t k = 0; k < ANIMATION_LENGTH_TICKS; k++) {
+    Nixie_encode_frame(shown[k], spi);
+    if (length > 0 && memcmp(spi, Nixie_animation_frames[length - 1].spi, SPI_BUFFER_SIZE) == 0) {
+      Nixie_animation_frames[length - 1].ticks++;
+    } else {
+      memcpy(Nixie_animation_frames[length].spi, spi, SPI_BUFFER_SIZE);
+      Nixie_animation_frames[length].ticks = 1;
+      length++;
+    }
+  }
+
+  return(length);
+}
+
+
+
+
+
+uint8_t Nixie_animation_check_trigger(RTC_TimeTypeDef *_local_time)
+{
+  // From the display tick: start the table built for this second, or ask
+  // the thread for the one of the next second when it changes the minute
+  // (or the hour). Nothing is computed here.
+  uint32_t now = Nixie_animation_seconds(_local_time);
+  uint32_t next = (now + 1) % 86400;
+  uint8_t wanted = Nixie_animation_requested;
+
+  if (Nixie_animation_ready) {
+    uint32_t start = Nixie_animation_seconds(&Nixie_animation_start);
+    if (start == now) {
+      Nixie_animation_ready = 0;
+      Nixie_sequence_start(Nixie_animation_frames, Nixie_animation_length);
+      return 1;
+    }
+    // Missed (the RTC was set across it): dropped
+    if (start != next) {
+      Nixie_animation_ready = 0;
+    }
+    return 0;
+  }
+
+  if ((Config.animation_trigger == ANIMATION_ON_MINUTE && next % 60 == 0) ||
+      (Config.animation_trigger == ANIMATION_ON_HOUR && next % 3600 == 0)) {
+    wanted = 1;
+  }
+
+  if (wanted) {
+    Nixie_animation_requested = 0;
+    Nixie_animation_start.Hours = next / 3600;
+    Nixie_animation_start.Minutes = (next / 60) % 60;
+    Nixie_animation_start.Seconds = next % 60;
+    Nixie_animation_pending = 1;
+  } else if (Nixie_animation_pending && Nixie_animation_seconds(&Nixie_animation_start) != next) {
+    // The thread did not make it in time
+    Nixie_animation_pending = 0;
+  }
+
+  return 0;
+}
+
+
+
+
+
+void Nixie_animation_process()
+{
+  RTC_TimeTypeDef start;
+  uint16_t length = 0;
+  uint32_t primask = __get_PRIMASK();
+
+  // A table is wanted, and the player is not on the one to be rewritten
+  if (Nixie_animation_pending == 0 || Nixie_sequence_active()) {
+    return;
+  }
+  __disable_irq();
+  start = Nixie_animation_start;
+  __set_PRIMASK(primask);
+
+  // Precompute the whole animation on the fast clock, the display tick
+  // only starts it and advances the index
+  Clock_burst_begin();
+  length = Nixie_animation_build(&start);
+  Clock_burst_end();
+
+  // Hand it over, unless the tick gave up on that second meanwhile
+  __disable_irq();
+  if (Nixie_animation_pending && Nixie_animation_seconds(&Nixie_animation_start) == Nixie_animation_seconds(&start)) {
+    Nixie_animation_length = length;
+    Nixie_animation_ready = 1;
+  }
+  Nixie_animation_pending = 0;
+  __set_PRIMASK(primask);
+}
@@ -0,0 +1,215 @@
+/**
+  ******************************************************************************
+  * @file           : nixie_antipoison.c
+  * @brief          : Scheduled cathode poisoning prevention for the Nixie tubes
+  ******************************************************************************
+  * @attention
+  *
+  * Copyright (c) 2023 Nicolò Campanini.
+  * All rights reserved.
+  *
+  * This software is licensed under terms that can be found in the LICENSE file
+  * in the root directory of this software component.
+  * If no LICENSE file comes with this software, it is provided AS-IS.
+  *
+  ******************************************************************************
+  */
+
+#include "nixie_antipoison.h"
+#include "clock_profile.h"
+#include "config.h"
+
+
+
+#if ANTIPOISON_CYCLE_TICKS < (NIXIE_DIGITS * ANTIPOISON_DWELL_MIN_TICKS)
+#error "ANTIPOISON_CYCLE_TICKS must fit the minimum dwell of every cathode"
+#endif
+
+
+
+
+// Expected minutes per day each cathode is lit by a 24h clock, used to weight
+// the dwell times. Tubes are ordered as in Nixie_time_to_digits.
+const uint16_t Nixie_antipoison_usage_estimate[NIXIE_TUBES][NIXIE_DIGITS] = {
+  {600, 600, 240,   0,   0,   0,   0,   0,   0,   0},  // Hours Dec
+  {180, 180, 180, 180, 120, 120, 120, 120, 120, 120},  // Hours Uni
+  {240, 240, 240, 240, 240, 240,   0,   0,   0,   0},  // Minutes Dec
+  {144, 144, 144, 144, 144, 144, 144, 144, 144, 144},  // Minutes Uni
+  {240, 240, 240, 240, 240, 240,   0,   0,   0,   0},  // Seconds Dec
+  {144, 144, 144, 144, 144, 144, 144, 144, 144, 144}   // Seconds Uni
+};
+
+// Frame table played by the display tick during a run
+Nixie_frame_t Nixie_antipoison_frames[ANTIPOISON_MAX_FRAMES];
+// Set by the schedule check (interrupt), consumed by the main loop
+volatile uint8_t Nixie_antipoison_requested = 0;
+// Hour and minute of the last scheduled run, to trigger only once
+uint16_t Nixie_antipoison_last_run = 0xFFFF;
+
+
+
+
+
+void Nixie_antipoison_init()
+{
+  Nixie_antipoison_requested = 0;
+  Nixie_antipoison_last_run = 0xFFFF;
+}
+
+
+
+
+
+uint32_t Nixie_antipoison_usage(uint8_t _tube, uint8_t _digit)
+{
+  if (_tube >= NIXIE_TUBES || _digit >= NIXIE_DIGITS) {
+    return 0;
+  }
+  // Use the measured on-time once the tube has enough history
+  if (Nixie_usage_tube_total(_tube) >= ANTIPOISON_MEASURED_MIN_S) {
+    return(Nixie_usage_get(_tube, _digit));
+  }
+  return(Nixie_antipoison_usage_estimate[_tube][_digit]);
+}
+
+
+
+
+
+void Nixie_antipoison_check_schedule(RTC_TimeTypeDef *_local_time)
+{
+  uint16_t now = _local_time->Hours * 60 + _local_time->Minutes;
+
+  // Check if the scheduled minute is reached
+  if ((Config.antipoison_hour == ANTIPOISON_HOURLY || _local_time->Hours == Config.antipoison_hour) &&
+      _local_time->Minutes == Config.antipoison_minute) {
+    // Trigger only once in the scheduled minute
+    if (Nixie_antipoison_last_run != now) {
+      Nixie_antipoison_last_run = now;
+      Nixie_antipoison_requested = 1;
+    }
+  }
+}
+
+
+
+
+
+void Nixie_antipoison_request()
+{
+  Nixie_antipoison_requested = 1;
+}
+
+
+
+
+
+void Nixie_antipoison_dwell(uint8_t _tube, uint16_t *_dwell)
+{
+  uint32_t usage[NIXIE_DIGITS];
+  uint32_t weight[NIXIE_DIGITS];
+  uint32_t max_usage = 0;
+  uint64_t weight_sum = 0;
+  uint16_t extra = ANTIPOISON_CYCLE_TICKS - (NIXIE_DIGITS * ANTIPOISON_DWELL_MIN_TICKS);
+  uint16_t assigned = 0;
+  uint8_t heaviest = 0;
+
+  // Get the usage of each cathode of the tube
+  for (uint8_t d = 0; d < NIXIE_DIGITS; d++) {
+    usage[d] = Nixie_antipoison_usage(_tube, d);
+    if (usage[d] > max_usage) {
+      max_usage = usage[d];
+    }
+  }
+
+  // The less a cathode was used, the heavier its weight. The offset keeps
+  // small differences between similar cathodes from dominating the split.
+  for (uint8_t d = 0; d < NIXIE_DIGITS; d++) {
+    weight[d] = (max_usage - usage[d]) + (max_usage / NIXIE_DIGITS) + 1;
+    weight_sum += weight[d];
+    if (weight[d] > weight[heaviest]) {
+      heaviest = d;
+    }
+  }
+
+  // Split the extra ticks proportionally to the weights
+  for (uint8_t d = 0; d < NIXIE_DIGITS; d++) {
+    _dwell[d] = ANTIPOISON_DWELL_MIN_TICKS + (uint16_t) (((uint64_t) extra * weight[d]) / weight_sum);
+    assigned += _dwell[d];
+  }
+
+  // Give the rounding leftover to the least used cathode
+  _dwell[heaviest] += ANTIPOISON_CYCLE_TICKS - assigned;
+}
+
+
+
+
+
+uint16_t Nixie_antipoison_plan()
+{
+  uint16_t dwell[NIXIE_TUBES][NIXIE_DIGITS];
+  uint16_t segment_end[NIXIE_TUBES];
+  uint8_t position[NIXIE_TUBES];
+  uint8_t digits[NIXIE_TUBES];
+  uint16_t now = 0;
+  uint16_t length = 0;
+
+  // Compute the dwell of every cathode, each tube sums to ANTIPOISON_CYCLE_TICKS
+  for (uint8_t t = 0; t < NIXIE_TUBES; t++) {
+    Nixie_antipoison_dwell(t, dwell[t]);
+    position[t] = 0;
+    segment_end[t] = dwell[t][t % NIXIE_DIGITS];
+  }
+
+  // Merge the six timelines: a new frame starts whenever any tube changes digit
+  while (now < ANTIPOISON_CYCLE_TICKS && length < ANTIPOISON_MAX_FRAMES) {
+    uint16_t next = ANTIPOISON_CYCLE_TICKS;
+
+    for (uint8_t t = 0; t < NIXIE_TUBES; t++) {
+      // Tubes start from different cathodes to spread the sequence
+      digits[t] = (position[t] + t) % NIXIE_DIGITS;
+      if (segment_end[t] < next) {
+        next = segment_end[t];
+      }
+    }
+
+    // Store the frame if it lasts at least one tick
+    if (next > now) {
+      Nixie_encode_frame(digits, Nixie_antipoison_frames[length].spi);
+      Nixie_antipoison_frames[length].ticks = next - now;
+      length++;
+    }
+    now = next;
+
+    // Advance the tubes whose cathode is done
+    for (uint8_t t = 0; t < NIXIE_TUBES; t++) {
+      if (segment_end[t] == now && position[t] < NIXIE_DIGITS - 1) {
+        position[t]++;
+        segment_end[t] += dwell[t][(position[t] + t) % NIXIE_DIGITS];
+      }
+    }
+  }
+
+  return(length);
+}
+
+
+
+
+
+void Nixie_antipoison_process()
+{
+  // Run only when requested and the display is showing the time. With the
+  // tubes dark (night schedule) the run waits for them to be lit again.
+  if (Nixie_antipoison_requested == 0 || Nixie_sequence_active() || !Nixie_is_lit()) {
+    return;
+  }
+  Nixie_antipoison_requested = 0;
+
+  // Build the frame table on the fast clock and hand it to the display tick
+  Clock_burst_begin();
+  uint16_t length = Nixie_antipoison_plan();
+  Clock_burst_end();
+  Nixie_sequence_start(Nixie_antipoison_frames, length);
+}
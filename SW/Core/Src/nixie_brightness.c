@@ -0,0 +1,189 @@
+/**
+  ******************************************************************************
+  * @file           : nixie_brightness.c
+  * @brief          : Gamma corrected, slewed brightness on the TIM1 PWM
+  ******************************************************************************
+  * @attention
+  *
+  * Copyright (c) 2023 Nicolò Campanini.
+  * All rights reserved.
+  *
+  * This software is licensed under terms that can be found in the LICENSE file
+  * in the root directory of this software component.
+  * If no LICENSE file comes with this software, it is provided AS-IS.
+  *
+  ******************************************************************************
+  */
+
+#include "nixie_brightness.h"
+
+
+
+
+
+// Gamma 2.2 curve: duty cycle for each perceptual level, Q16 of the period
+const uint16_t Nixie_brightness_gamma[BRIGHTNESS_LEVELS] = {
+      0,     0,     2,     4,     7,    11,    17,    24,    32,    42,    53,    65,
+     79,    94,   111,   129,   148,   169,   192,   216,   242,   270,   299,   330,
+    362,   396,   432,   469,   508,   549,   591,   635,   681,   729,   779,   830,
+    883,   938,   995,  1053,  1113,  1175,  1239,  1305,  1373,  1443,  1514,  1587,
+   1663,  1740,  1819,  1900,  1983,  2068,  2155,  2243,  2334,  2427,  2521,  2618,
+   2717,  2817,  2920,  3024,  3131,  3240,  3350,  3463,  3578,  3694,  3813,  3934,
+   4057,  4182,  4309,  4438,  4570,  4703,  4838,  4976,  5115,  5257,  5401,  5547,
+   5695,  5845,  5998,  6152,  6309,  6468,  6629,  6792,  6957,  7124,  7294,  7466,
+   7640,  7816,  7994,  8175,  8358,  8543,  8730,  8919,  9111,  9305,  9501,  9699,
+   9900, 10102, 10307, 10515, 10724, 10936, 11150, 11366, 11585, 11806, 12029, 12254,
+  12482, 12712, 12944, 13179, 13416, 13655, 13896, 14140, 14386, 14635, 14885, 15138,
+  15394, 15652, 15912, 16174, 16439, 16706, 16975, 17247, 17521, 17798, 18077, 18358,
+  18642, 18928, 19216, 19507, 19800, 20095, 20393, 20694, 20996, 21301, 21609, 21919,
+  22231, 22546, 22863, 23182, 23504, 23829, 24156, 24485, 24817, 25151, 25487, 25826,
+  26168, 26512, 26858, 27207, 27558, 27912, 28268, 28627, 28988, 29351, 29717, 30086,
+  30457, 30830, 31206, 31585, 31966, 32349, 32735, 33124, 33514, 33908, 34304, 34702,
+  35103, 35507, 35913, 36321, 36732, 37146, 37562, 37981, 38402, 38825, 39252, 39680,
+  40112, 40546, 40982, 41421, 41862, 42306, 42753, 43202, 43654, 44108, 44565, 45025,
+  45487, 45951, 46418, 46888, 47360, 47835, 48313, 48793, 49275, 49761, 50249, 50739,
+  51232, 51728, 52226, 52727, 53230, 53736, 54245, 54756, 55270, 55787, 56306, 56828,
+  57352, 57879, 58409, 58941, 59476, 60014, 60554, 61097, 61642, 62190, 62741, 63295,
+  63851, 64410, 64971, 65535
+};
+
+// Global TIM handler for the PWM
+TIM_HandleTypeDef *Nixie_brightness_htim;
+// Global variable for PWM channel
+uint32_t Nixie_brightness_channel = 0;
+// Fade state, shared with the update interrupt
+volatile Nixie_brightness_struct_t Nixie_brightness_struct;
+
+
+
+
+
+void Nixie_brightness_init(TIM_HandleTypeDef *_htim, uint32_t _PWM_channel)
+{
+  // Save the PWM Timer handler and channel
+  Nixie_brightness_htim = _htim;
+  Nixie_brightness_channel = _PWM_channel;
+
+  // Start dark
+  Nixie_brightness_struct.level_q8 = 0;
+  Nixie_brightness_struct.target_q8 = 0;
+  Nixie_brightness_struct.step_q8 = 0;
+
+  // The compare register is preloaded: a new value is taken only at the
+  // update event, so a change never cuts a PWM period
+  __HAL_TIM_SET_COMPARE(Nixie_brightness_htim, Nixie_brightness_channel, 0);
+  // The update event (every repetition counter + 1 periods) runs the fade.
+  // SR is rc_w0: as __HAL_TIM_CLEAR_FLAG(), with the mask at 32 bits
+  Nixie_brightness_htim->Instance->SR = ~(uint32_t) TIM_FLAG_UPDATE;
+  __HAL_TIM_ENABLE_IT(Nixie_brightness_htim, TIM_IT_UPDATE);
+}
+
+
+
+
+
+void Nixie_brightness_set(uint8_t _level, uint16_t _fade_ms)
+{
+  uint16_t target_q8 = ((uint16_t) _level) << 8;
+  uint16_t distance = 0;
+  uint32_t updates = ((uint32_t) _fade_ms * BRIGHTNESS_UPDATE_HZ) / 1000;
+
+  __disable_irq();
+  // Distance to cover, in the perceptual domain so the fade looks linear
+  if (target_q8 > Nixie_brightness_struct.level_q8) {
+    distance = target_q8 - Nixie_brightness_struct.level_q8;
+  } else {
+    distance = Nixie_brightness_struct.level_q8 - target_q8;
+  }
+  // Zero fade time: jump at the next update event
+  if (updates == 0) {
+    Nixie_brightness_struct.step_q8 = 0xFFFF;
+  } else {
+    Nixie_brightness_struct.step_q8 = (distance + updates - 1) / updates;
+    if (Nixie_brightness_struct.step_q8 == 0) {
+      Nixie_brightness_struct.step_q8 = 1;
+    }
+  }
+  Nixie_brightness_struct.target_q8 = target_q8;
+  __enable_irq();
+}
+
+
+
+
+
+uint8_t Nixie_brightness_get()
+{
+  return(Nixie_brightness_struct.level_q8 >> 8);
+}
+
+
+
+
+
+uint8_t Nixie_brightness_fading()
+{
+  return(Nixie_brightness_struct.level_q8 != Nixie_brightness_struct.target_q8);
+}
+
+
+
+
+
+uint32_t Nixie_brightness_to_compare(uint16_t _level_q8, uint32_t _period)
+{
+  uint8_t index = _level_q8 >> 8;
+  uint32_t fraction = _level_q8 & 0xFF;
+  uint32_t duty = Nixie_brightness_gamma[index];
+  uint32_t compare = 0;
+
+  // Interpolate between two LUT entries, fades use the fractional levels
+  if (index < BRIGHTNESS_MAX) {
+    duty += ((Nixie_brightness_gamma[index + 1] - duty) * fraction) >> 8;
+  }
+  // Rescale to the actual period (it changes with the clock profile)
+  compare = (duty * _period) >> BRIGHTNESS_LUT_SHIFT;
+  // A lit level never rounds down to off
+  if (compare == 0 && _level_q8 > 0) {
+    compare = 1;
+  }
+  return(compare);
+}
+
+
+
+
+
+void Nixie_brightness_update()
+{
+  uint16_t level = Nixie_brightness_struct.level_q8;
+  uint16_t target = Nixie_brightness_struct.target_q8;
+  uint16_t step = Nixie_brightness_struct.step_q8;
+
+  if (level == target) {
+    return;
+  }
+
+  // Move toward the target without overshooting
+  if (level < target) {
+    level = (target - level > step) ? level + step : target;
+  } else {
+    level = (level - target > step) ? level - step : target;
+  }
+  Nixie_brightness_struct.level_q8 = level;
+
+  // Written in the preload register, applied at the next update event
+  Nixie_brightness_refresh();
+}
+
+
+
+
+
+void Nixie_brightness_refresh()
+{
+  // Compare value of the current level for the current period (e.g. after
+  // a clock profile change)
+  __HAL_TIM_SET_COMPARE(Nixie_brightness_htim, Nixie_brightness_channel,
+      Nixie_brightness_to_compare(Nixie_brightness_struct.level_q8, __HAL_TIM_GET_AUTORELOAD(Nixie_brightness_htim) + 1));
+}
@@ -16,6 +16,11 @@
   */
 
 #include "nixie_display.h"
+#include "power.h"
+#include "profiler.h"
+#include "latency_trace.h"
+#include "blackbox.h"
+#include "watchdog.h"
 
 
 
@@ -27,9 +32,13 @@ SPI_HandleTypeDef *Nixie_hspi;
 TIM_HandleTypeDef *Nixie_htim;
 // Global variable for PWM channel
 uint32_t Nixie_PWM_channel = 0;
+// HV supply state
+uint8_t Nixie_HV_enabled = 0;
 
 // Buffer for SPI communication 
 uint8_t Nixie_SPI_buffer[SPI_BUFFER_SIZE];
+// Frame table player
+Nixie_sequence_struct_t Nixie_sequence_struct;
 
 
 
@@ -52,6 +61,12 @@ void Nixie_init(SPI_HandleTypeDef *_hspi, TIM_HandleTypeDef *_htim, uint32_t _PW
   for (uint8_t i = 0; i < SPI_BUFFER_SIZE; i++) {
     Nixie_SPI_buffer[i] = 0;
   }
+  // No sequence playing at startup
+  Nixie_sequence_struct.frames = NULL;
+  Nixie_sequence_struct.length = 0;
+  Nixie_sequence_struct.index = 0;
+  Nixie_sequence_struct.ticks_left = 0;
+  Nixie_sequence_struct.active = 0;
 
   // Start the PWM generation
   HAL_TIM_PWM_Start(Nixie_htim, Nixie_PWM_channel);
@@ -67,6 +82,10 @@ void Nixie_enable_HV()
 {
   // Turn-off the GPIO
   HAL_GPIO_WritePin(HV_OFF_GPIO_Port, HV_OFF_Pin, GPIO_PIN_RESET);
+  Nixie_HV_enabled = 1;
+  Blackbox_log(BLACKBOX_HV, 1);
+  // The PWM and the display tick must keep running: no Stop mode
+  Power_lock(POWER_LOCK_DISPLAY);
 }
 
 
@@ -77,6 +96,10 @@ void Nixie_disable_HV()
 {
   // Turn-on the GPIO
   HAL_GPIO_WritePin(HV_OFF_GPIO_Port, HV_OFF_Pin, GPIO_PIN_SET);
+  Nixie_HV_enabled = 0;
+  Blackbox_log(BLACKBOX_HV, 0);
+  // Tubes off, the clocks can stop between the events
+  Power_unlock(POWER_LOCK_DISPLAY);
 }
 
 
@@ -85,10 +108,27 @@ void Nixie_disable_HV()
 
 void Nixie_update_display(uint8_t _hours, uint8_t _minutes, uint8_t _seconds)
 {
-  // Buffer variables for the two HV5530 drivers
-  uint32_t driver_1 = 0;
-  uint32_t driver_2 = 0;
+  uint8_t digits[NIXIE_TUBES];
+
+  PROF_START(PROF_FRAME_ENCODE);
+  // Split the values in one digit per tube
+  Nixie_time_to_digits(_hours, _minutes, _seconds, digits);
+  // Compose the SPI buffer
+  Nixie_encode_frame(digits, Nixie_SPI_buffer);
+  PROF_STOP(PROF_FRAME_ENCODE);
+  // Send data to screen
+  PROF_START(PROF_SPI_START);
+  Watchdog_expect(WATCHDOG_DISPLAY);
+  HAL_SPI_Transmit_IT(Nixie_hspi, Nixie_SPI_buffer, SPI_BUFFER_SIZE);
+  PROF_STOP(PROF_SPI_START);
+}
+
+
 
+
+
+void Nixie_time_to_digits(uint8_t _hours, uint8_t _minutes, uint8_t _seconds, uint8_t *_digits)
+{
   // Clamp values
   if (_hours > 99)
     _hours = 99;
@@ -99,87 +139,195 @@ void Nixie_update_display(uint8_t _hours, uint8_t _minutes, uint8_t _seconds)
   if (_seconds > 99)
 	  _seconds = 99;
 
-  uint8_t hours_dec = _hours / 10;
-  uint8_t hours_uni = _hours - (hours_dec * 10);
+  // Digits are ordered as the tubes, from N1 (hours dec) to N6 (seconds uni)
+  _digits[0] = _hours / 10;
+  _digits[1] = _hours - (_digits[0] * 10);
+
+  _digits[2] = _minutes / 10;
+  _digits[3] = _minutes - (_digits[2] * 10);
+
+  _digits[4] = _seconds / 10;
+  _digits[5] = _seconds - (_digits[4] * 10);
+}
+
+
 
-  uint8_t minutes_dec = _minutes / 10;
-  uint8_t minutes_uni = _minutes - (minutes_dec * 10);
 
-  uint8_t seconds_dec = _seconds / 10;
-  uint8_t seconds_uni = _seconds - (seconds_dec * 10);
+
+void Nixie_encode_frame(const uint8_t *_digits, uint8_t *_spi_buffer)
+{
+  // Buffer variables for the two HV5530 drivers
+  uint32_t driver_1 = 0;
+  uint32_t driver_2 = 0;
 
   // Driver 1 works with N1, N2, N3
   // N3 --> Minutes Dec --> 1 - 10
   // N2 --> Hours Uni --> 12 - 21
-  // N3 --> Hours Dec --> 22 - 31
+  // N1 --> Hours Dec --> 22 - 31
 
   // Driver 2 works with N4, N5, N6
   // N6 --> Seconds Uni --> 1 - 10
   // N5 --> Seconds Dec --> 11 - 20
   // N4 --> Minutes Uni --> 22 - 31
 
-  driver_1 = ((uint32_t) 1) << minutes_dec;
-  driver_1 = driver_1 | (((uint32_t) 1) << (hours_uni + 11));
-  driver_1 = driver_1 | (((uint32_t) 1) << (hours_dec + 21));
-
-  driver_2 = ((uint32_t) 1) << seconds_uni;
-  driver_2 = driver_2 | (((uint32_t) 1) << (seconds_dec + 10));
-  driver_2 = driver_2 | (((uint32_t) 1) << (minutes_uni + 21));
+  // A digit equal to NIXIE_BLANK (or out of range) leaves the tube off
+  if (_digits[0] < NIXIE_DIGITS)
+    driver_1 = driver_1 | (((uint32_t) 1) << (_digits[0] + 21));
+  if (_digits[1] < NIXIE_DIGITS)
+    driver_1 = driver_1 | (((uint32_t) 1) << (_digits[1] + 11));
+  if (_digits[2] < NIXIE_DIGITS)
+    driver_1 = driver_1 | (((uint32_t) 1) << _digits[2]);
+
+  if (_digits[3] < NIXIE_DIGITS)
+    driver_2 = driver_2 | (((uint32_t) 1) << (_digits[3] + 21));
+  if (_digits[4] < NIXIE_DIGITS)
+    driver_2 = driver_2 | (((uint32_t) 1) << (_digits[4] + 10));
+  if (_digits[5] < NIXIE_DIGITS)
+    driver_2 = driver_2 | (((uint32_t) 1) << _digits[5]);
 
   // Compose the SPI buffer
-  Nixie_SPI_buffer[0] = (uint8_t) (driver_2 >> 24);
-  Nixie_SPI_buffer[1] = (uint8_t) (driver_2 >> 16);
-  Nixie_SPI_buffer[2] = (uint8_t) (driver_2 >> 8);
-  Nixie_SPI_buffer[3] = (uint8_t) (driver_2);
+  _spi_buffer[0] = (uint8_t) (driver_2 >> 24);
+  _spi_buffer[1] = (uint8_t) (driver_2 >> 16);
+  _spi_buffer[2] = (uint8_t) (driver_2 >> 8);
+  _spi_buffer[3] = (uint8_t) (driver_2);
+
+  _spi_buffer[4] = (uint8_t) (driver_1 >> 24);
+  _spi_buffer[5] = (uint8_t) (driver_1 >> 16);
+  _spi_buffer[6] = (uint8_t) (driver_1 >> 8);
+  _spi_buffer[7] = (uint8_t) (driver_1);
+}
 
-  Nixie_SPI_buffer[4] = (uint8_t) (driver_1 >> 24);
-  Nixie_SPI_buffer[5] = (uint8_t) (driver_1 >> 16);
-  Nixie_SPI_buffer[6] = (uint8_t) (driver_1 >> 8);
-  Nixie_SPI_buffer[7] = (uint8_t) (driver_1);
 
+
+
+
+void Nixie_decode_frame(const uint8_t *_spi_buffer, uint8_t *_digits)
+{
+  // Rebuild the two HV5530 driver words
+  uint32_t driver_2 = ((uint32_t) _spi_buffer[0] << 24) | ((uint32_t) _spi_buffer[1] << 16) |
+                      ((uint32_t) _spi_buffer[2] << 8) | (uint32_t) _spi_buffer[3];
+  uint32_t driver_1 = ((uint32_t) _spi_buffer[4] << 24) | ((uint32_t) _spi_buffer[5] << 16) |
+                      ((uint32_t) _spi_buffer[6] << 8) | (uint32_t) _spi_buffer[7];
+  // Same tube order and bit positions as Nixie_encode_frame
+  uint32_t fields[NIXIE_TUBES] = {
+    driver_1 >> 21, driver_1 >> 11, driver_1,
+    driver_2 >> 21, driver_2 >> 10, driver_2
+  };
+
+  for (uint8_t t = 0; t < NIXIE_TUBES; t++) {
+    _digits[t] = NIXIE_BLANK;
+    for (uint8_t d = 0; d < NIXIE_DIGITS; d++) {
+      if (fields[t] & (((uint32_t) 1) << d)) {
+        _digits[t] = d;
+        break;
+      }
+    }
+  }
+}
+
+
+
+
+
+const uint8_t *Nixie_get_framebuffer()
+{
+  return(Nixie_SPI_buffer);
+}
+
+
+
+
+
+uint8_t Nixie_is_lit()
+{
+  // The tubes are lit only with the HV on and a non-zero PWM duty cycle
+  return(Nixie_HV_enabled && __HAL_TIM_GET_COMPARE(Nixie_htim, Nixie_PWM_channel) > 0);
+}
+
+
+
+
+
+void Nixie_send_frame(const uint8_t *_spi_buffer)
+{
+  // Copy the precomputed frame, the table may be rebuilt while SPI is busy
+  for (uint8_t i = 0; i < SPI_BUFFER_SIZE; i++) {
+    Nixie_SPI_buffer[i] = _spi_buffer[i];
+  }
   // Send data to screen
+  PROF_START(PROF_SPI_START);
+  Watchdog_expect(WATCHDOG_DISPLAY);
   HAL_SPI_Transmit_IT(Nixie_hspi, Nixie_SPI_buffer, SPI_BUFFER_SIZE);
+  PROF_STOP(PROF_SPI_START);
 }
 
 
 
 
 
-void Nixie_set_brightness(uint8_t _brightness)
+void Nixie_sequence_start(const Nixie_frame_t *_frames, uint16_t _length)
 {
-  // Clamp brightness value
-  if (_brightness > 99)
-    _brightness = 99;
-  // Set the PWM register
-  __HAL_TIM_SET_COMPARE(Nixie_htim, Nixie_PWM_channel, _brightness);
+  // Nothing to play
+  if (_frames == NULL || _length == 0) {
+    return;
+  }
+  // The display tick steps the player from PendSV: the table is swapped
+  // under PRIMASK, so that it never sees half of the new one
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  Nixie_sequence_struct.frames = _frames;
+  Nixie_sequence_struct.length = _length;
+  Nixie_sequence_struct.index = 0;
+  Nixie_sequence_struct.ticks_left = _frames[0].ticks;
+  // Arm the player, the next display tick will show the first frame
+  Nixie_sequence_struct.active = 1;
+  __set_PRIMASK(primask);
 }
 
 
 
 
 
-Nixie_mode_enum_t Nixie_get_mode() 
+void Nixie_sequence_stop()
 {
-  // Variabile statica per tenere traccia delle chiamate in modalità scramble
-  static int scramble_calls_left = 0;
+  Nixie_sequence_struct.active = 0;
+}
+
+
 
-  // Se ci sono ancora chiamate in modalità scramble, decrementa il contatore e ritorna SCRAMBLE
-  if (scramble_calls_left > 0) {
-      scramble_calls_left--;
-      return SCRAMBLE;
-  }
 
-  // Genera un numero casuale tra 0 e RANDOM_RANGE
-  int random_number = rand() % RANDOM_RANGE;
 
-  // Se il numero è minore di SCRAMBLE_PROBABILITY, imposta il contatore a SCRAMBLE_CALLS e ritorna SCRAMBLE
-  // Altrimenti, ritorna NORMAL
-  if (random_number < SCRAMBLE_PROBABILITY) {
-      scramble_calls_left = SCRAMBLE_CALLS;
-      return SCRAMBLE;
-  } else {
-      return NORMAL;
+uint8_t Nixie_sequence_active()
+{
+  return(Nixie_sequence_struct.active);
+}
+
+
+
+
+
+uint8_t Nixie_sequence_step()
+{
+  // Return zero if no sequence is playing, the caller shows the time
+  if (Nixie_sequence_struct.active == 0) {
+    return 0;
+  }
+
+  // Skip the frames that are already consumed
+  while (Nixie_sequence_struct.ticks_left == 0) {
+    Nixie_sequence_struct.index++;
+    if (Nixie_sequence_struct.index >= Nixie_sequence_struct.length) {
+      Nixie_sequence_struct.active = 0;
+      return 0;
+    }
+    Nixie_sequence_struct.ticks_left = Nixie_sequence_struct.frames[Nixie_sequence_struct.index].ticks;
   }
+
+  // Send the current frame and consume one tick
+  Nixie_send_frame(Nixie_sequence_struct.frames[Nixie_sequence_struct.index].spi);
+  Nixie_sequence_struct.ticks_left--;
+
+  return 1;
 }
 
 
@@ -189,24 +337,17 @@ Nixie_mode_enum_t Nixie_get_mode()
 void HAL_SPI_TxCpltCallback(SPI_HandleTypeDef *hspi)
 {
 	if (hspi == Nixie_hspi) {
+    PROF_START(PROF_LATCH);
     // Toggle the Latch pin (multiple times to have correct timing)
 		HAL_GPIO_WritePin(LATCH_EN_GPIO_Port, LATCH_EN_Pin, GPIO_PIN_SET);
 		HAL_GPIO_WritePin(LATCH_EN_GPIO_Port, LATCH_EN_Pin, GPIO_PIN_SET);
 		HAL_GPIO_WritePin(LATCH_EN_GPIO_Port, LATCH_EN_Pin, GPIO_PIN_SET);
 		HAL_GPIO_WritePin(LATCH_EN_GPIO_Port, LATCH_EN_Pin, GPIO_PIN_RESET);
+    PROF_STOP(PROF_LATCH);
+    // The digits are on the tubes now
+    Trace_latch();
+    Watchdog_done(WATCHDOG_DISPLAY);
 	}
 }
 
 
-
-
-
-void Nixie_get_random(uint8_t *_value_h, uint8_t *_value_m, uint8_t *_value_s)
-{
-  // Generate random values
-  *_value_h = rand() % 100;
-  *_value_m = rand() % 100;
-  *_value_s = rand() % 100;
-}
-
-
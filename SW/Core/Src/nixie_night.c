@@ -0,0 +1,502 @@
+/**
+  ******************************************************************************
+  * @file           : nixie_night.c
+  * @brief          : Night schedule of the HV supply with brightness ramps
+  ******************************************************************************
+  * @attention
+  *
+  * Copyright (c) 2023 Nicolò Campanini.
+  * All rights reserved.
+  *
+  * This software is licensed under terms that can be found in the LICENSE file
+  * in the root directory of this software component.
+  * If no LICENSE file comes with this software, it is provided AS-IS.
+  *
+  ******************************************************************************
+  */
+
+#include "nixie_night.h"
+#include "nixie_brightness.h"
+#include "nixie_ambient.h"
+#include "config.h"
+#include "kv_store.h"
+#include "math.h"
+#include <string.h>
+
+
+
+
+
+#define NIGHT_DEG_TO_RAD 0.01745329252f
+
+// Console names, index of the weekday and of Nixie_night_edge_type_t
+const char *const Nixie_night_day_names[NIGHT_DAYS] = {"sun", "mon", "tue", "wed", "thu", "fri", "sat"};
+const char *const Nixie_night_edge_names[] = {"fixed", "sunrise", "sunset"};
+const char *const Nixie_night_state_names[] = {"on", "ramp_down", "off", "ramp_up"};
+
+// Global RTC handler for the backup register
+RTC_HandleTypeDef *Nixie_night_hrtc;
+// Schedule, changed at run time with Nixie_night_set_config()
+Nixie_night_config_t Nixie_night_config;
+Nixie_night_state_t Nixie_night_state = NIGHT_ON;
+// Set by the display tick at each new local minute
+volatile uint8_t Nixie_night_minute_pending = 0;
+volatile uint16_t Nixie_night_minute = 0;
+volatile uint16_t Nixie_night_day_of_year = 0;
+volatile uint8_t Nixie_night_weekday_now = 0;
+volatile int16_t Nixie_night_utc_offset = 0;
+uint8_t Nixie_night_last_minute = 0xFF;
+// Result of the last evaluation of the schedule
+uint8_t Nixie_night_wanted_on = 1;
+// Brightness to restore at the ramp up
+uint8_t Nixie_night_saved_level = BRIGHTNESS_DEFAULT;
+uint8_t Nixie_night_saved_ambient = 0;
+// Sunrise and sunset of the cached day (-1 = the sun doesn't rise/set)
+uint16_t Nixie_night_sun_day = 0xFFFF;
+int16_t Nixie_night_sunrise = -1;
+int16_t Nixie_night_sunset = -1;
+uint32_t Nixie_night_saved_minutes = 0;
+
+
+
+
+
+void Nixie_night_init(RTC_HandleTypeDef *_hrtc)
+{
+  Nixie_night_config_t saved;
+  uint8_t valid = 1;
+
+  Nixie_night_hrtc = _hrtc;
+
+  // Same window every day
+  Nixie_night_config.enabled = 1;
+  for (uint8_t d = 0; d < NIGHT_DAYS; d++) {
+    Nixie_night_config.days[d].enabled = 1;
+    Nixie_night_config.days[d].on.type = NIGHT_EDGE_FIXED;
+    Nixie_night_config.days[d].on.minutes = Config.night_on_minute;
+    Nixie_night_config.days[d].off.type = NIGHT_EDGE_FIXED;
+    Nixie_night_config.days[d].off.minutes = Config.night_off_minute;
+  }
+
+  // Windows of each weekday from the store (KV_init() before), if sane
+  if (KV_get(KV_KEY_NIGHT, &saved, sizeof(saved)) == sizeof(saved)) {
+    for (uint8_t d = 0; d < NIGHT_DAYS; d++) {
+      valid &= Nixie_night_edge_valid(&saved.days[d].on) && Nixie_night_edge_valid(&saved.days[d].off);
+    }
+    if (valid) {
+      Nixie_night_config = saved;
+    }
+  }
+
+  // Start on: the first minute of the schedule decides
+  Nixie_night_state = NIGHT_ON;
+  Nixie_night_wanted_on = 1;
+  Nixie_night_minute_pending = 0;
+  Nixie_night_last_minute = 0xFF;
+  Nixie_night_sun_day = 0xFFFF;
+  Nixie_night_saved_minutes = HAL_RTCEx_BKUPRead(Nixie_night_hrtc, NIGHT_BKP_SAVED);
+}
+
+
+
+
+
+uint8_t Nixie_night_weekday(uint16_t _year, uint8_t _month, uint8_t _day)
+{
+  // Sakamoto's method, 0 = Sunday
+  static const uint8_t offset[12] = {0, 3, 2, 5, 0, 3, 5, 1, 4, 6, 2, 4};
+
+  if (_month < 3) {
+    _year -= 1;
+  }
+  return((_year + _year / 4 - _year / 100 + _year / 400 + offset[_month - 1] + _day) % 7);
+}
+
+
+
+
+
+uint16_t Nixie_night_day_of_year_from(uint16_t _year, uint8_t _month, uint8_t _day)
+{
+  static const uint16_t before[12] = {0, 31, 59, 90, 120, 151, 181, 212, 243, 273, 304, 334};
+  uint8_t leap = (_year % 4 == 0 && _year % 100 != 0) || (_year % 400 == 0);
+
+  return(before[_month - 1] + _day + ((leap && _month > 2) ? 1 : 0));
+}
+
+
+
+
+
+int16_t Nixie_night_sun_minute(uint16_t _day_of_year, uint8_t _rising, int16_t _utc_offset_min)
+{
+  // Almanac for Computers (1990) sunrise/sunset algorithm, ~1 minute accuracy
+  float latitude = Config.latitude_cdeg / 100.0f;
+  float lng_hour = Config.longitude_cdeg / 100.0f / 15.0f;
+  float t = _day_of_year + (((_rising ? 6.0f : 18.0f) - lng_hour) / 24.0f);
+
+  // Sun mean anomaly and true longitude
+  float m = (0.9856f * t) - 3.289f;
+  float l = m + (1.916f * sinf(m * NIGHT_DEG_TO_RAD)) + (0.020f * sinf(2 * m * NIGHT_DEG_TO_RAD)) + 282.634f;
+  l = fmodf(l + 360.0f, 360.0f);
+
+  // Right ascension, in the same quadrant as l, in hours
+  float ra = atanf(0.91764f * tanf(l * NIGHT_DEG_TO_RAD)) / NIGHT_DEG_TO_RAD;
+  ra = fmodf(ra + 360.0f, 360.0f);
+  ra += (floorf(l / 90.0f) - floorf(ra / 90.0f)) * 90.0f;
+  ra /= 15.0f;
+
+  // Declination and local hour angle
+  float sin_dec = 0.39782f * sinf(l * NIGHT_DEG_TO_RAD);
+  float cos_dec = cosf(asinf(sin_dec));
+  float cos_h = (cosf(NIGHT_ZENITH * NIGHT_DEG_TO_RAD) - (sin_dec * sinf(latitude * NIGHT_DEG_TO_RAD))) /
+                (cos_dec * cosf(latitude * NIGHT_DEG_TO_RAD));
+  if (cos_h > 1.0f || cos_h < -1.0f) {
+    return(-1);
+  }
+  float h = acosf(cos_h) / NIGHT_DEG_TO_RAD;
+  if (_rising) {
+    h = 360.0f - h;
+  }
+  h /= 15.0f;
+
+  // Local mean time, then UTC, then local minute of the day
+  float ut = h + ra - (0.06571f * t) - 6.622f - lng_hour;
+  int32_t minute = (int32_t) (ut * 60.0f + 0.5f) + _utc_offset_min;
+  minute %= 1440;
+  if (minute < 0) {
+    minute += 1440;
+  }
+  return(minute);
+}
+
+
+
+
+
+int16_t Nixie_night_edge_minute(Nixie_night_edge_t *_edge)
+{
+  int32_t minute = _edge->minutes;
+
+  if (_edge->type == NIGHT_EDGE_FIXED) {
+    return(minute);
+  }
+  if (_edge->type == NIGHT_EDGE_SUNRISE) {
+    if (Nixie_night_sunrise < 0) {
+      return(-1);
+    }
+    minute += Nixie_night_sunrise;
+  } else {
+    if (Nixie_night_sunset < 0) {
+      return(-1);
+    }
+    minute += Nixie_night_sunset;
+  }
+  minute %= 1440;
+  if (minute < 0) {
+    minute += 1440;
+  }
+  return(minute);
+}
+
+
+
+
+
+uint8_t Nixie_night_evaluate()
+{
+  Nixie_night_window_t *window = &Nixie_night_config.days[Nixie_night_weekday_now];
+  uint16_t now = Nixie_night_minute;
+
+  if (Nixie_night_config.enabled == 0 || window->enabled == 0) {
+    return(1);
+  }
+
+  // Sun times once per day
+  if (Nixie_night_sun_day != Nixie_night_day_of_year) {
+    Nixie_night_sun_day = Nixie_night_day_of_year;
+    Nixie_night_sunrise = Nixie_night_sun_minute(Nixie_night_day_of_year, 1, Nixie_night_utc_offset);
+    Nixie_night_sunset = Nixie_night_sun_minute(Nixie_night_day_of_year, 0, Nixie_night_utc_offset);
+  }
+
+  int16_t on = Nixie_night_edge_minute(&window->on);
+  int16_t off = Nixie_night_edge_minute(&window->off);
+  // No sunrise or sunset (polar day/night): keep the tubes on
+  if (on < 0 || off < 0) {
+    return(1);
+  }
+
+  if (on <= off) {
+    return(now >= on && now < off);
+  }
+  // Window across midnight
+  return(now >= on || now < off);
+}
+
+
+
+
+
+void Nixie_night_check_schedule(RTC_TimeTypeDef *_local_time, RTC_DateTypeDef *_local_date, int16_t _utc_offset_min)
+{
+  // Called by the display tick, the work is done in Nixie_night_process()
+  if (_local_time->Minutes == Nixie_night_last_minute) {
+    return;
+  }
+  Nixie_night_last_minute = _local_time->Minutes;
+
+  Nixie_night_minute = _local_time->Hours * 60 + _local_time->Minutes;
+  Nixie_night_day_of_year = Nixie_night_day_of_year_from(2000 + _local_date->Year, _local_date->Month, _local_date->Date);
+  Nixie_night_weekday_now = Nixie_night_weekday(2000 + _local_date->Year, _local_date->Month, _local_date->Date);
+  Nixie_night_utc_offset = _utc_offset_min;
+  Nixie_night_minute_pending = 1;
+}
+
+
+
+
+
+void Nixie_night_ramp_down()
+{
+  Nixie_ambient_config_t ambient;
+
+  // Remember the brightness (not a level in the middle of a ramp up), and
+  // stop the ambient light from driving it
+  Nixie_ambient_get_config(&ambient);
+  if (Nixie_night_state == NIGHT_ON) {
+    Nixie_night_saved_ambient = ambient.enabled;
+    Nixie_night_saved_level = Nixie_brightness_get();
+  }
+  ambient.enabled = 0;
+  Nixie_ambient_set_config(&ambient);
+
+  Nixie_brightness_set(0, NIGHT_RAMP_MS);
+  Nixie_night_state = NIGHT_RAMP_DOWN;
+}
+
+
+
+
+
+void Nixie_night_ramp_up()
+{
+  Nixie_ambient_config_t ambient;
+
+  // HV first, the tubes light up from zero
+  if (Nixie_night_state == NIGHT_OFF) {
+    Nixie_brightness_set(0, 0);
+    Nixie_enable_HV();
+  }
+
+  if (Nixie_night_saved_ambient) {
+    // The ambient light sets the level at its next value, with its fade
+    Nixie_ambient_get_config(&ambient);
+    ambient.enabled = 1;
+    Nixie_ambient_set_config(&ambient);
+  } else {
+    Nixie_brightness_set(Nixie_night_saved_level, NIGHT_RAMP_MS);
+  }
+  Nixie_night_state = NIGHT_RAMP_UP;
+}
+
+
+
+
+
+void Nixie_night_process()
+{
+  // New minute: evaluate the schedule and count the saved tube time
+  if (Nixie_night_minute_pending) {
+    Nixie_night_minute_pending = 0;
+    Nixie_night_wanted_on = Nixie_night_evaluate();
+
+    if (Nixie_night_state == NIGHT_OFF) {
+      Nixie_night_saved_minutes += NIXIE_TUBES;
+      HAL_RTCEx_BKUPWrite(Nixie_night_hrtc, NIGHT_BKP_SAVED, Nixie_night_saved_minutes);
+    }
+  }
+
+  switch (Nixie_night_state) {
+    case NIGHT_ON:
+      if (!Nixie_night_wanted_on) {
+        Nixie_night_ramp_down();
+      }
+      break;
+
+    case NIGHT_RAMP_DOWN:
+      if (Nixie_night_wanted_on) {
+        // Back on before the end of the ramp
+        Nixie_night_ramp_up();
+      } else if (!Nixie_brightness_fading()) {
+        // Dark: cut the HV
+        Nixie_disable_HV();
+        Nixie_night_state = NIGHT_OFF;
+      }
+      break;
+
+    case NIGHT_OFF:
+      if (Nixie_night_wanted_on) {
+        Nixie_night_ramp_up();
+      }
+      break;
+
+    case NIGHT_RAMP_UP:
+      if (!Nixie_night_wanted_on) {
+        Nixie_night_ramp_down();
+      } else if (!Nixie_brightness_fading()) {
+        Nixie_night_state = NIGHT_ON;
+      }
+      break;
+  }
+}
+
+
+
+
+
+void Nixie_night_get_config(Nixie_night_config_t *_config)
+{
+  *_config = Nixie_night_config;
+}
+
+
+
+
+
+void Nixie_night_set_config(Nixie_night_config_t *_config)
+{
+  Nixie_night_config = *_config;
+  // Sunrise/sunset and the window are evaluated again at the next process
+  Nixie_night_sun_day = 0xFFFF;
+  Nixie_night_minute_pending = (Nixie_night_last_minute != 0xFF);
+}
+
+
+
+
+
+HAL_StatusTypeDef Nixie_night_save()
+{
+  // The whole schedule as one record: unchanged, it costs no write
+  return(KV_set(KV_KEY_NIGHT, &Nixie_night_config, sizeof(Nixie_night_config)));
+}
+
+
+
+
+
+uint8_t Nixie_night_edge_valid(const Nixie_night_edge_t *_edge)
+{
+  // Minute of the day, or an offset of up to half a day from the sun
+  switch (_edge->type) {
+    case NIGHT_EDGE_FIXED:
+      return(_edge->minutes >= 0 && _edge->minutes < 1440);
+    case NIGHT_EDGE_SUNRISE:
+    case NIGHT_EDGE_SUNSET:
+      return(_edge->minutes >= -NIGHT_SUN_OFFSET_MAX && _edge->minutes <= NIGHT_SUN_OFFSET_MAX);
+    default:
+      return(0);
+  }
+}
+
+
+
+
+
+uint8_t Nixie_night_parse_day(const char *_name, uint8_t *_day)
+{
+  // "sun".."sat", 0 returned for another name
+  for (uint8_t d = 0; d < NIGHT_DAYS; d++) {
+    if (strcmp(_name, Nixie_night_day_names[d]) == 0) {
+      *_day = d;
+      return(1);
+    }
+  }
+  return(0);
+}
+
+
+
+
+
+uint8_t Nixie_night_parse_edge(const char *_name, Nixie_night_edge_type_t *_type)
+{
+  // "fixed", "sunrise" or "sunset", 0 returned for another name
+  for (uint8_t e = NIGHT_EDGE_FIXED; e <= NIGHT_EDGE_SUNSET; e++) {
+    if (strcmp(_name, Nixie_night_edge_names[e]) == 0) {
+      *_type = (Nixie_night_edge_type_t) e;
+      return(1);
+    }
+  }
+  return(0);
+}
+
+
+
+
+
+Nixie_night_state_t Nixie_night_get_state()
+{
+  return(Nixie_night_state);
+}
+
+
+
+
+
+uint32_t Nixie_night_tube_minutes_saved()
+{
+  return(Nixie_night_saved_minutes);
+}
+
+
+
+
+
+char *Nixie_night_append_edge(char *_out, const Nixie_night_edge_t *_edge)
+{
+  // <type>:<minutes>, the minute of the day or the offset from the sun
+  _out = Text_append(_out, Nixie_night_edge_names[_edge->type]);
+  _out = Text_append(_out, ":");
+  return(Text_append_i32(_out, _edge->minutes));
+}
+
+
+
+
+
+void Nixie_night_dump(Text_write_t _write)
+{
+  // State, tube-minutes saved, sun times of the day (-1 = none or not yet
+  // known) and the window of each weekday:
+  //   night state=<on|ramp_down|off|ramp_up> saved_min=<tube-minutes> sunrise=<min> sunset=<min>
+  //   night <day> enabled=<0|1> on=<type>:<minutes> off=<type>:<minutes>
+  char line[80];
+  char *out = NULL;
+  Nixie_night_window_t *window = NULL;
+
+  out = Text_append(line, "night state=");
+  out = Text_append(out, Nixie_night_state_names[Nixie_night_state]);
+  out = Text_append(out, " saved_min=");
+  out = Text_append_u32(out, Nixie_night_saved_minutes);
+  out = Text_append(out, " sunrise=");
+  out = Text_append_i32(out, (Nixie_night_sun_day == 0xFFFF) ? -1 : Nixie_night_sunrise);
+  out = Text_append(out, " sunset=");
+  out = Text_append_i32(out, (Nixie_night_sun_day == 0xFFFF) ? -1 : Nixie_night_sunset);
+  out = Text_append(out, "\r\n");
+  _write(line, out - line);
+
+  for (uint8_t d = 0; d < NIGHT_DAYS; d++) {
+    window = &Nixie_night_config.days[d];
+    out = Text_append(line, "night ");
+    out = Text_append(out, Nixie_night_day_names[d]);
+    out = Text_append(out, " enabled=");
+    out = Text_append_u32(out, Nixie_night_config.enabled && window->enabled);
+    out = Text_append(out, " on=");
+    out = Nixie_night_append_edge(out, &window->on);
+    out = Text_append(out, " off=");
+    out = Nixie_night_append_edge(out, &window->off);
+    out = Text_append(out, "\r\n");
+    _write(line, out - line);
+  }
+}
@@ -0,0 +1,289 @@
+/**
+  ******************************************************************************
+  * @file           : nixie_usage.c
+  * @brief          : Per-cathode on-time accounting for the Nixie tubes
+  ******************************************************************************
+  * @attention
+  *
+  * Copyright (c) 2023 Nicolò Campanini.
+  * All rights reserved.
+  *
+  * This software is licensed under terms that can be found in the LICENSE file
+  * in the root directory of this software component.
+  * If no LICENSE file comes with this software, it is provided AS-IS.
+  *
+  ******************************************************************************
+  */
+
+#include "nixie_usage.h"
+#include "blackbox.h"
+
+
+
+#if USAGE_FLASH_PERIOD_MIN + USAGE_RETRY_MIN > 255
+#error "USAGE_FLASH_PERIOD_MIN must fit the one byte backup checkpoint"
+#endif
+
+
+
+
+// Global RTC handler, used for the backup registers
+RTC_HandleTypeDef *Nixie_usage_hrtc;
+// Global variable containing the on-time counters
+Nixie_usage_struct_t Nixie_usage_struct;
+// Set by the display tick, consumed by the main loop
+volatile uint8_t Nixie_usage_commit_requested = 0;
+
+
+
+
+
+void Nixie_usage_checkpoint()
+{
+  uint32_t packed[USAGE_BKP_COUNT] = {0};
+
+  // Pack the pending minutes, one byte per cathode
+  for (uint8_t i = 0; i < NIXIE_TUBES * NIXIE_DIGITS; i++) {
+    uint32_t minutes = Nixie_usage_struct.pending[i / NIXIE_DIGITS][i % NIXIE_DIGITS] / USAGE_TICKS_PER_MINUTE;
+    if (minutes > 0xFF) {
+      minutes = 0xFF;
+    }
+    packed[i / 4] |= minutes << ((i % 4) * 8);
+  }
+
+  // Write the backup registers
+  for (uint8_t i = 0; i < USAGE_BKP_COUNT; i++) {
+    HAL_RTCEx_BKUPWrite(Nixie_usage_hrtc, USAGE_BKP_FIRST + i, packed[i]);
+  }
+  HAL_RTCEx_BKUPWrite(Nixie_usage_hrtc, USAGE_BKP_MARKER, USAGE_BKP_MAGIC | (Nixie_usage_struct.sequence & 0xFFFF));
+}
+
+
+
+
+
+void Nixie_usage_init(RTC_HandleTypeDef *_hrtc)
+{
+  Nixie_usage_record_t record;
+
+  // Init the internal RTC handler
+  Nixie_usage_hrtc = _hrtc;
+  // Init the counters at zero
+  memset(&Nixie_usage_struct, 0, sizeof(Nixie_usage_struct));
+  Nixie_usage_commit_requested = 0;
+
+  // Load the counters from the store (KV_init() before)
+  if (KV_get(KV_KEY_USAGE, &record, sizeof(record)) == sizeof(record)) {
+    memcpy(Nixie_usage_struct.base, record.seconds, sizeof(Nixie_usage_struct.base));
+    Nixie_usage_struct.sequence = record.sequence;
+  }
+
+  // Restore the pending minutes only if they refer to the loaded record
+  if (HAL_RTCEx_BKUPRead(Nixie_usage_hrtc, USAGE_BKP_MARKER) == (USAGE_BKP_MAGIC | (Nixie_usage_struct.sequence & 0xFFFF))) {
+    for (uint8_t i = 0; i < NIXIE_TUBES * NIXIE_DIGITS; i++) {
+      uint32_t packed = HAL_RTCEx_BKUPRead(Nixie_usage_hrtc, USAGE_BKP_FIRST + (i / 4));
+      uint32_t minutes = (packed >> ((i % 4) * 8)) & 0xFF;
+      Nixie_usage_struct.pending[i / NIXIE_DIGITS][i % NIXIE_DIGITS] = minutes * USAGE_TICKS_PER_MINUTE;
+      Nixie_usage_struct.saturated += (minutes == 0xFF);
+    }
+  }
+  // A full byte held more than it could: the rest is lost
+  if (Nixie_usage_struct.saturated > 0) {
+    Blackbox_log(BLACKBOX_USAGE, USAGE_LOG_SATURATED | Nixie_usage_struct.saturated);
+  }
+
+  // Rewrite the checkpoint so that it matches the loaded record
+  Nixie_usage_checkpoint();
+}
+
+
+
+
+
+void Nixie_usage_tick()
+{
+  uint8_t digits[NIXIE_TUBES];
+
+  // Count the cathodes lit in the framebuffer at every tick: the frames of
+  // a sequence last one tick or a few, a sample per second would miss them
+  if (Nixie_is_lit()) {
+    Nixie_decode_frame(Nixie_get_framebuffer(), digits);
+    for (uint8_t t = 0; t < NIXIE_TUBES; t++) {
+      if (digits[t] < NIXIE_DIGITS) {
+        Nixie_usage_struct.pending[t][digits[t]]++;
+      }
+    }
+  }
+
+  if (++Nixie_usage_struct.ticks < NIXIE_TICKS_PER_SECOND) {
+    return;
+  }
+  Nixie_usage_struct.ticks = 0;
+
+  // Checkpoint to the backup registers once per minute
+  if (++Nixie_usage_struct.seconds < 60) {
+    return;
+  }
+  Nixie_usage_struct.seconds = 0;
+  Nixie_usage_checkpoint();
+
+  // Ask the main loop to commit to flash
+  if (++Nixie_usage_struct.minutes >= USAGE_FLASH_PERIOD_MIN) {
+    Nixie_usage_struct.minutes = 0;
+    Nixie_usage_commit_requested = 1;
+  }
+}
+
+
+
+
+
+void Nixie_usage_commit()
+{
+  Nixie_usage_record_t record;
+  uint32_t snapshot[NIXIE_TUBES][NIXIE_DIGITS];
+  HAL_StatusTypeDef status = HAL_OK;
+  uint8_t empty = 1;
+
+  // Snapshot the pending counters, the display tick keeps incrementing them
+  __disable_irq();
+  memcpy(snapshot, Nixie_usage_struct.pending, sizeof(snapshot));
+  __enable_irq();
+
+  // Build the record with the total on-time, whole seconds only: the
+  // rest of a second stays pending
+  record.sequence = Nixie_usage_struct.sequence + 1;
+  for (uint8_t t = 0; t < NIXIE_TUBES; t++) {
+    for (uint8_t d = 0; d < NIXIE_DIGITS; d++) {
+      snapshot[t][d] /= NIXIE_TICKS_PER_SECOND;
+      record.seconds[t][d] = Nixie_usage_struct.base[t][d] + snapshot[t][d];
+      if (snapshot[t][d]) {
+        empty = 0;
+      }
+    }
+  }
+
+  // Nothing to save, spare the flash
+  if (empty) {
+    return;
+  }
+
+  // Throttled or failed: the seconds stay pending and the commit is tried
+  // again soon, the checkpoint has room for USAGE_RETRY_MIN more. Logged
+  // at the first failure of a streak.
+  status = KV_set(KV_KEY_USAGE, &record, sizeof(record));
+  if (status != HAL_OK) {
+    Nixie_usage_struct.failures++;
+    if (!Nixie_usage_struct.failing) {
+      Nixie_usage_struct.failing = 1;
+      Blackbox_log(BLACKBOX_USAGE, status);
+    }
+    Nixie_usage_struct.minutes = USAGE_FLASH_PERIOD_MIN - USAGE_RETRY_MIN;
+    return;
+  }
+  Nixie_usage_struct.commits++;
+  Nixie_usage_struct.failing = 0;
+
+  // Move the committed seconds to the base and realign the checkpoint
+  __disable_irq();
+  for (uint8_t t = 0; t < NIXIE_TUBES; t++) {
+    for (uint8_t d = 0; d < NIXIE_DIGITS; d++) {
+      Nixie_usage_struct.base[t][d] = record.seconds[t][d];
+      Nixie_usage_struct.pending[t][d] -= snapshot[t][d] * NIXIE_TICKS_PER_SECOND;
+    }
+  }
+  Nixie_usage_struct.sequence = record.sequence;
+  Nixie_usage_checkpoint();
+  __enable_irq();
+}
+
+
+
+
+
+void Nixie_usage_process()
+{
+  if (Nixie_usage_commit_requested == 0) {
+    return;
+  }
+  Nixie_usage_commit_requested = 0;
+  Nixie_usage_commit();
+}
+
+
+
+
+
+uint32_t Nixie_usage_get(uint8_t _tube, uint8_t _digit)
+{
+  if (_tube >= NIXIE_TUBES || _digit >= NIXIE_DIGITS) {
+    return 0;
+  }
+  return(Nixie_usage_struct.base[_tube][_digit] +
+         Nixie_usage_struct.pending[_tube][_digit] / NIXIE_TICKS_PER_SECOND);
+}
+
+
+
+
+
+void Nixie_usage_read_all(uint32_t *_seconds)
+{
+  // Copy the counters as a NIXIE_TUBES x NIXIE_DIGITS table
+  for (uint8_t t = 0; t < NIXIE_TUBES; t++) {
+    for (uint8_t d = 0; d < NIXIE_DIGITS; d++) {
+      _seconds[t * NIXIE_DIGITS + d] = Nixie_usage_get(t, d);
+    }
+  }
+}
+
+
+
+
+
+uint32_t Nixie_usage_tube_total(uint8_t _tube)
+{
+  uint32_t total = 0;
+
+  for (uint8_t d = 0; d < NIXIE_DIGITS; d++) {
+    total += Nixie_usage_get(_tube, d);
+  }
+  return(total);
+}
+
+
+
+
+
+void Nixie_usage_dump(Text_write_t _write)
+{
+  // On-time of each cathode (s), then the flash commits:
+  //   usage tube<t> 0=<s> 1=<s> ... 9=<s>
+  //   usage commits=<n> failures=<n> saturated=<cathodes>
+  char line[160];
+  char *out = NULL;
+  uint32_t seconds[NIXIE_TUBES * NIXIE_DIGITS];
+
+  Nixie_usage_read_all(seconds);
+  for (uint8_t t = 0; t < NIXIE_TUBES; t++) {
+    out = Text_append(line, "usage tube");
+    out = Text_append_u32(out, t);
+    for (uint8_t d = 0; d < NIXIE_DIGITS; d++) {
+      out = Text_append(out, " ");
+      out = Text_append_u32(out, d);
+      out = Text_append(out, "=");
+      out = Text_append_u32(out, seconds[t * NIXIE_DIGITS + d]);
+    }
+    out = Text_append(out, "\r\n");
+    _write(line, out - line);
+  }
+
+  out = Text_append(line, "usage commits=");
+  out = Text_append_u32(out, Nixie_usage_struct.commits);
+  out = Text_append(out, " failures=");
+  out = Text_append_u32(out, Nixie_usage_struct.failures);
+  out = Text_append(out, " saturated=");
+  out = Text_append_u32(out, Nixie_usage_struct.saturated);
+  out = Text_append(out, "\r\n");
+  _write(line, out - line);
+}
@@ -0,0 +1,474 @@
+/**
+  ******************************************************************************
+  * @file           : power.c
+  * @brief          : Sleep/Stop power manager with state accounting
+  ******************************************************************************
+  * @attention
+  *
+  * Copyright (c) 2023 Nicolò Campanini.
+  * All rights reserved.
+  *
+  * This software is licensed under terms that can be found in the LICENSE file
+  * in the root directory of this software component.
+  * If no LICENSE file comes with this software, it is provided AS-IS.
+  *
+  ******************************************************************************
+  */
+
+#include "power.h"
+#include "cycle_counter.h"
+#include "cpu_load.h"
+#include "blackbox.h"
+
+
+
+
+
+// Global RTC handler, wakeup timer and Stop time measure
+RTC_HandleTypeDef *Power_hrtc;
+// Modules needing the clocks, and the enabled wake-up sources
+volatile uint32_t Power_locks = 0;
+uint32_t Power_wake_sources = POWER_WAKE_DEFAULT;
+// HAL tick until which Stop is not used
+volatile uint32_t Power_awake_until = 0;
+// Last state entered by the idle loop: the wake-up handlers run right
+// after Power_idle() returns, and still see POWER_STOP
+volatile Power_state_t Power_state = POWER_RUN;
+// Time accounting
+Power_stats_t Power_stats;
+uint32_t Power_last_cycles = 0;
+// Supply current of the current clock profile
+uint32_t Power_run_uA = POWER_RUN_UA;
+uint32_t Power_sleep_uA = POWER_SLEEP_UA;
+// Power_time_us() at the last exit from Stop
+volatile uint32_t Power_wake_us = 0;
+
+
+
+
+
+void Power_init(RTC_HandleTypeDef *_hrtc)
+{
+  // Power_locks is left as is, the display may already hold its lock
+  Power_hrtc = _hrtc;
+  Power_wake_sources = POWER_WAKE_DEFAULT;
+  Power_awake_until = HAL_GetTick();
+
+  Power_stats.run_us = 0;
+  Power_stats.sleep_us = 0;
+  Power_stats.charge_uAus = 0;
+  Power_stats.stop_us = 0;
+  Power_stats.stops = 0;
+  Power_stats.wakes_rtc = 0;
+  Power_stats.wakes_rx = 0;
+  Power_stats.wakes_pps = 0;
+  Cycles_init();
+  Power_last_cycles = Cycles_now();
+
+  // Flash in deep power down during Stop: a few us more to wake, much less current
+  HAL_PWREx_EnableFlashPowerDown();
+
+  // Periodic RTC wakeup, 1 Hz clock (ck_spre): harmless while running
+  HAL_RTCEx_SetWakeUpTimer_IT(Power_hrtc, POWER_RTC_WAKE_S - 1, RTC_WAKEUPCLOCK_CK_SPRE_16BITS);
+
+  // PB7 (USART1 RX, still in AF mode) on EXTI line 7, falling edge (start bit).
+  // The line is unmasked only while in Stop.
+  __HAL_RCC_SYSCFG_CLK_ENABLE();
+  SYSCFG->EXTICR[1] = (SYSCFG->EXTICR[1] & ~SYSCFG_EXTICR2_EXTI7) | SYSCFG_EXTICR2_EXTI7_PB;
+  EXTI->FTSR |= EXTI_FTSR_TR7;
+  EXTI->RTSR &= ~EXTI_RTSR_TR7;
+  EXTI->IMR &= ~EXTI_IMR_MR7;
+  EXTI->PR = EXTI_PR_PR7;
+  HAL_NVIC_SetPriority(EXTI9_5_IRQn, 5, 0);
+  HAL_NVIC_EnableIRQ(EXTI9_5_IRQn);
+}
+
+
+
+
+
+void Power_lock(uint32_t _lock)
+{
+  __disable_irq();
+  Power_locks |= _lock;
+  __enable_irq();
+}
+
+
+
+
+
+void Power_unlock(uint32_t _lock)
+{
+  __disable_irq();
+  Power_locks &= ~_lock;
+  __enable_irq();
+}
+
+
+
+
+
+void Power_hold(uint32_t _ms)
+{
+  uint32_t until = HAL_GetTick() + _ms;
+
+  // Only extend the awake window
+  if ((int32_t) (until - Power_awake_until) > 0) {
+    Power_awake_until = until;
+  }
+}
+
+
+
+
+
+void Power_set_wake_sources(uint32_t _sources)
+{
+  Power_wake_sources = _sources;
+}
+
+
+
+
+
+void Power_account_run()
+{
+  // Everything since the last call was run time, at the current clock
+  uint32_t now = Cycles_now();
+  uint32_t cycles_per_us = SystemCoreClock / 1000000;
+  uint32_t us = (now - Power_last_cycles) / cycles_per_us;
+
+  Power_stats.run_us += us;
+  Power_stats.charge_uAus += (uint64_t) us * Power_run_uA;
+  // Keep the remainder for the next call
+  Power_last_cycles += us * cycles_per_us;
+}
+
+
+
+
+
+void Power_set_currents(uint32_t _run_uA, uint32_t _sleep_uA)
+{
+  // Account the time so far with the old clock, then switch the currents
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  Power_account_run();
+  Power_run_uA = _run_uA;
+  Power_sleep_uA = _sleep_uA;
+  __set_PRIMASK(primask);
+}
+
+
+
+
+
+uint32_t Power_rtc_ms()
+{
+  // Time of day in ms from the shadow registers. SSR counts down from
+  // SynchPrediv; reading SSR locks TR until DR is read.
+  uint32_t ssr = Power_hrtc->Instance->SSR;
+  uint32_t tr = Power_hrtc->Instance->TR;
+  (void) Power_hrtc->Instance->DR;
+  uint32_t prediv = Power_hrtc->Init.SynchPrediv;
+
+  uint32_t hours = RTC_Bcd2ToByte((tr & (RTC_TR_HT | RTC_TR_HU)) >> RTC_TR_HU_Pos);
+  uint32_t minutes = RTC_Bcd2ToByte((tr & (RTC_TR_MNT | RTC_TR_MNU)) >> RTC_TR_MNU_Pos);
+  uint32_t seconds = RTC_Bcd2ToByte((tr & (RTC_TR_ST | RTC_TR_SU)) >> RTC_TR_SU_Pos);
+
+  return(((hours * 60 + minutes) * 60 + seconds) * 1000 + ((prediv - ssr) * 1000) / (prediv + 1));
+}
+
+
+
+
+
+uint32_t Power_time_us()
+{
+  // HAL tick and SysTick count: a microsecond time that goes on across the
+  // clock profiles (the SysTick is retimed) and across Stop (the HAL tick is
+  // moved forward by it). Wraps in 71 minutes, for differences only.
+  uint32_t ms = 0;
+  uint32_t count = 0;
+  uint32_t pending = 0;
+  uint32_t load = SysTick->LOAD;
+
+  do {
+    ms = HAL_GetTick();
+    count = SysTick->VAL;
+    pending = SCB->ICSR & SCB_ICSR_PENDSTSET_Msk;
+  } while (ms != HAL_GetTick());
+
+  // Reloaded with its handler not run yet: masked, or in a higher priority
+  if (pending && count > load / 2) {
+    ms++;
+  }
+  return(ms * 1000 + ((load - count) * 1000) / (load + 1));
+}
+
+
+
+
+
+uint32_t Power_last_wake_us()
+{
+  // The peripherals lost what came while in Stop, up to this time
+  return(Power_wake_us);
+}
+
+
+
+
+
+void Power_restore_clocks(uint32_t _source)
+{
+  // Direct register path, no HAL timeouts (the tick is suspended). Stop
+  // keeps the PLL configuration and the prescalers: only the oscillators
+  // are restarted and the system clock switched back from HSI.
+  if (_source == RCC_CFGR_SW_HSI) {
+    return;
+  }
+  if ((_source == RCC_CFGR_SW_HSE) || ((RCC->PLLCFGR & RCC_PLLCFGR_PLLSRC) == RCC_PLLCFGR_PLLSRC_HSE)) {
+    RCC->CR |= RCC_CR_HSEON;
+    while ((RCC->CR & RCC_CR_HSERDY) == 0) {
+    }
+  }
+  if (_source == RCC_CFGR_SW_PLL) {
+    RCC->CR |= RCC_CR_PLLON;
+    while ((RCC->CR & RCC_CR_PLLRDY) == 0) {
+    }
+  }
+  RCC->CFGR = (RCC->CFGR & ~RCC_CFGR_SW) | _source;
+  while ((RCC->CFGR & RCC_CFGR_SWS) != (_source << RCC_CFGR_SWS_Pos)) {
+  }
+}
+
+
+
+
+
+uint8_t Power_rtc_resync()
+{
+  // As HAL_RTC_WaitForSynchro(), whose HAL_GetTick() timeout can't expire
+  // here: the tick is suspended and PRIMASK is set
+  uint32_t limit = (SystemCoreClock / 1000000) * POWER_RSF_TIMEOUT_US;
+  uint32_t start = Cycles_now();
+
+  __HAL_RTC_WRITEPROTECTION_DISABLE(Power_hrtc);
+  Power_hrtc->Instance->ISR &= (uint32_t) RTC_RSF_MASK;
+  __HAL_RTC_WRITEPROTECTION_ENABLE(Power_hrtc);
+  while ((Power_hrtc->Instance->ISR & RTC_ISR_RSF) == 0) {
+    if (Cycles_now() - start > limit) {
+      return(0);
+    }
+    __NOP();
+  }
+  return(1);
+}
+
+
+
+
+
+void Power_enter_stop()
+{
+  // Clock source in use, Stop exits on HSI
+  uint32_t source = RCC->CFGR & RCC_CFGR_SW;
+  uint32_t before = 0;
+  uint32_t after = 0;
+
+  if (Power_wake_sources & POWER_WAKE_RX) {
+    EXTI->PR = EXTI_PR_PR7;
+    EXTI->IMR |= EXTI_IMR_MR7;
+  }
+
+  HAL_SuspendTick();
+  before = Power_rtc_ms();
+  Power_stats.stops++;
+  Power_state = POWER_STOP;
+
+  // Woken by any enabled EXTI line (RTC wakeup is line 22), even with PRIMASK set
+  HAL_PWR_EnterSTOPMode(PWR_LOWPOWERREGULATOR_ON, PWR_STOPENTRY_WFI);
+
+  // Restore the clocks before any interrupt handler runs
+  Power_restore_clocks(source);
+  EXTI->IMR &= ~EXTI_IMR_MR7;
+
+  // The calendar shadow registers are stale after Stop: resynchronize. A
+  // failing LSE never sets RSF: the wait is bounded on the cycle counter
+  // and the wakeup goes on with the old shadow values
+  if (Power_rtc_resync() == 0) {
+    Blackbox_log(BLACKBOX_RTC_SYNC, POWER_RSF_TIMEOUT_US);
+  }
+
+  // Account the Stop time and move the HAL tick forward by it
+  after = Power_rtc_ms();
+  if (after < before) {
+    after += 86400000;
+  }
+  Power_stats.stop_us += (uint64_t) (after - before) * 1000;
+  Load_account_stop(after - before);
+  uwTick += after - before;
+  HAL_ResumeTick();
+  Power_wake_us = Power_time_us();
+}
+
+
+
+
+
+void Power_idle()
+{
+  // Called by the scheduler with PRIMASK set and nothing to do
+  uint8_t load = Load_switch(LOAD_IDLE);
+  Power_account_run();
+
+  if (Power_locks == 0 && (int32_t) (HAL_GetTick() - Power_awake_until) >= 0) {
+    Power_enter_stop();
+  } else {
+    uint32_t start = Cycles_now();
+    Power_state = POWER_SLEEP;
+    __WFI();
+    uint32_t us = (Cycles_now() - start) / (SystemCoreClock / 1000000);
+    Power_stats.sleep_us += us;
+    Power_stats.charge_uAus += (uint64_t) us * Power_sleep_uA;
+  }
+
+  Power_last_cycles = Cycles_now();
+  Load_switch(load);
+}
+
+
+
+
+
+void Power_get_stats(Power_stats_t *_stats)
+{
+  uint32_t primask = __get_PRIMASK();
+
+  __disable_irq();
+  *_stats = Power_stats;
+  __set_PRIMASK(primask);
+}
+
+
+
+
+
+uint32_t Power_average_current_uA()
+{
+  Power_stats_t stats;
+  uint64_t stop_us = 0;
+  uint64_t total_us = 0;
+
+  Power_get_stats(&stats);
+  stop_us = stats.stop_us;
+  total_us = stats.run_us + stats.sleep_us + stop_us;
+  if (total_us == 0) {
+    return(Power_run_uA);
+  }
+
+  // Time weighted average of the per state currents
+  return((stats.charge_uAus + stop_us * POWER_STOP_UA) / total_us);
+}
+
+
+
+
+
+uint16_t Power_duty_permille()
+{
+  Power_stats_t stats;
+  uint64_t total_us = 0;
+
+  Power_get_stats(&stats);
+  total_us = stats.run_us + stats.sleep_us + stats.stop_us;
+  if (total_us == 0) {
+    return(1000);
+  }
+
+  // Fraction of time with the CPU active
+  return((stats.run_us * 1000) / total_us);
+}
+
+
+
+
+
+void Power_dump(Text_write_t _write)
+{
+  // Time per state (s), Stop entries and wake-ups, duty and estimate:
+  //   power run=<s> sleep=<s> stop=<s> stops=<count> rtc=<wakes> rx=<wakes> pps=<wakes>
+  //   power duty=<permille> avg=<uA>
+  // From the thread context only
+  char line[112];
+  char *out = NULL;
+  Power_stats_t stats;
+
+  Power_get_stats(&stats);
+  out = Text_append(line, "power run=");
+  out = Text_append_u32(out, (uint32_t) (stats.run_us / 1000000));
+  out = Text_append(out, " sleep=");
+  out = Text_append_u32(out, (uint32_t) (stats.sleep_us / 1000000));
+  out = Text_append(out, " stop=");
+  out = Text_append_u32(out, (uint32_t) (stats.stop_us / 1000000));
+  out = Text_append(out, " stops=");
+  out = Text_append_u32(out, stats.stops);
+  out = Text_append(out, " rtc=");
+  out = Text_append_u32(out, stats.wakes_rtc);
+  out = Text_append(out, " rx=");
+  out = Text_append_u32(out, stats.wakes_rx);
+  out = Text_append(out, " pps=");
+  out = Text_append_u32(out, stats.wakes_pps);
+  out = Text_append(out, "\r\n");
+  _write(line, out - line);
+
+  out = Text_append(line, "power duty=");
+  out = Text_append_u32(out, Power_duty_permille());
+  out = Text_append(out, " avg=");
+  out = Text_append_u32(out, Power_average_current_uA());
+  out = Text_append(out, "\r\n");
+  _write(line, out - line);
+}
+
+
+
+
+
+void HAL_RTCEx_WakeUpTimerEventCallback(RTC_HandleTypeDef *hrtc)
+{
+  if (hrtc == Power_hrtc && Power_state == POWER_STOP) {
+    // Let the display tick run once before going back to Stop
+    Power_stats.wakes_rtc++;
+    Power_hold(POWER_RTC_AWAKE_MS);
+  }
+}
+
+
+
+
+
+void Power_rx_wakeup()
+{
+  // Called from EXTI9_5_IRQHandler: the start bit woke the core from Stop
+  if (EXTI->PR & EXTI_PR_PR7) {
+    EXTI->PR = EXTI_PR_PR7;
+    Power_stats.wakes_rx++;
+    // The first bytes are lost, stay awake for the next burst
+    Power_hold(POWER_RX_AWAKE_MS);
+  }
+}
+
+
+
+
+
+#ifdef PPS_Pin
+void HAL_GPIO_EXTI_Callback(uint16_t GPIO_Pin)
+{
+  if (GPIO_Pin == PPS_Pin && Power_state == POWER_STOP) {
+    Power_stats.wakes_pps++;
+  }
+}
+#endif
@@ -0,0 +1,105 @@
+/**
+  ******************************************************************************
+  * @file           : prng.c
+  * @brief          : Small seedable xorshift32 pseudo random generator
+  ******************************************************************************
+  * @attention
+  *
+  * Copyright (c) 2023 Nicolò Campanini.
+  * All rights reserved.
+  *
+  * This software is licensed under terms that can be found in the LICENSE file
+  * in the root directory of this software component.
+  * If no LICENSE file comes with this software, it is provided AS-IS.
+  *
+  ******************************************************************************
+  */
+
+#include "prng.h"
+#include "cycle_counter.h"
+
+
+
+
+
+void PRNG_seed(PRNG_state_t *_prng, uint32_t _seed)
+{
+  // A zero state would lock xorshift at zero forever
+  if (_seed == 0) {
+    _seed = PRNG_DEFAULT_SEED;
+  }
+  _prng->state = _seed;
+}
+
+
+
+
+
+uint32_t PRNG_hardware_seed(ADC_HandleTypeDef *_hadc, RTC_HandleTypeDef *_hrtc)
+{
+#ifdef PRNG_DETERMINISTIC_SEED
+  // Same sequence at every boot, for tests
+  (void) _hadc;
+  (void) _hrtc;
+  return(PRNG_DETERMINISTIC_SEED);
+#else
+  uint32_t seed = 0;
+
+  // RTC sub-seconds: the boot time is not aligned to the RTC second
+  seed ^= _hrtc->Instance->SSR;
+  seed ^= Cycles_now();
+
+  // Collect the noisy LSB of a few ADC conversions
+  for (uint8_t i = 0; i < PRNG_ADC_SAMPLES; i++) {
+    HAL_ADC_Start(_hadc);
+    if (HAL_ADC_PollForConversion(_hadc, 1) == HAL_OK) {
+      seed = (seed << 2) ^ (seed >> 30) ^ (HAL_ADC_GetValue(_hadc) & 0x3);
+    }
+    HAL_ADC_Stop(_hadc);
+  }
+
+  // Final mix (murmur3 finalizer) to spread the few entropy bits
+  seed ^= seed >> 16;
+  seed *= 0x85EBCA6B;
+  seed ^= seed >> 13;
+  seed *= 0xC2B2AE35;
+  seed ^= seed >> 16;
+
+  return(seed);
+#endif
+}
+
+
+
+
+
+uint32_t PRNG_next(PRNG_state_t *_prng)
+{
+  // xorshift32 (13, 17, 5)
+  uint32_t x = _prng->state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  _prng->state = x;
+  return(x);
+}
+
+
+
+
+
+uint32_t PRNG_range(PRNG_state_t *_prng, uint32_t _range)
+{
+  // Value in [0, _range) with a multiply and shift instead of a modulo
+  return((uint32_t) (((uint64_t) PRNG_next(_prng) * _range) >> 32));
+}
+
+
+
+
+
+uint8_t PRNG_chance(PRNG_state_t *_prng, uint32_t _threshold)
+{
+  // _threshold comes from PRNG_PROBABILITY(), no division at run time
+  return(PRNG_next(_prng) < _threshold);
+}
@@ -0,0 +1,122 @@
+/**
+  ******************************************************************************
+  * @file           : profiler.c
+  * @brief          : Cycle counter probes of the display pipeline
+  ******************************************************************************
+  * @attention
+  *
+  * Copyright (c) 2023 Nicolò Campanini.
+  * All rights reserved.
+  *
+  * This software is licensed under terms that can be found in the LICENSE file
+  * in the root directory of this software component.
+  * If no LICENSE file comes with this software, it is provided AS-IS.
+  *
+  ******************************************************************************
+  */
+
+#include "profiler.h"
+
+
+
+
+
+Prof_stats_t Prof_stats[PROF_PROBES];
+
+const char *Prof_names[PROF_PROBES] = {
+  "gps_scan",
+  "gps_parse",
+  "rtc_read",
+  "timezone",
+  "frame_encode",
+  "spi_start",
+  "latch"
+};
+
+
+
+
+
+void Prof_init()
+{
+  Cycles_init();
+  Prof_reset();
+}
+
+
+
+
+
+void Prof_get_stats(Prof_probe_t _probe, Prof_stats_t *_stats)
+{
+  // The probes also run in the interrupts: copy with them masked
+  __disable_irq();
+  *_stats = Prof_stats[_probe];
+  __enable_irq();
+}
+
+
+
+
+
+uint32_t Prof_avg_cycles(Prof_stats_t *_stats)
+{
+  if (_stats->count == 0) {
+    return(0);
+  }
+  return(_stats->total_cycles / _stats->count);
+}
+
+
+
+
+
+void Prof_dump(Text_write_t _write)
+{
+  // One line per probe, cycles at SystemCoreClock:
+  //   prof <name> n=<count> min=<min> avg=<avg> max=<max> hist=<b0>,<b1>,...
+  // From the thread context only
+  char line[96 + PROF_BUCKETS * (TEXT_U32_DIGITS + 1)];
+  Prof_stats_t stats;
+  char *out = NULL;
+
+  for (uint8_t p = 0; p < PROF_PROBES; p++) {
+    Prof_get_stats(p, &stats);
+    out = Text_append(line, "prof ");
+    out = Text_append(out, Prof_names[p]);
+    out = Text_append(out, " n=");
+    out = Text_append_u32(out, stats.count);
+    out = Text_append(out, " min=");
+    out = Text_append_u32(out, (stats.count > 0) ? stats.min_cycles : 0);
+    out = Text_append(out, " avg=");
+    out = Text_append_u32(out, Prof_avg_cycles(&stats));
+    out = Text_append(out, " max=");
+    out = Text_append_u32(out, stats.max_cycles);
+    out = Text_append(out, " hist=");
+    for (uint8_t b = 0; b < PROF_BUCKETS; b++) {
+      out = Text_append_u32(out, stats.histogram[b]);
+      *out++ = (b < PROF_BUCKETS - 1) ? ',' : '\r';
+    }
+    *out++ = '\n';
+    _write(line, out - line);
+  }
+}
+
+
+
+
+
+void Prof_reset()
+{
+  __disable_irq();
+  for (uint8_t p = 0; p < PROF_PROBES; p++) {
+    Prof_stats[p].count = 0;
+    Prof_stats[p].min_cycles = UINT32_MAX;
+    Prof_stats[p].max_cycles = 0;
+    Prof_stats[p].total_cycles = 0;
+    for (uint8_t b = 0; b < PROF_BUCKETS; b++) {
+      Prof_stats[p].histogram[b] = 0;
+    }
+  }
+  __enable_irq();
+}
@@ -0,0 +1,150 @@
+/**
+  ******************************************************************************
+  * @file           : scheduler.c
+  * @brief          : Cooperative run-to-completion event scheduler
+  ******************************************************************************
+  * @attention
+  *
+  * Copyright (c) 2023 Nicolò Campanini.
+  * All rights reserved.
+  *
+  * This software is licensed under terms that can be found in the LICENSE file
+  * in the root directory of this software component.
+  * If no LICENSE file comes with this software, it is provided AS-IS.
+  *
+  ******************************************************************************
+  */
+
+#include "scheduler.h"
+#include "cycle_counter.h"
+#include "power.h"
+#include "watchdog.h"
+#include "cpu_load.h"
+
+
+
+
+
+// Pending events, one bit per event (bit 0 = highest priority)
+volatile uint32_t Sched_pending = 0;
+// Task table and run time statistics, indexed by event
+Sched_task_t Sched_tasks[SCHED_EVENTS];
+Sched_stats_t Sched_stats[SCHED_EVENTS];
+
+
+
+
+
+void Sched_init()
+{
+  Sched_pending = 0;
+  for (uint8_t i = 0; i < SCHED_EVENTS; i++) {
+    Sched_tasks[i] = NULL;
+    Sched_stats[i].name = NULL;
+  }
+  Sched_reset_stats();
+  // Run time is measured with the cycle counter
+  Cycles_init();
+}
+
+
+
+
+
+void Sched_register(Sched_event_t _event, Sched_task_t _task, const char *_name)
+{
+  Sched_tasks[_event] = _task;
+  Sched_stats[_event].name = _name;
+}
+
+
+
+
+
+void Sched_post(Sched_event_t _event)
+{
+  // Safe from any interrupt priority
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  Sched_pending |= (1UL << _event);
+  __set_PRIMASK(primask);
+}
+
+
+
+
+
+void Sched_run()
+{
+  while (1) {
+    // Alive: at every pass, at least at every wakeup from Stop
+    Watchdog_checkin(WATCHDOG_LOOP);
+
+    __disable_irq();
+    if (Sched_pending == 0) {
+      // Sleep (or Stop) until an interrupt: a pending interrupt wakes the
+      // core even with PRIMASK set, so an event posted right before is
+      // never missed, and the clocks are restored before its handler runs
+      Power_idle();
+      __enable_irq();
+      continue;
+    }
+
+    // Highest priority pending event
+    uint8_t event = __CLZ(__RBIT(Sched_pending));
+    Sched_pending &= ~(1UL << event);
+    __enable_irq();
+
+    if (Sched_tasks[event] == NULL) {
+      continue;
+    }
+
+    // Run to completion and account the run time (with the interrupts in
+    // it here, without them in the CPU load)
+    uint32_t start = Cycles_now();
+    uint8_t load = Load_switch(LOAD_TASKS + event);
+    Sched_tasks[event]();
+    Load_switch(load);
+    uint32_t cycles = Cycles_now() - start;
+
+    Sched_stats[event].runs++;
+    Sched_stats[event].total_cycles += cycles;
+    if (cycles > Sched_stats[event].max_cycles) {
+      Sched_stats[event].max_cycles = cycles;
+    }
+  }
+}
+
+
+
+
+
+void Sched_get_stats(Sched_event_t _event, Sched_stats_t *_stats)
+{
+  *_stats = Sched_stats[_event];
+}
+
+
+
+
+
+uint32_t Sched_avg_cycles(Sched_stats_t *_stats)
+{
+  if (_stats->runs == 0) {
+    return(0);
+  }
+  return(_stats->total_cycles / _stats->runs);
+}
+
+
+
+
+
+void Sched_reset_stats()
+{
+  for (uint8_t i = 0; i < SCHED_EVENTS; i++) {
+    Sched_stats[i].runs = 0;
+    Sched_stats[i].max_cycles = 0;
+    Sched_stats[i].total_cycles = 0;
+  }
+}
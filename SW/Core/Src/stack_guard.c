@@ -0,0 +1,157 @@
+/**
+  ******************************************************************************
+  * @file           : stack_guard.c
+  * @brief          : Stack painting, high-water mark and MPU overflow guard
+  ******************************************************************************
+  * @attention
+  *
+  * Copyright (c) 2023 Nicolò Campanini.
+  * All rights reserved.
+  *
+  * This software is licensed under terms that can be found in the LICENSE file
+  * in the root directory of this software component.
+  * If no LICENSE file comes with this software, it is provided AS-IS.
+  *
+  ******************************************************************************
+  */
+
+#include "stack_guard.h"
+#include "blackbox.h"
+
+
+
+
+
+#if defined(__arm__)
+// Linker script symbols: the guard, and the top of the stack
+extern uint32_t _sstack_guard;
+extern uint32_t _estack_guard;
+extern uint32_t _estack;
+#endif
+
+
+
+
+
+void Stack_init()
+{
+  // First thing in main(): paint the stack below the current frame, then
+  // arm the guard. On the host there is no stack of the target to watch.
+#if defined(__arm__)
+  MPU_Region_InitTypeDef region = {0};
+  uint32_t *word = &_estack_guard;
+  uint32_t *top = (uint32_t *) (__get_MSP() - STACK_PAINT_MARGIN);
+
+  while (word < top) {
+    *word++ = STACK_PAINT;
+  }
+
+  // No access to the guard, the default map everywhere else
+  HAL_MPU_Disable();
+  region.Enable = MPU_REGION_ENABLE;
+  region.Number = MPU_REGION_NUMBER0;
+  region.BaseAddress = (uint32_t) &_sstack_guard;
+  region.Size = MPU_REGION_SIZE_256B;
+  region.SubRegionDisable = 0x00;
+  region.TypeExtField = MPU_TEX_LEVEL0;
+  region.AccessPermission = MPU_REGION_NO_ACCESS;
+  region.DisableExec = MPU_INSTRUCTION_ACCESS_DISABLE;
+  region.IsShareable = MPU_ACCESS_NOT_SHAREABLE;
+  region.IsCacheable = MPU_ACCESS_NOT_CACHEABLE;
+  region.IsBufferable = MPU_ACCESS_NOT_BUFFERABLE;
+  HAL_MPU_ConfigRegion(&region);
+  HAL_MPU_Enable(MPU_PRIVILEGED_DEFAULT);
+
+  // To MemManage_Handler(), not escalated to a HardFault
+  SCB->SHCSR |= SCB_SHCSR_MEMFAULTENA_Msk;
+#endif
+}
+
+
+
+
+
+uint32_t Stack_size()
+{
+  // Bytes the stack can grow to before the guard
+#if defined(__arm__)
+  return((uint32_t) &_estack - (uint32_t) &_estack_guard);
+#else
+  return(0);
+#endif
+}
+
+
+
+
+
+uint32_t Stack_used()
+{
+  // High-water mark: the deepest word that lost its paint since the boot
+#if defined(__arm__)
+  const uint32_t *word = &_estack_guard;
+
+  while (word < &_estack && *word == STACK_PAINT) {
+    word++;
+  }
+  return((uint32_t) &_estack - (uint32_t) word);
+#else
+  return(0);
+#endif
+}
+
+
+
+
+
+void Stack_dump(Text_write_t _write)
+{
+  // stack size=<bytes> used=<bytes> free=<bytes>, from the thread context
+  char line[64];
+  char *out = NULL;
+  uint32_t size = Stack_size();
+  uint32_t used = Stack_used();
+
+  out = Text_append(line, "stack size=");
+  out = Text_append_u32(out, size);
+  out = Text_append(out, " used=");
+  out = Text_append_u32(out, used);
+  out = Text_append(out, " free=");
+  out = Text_append_u32(out, size - used);
+  out = Text_append(out, "\r\n");
+  _write(line, out - line);
+}
+
+
+
+
+
+#if defined(__arm__)
+void Stack_overflow(uint32_t *_frame)
+{
+  // The stacked frame is there unless the stacking itself hit the guard
+  uint32_t valid = ((SCB->CFSR & SCB_CFSR_MSTKERR_Msk) == 0) && (_frame >= &_estack_guard);
+  uint32_t address = (SCB->CFSR & SCB_CFSR_MMARVALID_Msk) ? SCB->MMFAR : (uint32_t) _frame;
+
+  Blackbox_save_fault(valid ? _frame[6] : 0, valid ? _frame[5] : 0, valid ? _frame[7] : 0);
+  Blackbox_log(BLACKBOX_STACK, address);
+  NVIC_SystemReset();
+}
+
+
+
+
+
+// The memory management vector (not generated by CubeMX). The stack is in
+// the guard: take the frame address, then move to the top of the stack
+// before any push. Nothing returns from here.
+__attribute__((naked)) void MemManage_Handler(void)
+{
+  __asm volatile(
+    "mrs r0, msp        \n"
+    "ldr r1, =_estack   \n"
+    "msr msp, r1        \n"
+    "b Stack_overflow   \n"
+  );
+}
+#endif
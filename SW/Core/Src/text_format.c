@@ -0,0 +1,126 @@
+/**
+  ******************************************************************************
+  * @file           : text_format.c
+  * @brief          : Minimal text formatting for the debug dumps
+  ******************************************************************************
+  * @attention
+  *
+  * Copyright (c) 2023 Nicolò Campanini.
+  * All rights reserved.
+  *
+  * This software is licensed under terms that can be found in the LICENSE file
+  * in the root directory of this software component.
+  * If no LICENSE file comes with this software, it is provided AS-IS.
+  *
+  ******************************************************************************
+  */
+
+#include "text_format.h"
+
+
+
+
+
+char *Text_append(char *_out, const char *_text)
+{
+  while (*_text != '\0') {
+    *_out++ = *_text++;
+  }
+  return(_out);
+}
+
+
+
+
+
+char *Text_append_u32(char *_out, uint32_t _value)
+{
+  // Decimal digits, written backwards then reversed
+  char digits[TEXT_U32_DIGITS];
+  uint8_t length = 0;
+
+  do {
+    digits[length++] = '0' + (_value % 10);
+    _value /= 10;
+  } while (_value > 0);
+  while (length > 0) {
+    *_out++ = digits[--length];
+  }
+  return(_out);
+}
+
+
+
+
+
+char *Text_append_hex32(char *_out, uint32_t _value)
+{
+  // 0x and eight digits: addresses and registers line up in the dumps
+  const char *hex = "0123456789ABCDEF";
+
+  *_out++ = '0';
+  *_out++ = 'x';
+  for (int8_t shift = 28; shift >= 0; shift -= 4) {
+    *_out++ = hex[(_value >> shift) & 0xF];
+  }
+  return(_out);
+}
+
+
+
+
+
+char *Text_append_i32(char *_out, int32_t _value)
+{
+  if (_value < 0) {
+    *_out++ = '-';
+    return(Text_append_u32(_out, (uint32_t) 0 - (uint32_t) _value));
+  }
+  return(Text_append_u32(_out, (uint32_t) _value));
+}
+
+
+
+
+
+uint8_t Text_parse_i32(const char *_text, int32_t *_value)
+{
+  // Optional sign and decimal digits, nothing else: 1 if valid
+  uint8_t negative = 0;
+  uint32_t value = 0;
+
+  if (*_text == '-' || *_text == '+') {
+    negative = (*_text == '-');
+    _text++;
+  }
+  if (*_text == '\0') {
+    return(0);
+  }
+  while (*_text != '\0') {
+    if (*_text < '0' || *_text > '9' || value > (INT32_MAX - 9) / 10) {
+      return(0);
+    }
+    value = value * 10 + (uint32_t) (*_text++ - '0');
+  }
+  *_value = negative ? -(int32_t) value : (int32_t) value;
+  return(1);
+}
+
+
+
+
+
+uint8_t Text_parse_digits(const char *_text, uint8_t _count, uint32_t *_value)
+{
+  // Exactly _count decimal digits, as the fixed fields of NMEA: 1 if valid
+  uint32_t value = 0;
+
+  for (uint8_t i = 0; i < _count; i++) {
+    if (_text[i] < '0' || _text[i] > '9') {
+      return(0);
+    }
+    value = value * 10 + (uint32_t) (_text[i] - '0');
+  }
+  *_value = value;
+  return(1);
+}
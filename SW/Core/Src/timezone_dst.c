@@ -16,6 +16,7 @@
   */
 
 #include "timezone_dst.h"
+#include "config.h"
 
 
 
@@ -81,34 +82,36 @@ int get_last_Sunday(int year, int month) {
 
 
 
-time_t RTC_to_time_t(RTC_TimeTypeDef *timeTypeDef, RTC_DateTypeDef *dateTypeDef) {
-    struct tm t;
-    t.tm_sec = timeTypeDef->Seconds;
-    t.tm_min = timeTypeDef->Minutes;
-    t.tm_hour = timeTypeDef->Hours;
-    t.tm_mday = dateTypeDef->Date;
-    t.tm_mon = dateTypeDef->Month - 1; // In struct tm, month is 0-11
-    t.tm_year = dateTypeDef->Year + 100; // Years since 1900
-    t.tm_isdst = -1; // -1 means info not available
-
-    time_t time = mktime(&t);
-    return time;
+uint32_t RTC_to_days(RTC_DateTypeDef *dateTypeDef) {
+    // Days since 2000-01-01, the RTC holds years 2000 to 2099
+    uint32_t year = dateTypeDef->Year;
+    uint32_t days = 365 * year + (year + 3) / 4;
+    for (int month = 1; month < dateTypeDef->Month; month++) {
+        days += get_Last_Day_Of_Month(2000 + year, month);
+    }
+    return days + dateTypeDef->Date - 1;
 }
 
 
 
 
 
-void time_t_to_RTC(time_t time, RTC_TimeTypeDef *timeTypeDef, RTC_DateTypeDef *dateTypeDef) {
-    struct tm *t;
-    t = gmtime(&time);
-
-    timeTypeDef->Seconds = t->tm_sec;
-    timeTypeDef->Minutes = t->tm_min;
-    timeTypeDef->Hours = t->tm_hour;
-    dateTypeDef->Date = t->tm_mday;
-    dateTypeDef->Month = t->tm_mon + 1; // In struct tm, month is 0-11
-    dateTypeDef->Year = t->tm_year - 100; // Years since 1900
+void days_to_RTC(uint32_t days, RTC_DateTypeDef *dateTypeDef) {
+    // Four years cycles of 1461 days, each starting with a leap year
+    uint32_t year = 4 * (days / 1461);
+    days %= 1461;
+    if (days >= 366) {
+        year += (days - 1) / 365;
+        days = (days - 1) % 365;
+    }
+    int month = 1;
+    while (days >= (uint32_t) get_Last_Day_Of_Month(2000 + year, month)) {
+        days -= get_Last_Day_Of_Month(2000 + year, month);
+        month++;
+    }
+    dateTypeDef->Date = days + 1;
+    dateTypeDef->Month = month;
+    dateTypeDef->Year = year;
 }
 
 
@@ -116,25 +119,31 @@ void time_t_to_RTC(time_t time, RTC_TimeTypeDef *timeTypeDef, RTC_DateTypeDef *d
 
 
 void Apply_timezone_dst(RTC_TimeTypeDef *timeTypeDef, RTC_DateTypeDef *dateTypeDef) {
-    // Converti RTC_TimeTypeDef e RTC_DateTypeDef in time_t
-    time_t _utc_unixtime = RTC_to_time_t(timeTypeDef, dateTypeDef);
-    struct tm utc_buf;
-    // Estrai la struttura tm per UTC
-    gmtime_r(&_utc_unixtime, &utc_buf);
-    // Genera year e month in un formato comodo per estrarre ultima domenica di marzo e ottobre
-    int year = utc_buf.tm_year + 1900;
-    int last_sunday_march = get_last_Sunday(year, 3);
-    int last_sunday_october = get_last_Sunday(year, 10);
-    // Genera time_t per ultime domeniche di marzo e ottobre
-    time_t lastSundayMarch = mktime(&(struct tm){.tm_year = utc_buf.tm_year, .tm_mon = 2, .tm_mday = last_sunday_march, .tm_hour = 1});
-    time_t lastSundayOctober = mktime(&(struct tm){.tm_year = utc_buf.tm_year, .tm_mon = 9, .tm_mday = last_sunday_october, .tm_hour = 1});
+    // Integer calendar arithmetic, no mktime()/gmtime(): day number and second of the day
+    uint32_t days = RTC_to_days(dateTypeDef);
+    int32_t seconds = timeTypeDef->Hours * 3600 + timeTypeDef->Minutes * 60 + timeTypeDef->Seconds;
+    // Ultime domeniche di marzo e ottobre, il cambio e' alle 01:00 UTC
+    int year = 2000 + dateTypeDef->Year;
+    RTC_DateTypeDef march = {.Year = dateTypeDef->Year, .Month = 3, .Date = get_last_Sunday(year, 3)};
+    RTC_DateTypeDef october = {.Year = dateTypeDef->Year, .Month = 10, .Date = get_last_Sunday(year, 10)};
+    uint32_t last_sunday_march = RTC_to_days(&march);
+    uint32_t last_sunday_october = RTC_to_days(&october);
     // Controlla le regole DST
-    uint8_t dst_effective = (difftime(_utc_unixtime, lastSundayMarch) > 0 && difftime(_utc_unixtime, lastSundayOctober) < 0);
-    // Applica il corretto offset di secondi
-    _utc_unixtime += TIMEZONE_OFFSET_S + dst_effective * DST_OFFSET_S;
-    // Converti il time_t modificato di nuovo in RTC_TimeTypeDef e RTC_DateTypeDef
-    time_t_to_RTC(_utc_unixtime, timeTypeDef, dateTypeDef);
+    uint8_t dst_effective = (days > last_sunday_march || (days == last_sunday_march && seconds > 3600)) &&
+                            (days < last_sunday_october || (days == last_sunday_october && seconds < 3600));
+    // Applica il corretto offset di secondi, riportando il giorno
+    seconds += Config.timezone_offset_s + dst_effective * Config.dst_offset_s;
+    while (seconds < 0) {
+        seconds += 86400;
+        days--;
+    }
+    while (seconds >= 86400) {
+        seconds -= 86400;
+        days++;
+    }
+    // Torna a RTC_TimeTypeDef e RTC_DateTypeDef
+    timeTypeDef->Hours = seconds / 3600;
+    timeTypeDef->Minutes = (seconds / 60) % 60;
+    timeTypeDef->Seconds = seconds % 60;
+    days_to_RTC(days, dateTypeDef);
 }
-
-
-
@@ -0,0 +1,192 @@
+/**
+  ******************************************************************************
+  * @file           : watchdog.c
+  * @brief          : IWDG kicked only while every subsystem checks in on time
+  ******************************************************************************
+  * @attention
+  *
+  * Copyright (c) 2023 Nicolò Campanini.
+  * All rights reserved.
+  *
+  * This software is licensed under terms that can be found in the LICENSE file
+  * in the root directory of this software component.
+  * If no LICENSE file comes with this software, it is provided AS-IS.
+  *
+  ******************************************************************************
+  */
+
+#include "watchdog.h"
+#include "blackbox.h"
+
+
+
+
+
+// IWDG keys: reload, register write access, start
+#define WATCHDOG_KEY_RELOAD 0xAAAA
+#define WATCHDOG_KEY_ACCESS 0x5555
+#define WATCHDOG_KEY_START 0xCCCC
+
+// Global RTC handler, for the backup registers. NULL until the IWDG runs.
+RTC_HandleTypeDef *Watchdog_hrtc = NULL;
+// HAL tick by which each subsystem must check in, 0 when nothing is
+// expected (bit 0 set on the others, so that a deadline is never 0)
+volatile uint32_t Watchdog_due[WATCHDOG_SUBSYSTEMS];
+// Subsystems found late, once recorded the IWDG is left to expire
+uint32_t Watchdog_late = 0;
+// Late subsystems of the watchdog reset before this boot, 0 for a reset
+// with the supervision itself stopped
+uint32_t Watchdog_reset_reason = 0;
+
+const uint16_t Watchdog_deadline_ms[WATCHDOG_SUBSYSTEMS] = {
+  WATCHDOG_LOOP_MS,
+  WATCHDOG_GPS_MS,
+  WATCHDOG_DISPLAY_MS
+};
+
+const char *Watchdog_names[WATCHDOG_SUBSYSTEMS] = {
+  "loop",
+  "gps",
+  "display"
+};
+
+
+
+
+
+void Watchdog_init(RTC_HandleTypeDef *_hrtc)
+{
+  // Reason of a watchdog reset: the late subsystems if the supervision saw
+  // them, none if it stopped running (masked core, interrupt storm). The
+  // blackbox ring, kept across the reset, holds the events before it.
+  if (Blackbox_reset_cause() & RCC_CSR_IWDGRSTF) {
+    uint32_t reason = HAL_RTCEx_BKUPRead(_hrtc, WATCHDOG_BKP_REASON);
+    if ((reason & 0xFFFF0000UL) == WATCHDOG_BKP_MAGIC) {
+      Watchdog_reset_reason = reason & 0xFFFF;
+    } else {
+      Watchdog_reset_reason = 0;
+      Blackbox_log(BLACKBOX_WATCHDOG, 0);
+    }
+    HAL_RTCEx_BKUPWrite(_hrtc, WATCHDOG_BKP_RESETS, HAL_RTCEx_BKUPRead(_hrtc, WATCHDOG_BKP_RESETS) + 1);
+  }
+  HAL_RTCEx_BKUPWrite(_hrtc, WATCHDOG_BKP_REASON, 0);
+
+  for (uint8_t i = 0; i < WATCHDOG_SUBSYSTEMS; i++) {
+    Watchdog_due[i] = 0;
+  }
+  Watchdog_late = 0;
+
+  // Stopped with the core on a debugger breakpoint
+  DBGMCU->APB1FZ |= DBGMCU_APB1_FZ_DBG_IWDG_STOP;
+
+  // Start (and the LSI with it), then the timeout: the prescaler and the
+  // reload take effect once the LSI domain has them (SR clear)
+  IWDG->KR = WATCHDOG_KEY_START;
+  IWDG->KR = WATCHDOG_KEY_ACCESS;
+  IWDG->PR = WATCHDOG_PRESCALER;
+  IWDG->RLR = WATCHDOG_RELOAD - 1;
+  while (IWDG->SR != 0) {
+  }
+  IWDG->KR = WATCHDOG_KEY_RELOAD;
+
+  Watchdog_hrtc = _hrtc;
+}
+
+
+
+
+
+void Watchdog_checkin(Watchdog_subsystem_t _subsystem)
+{
+  // Periodic subsystem: the next check-in is due within its deadline
+  Watchdog_due[_subsystem] = (HAL_GetTick() + Watchdog_deadline_ms[_subsystem]) | 1;
+}
+
+
+
+
+
+void Watchdog_expect(Watchdog_subsystem_t _subsystem)
+{
+  // Work handed over: done within the deadline. The first one sets it, a
+  // stream of work never done does not push it away.
+  if (Watchdog_due[_subsystem] == 0) {
+    Watchdog_due[_subsystem] = (HAL_GetTick() + Watchdog_deadline_ms[_subsystem]) | 1;
+  }
+}
+
+
+
+
+
+void Watchdog_done(Watchdog_subsystem_t _subsystem)
+{
+  Watchdog_due[_subsystem] = 0;
+}
+
+
+
+
+
+void Watchdog_tick()
+{
+  // From the 1 Hz RTC wakeup, in Run and after each Stop: kick the IWDG
+  // only with every expected check-in on time
+  uint32_t now = HAL_GetTick();
+  uint32_t late = 0;
+
+  if (Watchdog_hrtc == NULL) {
+    return;
+  }
+
+  for (uint8_t i = 0; i < WATCHDOG_SUBSYSTEMS; i++) {
+    uint32_t due = Watchdog_due[i];
+    if (due != 0 && (int32_t) (now - due) > 0) {
+      late |= (1UL << i);
+    }
+  }
+
+  if (late == 0) {
+    IWDG->KR = WATCHDOG_KEY_RELOAD;
+    return;
+  }
+
+  // Record once what was late, then no more kicks: the IWDG resets
+  if (Watchdog_late == 0) {
+    Watchdog_late = late;
+    HAL_RTCEx_BKUPWrite(Watchdog_hrtc, WATCHDOG_BKP_REASON, WATCHDOG_BKP_MAGIC | late);
+    Blackbox_log(BLACKBOX_WATCHDOG, late);
+  }
+}
+
+
+
+
+
+void Watchdog_dump(Text_write_t _write)
+{
+  // wdog resets=<count> reason=<late bits> loop=<ms> gps=<ms> display=<ms>
+  // Time left to each deadline, idle with nothing expected. The reason is
+  // the one of the last reset, when it was the watchdog.
+  char line[128];
+  char *out = NULL;
+  uint32_t now = HAL_GetTick();
+
+  out = Text_append(line, "wdog resets=");
+  out = Text_append_u32(out, (Watchdog_hrtc != NULL) ? HAL_RTCEx_BKUPRead(Watchdog_hrtc, WATCHDOG_BKP_RESETS) : 0);
+  out = Text_append(out, " reason=");
+  out = Text_append_hex32(out, Watchdog_reset_reason);
+  for (uint8_t i = 0; i < WATCHDOG_SUBSYSTEMS; i++) {
+    uint32_t due = Watchdog_due[i];
+    out = Text_append(out, " ");
+    out = Text_append(out, Watchdog_names[i]);
+    out = Text_append(out, "=");
+    if (due == 0) {
+      out = Text_append(out, "idle");
+    } else {
+      out = Text_append_u32(out, ((int32_t) (due - now) > 0) ? due - now : 0);
+    }
+  }
+  out = Text_append(out, "\r\n");
+  _write(line, out - line);
+}
@@ -0,0 +1,243 @@
+/**
+  ******************************************************************************
+  * @file           : sim.h
+  * @brief          : Host simulation of the clock: virtual time, peripherals,
+  *                   GPS receiver and tubes.
+  ******************************************************************************
+  * @attention
+  *
+  * Copyright (c) 2023 Nicolò Campanini.
+  * All rights reserved.
+  *
+  * This software is licensed under terms that can be found in the LICENSE file
+  * in the root directory of this software component.
+  * If no LICENSE file comes with this software, it is provided AS-IS.
+  *
+  ******************************************************************************
+  */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __SIM_H
+#define __SIM_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Includes ------------------------------------------------------------------*/
+#include "main.h"
+#include "nixie_display.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+
+/* Types ---------------------------------------------------------------------*/
+// The firmware runs unmodified on the host: the peripheral, core and flash
+// address ranges are mapped at their STM32F401 addresses, the HAL calls go
+// to sim_hal.c and the interrupts are dispatched by sim_core.c. Code runs
+// in zero virtual time; the time only moves when the firmware sleeps
+// (WFI, Stop), jumping to the next event, and by one core cycle per NOP
+// so that the polling loops bounded on the cycle counter end.
+
+#define SIM_NS_PER_S 1000000000ULL
+#define SIM_NS_PER_MS 1000000ULL
+#define SIM_NEVER UINT64_MAX
+
+// Address ranges backed by host memory
+#define SIM_FLASH_BASE 0x08000000UL
+#define SIM_FLASH_SIZE 0x40000UL
+#define SIM_PERIPH_BASE 0x40000000UL
+#define SIM_PERIPH_SIZE 0x30000UL
+#define SIM_BITBAND_BASE 0x42000000UL
+#define SIM_BITBAND_SIZE 0x2000000UL
+#define SIM_CORE_BASE 0xE0000000UL
+#define SIM_CORE_SIZE 0x100000UL
+
+// Interrupt lines known to the simulation
+#define SIM_IRQ_LINES 96
+
+// Simulated hardware
+#define SIM_GPS_BAUD 9600
+#define SIM_UART_BAUD_TOLERANCE_PERMILLE 25
+#define SIM_RX_QUEUE_SIZE 4096
+#define SIM_ADC_NOISE 8
+#define SIM_CONSOLE_BAUD 115200
+#define SIM_CONSOLE_LINE_GAP_MS 1000
+#define SIM_CONSOLE_OUTPUT_SIZE 32768
+#define SIM_CONSOLE_EXPECTS 16
+
+// GPS outage windows, relative to the start of the run
+#define SIM_MAX_OUTAGES 8
+#define SIM_GPS_ROLLOVER_DAYS (1024 * 7)
+
+typedef enum {
+  SIM_GPS_SILENT,                // Receiver unplugged: no sentences at all
+  SIM_GPS_NOFIX,                 // Sentences with empty time fields
+  SIM_GPS_ROLLOVER               // Fix with the date 1024 weeks back (week rollover)
+} Sim_outage_type_t;
+
+
+
+typedef struct{
+  uint32_t start_s;
+  uint32_t duration_s;
+  Sim_outage_type_t type;
+} Sim_outage_t;
+
+
+
+// Weekday with its own night window, set on the console by the scenario
+typedef struct{
+  uint8_t weekday;               // 0 = Sunday
+  int16_t on_min;                // Fixed on edge, local minute
+  int16_t off_after_sunset_min;  // Off edge, minutes from the sunset
+} Sim_night_day_t;
+
+
+
+typedef struct{
+  const char *name;
+  int64_t start_utc;             // True UTC at power on (unix time)
+  uint32_t duration_s;           // Virtual run time
+  uint8_t rtc_kept;              // Backup domain alive: RTC already on time at power on
+  int32_t rtc_ppm;               // LSE frequency error
+  uint16_t gps_latency_ms;       // Start of the burst after the PPS second
+  uint16_t gps_ttff_s;           // Cold start: sentences without a fix until then
+  Sim_outage_t outages[SIM_MAX_OUTAGES];
+  uint8_t outage_count;
+  uint32_t rsf_stuck_s;          // LSE failing: RSF not set again from then on,
+  uint32_t rsf_stuck_duration_s; // for this long
+  uint16_t light;                // Ambient light sensor, 12 bit ADC counts
+  uint32_t tolerance_ms;         // Allowed error of the shown time once synced
+  int16_t night_off_min;         // Expected dark window (local), -1 to skip the check
+  int16_t night_on_min;
+  const Sim_night_day_t *night_day;     // NULL = the same window every day
+  uint32_t console_at_s;         // Commands typed on USART2 at this time
+  const char *console;
+  const char *console_expect[SIM_CONSOLE_EXPECTS];      // Strings the output must have
+  uint8_t named_only;            // Too long for every run: only with --scenario
+  uint8_t verbose;
+} Sim_scenario_t;
+
+
+
+typedef struct{
+  uint32_t checks;               // Once per second, mid second
+  uint32_t passed;
+  uint32_t failed;
+  uint32_t unsynced;             // RTC not yet set from GPS
+  uint32_t sequences;            // Animation or cathode poisoning prevention on the tubes
+  uint32_t dark;                 // Tubes off (night schedule)
+  uint32_t night_failed;         // Lit in the dark window or dark in the lit one
+  int32_t max_error_ms;          // Largest error of the shown time
+  uint32_t latches;              // Frames latched into the HV5530
+  uint32_t ghost_frames;         // More than one cathode on in a tube
+  uint32_t dst_changes;          // Jumps of the shown hour by the DST
+  uint32_t calendar_failed;      // RTC date more than a day off the true one
+  uint64_t shown_ns[NIXIE_TUBES][NIXIE_DIGITS]; // Time each cathode was latched on the lit tubes
+} Sim_display_stats_t;
+
+
+
+typedef struct{
+  uint32_t events;               // Events processed by the virtual clock
+  uint32_t interrupts;           // Handlers run
+  uint32_t stops;                // Stop mode entries
+  uint64_t stop_ns;              // Virtual time spent in Stop
+  uint32_t rtc_sets;             // Calendar writes from the firmware
+  uint32_t rx_bytes;             // Bytes received by the USART
+  uint32_t rx_lost;              // Bytes lost (no reception running, Stop)
+  uint32_t rx_framing;           // Bytes garbled by a wrong baud rate
+  uint32_t tx_bytes;             // Bytes sent by the firmware on a USART
+  uint32_t spi_frames;           // SPI transfers to the drivers
+  uint32_t flash_erases;
+  uint32_t flash_overwrites;     // Programming a word that is not erased
+} Sim_stats_t;
+
+
+
+/* Functions -----------------------------------------------------------------*/
+// sim_core.c: memory map, virtual clock, interrupts
+void Sim_map_memory(void);
+uint64_t Sim_now(void);
+void Sim_set_end(uint64_t _end_ns);
+void Sim_step(void);
+void Sim_stop_mode(void);
+uint8_t Sim_is_stopped(void);
+void Sim_pend_irq(IRQn_Type _irq);
+void Sim_watchdog_reset(void);
+uint32_t Sim_hclk_hz(void);
+uint32_t Sim_pclk1_hz(void);
+uint32_t Sim_pclk2_hz(void);
+uint32_t Sim_timer_clock_hz(TIM_TypeDef *_tim);
+int Sim_run_firmware(const Sim_scenario_t *_scenario);
+int64_t Sim_days_from_civil(int32_t _year, uint8_t _month, uint8_t _day);
+void Sim_civil_from_days(int64_t _days, int32_t *_year, uint8_t *_month, uint8_t *_day);
+extern Sim_stats_t Sim_stats;
+extern const Sim_scenario_t *Sim_scenario;
+
+// sim_periph.c: RTC, timers, ADC with DMA, SPI, USART reception, flash
+void Sim_periph_reset(const Sim_scenario_t *_scenario);
+uint64_t Sim_periph_next(void);
+void Sim_periph_fire(uint64_t _now);
+void Sim_periph_sync(void);
+void Sim_periph_advance(uint64_t _now);
+void Sim_periph_resume(uint64_t _stopped_ns);
+void Sim_rtc_update(uint64_t _now);
+void Sim_rtc_set(int64_t _seconds);
+void Sim_rtc_shift(uint8_t _add1s, uint32_t _subfs);
+int64_t Sim_rtc_seconds(void);
+uint64_t Sim_rtc_last_set(void);
+void Sim_rtc_wakeup_arm(void);
+void Sim_uart_attach(UART_HandleTypeDef *_huart);
+void Sim_uart_push(const char *_data, uint16_t _length, uint64_t _start_ns, uint32_t _baud);
+void Sim_spi_start(SPI_HandleTypeDef *_hspi, uint8_t *_data, uint16_t _size);
+uint8_t Sim_spi_take_complete(SPI_HandleTypeDef *_hspi);
+void Sim_adc_start(ADC_HandleTypeDef *_hadc, uint16_t *_buffer, uint32_t _length);
+void Sim_adc_stop(void);
+uint16_t Sim_adc_sample(void);
+void Sim_dma_start(DMA_HandleTypeDef *_hdma, uint8_t *_memory, uint32_t _length);
+void Sim_dma_stop(DMA_HandleTypeDef *_hdma);
+void Sim_dma_write(DMA_Stream_TypeDef *_stream, uint16_t _value);
+void Sim_dma_irq(DMA_HandleTypeDef *_hdma);
+void Sim_flash_program(uint32_t _address, const void *_data, uint8_t _size);
+void Sim_flash_erase(uint32_t _sector);
+
+// sim_console.c: terminal on USART2
+void Sim_console_reset(const Sim_scenario_t *_scenario);
+void Sim_console_advance(uint8_t _byte);
+uint64_t Sim_console_next(void);
+void Sim_console_fire(uint64_t _now);
+void Sim_console_resume(uint64_t _stopped_ns);
+void Sim_console_write(const uint8_t *_data, uint16_t _length, uint8_t _interrupt);
+const char *Sim_console_output(void);
+
+// sim_gps.c: NMEA receiver
+void Sim_gps_reset(const Sim_scenario_t *_scenario);
+uint64_t Sim_gps_next(void);
+void Sim_gps_fire(uint64_t _now);
+uint64_t Sim_gps_first_fix(void);
+int64_t Sim_true_utc(uint64_t _now);
+
+// sim_display.c: HV5530 drivers, latch decoder and assertions
+void Sim_display_reset(const Sim_scenario_t *_scenario);
+void Sim_display_shift(uint8_t _byte);
+void Sim_display_gpio(GPIO_TypeDef *_port, uint16_t _pin, GPIO_PinState _state);
+uint8_t Sim_display_shown(uint8_t *_digits);
+uint64_t Sim_display_next(void);
+void Sim_display_fire(uint64_t _now);
+int32_t Sim_local_offset_s(int64_t _utc);
+int32_t Sim_sun_minute(int32_t _day_of_year, uint8_t _rising, int32_t _offset_min, double _latitude,
+                       double _longitude, double *_cos_h);
+uint32_t Sim_sun_check(uint32_t *_max_error_min);
+void Sim_display_get_stats(Sim_display_stats_t *_stats);
+
+
+
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
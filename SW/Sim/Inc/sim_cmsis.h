@@ -0,0 +1,192 @@
+/**
+  ******************************************************************************
+  * @file           : sim_cmsis.h
+  * @brief          : Host replacement of cmsis_gcc.h for the simulation build.
+  *                   Force-included (-include) before any other header.
+  ******************************************************************************
+  * @attention
+  *
+  * Copyright (c) 2023 Nicolò Campanini.
+  * All rights reserved.
+  *
+  * This software is licensed under terms that can be found in the LICENSE file
+  * in the root directory of this software component.
+  * If no LICENSE file comes with this software, it is provided AS-IS.
+  *
+  ******************************************************************************
+  */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __SIM_CMSIS_H
+#define __SIM_CMSIS_H
+
+// The real cmsis_gcc.h is skipped: its intrinsics are ARM assembly
+#define __CMSIS_GCC_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Includes ------------------------------------------------------------------*/
+#include <stdint.h>
+
+
+/* Types ---------------------------------------------------------------------*/
+#define __ASM                                  __asm
+#define __INLINE                               inline
+#define __STATIC_INLINE                        static inline
+#define __STATIC_FORCEINLINE                   __attribute__((always_inline)) static inline
+#define __NO_RETURN                            __attribute__((__noreturn__))
+#define __USED                                 __attribute__((used))
+#define __WEAK                                 __attribute__((weak))
+#define __PACKED                               __attribute__((packed, aligned(1)))
+#define __PACKED_STRUCT                        struct __attribute__((packed, aligned(1)))
+#define __PACKED_UNION                         union __attribute__((packed, aligned(1)))
+#define __ALIGNED(x)                           __attribute__((aligned(x)))
+#define __RESTRICT                             __restrict
+
+#define __UNALIGNED_UINT16_READ(addr)          (*((const uint16_t *) (const void *) (addr)))
+#define __UNALIGNED_UINT16_WRITE(addr, val)    ((void) (*((uint16_t *) (void *) (addr)) = (val)))
+#define __UNALIGNED_UINT32_READ(addr)          (*((const uint32_t *) (const void *) (addr)))
+#define __UNALIGNED_UINT32_WRITE(addr, val)    ((void) (*((uint32_t *) (void *) (addr)) = (val)))
+#define __UNALIGNED_UINT32(x)                  (*((uint32_t *) (x)))
+
+// Interrupt mask and active handler, owned by sim_core.c
+extern volatile uint32_t Sim_primask;
+extern volatile uint32_t Sim_ipsr;
+
+
+
+/* Functions -----------------------------------------------------------------*/
+// Implemented by sim_core.c: unmasking runs the pending handlers, WFI
+// advances the virtual time to the next event, NOP by one core cycle
+void Sim_irq_unmasked(void);
+void Sim_wfi(void);
+void Sim_cycle(void);
+void Sim_breakpoint(uint32_t _value);
+
+
+
+__STATIC_FORCEINLINE void __enable_irq(void)
+{
+  Sim_primask = 0;
+  Sim_irq_unmasked();
+}
+
+
+
+__STATIC_FORCEINLINE void __disable_irq(void)
+{
+  Sim_primask = 1;
+}
+
+
+
+__STATIC_FORCEINLINE uint32_t __get_PRIMASK(void)
+{
+  return(Sim_primask);
+}
+
+
+
+__STATIC_FORCEINLINE void __set_PRIMASK(uint32_t priMask)
+{
+  Sim_primask = priMask & 1;
+  if (Sim_primask == 0) {
+    Sim_irq_unmasked();
+  }
+}
+
+
+
+__STATIC_FORCEINLINE uint32_t __get_IPSR(void)
+{
+  return(Sim_ipsr);
+}
+
+
+
+__STATIC_FORCEINLINE uint32_t __get_MSP(void)
+{
+  // Only meaningful as a difference between two calls
+  volatile uint32_t marker = 0;
+  return((uint32_t) (uintptr_t) &marker);
+}
+
+
+
+#define __NOP()                                Sim_cycle()
+#define __WFI()                                Sim_wfi()
+#define __WFE()                                Sim_wfi()
+#define __SEV()                                do {} while (0)
+#define __BKPT(value)                          Sim_breakpoint(value)
+
+__STATIC_FORCEINLINE void __ISB(void) {}
+__STATIC_FORCEINLINE void __DSB(void) {}
+__STATIC_FORCEINLINE void __DMB(void) {}
+
+
+
+// Exclusive access: the simulated interrupts never split a function, the
+// store always succeeds
+__STATIC_FORCEINLINE uint32_t __LDREXW(volatile uint32_t *addr)
+{
+  return(*addr);
+}
+
+
+
+__STATIC_FORCEINLINE uint32_t __STREXW(uint32_t value, volatile uint32_t *addr)
+{
+  *addr = value;
+  return(0);
+}
+
+
+
+__STATIC_FORCEINLINE void __CLREX(void) {}
+
+
+
+__STATIC_FORCEINLINE uint32_t __REV(uint32_t value)
+{
+  return(__builtin_bswap32(value));
+}
+
+
+
+__STATIC_FORCEINLINE uint32_t __REV16(uint32_t value)
+{
+  return(((value & 0xFF00FF00) >> 8) | ((value & 0x00FF00FF) << 8));
+}
+
+
+
+__STATIC_FORCEINLINE uint32_t __RBIT(uint32_t value)
+{
+  uint32_t result = 0;
+
+  for (uint8_t i = 0; i < 32; i++) {
+    result = (result << 1) | (value & 1);
+    value >>= 1;
+  }
+  return(result);
+}
+
+
+
+// CLZ of zero is 32 on the core, undefined for __builtin_clz
+__STATIC_FORCEINLINE uint8_t __CLZ(uint32_t value)
+{
+  return((value == 0) ? 32 : (uint8_t) __builtin_clz(value));
+}
+
+
+
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,52 @@
+/**
+  ******************************************************************************
+  * @file           : sim_nvic.h
+  * @brief          : Virtual NVIC for the simulation build (CMSIS_NVIC_VIRTUAL).
+  ******************************************************************************
+  * @attention
+  *
+  * Copyright (c) 2023 Nicolò Campanini.
+  * All rights reserved.
+  *
+  * This software is licensed under terms that can be found in the LICENSE file
+  * in the root directory of this software component.
+  * If no LICENSE file comes with this software, it is provided AS-IS.
+  *
+  ******************************************************************************
+  */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __SIM_NVIC_H
+#define __SIM_NVIC_H
+
+// Included by core_cm4.h: the set/clear registers of the NVIC are write-one
+// and can't be plain memory, so the NVIC state lives in sim_core.c
+
+/* Functions -----------------------------------------------------------------*/
+void Sim_NVIC_SetPriorityGrouping(uint32_t PriorityGroup);
+uint32_t Sim_NVIC_GetPriorityGrouping(void);
+void Sim_NVIC_EnableIRQ(IRQn_Type IRQn);
+uint32_t Sim_NVIC_GetEnableIRQ(IRQn_Type IRQn);
+void Sim_NVIC_DisableIRQ(IRQn_Type IRQn);
+uint32_t Sim_NVIC_GetPendingIRQ(IRQn_Type IRQn);
+void Sim_NVIC_SetPendingIRQ(IRQn_Type IRQn);
+void Sim_NVIC_ClearPendingIRQ(IRQn_Type IRQn);
+uint32_t Sim_NVIC_GetActive(IRQn_Type IRQn);
+void Sim_NVIC_SetPriority(IRQn_Type IRQn, uint32_t priority);
+uint32_t Sim_NVIC_GetPriority(IRQn_Type IRQn);
+void Sim_NVIC_SystemReset(void);
+
+#define NVIC_SetPriorityGrouping    Sim_NVIC_SetPriorityGrouping
+#define NVIC_GetPriorityGrouping    Sim_NVIC_GetPriorityGrouping
+#define NVIC_EnableIRQ              Sim_NVIC_EnableIRQ
+#define NVIC_GetEnableIRQ           Sim_NVIC_GetEnableIRQ
+#define NVIC_DisableIRQ             Sim_NVIC_DisableIRQ
+#define NVIC_GetPendingIRQ          Sim_NVIC_GetPendingIRQ
+#define NVIC_SetPendingIRQ          Sim_NVIC_SetPendingIRQ
+#define NVIC_ClearPendingIRQ        Sim_NVIC_ClearPendingIRQ
+#define NVIC_GetActive              Sim_NVIC_GetActive
+#define NVIC_SetPriority            Sim_NVIC_SetPriority
+#define NVIC_GetPriority            Sim_NVIC_GetPriority
+#define NVIC_SystemReset            Sim_NVIC_SystemReset
+
+#endif
@@ -0,0 +1,163 @@
+/**
+  ******************************************************************************
+  * @file           : sim_console.c
+  * @brief          : Terminal on USART2 of the host simulation: scripted
+  *                   commands in, the console output captured
+  ******************************************************************************
+  * @attention
+  *
+  * Copyright (c) 2023 Nicolò Campanini.
+  * All rights reserved.
+  *
+  * This software is licensed under terms that can be found in the LICENSE file
+  * in the root directory of this software component.
+  * If no LICENSE file comes with this software, it is provided AS-IS.
+  *
+  ******************************************************************************
+  */
+
+#include "sim.h"
+
+
+
+
+
+// Script typed on the terminal from console_at_s, see Sim_console_advance()
+const char *Sim_console_script = NULL;
+uint32_t Sim_console_sent = 0;
+uint64_t Sim_console_next_byte = SIM_NEVER;
+// End of the transmission in progress
+uint64_t Sim_console_tx_done = SIM_NEVER;
+// Everything the firmware wrote on USART2
+char Sim_console_text[SIM_CONSOLE_OUTPUT_SIZE];
+uint32_t Sim_console_length = 0;
+
+
+
+
+
+void Sim_console_reset(const Sim_scenario_t *_scenario)
+{
+  Sim_console_script = _scenario->console;
+  Sim_console_sent = 0;
+  Sim_console_next_byte = (Sim_console_script != NULL) ? (uint64_t) _scenario->console_at_s * SIM_NS_PER_S : SIM_NEVER;
+  Sim_console_tx_done = SIM_NEVER;
+  Sim_console_length = 0;
+  Sim_console_text[0] = '\0';
+}
+
+
+
+
+
+void Sim_console_advance(uint8_t _byte)
+{
+  // Next byte of the script: back to back within a line, then a pause as
+  // an operator reading the answer before typing the next command
+  if (Sim_console_script[Sim_console_sent] == '\0') {
+    Sim_console_next_byte = SIM_NEVER;
+  } else if (_byte == '\n') {
+    Sim_console_next_byte += (uint64_t) SIM_CONSOLE_LINE_GAP_MS * SIM_NS_PER_MS;
+  } else {
+    Sim_console_next_byte += 10 * SIM_NS_PER_S / SIM_CONSOLE_BAUD;
+  }
+}
+
+
+
+
+
+uint64_t Sim_console_next()
+{
+  // Both directions are frozen in Stop
+  if (Sim_is_stopped()) {
+    return(SIM_NEVER);
+  }
+  return((Sim_console_next_byte < Sim_console_tx_done) ? Sim_console_next_byte : Sim_console_tx_done);
+}
+
+
+
+
+
+void Sim_console_fire(uint64_t _now)
+{
+  USART_TypeDef *usart = USART2;
+
+  if (Sim_console_next_byte <= _now) {
+    uint8_t byte = (uint8_t) Sim_console_script[Sim_console_sent++];
+
+    Sim_console_advance(byte);
+    if ((usart->CR1 & (USART_CR1_UE | USART_CR1_RE)) != (USART_CR1_UE | USART_CR1_RE)) {
+      Sim_stats.rx_lost++;
+    } else {
+      // Sampling clock against the line, as on USART1
+      uint64_t baud = (usart->BRR != 0) ? Sim_pclk1_hz() / usart->BRR : 0;
+      uint64_t error = (baud > SIM_CONSOLE_BAUD) ? baud - SIM_CONSOLE_BAUD : SIM_CONSOLE_BAUD - baud;
+      if (error * 1000 > (uint64_t) SIM_CONSOLE_BAUD * SIM_UART_BAUD_TOLERANCE_PERMILLE) {
+        Sim_stats.rx_framing++;
+        usart->SR |= USART_SR_FE;
+        byte ^= 0xA5;
+      }
+      if (usart->SR & USART_SR_RXNE) {
+        usart->SR |= USART_SR_ORE;
+      }
+      usart->SR |= USART_SR_RXNE;
+      usart->DR = byte;
+      if (usart->CR1 & USART_CR1_RXNEIE) {
+        Sim_pend_irq(USART2_IRQn);
+      }
+    }
+  }
+
+  if (Sim_console_tx_done <= _now) {
+    Sim_console_tx_done = SIM_NEVER;
+    usart->SR |= USART_SR_TXE | USART_SR_TC;
+    if (usart->CR1 & USART_CR1_TCIE) {
+      Sim_pend_irq(USART2_IRQn);
+    }
+  }
+}
+
+
+
+
+
+void Sim_console_resume(uint64_t _stopped_ns)
+{
+  // Input typed during the Stop is lost, the output resumes
+  while (Sim_console_next_byte != SIM_NEVER && Sim_console_next_byte < Sim_now()) {
+    Sim_stats.rx_lost++;
+    Sim_console_advance((uint8_t) Sim_console_script[Sim_console_sent++]);
+  }
+  if (Sim_console_tx_done != SIM_NEVER) {
+    Sim_console_tx_done += _stopped_ns;
+  }
+}
+
+
+
+
+
+void Sim_console_write(const uint8_t *_data, uint16_t _length, uint8_t _interrupt)
+{
+  // Firmware output on USART2. The text is taken at once, the interrupt
+  // mode transfer completes after its frames.
+  for (uint16_t i = 0; i < _length && Sim_console_length < SIM_CONSOLE_OUTPUT_SIZE - 1; i++) {
+    Sim_console_text[Sim_console_length++] = (char) _data[i];
+  }
+  Sim_console_text[Sim_console_length] = '\0';
+  if (_interrupt) {
+    USART2->SR &= ~USART_SR_TC;
+    Sim_console_tx_done = Sim_now() + (uint64_t) _length * 10 * SIM_NS_PER_S / SIM_CONSOLE_BAUD;
+  }
+}
+
+
+
+
+
+const char *Sim_console_output()
+{
+  return(Sim_console_text);
+}
@@ -0,0 +1,645 @@
+/**
+  ******************************************************************************
+  * @file           : sim_core.c
+  * @brief          : Memory map, virtual clock and interrupt dispatch of the
+  *                   host simulation
+  ******************************************************************************
+  * @attention
+  *
+  * Copyright (c) 2023 Nicolò Campanini.
+  * All rights reserved.
+  *
+  * This software is licensed under terms that can be found in the LICENSE file
+  * in the root directory of this software component.
+  * If no LICENSE file comes with this software, it is provided AS-IS.
+  *
+  ******************************************************************************
+  */
+
+#include "sim.h"
+#include "stm32f4xx_it.h"
+#include <setjmp.h>
+#include <sys/mman.h>
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+
+
+
+
+// CMSIS and HAL globals normally defined by system_stm32f4xx.c and stm32f4xx_hal.c
+uint32_t SystemCoreClock = HSI_VALUE;
+const uint8_t AHBPrescTable[16] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 2, 3, 4, 6, 7, 8, 9};
+const uint8_t APBPrescTable[8] = {0, 0, 0, 0, 1, 2, 3, 4};
+__IO uint32_t uwTick;
+uint32_t uwTickPrio = (1UL << __NVIC_PRIO_BITS);
+HAL_TickFreqTypeDef uwTickFreq = HAL_TICK_FREQ_DEFAULT;
+
+// Core state seen by the CMSIS intrinsics
+volatile uint32_t Sim_primask = 0;
+volatile uint32_t Sim_ipsr = 0;
+
+// Virtual time, end of the run and the way out of the firmware
+uint64_t Sim_time_ns = 0;
+uint64_t Sim_end_ns = SIM_NEVER;
+jmp_buf Sim_exit;
+uint8_t Sim_stopped = 0;
+// Sub-unit remainders of the cycle counter and of the HAL tick
+uint64_t Sim_cycles_rem = 0;
+uint64_t Sim_tick_rem = 0;
+
+// NVIC: the set/clear-enable and pending registers are write-one, kept here
+uint8_t Sim_nvic_enabled[SIM_IRQ_LINES];
+uint8_t Sim_nvic_pending[SIM_IRQ_LINES];
+uint8_t Sim_nvic_priority[SIM_IRQ_LINES];
+uint32_t Sim_nvic_pending_lines = 0;
+uint32_t Sim_priority_group = 0;
+
+// Handlers of stm32f4xx_it.c for the lines the simulation raises
+typedef void (*Sim_handler_t)(void);
+const Sim_handler_t Sim_vectors[SIM_IRQ_LINES] = {
+  [RTC_WKUP_IRQn] = RTC_WKUP_IRQHandler,
+  [EXTI9_5_IRQn] = EXTI9_5_IRQHandler,
+  [TIM1_UP_TIM10_IRQn] = TIM1_UP_TIM10_IRQHandler,
+  [TIM1_TRG_COM_TIM11_IRQn] = TIM1_TRG_COM_TIM11_IRQHandler,
+  [SPI2_IRQn] = SPI2_IRQHandler,
+  [USART1_IRQn] = USART1_IRQHandler,
+  [USART2_IRQn] = USART2_IRQHandler,
+  [DMA2_Stream0_IRQn] = DMA2_Stream0_IRQHandler,
+  [DMA2_Stream2_IRQn] = DMA2_Stream2_IRQHandler
+};
+
+// Event sources of the virtual clock
+typedef struct{
+  uint64_t (*next)(void);
+  void (*fire)(uint64_t _now);
+} Sim_source_t;
+
+const Sim_source_t Sim_sources[] = {
+  {Sim_periph_next, Sim_periph_fire},
+  {Sim_gps_next, Sim_gps_fire},
+  {Sim_display_next, Sim_display_fire},
+  {Sim_console_next, Sim_console_fire}
+};
+
+Sim_stats_t Sim_stats;
+const Sim_scenario_t *Sim_scenario;
+
+int Firmware_main(void);
+
+
+
+
+
+void *Sim_map_region(uintptr_t _base, size_t _size)
+{
+  void *region = mmap((void *) _base, _size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+
+  if (region != (void *) _base) {
+    fprintf(stderr, "sim: can't map 0x%08lx (%zu bytes) at its target address\n", (unsigned long) _base, _size);
+    exit(2);
+  }
+  return(region);
+}
+
+
+
+
+
+void Sim_map_memory()
+{
+  // Flash erased, registers at zero
+  memset(Sim_map_region(SIM_FLASH_BASE, SIM_FLASH_SIZE), 0xFF, SIM_FLASH_SIZE);
+  Sim_map_region(SIM_PERIPH_BASE, SIM_PERIPH_SIZE);
+  // Bit-band writes (RCC_BDCR RTCEN, PWR_CR DBP) land in plain memory
+  Sim_map_region(SIM_BITBAND_BASE, SIM_BITBAND_SIZE);
+  Sim_map_region(SIM_CORE_BASE, SIM_CORE_SIZE);
+}
+
+
+
+
+
+void Sim_reset_core()
+{
+  // Reset values the firmware depends on
+  RCC->CR = RCC_CR_HSION | RCC_CR_HSIRDY | (0x10 << RCC_CR_HSITRIM_Pos);
+  RCC->CFGR = RCC_CFGR_SW_HSI | RCC_CFGR_SWS_HSI;
+  RCC->PLLCFGR = 0x24003010;
+  FLASH->CR = FLASH_CR_LOCK;
+  SystemCoreClock = HSI_VALUE;
+
+  Sim_time_ns = 0;
+  Sim_stopped = 0;
+  Sim_cycles_rem = 0;
+  Sim_tick_rem = 0;
+  Sim_primask = 0;
+  Sim_ipsr = 0;
+  uwTick = 0;
+  memset(Sim_nvic_enabled, 0, sizeof(Sim_nvic_enabled));
+  memset(Sim_nvic_pending, 0, sizeof(Sim_nvic_pending));
+  Sim_nvic_pending_lines = 0;
+  memset(Sim_nvic_priority, 0, sizeof(Sim_nvic_priority));
+  memset(&Sim_stats, 0, sizeof(Sim_stats));
+}
+
+
+
+
+
+uint64_t Sim_now()
+{
+  return(Sim_time_ns);
+}
+
+
+
+
+
+void Sim_set_end(uint64_t _end_ns)
+{
+  Sim_end_ns = _end_ns;
+}
+
+
+
+
+
+uint8_t Sim_is_stopped()
+{
+  return(Sim_stopped);
+}
+
+
+
+
+
+uint32_t Sim_sysclk_hz()
+{
+  uint32_t pllcfgr = RCC->PLLCFGR;
+  uint64_t input = 0;
+
+  switch (RCC->CFGR & RCC_CFGR_SWS) {
+    case RCC_CFGR_SWS_HSE:
+      return(HSE_VALUE);
+    case RCC_CFGR_SWS_PLL:
+      input = (pllcfgr & RCC_PLLCFGR_PLLSRC) ? HSE_VALUE : HSI_VALUE;
+      return((uint32_t) (input * ((pllcfgr & RCC_PLLCFGR_PLLN) >> RCC_PLLCFGR_PLLN_Pos) /
+                         (pllcfgr & RCC_PLLCFGR_PLLM) /
+                         ((((pllcfgr & RCC_PLLCFGR_PLLP) >> RCC_PLLCFGR_PLLP_Pos) + 1) * 2)));
+    default:
+      return(HSI_VALUE);
+  }
+}
+
+
+
+
+
+uint32_t Sim_hclk_hz()
+{
+  return(Sim_sysclk_hz() >> AHBPrescTable[(RCC->CFGR & RCC_CFGR_HPRE) >> RCC_CFGR_HPRE_Pos]);
+}
+
+
+
+
+
+uint32_t Sim_pclk1_hz()
+{
+  return(Sim_hclk_hz() >> APBPrescTable[(RCC->CFGR & RCC_CFGR_PPRE1) >> RCC_CFGR_PPRE1_Pos]);
+}
+
+
+
+
+
+uint32_t Sim_pclk2_hz()
+{
+  return(Sim_hclk_hz() >> APBPrescTable[(RCC->CFGR & RCC_CFGR_PPRE2) >> RCC_CFGR_PPRE2_Pos]);
+}
+
+
+
+
+
+uint32_t Sim_timer_clock_hz(TIM_TypeDef *_tim)
+{
+  // Timers run at twice the APB clock when the APB is divided
+  if ((uintptr_t) _tim >= APB2PERIPH_BASE) {
+    return(((RCC->CFGR & RCC_CFGR_PPRE2) == RCC_CFGR_PPRE2_DIV1) ? Sim_pclk2_hz() : 2 * Sim_pclk2_hz());
+  }
+  return(((RCC->CFGR & RCC_CFGR_PPRE1) == RCC_CFGR_PPRE1_DIV1) ? Sim_pclk1_hz() : 2 * Sim_pclk1_hz());
+}
+
+
+
+
+
+void Sim_advance(uint64_t _t)
+{
+  uint64_t dt = _t - Sim_time_ns;
+
+  // In Stop the core clock and the SysTick are off
+  if (Sim_stopped == 0) {
+    if (DWT->CTRL & DWT_CTRL_CYCCNTENA_Msk) {
+      unsigned __int128 cycles = (unsigned __int128) dt * SystemCoreClock + Sim_cycles_rem;
+      DWT->CYCCNT += (uint32_t) (cycles / SIM_NS_PER_S);
+      Sim_cycles_rem = (uint64_t) (cycles % SIM_NS_PER_S);
+    }
+    // The HAL tick moves by the elapsed ms, the SysTick handler itself is
+    // not run 1000 times per virtual second
+    if ((SysTick->CTRL & (SysTick_CTRL_ENABLE_Msk | SysTick_CTRL_TICKINT_Msk)) ==
+        (SysTick_CTRL_ENABLE_Msk | SysTick_CTRL_TICKINT_Msk)) {
+      Sim_tick_rem += dt;
+      uwTick += (uint32_t) (Sim_tick_rem / SIM_NS_PER_MS);
+      Sim_tick_rem %= SIM_NS_PER_MS;
+      SysTick->VAL = SysTick->LOAD - (uint32_t) ((Sim_tick_rem * (SysTick->LOAD + 1)) / SIM_NS_PER_MS);
+    }
+  }
+
+  Sim_periph_advance(_t);
+  Sim_time_ns = _t;
+  Sim_rtc_update(_t);
+}
+
+
+
+
+
+void Sim_step()
+{
+  uint64_t next = SIM_NEVER;
+  uint8_t sources = sizeof(Sim_sources) / sizeof(Sim_sources[0]);
+
+  // Pick up the register writes done by the firmware since the last step
+  Sim_periph_sync();
+
+  for (uint8_t s = 0; s < sources; s++) {
+    uint64_t t = Sim_sources[s].next();
+    if (t < next) {
+      next = t;
+    }
+  }
+
+  if (next >= Sim_end_ns) {
+    longjmp(Sim_exit, 1);
+  }
+  if (next > Sim_time_ns) {
+    Sim_advance(next);
+  }
+
+  for (uint8_t s = 0; s < sources; s++) {
+    if (Sim_sources[s].next() <= Sim_time_ns) {
+      Sim_sources[s].fire(Sim_time_ns);
+    }
+  }
+  Sim_stats.events++;
+}
+
+
+
+
+
+uint8_t Sim_irq_waiting()
+{
+  if (SCB->ICSR & SCB_ICSR_PENDSVSET_Msk) {
+    return 1;
+  }
+  if (Sim_nvic_pending_lines == 0) {
+    return 0;
+  }
+  for (uint8_t i = 0; i < SIM_IRQ_LINES; i++) {
+    if (Sim_nvic_pending[i] && Sim_nvic_enabled[i]) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+
+
+
+
+void Sim_dispatch()
+{
+  // No nesting: a handler runs to completion before the next one
+  if (Sim_ipsr != 0) {
+    return;
+  }
+
+  while (Sim_primask == 0) {
+    // SysTick (-1) is never dispatched, it marks "nothing pending"
+    int16_t best = SysTick_IRQn;
+    uint32_t best_priority = 0x100;
+
+    // PendSV first on equal priority, as its exception number is lower
+    if (SCB->ICSR & SCB_ICSR_PENDSVCLR_Msk) {
+      SCB->ICSR &= ~(SCB_ICSR_PENDSVSET_Msk | SCB_ICSR_PENDSVCLR_Msk);
+    }
+    if (SCB->ICSR & SCB_ICSR_PENDSVSET_Msk) {
+      best = PendSV_IRQn;
+      best_priority = SCB->SHP[(PendSV_IRQn & 0xF) - 4] >> (8 - __NVIC_PRIO_BITS);
+    }
+    for (uint8_t i = 0; i < SIM_IRQ_LINES && Sim_nvic_pending_lines > 0; i++) {
+      if (Sim_nvic_pending[i] && Sim_nvic_enabled[i] && Sim_nvic_priority[i] < best_priority) {
+        best = i;
+        best_priority = Sim_nvic_priority[i];
+      }
+    }
+    if (best == SysTick_IRQn) {
+      return;
+    }
+
+    Sim_stats.interrupts++;
+    if (best == PendSV_IRQn) {
+      SCB->ICSR &= ~SCB_ICSR_PENDSVSET_Msk;
+      Sim_ipsr = PendSV_IRQn + 16;
+      PendSV_Handler();
+    } else {
+      Sim_NVIC_ClearPendingIRQ(best);
+      Sim_ipsr = best + 16;
+      if (Sim_vectors[best] != NULL) {
+        Sim_vectors[best]();
+      }
+    }
+    Sim_ipsr = 0;
+  }
+}
+
+
+
+
+
+void Sim_irq_unmasked()
+{
+  Sim_dispatch();
+}
+
+
+
+
+
+void Sim_cycle()
+{
+  // One core clock period, rounded up to the next ns
+  Sim_advance(Sim_time_ns + (SIM_NS_PER_S + SystemCoreClock - 1) / SystemCoreClock);
+}
+
+
+
+
+
+void Sim_wfi()
+{
+  // Sleep: the clocks keep running, any enabled interrupt wakes the core
+  // (even with PRIMASK set, the handlers then run when it is cleared)
+  while (Sim_irq_waiting() == 0) {
+    Sim_step();
+  }
+  Sim_dispatch();
+}
+
+
+
+
+
+void Sim_stop_mode()
+{
+  // Stop: only the EXTI lines (RTC wakeup, RX start bit) wake the core,
+  // the timers, the USART and the SPI are frozen
+  uint64_t start = Sim_time_ns;
+
+  Sim_stopped = 1;
+  Sim_stats.stops++;
+  while (Sim_irq_waiting() == 0) {
+    Sim_step();
+  }
+  Sim_stopped = 0;
+  Sim_stats.stop_ns += Sim_time_ns - start;
+  Sim_periph_resume(Sim_time_ns - start);
+  Sim_console_resume(Sim_time_ns - start);
+}
+
+
+
+
+
+void Sim_pend_irq(IRQn_Type _irq)
+{
+  Sim_NVIC_SetPendingIRQ(_irq);
+}
+
+
+
+
+
+void Sim_breakpoint(uint32_t _value)
+{
+  fprintf(stderr, "sim: breakpoint %lu at %.3f s\n", (unsigned long) _value, (double) Sim_time_ns / SIM_NS_PER_S);
+  abort();
+}
+
+
+
+
+
+void Sim_NVIC_SetPriorityGrouping(uint32_t PriorityGroup)
+{
+  Sim_priority_group = PriorityGroup & 0x7;
+  SCB->AIRCR = (0x5FAUL << SCB_AIRCR_VECTKEY_Pos) | (Sim_priority_group << SCB_AIRCR_PRIGROUP_Pos);
+}
+
+
+
+
+
+uint32_t Sim_NVIC_GetPriorityGrouping(void)
+{
+  return(Sim_priority_group);
+}
+
+
+
+
+
+void Sim_NVIC_EnableIRQ(IRQn_Type IRQn)
+{
+  if (IRQn >= 0) {
+    Sim_nvic_enabled[IRQn] = 1;
+  }
+}
+
+
+
+
+
+uint32_t Sim_NVIC_GetEnableIRQ(IRQn_Type IRQn)
+{
+  return((IRQn >= 0) ? Sim_nvic_enabled[IRQn] : 0);
+}
+
+
+
+
+
+void Sim_NVIC_DisableIRQ(IRQn_Type IRQn)
+{
+  if (IRQn >= 0) {
+    Sim_nvic_enabled[IRQn] = 0;
+  }
+}
+
+
+
+
+
+uint32_t Sim_NVIC_GetPendingIRQ(IRQn_Type IRQn)
+{
+  return((IRQn >= 0) ? Sim_nvic_pending[IRQn] : 0);
+}
+
+
+
+
+
+void Sim_NVIC_SetPendingIRQ(IRQn_Type IRQn)
+{
+  if (IRQn >= 0 && Sim_nvic_pending[IRQn] == 0) {
+    Sim_nvic_pending[IRQn] = 1;
+    Sim_nvic_pending_lines++;
+  }
+}
+
+
+
+
+
+void Sim_NVIC_ClearPendingIRQ(IRQn_Type IRQn)
+{
+  if (IRQn >= 0 && Sim_nvic_pending[IRQn] != 0) {
+    Sim_nvic_pending[IRQn] = 0;
+    Sim_nvic_pending_lines--;
+  }
+}
+
+
+
+
+
+uint32_t Sim_NVIC_GetActive(IRQn_Type IRQn)
+{
+  return(Sim_ipsr == (uint32_t) (IRQn + 16));
+}
+
+
+
+
+
+void Sim_NVIC_SetPriority(IRQn_Type IRQn, uint32_t priority)
+{
+  uint8_t value = (uint8_t) ((priority << (8 - __NVIC_PRIO_BITS)) & 0xFF);
+
+  if (IRQn >= 0) {
+    Sim_nvic_priority[IRQn] = value >> (8 - __NVIC_PRIO_BITS);
+    NVIC->IP[IRQn] = value;
+  } else {
+    SCB->SHP[(((uint32_t) IRQn) & 0xF) - 4] = value;
+  }
+}
+
+
+
+
+
+uint32_t Sim_NVIC_GetPriority(IRQn_Type IRQn)
+{
+  if (IRQn >= 0) {
+    return(Sim_nvic_priority[IRQn]);
+  }
+  return(SCB->SHP[(((uint32_t) IRQn) & 0xF) - 4] >> (8 - __NVIC_PRIO_BITS));
+}
+
+
+
+
+
+void Sim_NVIC_SystemReset(void)
+{
+  // A reset ends the run: the firmware RAM is not re-initialized in place
+  fprintf(stderr, "sim: system reset at %.3f s\n", (double) Sim_time_ns / SIM_NS_PER_S);
+  longjmp(Sim_exit, 2);
+}
+
+
+
+
+
+void Sim_watchdog_reset()
+{
+  // The IWDG expired: a reset, as Sim_NVIC_SystemReset()
+  fprintf(stderr, "sim: watchdog reset at %.3f s\n", (double) Sim_time_ns / SIM_NS_PER_S);
+  longjmp(Sim_exit, 2);
+}
+
+
+
+
+
+int64_t Sim_days_from_civil(int32_t _year, uint8_t _month, uint8_t _day)
+{
+  // Days since 1970-01-01 of a proleptic Gregorian date
+  int32_t year = (_month <= 2) ? _year - 1 : _year;
+  int32_t era = (year >= 0 ? year : year - 399) / 400;
+  uint32_t year_of_era = (uint32_t) (year - era * 400);
+  uint32_t day_of_year = (153 * (_month + (_month > 2 ? -3 : 9)) + 2) / 5 + _day - 1;
+  uint32_t day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+
+  return((int64_t) era * 146097 + (int64_t) day_of_era - 719468);
+}
+
+
+
+
+
+void Sim_civil_from_days(int64_t _days, int32_t *_year, uint8_t *_month, uint8_t *_day)
+{
+  // Inverse of Sim_days_from_civil()
+  int64_t z = _days + 719468;
+  int64_t era = (z >= 0 ? z : z - 146096) / 146097;
+  uint32_t day_of_era = (uint32_t) (z - era * 146097);
+  uint32_t year_of_era = (day_of_era - day_of_era / 1460 + day_of_era / 36524 - day_of_era / 146096) / 365;
+  uint32_t day_of_year = day_of_era - (365 * year_of_era + year_of_era / 4 - year_of_era / 100);
+  uint32_t mp = (5 * day_of_year + 2) / 153;
+
+  *_day = (uint8_t) (day_of_year - (153 * mp + 2) / 5 + 1);
+  *_month = (uint8_t) (mp < 10 ? mp + 3 : mp - 9);
+  *_year = (int32_t) (year_of_era + era * 400 + (*_month <= 2));
+}
+
+
+
+
+
+int Sim_run_firmware(const Sim_scenario_t *_scenario)
+{
+  int reason = 0;
+
+  Sim_scenario = _scenario;
+  Sim_reset_core();
+  Sim_periph_reset(_scenario);
+  Sim_gps_reset(_scenario);
+  Sim_display_reset(_scenario);
+  Sim_console_reset(_scenario);
+  Sim_end_ns = (uint64_t) _scenario->duration_s * SIM_NS_PER_S;
+
+  // The firmware never returns: the virtual clock jumps out at the end
+  reason = setjmp(Sim_exit);
+  if (reason == 0) {
+    Firmware_main();
+  }
+  return(reason);
+}
@@ -0,0 +1,546 @@
+/**
+  ******************************************************************************
+  * @file           : sim_display.c
+  * @brief          : HV5530 drivers of the host simulation: shift register,
+  *                   latch decoder and checks on what the tubes show
+  ******************************************************************************
+  * @attention
+  *
+  * Copyright (c) 2023 Nicolò Campanini.
+  * All rights reserved.
+  *
+  * This software is licensed under terms that can be found in the LICENSE file
+  * in the root directory of this software component.
+  * If no LICENSE file comes with this software, it is provided AS-IS.
+  *
+  ******************************************************************************
+  */
+
+#include "sim.h"
+#include "nixie_display.h"
+#include "nixie_night.h"
+#include "config.h"
+#include <math.h>
+
+
+
+
+
+// A frame of a sequence stays on the tubes up to the next display tick
+#define SIM_SEQUENCE_HOLD_NS (100 * SIM_NS_PER_MS)
+// Night schedule edges: the ramp and the minute resolution of the schedule
+#define SIM_NIGHT_MARGIN_S 90
+// Sun edges: the firmware algorithm against the one of the sim, ~1 min each
+#define SIM_SUN_MARGIN_S 240
+// Polar day or night: both must agree away from the boundary days. Times
+// compared only with the sun crossing the horizon at a steep enough angle
+#define SIM_SUN_POLAR_MARGIN 0.02
+#define SIM_SUN_GRAZING 0.9
+
+// The two HV5530 in chain: the bits shifted in, and the outputs latched
+uint64_t Sim_shift = 0;
+uint64_t Sim_latched = 0;
+GPIO_PinState Sim_latch_pin = GPIO_PIN_RESET;
+uint8_t Sim_digits[NIXIE_TUBES];
+uint8_t Sim_digits_valid = 0;
+// Last latch and the tubes lit then, for the on-time of the cathodes
+uint64_t Sim_latch_ns = 0;
+uint8_t Sim_latch_lit = 0;
+
+// Shown time at the last latch, to spot the second edges and the DST jumps
+int32_t Sim_last_shown_s = -1;
+int32_t Sim_last_offset_h = 99;
+uint64_t Sim_sequence_ns = 0;
+uint8_t Sim_sequence_seen = 0;
+// RTC write in effect at the last latch: a second edge made by a write
+// (the step of a sync) carries the drift from before it
+uint64_t Sim_latch_set_ns = 0;
+
+// Mid-second check, once per true second
+uint64_t Sim_check_next = 0;
+Sim_display_stats_t Sim_display_stats;
+
+
+
+
+
+void Sim_display_reset(const Sim_scenario_t *_scenario)
+{
+  Sim_shift = 0;
+  Sim_latched = 0;
+  Sim_latch_pin = GPIO_PIN_RESET;
+  Sim_digits_valid = 0;
+  Sim_latch_ns = 0;
+  Sim_latch_lit = 0;
+  Sim_last_shown_s = -1;
+  Sim_last_offset_h = 99;
+  Sim_sequence_ns = 0;
+  Sim_sequence_seen = 0;
+  Sim_latch_set_ns = 0;
+  Sim_check_next = SIM_NS_PER_S / 2;
+  memset(&Sim_display_stats, 0, sizeof(Sim_display_stats));
+}
+
+
+
+
+
+int32_t Sim_local_offset_s(int64_t _utc)
+{
+  // CET / CEST: summer time from 01:00 UTC of the last Sunday of March to
+  // 01:00 UTC of the last Sunday of October (1970-01-01 was a Thursday)
+  int32_t year = 0;
+  uint8_t month = 0;
+  uint8_t day = 0;
+  int64_t march = 0;
+  int64_t october = 0;
+
+  Sim_civil_from_days(_utc / 86400, &year, &month, &day);
+  march = Sim_days_from_civil(year, 3, 31);
+  march -= (march + 4) % 7;
+  october = Sim_days_from_civil(year, 10, 31);
+  october -= (october + 4) % 7;
+
+  if (_utc > march * 86400 + 3600 && _utc < october * 86400 + 3600) {
+    return(7200);
+  }
+  return(3600);
+}
+
+
+
+
+
+uint8_t Sim_display_lit()
+{
+  // HV on (HV_OFF low) and the PWM of TIM1 channel 1 really driving the supply
+  return((HV_OFF_GPIO_Port->ODR & HV_OFF_Pin) == 0 && (TIM1->CR1 & TIM_CR1_CEN) && (TIM1->BDTR & TIM_BDTR_MOE) &&
+         (TIM1->CCER & TIM_CCER_CC1E) && TIM1->CCR1 > 0);
+}
+
+
+
+
+
+uint8_t Sim_display_synced()
+{
+  // The time shown can be checked once the RTC was written after a fix
+  if (Sim_scenario->rtc_kept) {
+    return(1);
+  }
+  return(Sim_gps_first_fix() != SIM_NEVER && Sim_rtc_last_set() >= Sim_gps_first_fix());
+}
+
+
+
+
+
+int64_t Sim_display_allowed_ms(uint64_t _now)
+{
+  // Tolerance plus the LSE drift accumulated since the last RTC write, or
+  // the one before for the edge made by a write
+  uint64_t since = (Sim_latch_set_ns < Sim_rtc_last_set()) ? Sim_latch_set_ns : Sim_rtc_last_set();
+  uint64_t elapsed = _now - since;
+  uint64_t ppm = (uint64_t) ((Sim_scenario->rtc_ppm < 0) ? -Sim_scenario->rtc_ppm : Sim_scenario->rtc_ppm);
+
+  return((int64_t) Sim_scenario->tolerance_ms + (int64_t) (elapsed / SIM_NS_PER_MS * ppm / 1000000));
+}
+
+
+
+
+
+int64_t Sim_local_ms(uint64_t _now)
+{
+  // True local time of day, in ms
+  int64_t utc = Sim_true_utc(_now);
+  int64_t local = utc + Sim_local_offset_s(utc);
+
+  return((local % 86400) * 1000 + (int64_t) ((_now % SIM_NS_PER_S) / SIM_NS_PER_MS));
+}
+
+
+
+
+
+int64_t Sim_wrap_ms(int64_t _ms)
+{
+  // Difference of two times of day, in -12 h .. +12 h
+  _ms %= 86400000;
+  if (_ms >= 43200000) {
+    _ms -= 86400000;
+  }
+  if (_ms < -43200000) {
+    _ms += 86400000;
+  }
+  return(_ms);
+}
+
+
+
+
+
+int32_t Sim_shown_seconds()
+{
+  // Time of day on the tubes, -1 if a tube is blank
+  for (uint8_t t = 0; t < NIXIE_TUBES; t++) {
+    if (Sim_digits[t] >= NIXIE_DIGITS) {
+      return(-1);
+    }
+  }
+  return((Sim_digits[0] * 10 + Sim_digits[1]) * 3600 + (Sim_digits[2] * 10 + Sim_digits[3]) * 60 +
+         Sim_digits[4] * 10 + Sim_digits[5]);
+}
+
+
+
+
+
+void Sim_display_log(const char *_what, int64_t _error_ms)
+{
+  int64_t local = Sim_local_ms(Sim_now()) / 1000;
+
+  if (Sim_scenario->verbose) {
+    fprintf(stderr, "  %10.3f s  %-12s shown %u%u:%u%u:%u%u  expected %02u:%02u:%02u  error %lld ms\n",
+            (double) Sim_now() / SIM_NS_PER_S, _what, Sim_digits[0], Sim_digits[1], Sim_digits[2], Sim_digits[3],
+            Sim_digits[4], Sim_digits[5], (unsigned) (local / 3600), (unsigned) ((local / 60) % 60),
+            (unsigned) (local % 60), (long long) _error_ms);
+  }
+}
+
+
+
+
+
+void Sim_display_latch()
+{
+  // Outputs follow the shift register: driver 2 in the high word, driver 1 low
+  uint32_t driver_1 = (uint32_t) Sim_latched;
+  uint32_t driver_2 = (uint32_t) (Sim_latched >> 32);
+  uint32_t fields[NIXIE_TUBES] = {
+    driver_1 >> 21, driver_1 >> 11, driver_1,
+    driver_2 >> 21, driver_2 >> 10, driver_2
+  };
+  uint8_t ghost = 0;
+  uint64_t now = Sim_now();
+  int32_t shown = 0;
+
+  // On-time of the cathodes of the frame ending here, for the usage
+  // counters of the firmware
+  for (uint8_t t = 0; t < NIXIE_TUBES && Sim_digits_valid && Sim_latch_lit; t++) {
+    if (Sim_digits[t] < NIXIE_DIGITS) {
+      Sim_display_stats.shown_ns[t][Sim_digits[t]] += now - Sim_latch_ns;
+    }
+  }
+  Sim_latch_ns = now;
+  Sim_latch_lit = Sim_display_lit();
+
+  Sim_display_stats.latches++;
+  for (uint8_t t = 0; t < NIXIE_TUBES; t++) {
+    uint32_t cathodes = fields[t] & ((1U << NIXIE_DIGITS) - 1);
+    Sim_digits[t] = cathodes ? (uint8_t) __builtin_ctz(cathodes) : NIXIE_BLANK;
+    if (cathodes & (cathodes - 1)) {
+      ghost = 1;
+    }
+  }
+  Sim_digits_valid = 1;
+  Sim_display_stats.ghost_frames += ghost;
+
+  // Sequence frames are not a time
+  if (Nixie_sequence_active()) {
+    Sim_sequence_ns = now;
+    Sim_sequence_seen = 1;
+    Sim_last_shown_s = -1;
+    return;
+  }
+
+  shown = Sim_shown_seconds();
+  if (shown < 0 || !Sim_display_synced()) {
+    Sim_last_shown_s = -1;
+    return;
+  }
+
+  // Second edge: how late (or early) the tubes turned to the new second
+  if (Sim_last_shown_s >= 0 && shown == (Sim_last_shown_s + 1) % 86400 && Sim_display_lit()) {
+    int64_t error = Sim_wrap_ms(Sim_local_ms(now) - (int64_t) shown * 1000);
+    int64_t magnitude = (error < 0) ? -error : error;
+
+    Sim_display_stats.checks++;
+    if (magnitude > Sim_display_allowed_ms(now)) {
+      Sim_display_stats.failed++;
+      Sim_display_log("late edge", error);
+    } else {
+      Sim_display_stats.passed++;
+    }
+    if (magnitude > Sim_display_stats.max_error_ms) {
+      Sim_display_stats.max_error_ms = (int32_t) magnitude;
+    }
+  }
+
+  // Offset from UTC on the lit tubes, to the hour: a change is a DST switch
+  if (shown != Sim_last_shown_s && Sim_display_lit()) {
+    int64_t offset_ms = Sim_wrap_ms((int64_t) shown * 1000 - (Sim_true_utc(now) % 86400) * 1000);
+    int32_t offset_h = (int32_t) ((offset_ms + ((offset_ms < 0) ? -1800000 : 1800000)) / 3600000);
+
+    if (Sim_last_offset_h != 99 && offset_h != Sim_last_offset_h) {
+      Sim_display_stats.dst_changes++;
+      Sim_display_log("offset", offset_h - Sim_last_offset_h);
+    }
+    Sim_last_offset_h = offset_h;
+  }
+  Sim_last_shown_s = shown;
+  Sim_latch_set_ns = Sim_rtc_last_set();
+}
+
+
+
+
+
+void Sim_display_shift(uint8_t _byte)
+{
+  // MSB first, the first byte ends in the far driver
+  Sim_shift = (Sim_shift << 8) | _byte;
+}
+
+
+
+
+
+void Sim_display_gpio(GPIO_TypeDef *_port, uint16_t _pin, GPIO_PinState _state)
+{
+  // The outputs are loaded on the rising edge of LATCH_EN
+  if (_port == LATCH_EN_GPIO_Port && (_pin & LATCH_EN_Pin)) {
+    if (_state == GPIO_PIN_SET && Sim_latch_pin == GPIO_PIN_RESET) {
+      Sim_latched = Sim_shift;
+      Sim_display_latch();
+    }
+    Sim_latch_pin = _state;
+  }
+}
+
+
+
+
+
+uint8_t Sim_display_shown(uint8_t *_digits)
+{
+  memcpy(_digits, Sim_digits, NIXIE_TUBES);
+  return(Sim_digits_valid && Sim_display_lit());
+}
+
+
+
+
+
+int32_t Sim_sun_minute(int32_t _day_of_year, uint8_t _rising, int32_t _offset_min, double _latitude,
+                       double _longitude, double *_cos_h)
+{
+  // NOAA equation of time and declination (not the algorithm of the
+  // firmware), local minute of the day, -1 = the sun doesn't rise/set
+  double gamma = 2 * M_PI / 365 * (_day_of_year - 1);
+  double eqtime = 229.18 * (0.000075 + 0.001868 * cos(gamma) - 0.032077 * sin(gamma) -
+                            0.014615 * cos(2 * gamma) - 0.040849 * sin(2 * gamma));
+  double decl = 0.006918 - 0.399912 * cos(gamma) + 0.070257 * sin(gamma) - 0.006758 * cos(2 * gamma) +
+                0.000907 * sin(2 * gamma) - 0.002697 * cos(3 * gamma) + 0.00148 * sin(3 * gamma);
+  double lat = _latitude * M_PI / 180;
+  double cos_h = cos(90.833 * M_PI / 180) / (cos(lat) * cos(decl)) - tan(lat) * tan(decl);
+  double h = 0;
+  int32_t minute = 0;
+
+  if (_cos_h != NULL) {
+    *_cos_h = cos_h;
+  }
+  if (cos_h > 1 || cos_h < -1) {
+    return(-1);
+  }
+  h = acos(cos_h) * 180 / M_PI;
+  minute = (int32_t) lround(720 - 4 * (_longitude + (_rising ? h : -h)) - eqtime) + _offset_min;
+  minute %= 1440;
+  return((minute < 0) ? minute + 1440 : minute);
+}
+
+
+
+
+
+uint32_t Sim_sun_check(uint32_t *_max_error_min)
+{
+  // Nixie_night_sun_minute() against Sim_sun_minute() on every day of a
+  // year, at a few places: the days off by more than the tolerance of the
+  // place (the sun grazing the horizon at high latitudes makes the two
+  // algorithms drift apart), polar days that differ, and the largest
+  // error at the default location
+  static const int16_t places[][3] = {
+    {4546, 919, 3},       // Milan, the default
+    {-22, -7851, 3},      // Quito, on the equator
+    {-3387, 15121, 3},    // Sydney, southern hemisphere
+    {6415, -2194, 6},     // Reykjavik, long days and nights
+    {7822, 1565, 20}      // Longyearbyen, polar day and night
+  };
+  int16_t latitude = Config.latitude_cdeg;
+  int16_t longitude = Config.longitude_cdeg;
+  uint32_t failed = 0;
+
+  *_max_error_min = 0;
+  for (uint8_t p = 0; p < sizeof(places) / sizeof(places[0]); p++) {
+    int32_t offset_min = (int32_t) lround(places[p][1] / 1500.0) * 60;
+
+    Config.latitude_cdeg = places[p][0];
+    Config.longitude_cdeg = places[p][1];
+    for (uint16_t day = 1; day <= 365; day++) {
+      for (uint8_t rising = 0; rising <= 1; rising++) {
+        double cos_h = 0;
+        int32_t expected = Sim_sun_minute(day, rising, offset_min, places[p][0] / 100.0, places[p][1] / 100.0,
+                                          &cos_h);
+        int32_t minute = Nixie_night_sun_minute(day, rising, (int16_t) offset_min);
+        int32_t error = 0;
+
+        if (expected < 0 || minute < 0) {
+          // Near the boundary days either one may still see the sun
+          failed += (expected < 0) != (minute < 0) && fabs(fabs(cos_h) - 1) > SIM_SUN_POLAR_MARGIN;
+          continue;
+        }
+        if (fabs(cos_h) > SIM_SUN_GRAZING) {
+          continue;
+        }
+        error = abs((int32_t) (Sim_wrap_ms((int64_t) (minute - expected) * 60000) / 60000));
+        failed += (error > places[p][2]);
+        if (p == 0 && (uint32_t) error > *_max_error_min) {
+          *_max_error_min = (uint32_t) error;
+        }
+      }
+    }
+  }
+  Config.latitude_cdeg = latitude;
+  Config.longitude_cdeg = longitude;
+  return(failed);
+}
+
+
+
+
+
+uint8_t Sim_night_expected(uint64_t _now, uint8_t *_dark)
+{
+  // Expected state from the configured window (of the local day, from
+  // the sunset for its own weekday), 0 close to its edges
+  int64_t utc = Sim_true_utc(_now);
+  int32_t offset = Sim_local_offset_s(utc);
+  int64_t local = utc + offset;
+  int64_t day = local / 86400;
+  int32_t second = (int32_t) (local % 86400);
+  int32_t off = Sim_scenario->night_off_min * 60;
+  int32_t on = Sim_scenario->night_on_min * 60;
+  int32_t margin = SIM_NIGHT_MARGIN_S;
+  const Sim_night_day_t *night_day = Sim_scenario->night_day;
+  int32_t to_off = 0;
+  int32_t to_on = 0;
+
+  if (Sim_scenario->night_off_min < 0) {
+    return(0);
+  }
+  if (night_day != NULL && (day + 4) % 7 == night_day->weekday) {
+    int32_t year = 0;
+    uint8_t month = 0;
+    uint8_t date = 0;
+    int32_t sunset = 0;
+
+    Sim_civil_from_days(day, &year, &month, &date);
+    sunset = Sim_sun_minute((int32_t) (day - Sim_days_from_civil(year, 1, 1) + 1), 0, offset / 60,
+                            NIGHT_LATITUDE_CDEG / 100.0, NIGHT_LONGITUDE_CDEG / 100.0, NULL);
+    on = night_day->on_min * 60;
+    off = (sunset + night_day->off_after_sunset_min) * 60;
+    margin = SIM_SUN_MARGIN_S;
+  }
+  to_off = (int32_t) Sim_wrap_ms((int64_t) (second - off) * 1000) / 1000;
+  to_on = (int32_t) Sim_wrap_ms((int64_t) (second - on) * 1000) / 1000;
+  if (abs(to_off) < margin || abs(to_on) < margin) {
+    return(0);
+  }
+  // Dark from the off minute to the on minute, across midnight
+  if (off > on) {
+    *_dark = (second >= off || second < on);
+  } else {
+    *_dark = (second >= off && second < on);
+  }
+  return(1);
+}
+
+
+
+
+
+uint64_t Sim_display_next()
+{
+  return(Sim_check_next);
+}
+
+
+
+
+
+void Sim_display_fire(uint64_t _now)
+{
+  // Mid second: the tubes must show the second being lived
+  int32_t shown = Sim_shown_seconds();
+  int64_t local = Sim_local_ms(_now);
+  int64_t day_error = 0;
+  uint8_t dark = 0;
+
+  Sim_check_next += SIM_NS_PER_S;
+
+  if (!Sim_display_synced()) {
+    Sim_display_stats.unsynced++;
+    return;
+  }
+  // The tubes show no date: a wrong one (a receiver rollover) would only
+  // come out at the DST and the night schedule, check the RTC day itself
+  day_error = Sim_rtc_seconds() / 86400 - (Sim_true_utc(_now) / 86400 - Sim_days_from_civil(2000, 1, 1));
+  if (day_error > 1 || day_error < -1) {
+    Sim_display_stats.calendar_failed++;
+    Sim_display_log("calendar", day_error);
+  }
+  if (Nixie_sequence_active() || (Sim_sequence_seen && _now - Sim_sequence_ns < SIM_SEQUENCE_HOLD_NS)) {
+    Sim_display_stats.sequences++;
+    return;
+  }
+
+  if (!Sim_display_lit()) {
+    Sim_display_stats.dark++;
+    if (Sim_night_expected(_now, &dark) && !dark) {
+      Sim_display_stats.night_failed++;
+      Sim_display_log("dark", 0);
+    }
+    return;
+  }
+  if (Sim_night_expected(_now, &dark) && dark) {
+    Sim_display_stats.night_failed++;
+    Sim_display_log("lit at night", 0);
+  }
+
+  // The shown second spans [shown, shown + 1 s): distance of the true time from it
+  Sim_display_stats.checks++;
+  if (shown >= 0) {
+    int64_t error = Sim_wrap_ms(local - (int64_t) shown * 1000);
+    int64_t distance = (error < 0) ? -error : ((error > 1000) ? error - 1000 : 0);
+
+    if (distance <= Sim_display_allowed_ms(_now)) {
+      Sim_display_stats.passed++;
+      return;
+    }
+    Sim_display_stats.failed++;
+    Sim_display_log("mid second", error);
+    return;
+  }
+  Sim_display_stats.failed++;
+  Sim_display_log("blank", 0);
+}
+
+
+
+
+
+void Sim_display_get_stats(Sim_display_stats_t *_stats)
+{
+  *_stats = Sim_display_stats;
+}
@@ -0,0 +1,154 @@
+/**
+  ******************************************************************************
+  * @file           : sim_gps.c
+  * @brief          : NMEA 0183 receiver of the host simulation
+  ******************************************************************************
+  * @attention
+  *
+  * Copyright (c) 2023 Nicolò Campanini.
+  * All rights reserved.
+  *
+  * This software is licensed under terms that can be found in the LICENSE file
+  * in the root directory of this software component.
+  * If no LICENSE file comes with this software, it is provided AS-IS.
+  *
+  ******************************************************************************
+  */
+
+#include "sim.h"
+
+
+
+
+
+// Next burst: one per true UTC second, gps_latency_ms after the PPS edge
+uint64_t Sim_gps_second = 0;
+uint64_t Sim_gps_first_fix_ns = SIM_NEVER;
+uint16_t Sim_gps_latency_ms = 0;
+
+
+
+
+
+void Sim_gps_reset(const Sim_scenario_t *_scenario)
+{
+  Sim_gps_second = 0;
+  Sim_gps_first_fix_ns = SIM_NEVER;
+  Sim_gps_latency_ms = _scenario->gps_latency_ms;
+}
+
+
+
+
+
+int64_t Sim_true_utc(uint64_t _now)
+{
+  return(Sim_scenario->start_utc + (int64_t) (_now / SIM_NS_PER_S));
+}
+
+
+
+
+
+uint64_t Sim_gps_first_fix()
+{
+  return(Sim_gps_first_fix_ns);
+}
+
+
+
+
+
+uint64_t Sim_gps_next()
+{
+  return(Sim_gps_second * SIM_NS_PER_S + Sim_gps_latency_ms * SIM_NS_PER_MS);
+}
+
+
+
+
+
+uint16_t Sim_gps_sentence(char *_out, uint16_t _size, const char *_body)
+{
+  // $<body>*<checksum>\r\n, the checksum is the XOR of the body
+  uint8_t checksum = 0;
+
+  for (const char *c = _body; *c != '\0'; c++) {
+    checksum ^= (uint8_t) *c;
+  }
+  return((uint16_t) snprintf(_out, _size, "$%s*%02X\r\n", _body, checksum));
+}
+
+
+
+
+
+Sim_outage_type_t Sim_gps_state(uint32_t _second, uint8_t *_fix)
+{
+  // Outage windows first, then the cold start
+  *_fix = (_second >= Sim_scenario->gps_ttff_s);
+  for (uint8_t o = 0; o < Sim_scenario->outage_count; o++) {
+    const Sim_outage_t *outage = &Sim_scenario->outages[o];
+    if (_second >= outage->start_s && _second < outage->start_s + outage->duration_s) {
+      *_fix = (outage->type == SIM_GPS_ROLLOVER);
+      return(outage->type);
+    }
+  }
+  return(SIM_GPS_NOFIX);
+}
+
+
+
+
+
+void Sim_gps_fire(uint64_t _now)
+{
+  // RMC, GGA and ZDA for the PPS second just passed, as one burst
+  uint32_t second = (uint32_t) Sim_gps_second;
+  int64_t utc = Sim_true_utc(second * SIM_NS_PER_S);
+  int64_t days = utc / 86400;
+  uint32_t time = (uint32_t) (utc % 86400);
+  int32_t year = 0;
+  uint8_t month = 0;
+  uint8_t day = 0;
+  uint8_t fix = 0;
+  Sim_outage_type_t state = SIM_GPS_NOFIX;
+  char body[96];
+  char burst[256];
+  uint16_t length = 0;
+
+  Sim_gps_second++;
+  state = Sim_gps_state(second, &fix);
+  if (state == SIM_GPS_SILENT) {
+    return;
+  }
+  // Consistent in every sentence, one second apart: only the RTC tells
+  if (state == SIM_GPS_ROLLOVER) {
+    days -= SIM_GPS_ROLLOVER_DAYS;
+  }
+  Sim_civil_from_days(days, &year, &month, &day);
+
+  if (fix) {
+    uint32_t hh = time / 3600, mm = (time / 60) % 60, ss = time % 60;
+
+    snprintf(body, sizeof(body), "GPRMC,%02lu%02lu%02lu.000,A,4527.600,N,00911.400,E,0.00,0.00,%02u%02u%02u,,,A",
+             (unsigned long) hh, (unsigned long) mm, (unsigned long) ss, day, month, (unsigned) (year % 100));
+    length += Sim_gps_sentence(burst + length, sizeof(burst) - length, body);
+    snprintf(body, sizeof(body), "GPGGA,%02lu%02lu%02lu.000,4527.600,N,00911.400,E,1,08,1.0,120.0,M,47.0,M,,",
+             (unsigned long) hh, (unsigned long) mm, (unsigned long) ss);
+    length += Sim_gps_sentence(burst + length, sizeof(burst) - length, body);
+    snprintf(body, sizeof(body), "GPZDA,%02lu%02lu%02lu.000,%02u,%02u,%04ld,00,00",
+             (unsigned long) hh, (unsigned long) mm, (unsigned long) ss, day, month, (long) year);
+    length += Sim_gps_sentence(burst + length, sizeof(burst) - length, body);
+    if (Sim_gps_first_fix_ns == SIM_NEVER) {
+      Sim_gps_first_fix_ns = _now;
+    }
+  } else {
+    // No fix: the sentences keep coming with the fields empty
+    length += Sim_gps_sentence(burst + length, sizeof(burst) - length, "GPRMC,,V,,,,,,,,,,N");
+    length += Sim_gps_sentence(burst + length, sizeof(burst) - length, "GPGGA,,,,,,0,00,99.99,,,,,,");
+    length += Sim_gps_sentence(burst + length, sizeof(burst) - length, "GPZDA,,,,,00,00");
+  }
+
+  Sim_uart_push(burst, length, _now, SIM_GPS_BAUD);
+}
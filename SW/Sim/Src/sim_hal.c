@@ -0,0 +1,1462 @@
+/**
+  ******************************************************************************
+  * @file           : sim_hal.c
+  * @brief          : HAL functions used by the firmware, on the simulated
+  *                   registers of sim_periph.c
+  ******************************************************************************
+  * @attention
+  *
+  * Copyright (c) 2023 Nicolò Campanini.
+  * All rights reserved.
+  *
+  * This software is licensed under terms that can be found in the LICENSE file
+  * in the root directory of this software component.
+  * If no LICENSE file comes with this software, it is provided AS-IS.
+  *
+  ******************************************************************************
+  */
+
+#include "sim.h"
+
+// Same register effects and callbacks as the STM32F4 HAL, without the
+// polling loops: a flag never sets while the firmware code runs, as the
+// virtual time only moves when the core sleeps.
+
+
+
+
+
+/* Core ----------------------------------------------------------------------*/
+HAL_StatusTypeDef HAL_Init(void)
+{
+  FLASH->ACR |= FLASH_ACR_ICEN | FLASH_ACR_DCEN | FLASH_ACR_PRFTEN;
+  HAL_NVIC_SetPriorityGrouping(NVIC_PRIORITYGROUP_4);
+  HAL_InitTick(TICK_INT_PRIORITY);
+  HAL_MspInit();
+  return(HAL_OK);
+}
+
+
+
+
+
+HAL_StatusTypeDef HAL_InitTick(uint32_t TickPriority)
+{
+  // 1 ms SysTick on the core clock
+  SysTick->LOAD = (SystemCoreClock / (1000U / uwTickFreq)) - 1;
+  SysTick->VAL = 0;
+  SysTick->CTRL = SysTick_CTRL_CLKSOURCE_Msk | SysTick_CTRL_TICKINT_Msk | SysTick_CTRL_ENABLE_Msk;
+  if (TickPriority < (1UL << __NVIC_PRIO_BITS)) {
+    HAL_NVIC_SetPriority(SysTick_IRQn, TickPriority, 0);
+    uwTickPrio = TickPriority;
+  }
+  return(HAL_OK);
+}
+
+
+
+
+
+void HAL_IncTick(void)
+{
+  uwTick += uwTickFreq;
+}
+
+
+
+
+
+uint32_t HAL_GetTick(void)
+{
+  return(uwTick);
+}
+
+
+
+
+
+void HAL_Delay(uint32_t Delay)
+{
+  uint32_t start = HAL_GetTick();
+
+  // Busy wait: the interrupts keep running
+  while ((HAL_GetTick() - start) < Delay + 1) {
+    Sim_wfi();
+  }
+}
+
+
+
+
+
+void HAL_SuspendTick(void)
+{
+  SysTick->CTRL &= ~SysTick_CTRL_TICKINT_Msk;
+}
+
+
+
+
+
+void HAL_ResumeTick(void)
+{
+  SysTick->CTRL |= SysTick_CTRL_TICKINT_Msk;
+}
+
+
+
+
+
+__weak void HAL_MspInit(void)
+{
+}
+
+
+
+
+
+void HAL_NVIC_SetPriorityGrouping(uint32_t PriorityGroup)
+{
+  NVIC_SetPriorityGrouping(PriorityGroup);
+}
+
+
+
+
+
+void HAL_NVIC_SetPriority(IRQn_Type IRQn, uint32_t PreemptPriority, uint32_t SubPriority)
+{
+  NVIC_SetPriority(IRQn, NVIC_EncodePriority(NVIC_GetPriorityGrouping(), PreemptPriority, SubPriority));
+}
+
+
+
+
+
+void HAL_NVIC_EnableIRQ(IRQn_Type IRQn)
+{
+  NVIC_EnableIRQ(IRQn);
+}
+
+
+
+
+
+void HAL_NVIC_DisableIRQ(IRQn_Type IRQn)
+{
+  NVIC_DisableIRQ(IRQn);
+}
+
+
+
+
+
+/* RCC -----------------------------------------------------------------------*/
+HAL_StatusTypeDef HAL_RCC_OscConfig(RCC_OscInitTypeDef *RCC_OscInitStruct)
+{
+  // The oscillators are ready as soon as they are enabled
+  uint32_t sws = RCC->CFGR & RCC_CFGR_SWS;
+  uint8_t pll_hse = (RCC->PLLCFGR & RCC_PLLCFGR_PLLSRC) == RCC_PLLCFGR_PLLSRC_HSE;
+
+  if (RCC_OscInitStruct->OscillatorType & RCC_OSCILLATORTYPE_HSE) {
+    if (RCC_OscInitStruct->HSEState == RCC_HSE_OFF) {
+      if (sws == RCC_CFGR_SWS_HSE || (sws == RCC_CFGR_SWS_PLL && pll_hse)) {
+        return(HAL_ERROR);
+      }
+      RCC->CR &= ~(RCC_CR_HSEON | RCC_CR_HSERDY);
+    } else {
+      RCC->CR |= RCC_CR_HSEON | RCC_CR_HSERDY;
+    }
+  }
+  if (RCC_OscInitStruct->OscillatorType & RCC_OSCILLATORTYPE_LSE) {
+    if (RCC_OscInitStruct->LSEState == RCC_LSE_OFF) {
+      RCC->BDCR &= ~(RCC_BDCR_LSEON | RCC_BDCR_LSERDY);
+    } else {
+      RCC->BDCR |= RCC_BDCR_LSEON | RCC_BDCR_LSERDY;
+    }
+  }
+
+  if (RCC_OscInitStruct->PLL.PLLState != RCC_PLL_NONE) {
+    uint32_t pllcfgr = RCC_OscInitStruct->PLL.PLLSource | RCC_OscInitStruct->PLL.PLLM |
+                       (RCC_OscInitStruct->PLL.PLLN << RCC_PLLCFGR_PLLN_Pos) |
+                       (((RCC_OscInitStruct->PLL.PLLP >> 1U) - 1U) << RCC_PLLCFGR_PLLP_Pos) |
+                       (RCC_OscInitStruct->PLL.PLLQ << RCC_PLLCFGR_PLLQ_Pos);
+
+    // The PLL clocking the core can't be stopped or changed
+    if (sws == RCC_CFGR_SWS_PLL) {
+      uint32_t mask = RCC_PLLCFGR_PLLSRC | RCC_PLLCFGR_PLLM | RCC_PLLCFGR_PLLN | RCC_PLLCFGR_PLLP | RCC_PLLCFGR_PLLQ;
+      if (RCC_OscInitStruct->PLL.PLLState == RCC_PLL_OFF || (RCC->PLLCFGR & mask) != pllcfgr) {
+        return(HAL_ERROR);
+      }
+      return(HAL_OK);
+    }
+    RCC->CR &= ~(RCC_CR_PLLON | RCC_CR_PLLRDY);
+    if (RCC_OscInitStruct->PLL.PLLState == RCC_PLL_ON) {
+      if (RCC_OscInitStruct->PLL.PLLSource == RCC_PLLSOURCE_HSE && (RCC->CR & RCC_CR_HSERDY) == 0) {
+        return(HAL_TIMEOUT);
+      }
+      RCC->PLLCFGR = pllcfgr;
+      RCC->CR |= RCC_CR_PLLON | RCC_CR_PLLRDY;
+    }
+  }
+  return(HAL_OK);
+}
+
+
+
+
+
+HAL_StatusTypeDef HAL_RCC_ClockConfig(RCC_ClkInitTypeDef *RCC_ClkInitStruct, uint32_t FLatency)
+{
+  uint32_t source = RCC_ClkInitStruct->SYSCLKSource;
+
+  MODIFY_REG(FLASH->ACR, FLASH_ACR_LATENCY, FLatency);
+
+  if (RCC_ClkInitStruct->ClockType & RCC_CLOCKTYPE_SYSCLK) {
+    if ((source == RCC_SYSCLKSOURCE_HSE && (RCC->CR & RCC_CR_HSERDY) == 0) ||
+        (source == RCC_SYSCLKSOURCE_PLLCLK && (RCC->CR & RCC_CR_PLLRDY) == 0)) {
+      return(HAL_ERROR);
+    }
+    MODIFY_REG(RCC->CFGR, RCC_CFGR_SW | RCC_CFGR_SWS, source | (source << RCC_CFGR_SWS_Pos));
+  }
+  if (RCC_ClkInitStruct->ClockType & RCC_CLOCKTYPE_HCLK) {
+    MODIFY_REG(RCC->CFGR, RCC_CFGR_HPRE, RCC_ClkInitStruct->AHBCLKDivider);
+  }
+  if (RCC_ClkInitStruct->ClockType & RCC_CLOCKTYPE_PCLK1) {
+    MODIFY_REG(RCC->CFGR, RCC_CFGR_PPRE1, RCC_ClkInitStruct->APB1CLKDivider);
+  }
+  if (RCC_ClkInitStruct->ClockType & RCC_CLOCKTYPE_PCLK2) {
+    MODIFY_REG(RCC->CFGR, RCC_CFGR_PPRE2, RCC_ClkInitStruct->APB2CLKDivider << 3);
+  }
+
+  SystemCoreClock = Sim_hclk_hz();
+  return(HAL_InitTick(uwTickPrio));
+}
+
+
+
+
+
+uint32_t HAL_RCC_GetSysClockFreq(void)
+{
+  return(Sim_hclk_hz() << AHBPrescTable[(RCC->CFGR & RCC_CFGR_HPRE) >> RCC_CFGR_HPRE_Pos]);
+}
+
+
+
+
+
+uint32_t HAL_RCC_GetHCLKFreq(void)
+{
+  return(SystemCoreClock);
+}
+
+
+
+
+
+uint32_t HAL_RCC_GetPCLK1Freq(void)
+{
+  return(Sim_pclk1_hz());
+}
+
+
+
+
+
+uint32_t HAL_RCC_GetPCLK2Freq(void)
+{
+  return(Sim_pclk2_hz());
+}
+
+
+
+
+
+HAL_StatusTypeDef HAL_RCCEx_PeriphCLKConfig(RCC_PeriphCLKInitTypeDef *PeriphClkInit)
+{
+  if (PeriphClkInit->PeriphClockSelection & RCC_PERIPHCLK_RTC) {
+    MODIFY_REG(RCC->BDCR, RCC_BDCR_RTCSEL, PeriphClkInit->RTCClockSelection & RCC_BDCR_RTCSEL);
+  }
+  return(HAL_OK);
+}
+
+
+
+
+
+/* GPIO ----------------------------------------------------------------------*/
+void HAL_GPIO_Init(GPIO_TypeDef *GPIOx, GPIO_InitTypeDef *GPIO_Init)
+{
+  for (uint32_t pin = 0; pin < 16; pin++) {
+    if (GPIO_Init->Pin & (1U << pin)) {
+      MODIFY_REG(GPIOx->MODER, GPIO_MODER_MODER0 << (pin * 2), (GPIO_Init->Mode & GPIO_MODE) << (pin * 2));
+      MODIFY_REG(GPIOx->PUPDR, GPIO_PUPDR_PUPDR0 << (pin * 2), GPIO_Init->Pull << (pin * 2));
+    }
+  }
+}
+
+
+
+
+
+void HAL_GPIO_DeInit(GPIO_TypeDef *GPIOx, uint32_t GPIO_Pin)
+{
+  for (uint32_t pin = 0; pin < 16; pin++) {
+    if (GPIO_Pin & (1U << pin)) {
+      GPIOx->MODER |= GPIO_MODER_MODER0 << (pin * 2);
+      GPIOx->PUPDR &= ~(GPIO_PUPDR_PUPDR0 << (pin * 2));
+    }
+  }
+}
+
+
+
+
+
+void HAL_GPIO_WritePin(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin, GPIO_PinState PinState)
+{
+  if (PinState != GPIO_PIN_RESET) {
+    GPIOx->ODR |= GPIO_Pin;
+  } else {
+    GPIOx->ODR &= ~GPIO_Pin;
+  }
+  Sim_display_gpio(GPIOx, GPIO_Pin, PinState);
+}
+
+
+
+
+
+void HAL_GPIO_TogglePin(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin)
+{
+  GPIOx->ODR ^= GPIO_Pin;
+  Sim_display_gpio(GPIOx, GPIO_Pin, (GPIOx->ODR & GPIO_Pin) ? GPIO_PIN_SET : GPIO_PIN_RESET);
+}
+
+
+
+
+
+GPIO_PinState HAL_GPIO_ReadPin(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin)
+{
+  return((GPIOx->IDR & GPIO_Pin) ? GPIO_PIN_SET : GPIO_PIN_RESET);
+}
+
+
+
+
+
+/* TIM -----------------------------------------------------------------------*/
+__weak void HAL_TIM_Base_MspInit(TIM_HandleTypeDef *htim)
+{
+}
+
+
+
+
+
+__weak void HAL_TIM_PWM_MspInit(TIM_HandleTypeDef *htim)
+{
+}
+
+
+
+
+
+__weak void HAL_TIM_PeriodElapsedCallback(TIM_HandleTypeDef *htim)
+{
+}
+
+
+
+
+
+void Sim_tim_set_config(TIM_HandleTypeDef *htim)
+{
+  TIM_TypeDef *tim = htim->Instance;
+
+  MODIFY_REG(tim->CR1, TIM_CR1_DIR | TIM_CR1_CMS | TIM_CR1_CKD | TIM_CR1_ARPE,
+             htim->Init.CounterMode | htim->Init.ClockDivision | htim->Init.AutoReloadPreload);
+  tim->ARR = htim->Init.Period;
+  tim->PSC = htim->Init.Prescaler;
+  if (IS_TIM_REPETITION_COUNTER_INSTANCE(tim)) {
+    tim->RCR = htim->Init.RepetitionCounter;
+  }
+  // Load the prescaler now: this sets UIF as on the chip
+  tim->EGR = TIM_EGR_UG;
+  Sim_periph_sync();
+}
+
+
+
+
+
+HAL_StatusTypeDef HAL_TIM_Base_Init(TIM_HandleTypeDef *htim)
+{
+  if (htim == NULL) {
+    return(HAL_ERROR);
+  }
+  if (htim->State == HAL_TIM_STATE_RESET) {
+    htim->Lock = HAL_UNLOCKED;
+    HAL_TIM_Base_MspInit(htim);
+  }
+  Sim_tim_set_config(htim);
+  htim->State = HAL_TIM_STATE_READY;
+  return(HAL_OK);
+}
+
+
+
+
+
+HAL_StatusTypeDef HAL_TIM_PWM_Init(TIM_HandleTypeDef *htim)
+{
+  if (htim == NULL) {
+    return(HAL_ERROR);
+  }
+  if (htim->State == HAL_TIM_STATE_RESET) {
+    htim->Lock = HAL_UNLOCKED;
+    HAL_TIM_PWM_MspInit(htim);
+  }
+  Sim_tim_set_config(htim);
+  htim->State = HAL_TIM_STATE_READY;
+  return(HAL_OK);
+}
+
+
+
+
+
+HAL_StatusTypeDef HAL_TIM_ConfigClockSource(TIM_HandleTypeDef *htim, TIM_ClockConfigTypeDef *sClockSourceConfig)
+{
+  // Internal clock only
+  if (sClockSourceConfig->ClockSource != TIM_CLOCKSOURCE_INTERNAL) {
+    return(HAL_ERROR);
+  }
+  htim->Instance->SMCR &= ~(TIM_SMCR_SMS | TIM_SMCR_TS | TIM_SMCR_ETF | TIM_SMCR_ETPS | TIM_SMCR_ECE | TIM_SMCR_ETP);
+  return(HAL_OK);
+}
+
+
+
+
+
+HAL_StatusTypeDef HAL_TIMEx_MasterConfigSynchronization(TIM_HandleTypeDef *htim, TIM_MasterConfigTypeDef *sMasterConfig)
+{
+  MODIFY_REG(htim->Instance->CR2, TIM_CR2_MMS, sMasterConfig->MasterOutputTrigger);
+  MODIFY_REG(htim->Instance->SMCR, TIM_SMCR_MSM, sMasterConfig->MasterSlaveMode);
+  return(HAL_OK);
+}
+
+
+
+
+
+HAL_StatusTypeDef HAL_TIM_PWM_ConfigChannel(TIM_HandleTypeDef *htim, TIM_OC_InitTypeDef *sConfig, uint32_t Channel)
+{
+  // Channel is 0, 4, 8, 12: one CCR per channel, one CCMR half per channel
+  TIM_TypeDef *tim = htim->Instance;
+  volatile uint32_t *ccmr = (Channel < TIM_CHANNEL_3) ? &tim->CCMR1 : &tim->CCMR2;
+  uint32_t ccmr_shift = (Channel & TIM_CHANNEL_2) ? 8 : 0;
+
+  MODIFY_REG(*ccmr, (TIM_CCMR1_OC1M | TIM_CCMR1_OC1PE | TIM_CCMR1_OC1FE | TIM_CCMR1_CC1S) << ccmr_shift,
+             (sConfig->OCMode | TIM_CCMR1_OC1PE | sConfig->OCFastMode) << ccmr_shift);
+  MODIFY_REG(tim->CCER, TIM_CCER_CC1P << Channel, sConfig->OCPolarity << Channel);
+  (&tim->CCR1)[Channel / 4] = sConfig->Pulse;
+  return(HAL_OK);
+}
+
+
+
+
+
+HAL_StatusTypeDef HAL_TIMEx_ConfigBreakDeadTime(TIM_HandleTypeDef *htim, TIM_BreakDeadTimeConfigTypeDef *sBreakDeadTimeConfig)
+{
+  htim->Instance->BDTR = sBreakDeadTimeConfig->DeadTime | sBreakDeadTimeConfig->LockLevel |
+                         sBreakDeadTimeConfig->OffStateIDLEMode | sBreakDeadTimeConfig->OffStateRunMode |
+                         sBreakDeadTimeConfig->BreakState | sBreakDeadTimeConfig->BreakPolarity |
+                         sBreakDeadTimeConfig->AutomaticOutput;
+  return(HAL_OK);
+}
+
+
+
+
+
+HAL_StatusTypeDef HAL_TIM_PWM_Start(TIM_HandleTypeDef *htim, uint32_t Channel)
+{
+  htim->Instance->CCER |= TIM_CCER_CC1E << Channel;
+  if (IS_TIM_BREAK_INSTANCE(htim->Instance)) {
+    htim->Instance->BDTR |= TIM_BDTR_MOE;
+  }
+  htim->Instance->CR1 |= TIM_CR1_CEN;
+  htim->State = HAL_TIM_STATE_BUSY;
+  Sim_periph_sync();
+  return(HAL_OK);
+}
+
+
+
+
+
+HAL_StatusTypeDef HAL_TIM_Base_Start(TIM_HandleTypeDef *htim)
+{
+  htim->Instance->CR1 |= TIM_CR1_CEN;
+  htim->State = HAL_TIM_STATE_BUSY;
+  Sim_periph_sync();
+  return(HAL_OK);
+}
+
+
+
+
+
+HAL_StatusTypeDef HAL_TIM_Base_Start_IT(TIM_HandleTypeDef *htim)
+{
+  htim->Instance->DIER |= TIM_DIER_UIE;
+  return(HAL_TIM_Base_Start(htim));
+}
+
+
+
+
+
+void HAL_TIM_IRQHandler(TIM_HandleTypeDef *htim)
+{
+  // Update event only, the other flags are not used
+  if ((htim->Instance->SR & TIM_SR_UIF) && (htim->Instance->DIER & TIM_DIER_UIE)) {
+    htim->Instance->SR &= ~TIM_SR_UIF;
+    HAL_TIM_PeriodElapsedCallback(htim);
+  }
+}
+
+
+
+
+
+/* SPI -----------------------------------------------------------------------*/
+__weak void HAL_SPI_MspInit(SPI_HandleTypeDef *hspi)
+{
+}
+
+
+
+
+
+__weak void HAL_SPI_TxCpltCallback(SPI_HandleTypeDef *hspi)
+{
+}
+
+
+
+
+
+HAL_StatusTypeDef HAL_SPI_Init(SPI_HandleTypeDef *hspi)
+{
+  if (hspi == NULL) {
+    return(HAL_ERROR);
+  }
+  if (hspi->State == HAL_SPI_STATE_RESET) {
+    hspi->Lock = HAL_UNLOCKED;
+    HAL_SPI_MspInit(hspi);
+  }
+  hspi->Instance->CR1 = hspi->Init.Mode | hspi->Init.Direction | hspi->Init.DataSize | hspi->Init.CLKPolarity |
+                        hspi->Init.CLKPhase | (hspi->Init.NSS & SPI_CR1_SSM) | hspi->Init.BaudRatePrescaler |
+                        hspi->Init.FirstBit | hspi->Init.CRCCalculation;
+  hspi->ErrorCode = HAL_SPI_ERROR_NONE;
+  hspi->State = HAL_SPI_STATE_READY;
+  return(HAL_OK);
+}
+
+
+
+
+
+HAL_StatusTypeDef HAL_SPI_Transmit_IT(SPI_HandleTypeDef *hspi, uint8_t *pData, uint16_t Size)
+{
+  if (hspi->State != HAL_SPI_STATE_READY) {
+    return(HAL_BUSY);
+  }
+  if (pData == NULL || Size == 0) {
+    return(HAL_ERROR);
+  }
+  hspi->State = HAL_SPI_STATE_BUSY_TX;
+  hspi->pTxBuffPtr = pData;
+  hspi->TxXferSize = Size;
+  hspi->TxXferCount = Size;
+  hspi->Instance->CR1 |= SPI_CR1_SPE;
+  hspi->Instance->CR2 |= SPI_CR2_TXEIE | SPI_CR2_ERRIE;
+  Sim_spi_start(hspi, pData, Size);
+  return(HAL_OK);
+}
+
+
+
+
+
+void HAL_SPI_IRQHandler(SPI_HandleTypeDef *hspi)
+{
+  // The whole transfer is one event: last byte out of the shift register
+  if (Sim_spi_take_complete(hspi)) {
+    hspi->Instance->CR2 &= ~(SPI_CR2_TXEIE | SPI_CR2_ERRIE);
+    hspi->TxXferCount = 0;
+    hspi->State = HAL_SPI_STATE_READY;
+    HAL_SPI_TxCpltCallback(hspi);
+  }
+}
+
+
+
+
+
+/* DMA -----------------------------------------------------------------------*/
+HAL_StatusTypeDef HAL_DMA_Init(DMA_HandleTypeDef *hdma)
+{
+  if (hdma == NULL) {
+    return(HAL_ERROR);
+  }
+  hdma->Instance->CR = hdma->Init.Channel | hdma->Init.Direction | hdma->Init.PeriphInc | hdma->Init.MemInc |
+                       hdma->Init.PeriphDataAlignment | hdma->Init.MemDataAlignment | hdma->Init.Mode |
+                       hdma->Init.Priority;
+  hdma->ErrorCode = HAL_DMA_ERROR_NONE;
+  hdma->Lock = HAL_UNLOCKED;
+  hdma->State = HAL_DMA_STATE_READY;
+  return(HAL_OK);
+}
+
+
+
+
+
+HAL_StatusTypeDef HAL_DMA_DeInit(DMA_HandleTypeDef *hdma)
+{
+  if (hdma == NULL) {
+    return(HAL_ERROR);
+  }
+  hdma->Instance->CR = 0;
+  hdma->Instance->NDTR = 0;
+  hdma->State = HAL_DMA_STATE_RESET;
+  return(HAL_OK);
+}
+
+
+
+
+
+HAL_StatusTypeDef HAL_DMA_Abort(DMA_HandleTypeDef *hdma)
+{
+  hdma->Instance->CR &= ~(DMA_SxCR_TCIE | DMA_SxCR_TEIE | DMA_SxCR_DMEIE | DMA_SxCR_HTIE);
+  Sim_dma_stop(hdma);
+  hdma->State = HAL_DMA_STATE_READY;
+  hdma->Lock = HAL_UNLOCKED;
+  return(HAL_OK);
+}
+
+
+
+
+
+void HAL_DMA_IRQHandler(DMA_HandleTypeDef *hdma)
+{
+  Sim_dma_irq(hdma);
+}
+
+
+
+
+
+/* UART ----------------------------------------------------------------------*/
+__weak void HAL_UART_MspInit(UART_HandleTypeDef *huart)
+{
+}
+
+
+
+
+
+__weak void HAL_UART_ErrorCallback(UART_HandleTypeDef *huart)
+{
+}
+
+
+
+
+
+__weak void HAL_UARTEx_RxEventCallback(UART_HandleTypeDef *huart, uint16_t Size)
+{
+}
+
+
+
+
+
+__weak void HAL_UART_TxCpltCallback(UART_HandleTypeDef *huart)
+{
+}
+
+
+
+
+
+__weak void HAL_UART_RxCpltCallback(UART_HandleTypeDef *huart)
+{
+}
+
+
+
+
+
+HAL_StatusTypeDef HAL_UART_Init(UART_HandleTypeDef *huart)
+{
+  USART_TypeDef *usart = NULL;
+
+  if (huart == NULL) {
+    return(HAL_ERROR);
+  }
+  if (huart->gState == HAL_UART_STATE_RESET) {
+    huart->Lock = HAL_UNLOCKED;
+    HAL_UART_MspInit(huart);
+  }
+  usart = huart->Instance;
+  usart->CR1 &= ~USART_CR1_UE;
+  MODIFY_REG(usart->CR2, USART_CR2_STOP, huart->Init.StopBits);
+  MODIFY_REG(usart->CR1, USART_CR1_M | USART_CR1_PCE | USART_CR1_PS | USART_CR1_TE | USART_CR1_RE | USART_CR1_OVER8,
+             huart->Init.WordLength | huart->Init.Parity | huart->Init.Mode | huart->Init.OverSampling);
+  MODIFY_REG(usart->CR3, USART_CR3_RTSE | USART_CR3_CTSE, huart->Init.HwFlowCtl);
+  usart->BRR = UART_BRR_SAMPLING16((usart == USART1 || usart == USART6) ? Sim_pclk2_hz() : Sim_pclk1_hz(),
+                                   huart->Init.BaudRate);
+  usart->CR1 |= USART_CR1_UE;
+
+  huart->ErrorCode = HAL_UART_ERROR_NONE;
+  huart->gState = HAL_UART_STATE_READY;
+  huart->RxState = HAL_UART_STATE_READY;
+  Sim_uart_attach(huart);
+  return(HAL_OK);
+}
+
+
+
+
+
+HAL_StatusTypeDef HAL_UART_Transmit(UART_HandleTypeDef *huart, const uint8_t *pData, uint16_t Size, uint32_t Timeout)
+{
+  // Polled transmission, done in no virtual time: the text goes to stderr
+  // with -v, the firmware only sees TC set at the end
+  (void) Timeout;
+  if (huart->gState != HAL_UART_STATE_READY) {
+    return(HAL_BUSY);
+  }
+  if (pData == NULL || Size == 0) {
+    return(HAL_ERROR);
+  }
+  if (Sim_scenario->verbose) {
+    fprintf(stderr, "%s: ", Sim_scenario->name);
+    fwrite(pData, 1, Size, stderr);
+  }
+  Sim_stats.tx_bytes += Size;
+  if (huart->Instance == USART2) {
+    Sim_console_write(pData, Size, 0);
+  }
+  huart->Instance->SR |= USART_SR_TXE | USART_SR_TC;
+  return(HAL_OK);
+}
+
+
+
+
+
+HAL_StatusTypeDef HAL_UART_Transmit_IT(UART_HandleTypeDef *huart, const uint8_t *pData, uint16_t Size)
+{
+  // The text is taken at once, the transmission complete interrupt comes
+  // after the frames (USART2 only: the terminal times it)
+  if (huart->gState != HAL_UART_STATE_READY) {
+    return(HAL_BUSY);
+  }
+  if (pData == NULL || Size == 0 || huart->Instance != USART2) {
+    return(HAL_ERROR);
+  }
+  if (Sim_scenario->verbose) {
+    fprintf(stderr, "%s: ", Sim_scenario->name);
+    fwrite(pData, 1, Size, stderr);
+  }
+  Sim_stats.tx_bytes += Size;
+  huart->ErrorCode = HAL_UART_ERROR_NONE;
+  huart->gState = HAL_UART_STATE_BUSY_TX;
+  Sim_console_write(pData, Size, 1);
+  huart->Instance->CR1 |= USART_CR1_TCIE;
+  return(HAL_OK);
+}
+
+
+
+
+
+HAL_StatusTypeDef HAL_UART_Receive_IT(UART_HandleTypeDef *huart, uint8_t *pData, uint16_t Size)
+{
+  if (huart->RxState != HAL_UART_STATE_READY) {
+    return(HAL_BUSY);
+  }
+  if (pData == NULL || Size == 0) {
+    return(HAL_ERROR);
+  }
+  huart->ReceptionType = HAL_UART_RECEPTION_STANDARD;
+  huart->pRxBuffPtr = pData;
+  huart->RxXferSize = Size;
+  huart->RxXferCount = Size;
+  huart->ErrorCode = HAL_UART_ERROR_NONE;
+  huart->RxState = HAL_UART_STATE_BUSY_RX;
+  if (huart->Init.Parity != UART_PARITY_NONE) {
+    huart->Instance->CR1 |= USART_CR1_PEIE;
+  }
+  huart->Instance->CR3 |= USART_CR3_EIE;
+  huart->Instance->CR1 |= USART_CR1_RXNEIE;
+  return(HAL_OK);
+}
+
+
+
+
+
+void Sim_uart_end_rx(UART_HandleTypeDef *huart)
+{
+  // UART_EndRxTransfer()
+  huart->Instance->CR1 &= ~(USART_CR1_RXNEIE | USART_CR1_PEIE);
+  huart->Instance->CR3 &= ~USART_CR3_EIE;
+  if (huart->ReceptionType == HAL_UART_RECEPTION_TOIDLE) {
+    huart->Instance->CR1 &= ~USART_CR1_IDLEIE;
+  }
+  huart->RxState = HAL_UART_STATE_READY;
+  huart->ReceptionType = HAL_UART_RECEPTION_STANDARD;
+}
+
+
+
+
+
+void Sim_uart_dma_rx_complete(DMA_HandleTypeDef *hdma)
+{
+  // UART_DMAReceiveCplt(): buffer full before the line went idle
+  UART_HandleTypeDef *huart = (UART_HandleTypeDef *) hdma->Parent;
+
+  if ((hdma->Instance->CR & DMA_SxCR_CIRC) == 0) {
+    huart->RxXferCount = 0;
+    huart->Instance->CR1 &= ~USART_CR1_PEIE;
+    huart->Instance->CR3 &= ~(USART_CR3_EIE | USART_CR3_DMAR);
+    huart->RxState = HAL_UART_STATE_READY;
+    if (huart->ReceptionType == HAL_UART_RECEPTION_TOIDLE) {
+      huart->Instance->CR1 &= ~USART_CR1_IDLEIE;
+    }
+  }
+  if (huart->ReceptionType == HAL_UART_RECEPTION_TOIDLE) {
+    HAL_UARTEx_RxEventCallback(huart, huart->RxXferSize);
+  }
+}
+
+
+
+
+
+void Sim_uart_dma_rx_half(DMA_HandleTypeDef *hdma)
+{
+  UART_HandleTypeDef *huart = (UART_HandleTypeDef *) hdma->Parent;
+
+  if (huart->ReceptionType == HAL_UART_RECEPTION_TOIDLE) {
+    HAL_UARTEx_RxEventCallback(huart, huart->RxXferSize / 2U);
+  }
+}
+
+
+
+
+
+HAL_StatusTypeDef HAL_UARTEx_ReceiveToIdle_DMA(UART_HandleTypeDef *huart, uint8_t *pData, uint16_t Size)
+{
+  if (huart->RxState != HAL_UART_STATE_READY) {
+    return(HAL_BUSY);
+  }
+  if (pData == NULL || Size == 0) {
+    return(HAL_ERROR);
+  }
+
+  huart->ReceptionType = HAL_UART_RECEPTION_TOIDLE;
+  huart->pRxBuffPtr = pData;
+  huart->RxXferSize = Size;
+  huart->ErrorCode = HAL_UART_ERROR_NONE;
+  huart->RxState = HAL_UART_STATE_BUSY_RX;
+
+  // HAL_DMA_Start_IT(): every interrupt with a callback
+  huart->hdmarx->XferCpltCallback = Sim_uart_dma_rx_complete;
+  huart->hdmarx->XferHalfCpltCallback = Sim_uart_dma_rx_half;
+  huart->hdmarx->State = HAL_DMA_STATE_BUSY;
+  huart->hdmarx->Instance->CR |= DMA_SxCR_TCIE | DMA_SxCR_TEIE | DMA_SxCR_DMEIE | DMA_SxCR_HTIE;
+  Sim_dma_start(huart->hdmarx, pData, Size);
+
+  // Stale overrun and idle flags are cleared before enabling the interrupts
+  huart->Instance->SR &= ~(USART_SR_ORE | USART_SR_FE | USART_SR_NE | USART_SR_IDLE | USART_SR_RXNE);
+  if (huart->Init.Parity != UART_PARITY_NONE) {
+    huart->Instance->CR1 |= USART_CR1_PEIE;
+  }
+  huart->Instance->CR3 |= USART_CR3_EIE | USART_CR3_DMAR;
+  huart->Instance->CR1 |= USART_CR1_IDLEIE;
+  return(HAL_OK);
+}
+
+
+
+
+
+void HAL_UART_IRQHandler(UART_HandleTypeDef *huart)
+{
+  USART_TypeDef *usart = huart->Instance;
+  uint32_t sr = usart->SR;
+  uint32_t errors = sr & (USART_SR_PE | USART_SR_FE | USART_SR_NE | USART_SR_ORE);
+
+  // Interrupt mode reception: one byte per RXNE
+  if ((sr & USART_SR_RXNE) && (usart->CR1 & USART_CR1_RXNEIE) && huart->RxState == HAL_UART_STATE_BUSY_RX) {
+    usart->SR &= ~USART_SR_RXNE;
+    *huart->pRxBuffPtr++ = (uint8_t) usart->DR;
+    if (--huart->RxXferCount == 0) {
+      Sim_uart_end_rx(huart);
+      HAL_UART_RxCpltCallback(huart);
+    }
+  }
+
+  // Reception errors: with the DMA running, or an overrun, the HAL aborts
+  // the reception
+  if (errors && (usart->CR3 & USART_CR3_EIE)) {
+    usart->SR &= ~errors;
+    huart->ErrorCode |= ((sr & USART_SR_PE) ? HAL_UART_ERROR_PE : 0) | ((sr & USART_SR_FE) ? HAL_UART_ERROR_FE : 0) |
+                        ((sr & USART_SR_NE) ? HAL_UART_ERROR_NE : 0) | ((sr & USART_SR_ORE) ? HAL_UART_ERROR_ORE : 0);
+    if (usart->CR3 & USART_CR3_DMAR) {
+      Sim_uart_end_rx(huart);
+      usart->CR3 &= ~USART_CR3_DMAR;
+      HAL_DMA_Abort(huart->hdmarx);
+      HAL_UART_ErrorCallback(huart);
+      return;
+    }
+    if (sr & USART_SR_ORE) {
+      Sim_uart_end_rx(huart);
+    }
+    HAL_UART_ErrorCallback(huart);
+    huart->ErrorCode = HAL_UART_ERROR_NONE;
+  }
+
+  // Interrupt mode transmission done
+  if ((sr & USART_SR_TC) && (usart->CR1 & USART_CR1_TCIE)) {
+    usart->CR1 &= ~USART_CR1_TCIE;
+    huart->gState = HAL_UART_STATE_READY;
+    HAL_UART_TxCpltCallback(huart);
+  }
+
+  // Idle line: the size received so far goes to the RX event callback
+  if (huart->ReceptionType == HAL_UART_RECEPTION_TOIDLE && (sr & USART_SR_IDLE) && (usart->CR1 & USART_CR1_IDLEIE)) {
+    usart->SR &= ~USART_SR_IDLE;
+    if (usart->CR3 & USART_CR3_DMAR) {
+      uint16_t remaining = (uint16_t) huart->hdmarx->Instance->NDTR;
+      if (remaining > 0 && remaining < huart->RxXferSize) {
+        huart->RxXferCount = remaining;
+        if ((huart->hdmarx->Instance->CR & DMA_SxCR_CIRC) == 0) {
+          usart->CR1 &= ~USART_CR1_PEIE;
+          usart->CR3 &= ~(USART_CR3_EIE | USART_CR3_DMAR);
+          huart->RxState = HAL_UART_STATE_READY;
+          huart->ReceptionType = HAL_UART_RECEPTION_STANDARD;
+          usart->CR1 &= ~USART_CR1_IDLEIE;
+          HAL_DMA_Abort(huart->hdmarx);
+        }
+        HAL_UARTEx_RxEventCallback(huart, huart->RxXferSize - huart->RxXferCount);
+      }
+    }
+  }
+}
+
+
+
+
+
+/* ADC -----------------------------------------------------------------------*/
+__weak void HAL_ADC_MspInit(ADC_HandleTypeDef *hadc)
+{
+}
+
+
+
+
+
+__weak void HAL_ADC_ConvCpltCallback(ADC_HandleTypeDef *hadc)
+{
+}
+
+
+
+
+
+__weak void HAL_ADC_ConvHalfCpltCallback(ADC_HandleTypeDef *hadc)
+{
+}
+
+
+
+
+
+HAL_StatusTypeDef HAL_ADC_Init(ADC_HandleTypeDef *hadc)
+{
+  if (hadc == NULL) {
+    return(HAL_ERROR);
+  }
+  if (hadc->State == HAL_ADC_STATE_RESET) {
+    hadc->Lock = HAL_UNLOCKED;
+    HAL_ADC_MspInit(hadc);
+  }
+  MODIFY_REG(ADC1_COMMON->CCR, ADC_CCR_ADCPRE, hadc->Init.ClockPrescaler);
+  MODIFY_REG(hadc->Instance->CR1, ADC_CR1_RES | ADC_CR1_SCAN, hadc->Init.Resolution);
+  MODIFY_REG(hadc->Instance->CR2, ADC_CR2_ALIGN | ADC_CR2_EXTSEL | ADC_CR2_EXTEN | ADC_CR2_CONT | ADC_CR2_DDS,
+             hadc->Init.DataAlign | hadc->Init.ExternalTrigConv | hadc->Init.ExternalTrigConvEdge |
+             ((uint32_t) hadc->Init.DMAContinuousRequests << ADC_CR2_DDS_Pos));
+  hadc->ErrorCode = HAL_ADC_ERROR_NONE;
+  hadc->State = HAL_ADC_STATE_READY;
+  return(HAL_OK);
+}
+
+
+
+
+
+HAL_StatusTypeDef HAL_ADC_ConfigChannel(ADC_HandleTypeDef *hadc, ADC_ChannelConfTypeDef *sConfig)
+{
+  if (sConfig->Rank == 1) {
+    MODIFY_REG(hadc->Instance->SQR3, ADC_SQR3_SQ1, sConfig->Channel);
+  }
+  return(HAL_OK);
+}
+
+
+
+
+
+HAL_StatusTypeDef HAL_ADC_Start(ADC_HandleTypeDef *hadc)
+{
+  // Software start: the conversion is done by the time it is polled
+  hadc->Instance->CR2 |= ADC_CR2_ADON;
+  Sim_adc_sample();
+  hadc->Instance->SR |= ADC_SR_EOC;
+  hadc->State = HAL_ADC_STATE_REG_BUSY;
+  return(HAL_OK);
+}
+
+
+
+
+
+HAL_StatusTypeDef HAL_ADC_PollForConversion(ADC_HandleTypeDef *hadc, uint32_t Timeout)
+{
+  if ((hadc->Instance->SR & ADC_SR_EOC) == 0) {
+    return(HAL_TIMEOUT);
+  }
+  hadc->State = HAL_ADC_STATE_READY | HAL_ADC_STATE_REG_EOC;
+  return(HAL_OK);
+}
+
+
+
+
+
+uint32_t HAL_ADC_GetValue(ADC_HandleTypeDef *hadc)
+{
+  hadc->Instance->SR &= ~ADC_SR_EOC;
+  return(hadc->Instance->DR);
+}
+
+
+
+
+
+HAL_StatusTypeDef HAL_ADC_Stop(ADC_HandleTypeDef *hadc)
+{
+  hadc->Instance->CR2 &= ~ADC_CR2_ADON;
+  hadc->State = HAL_ADC_STATE_READY;
+  return(HAL_OK);
+}
+
+
+
+
+
+void Sim_adc_dma_complete(DMA_HandleTypeDef *hdma)
+{
+  HAL_ADC_ConvCpltCallback((ADC_HandleTypeDef *) hdma->Parent);
+}
+
+
+
+
+
+void Sim_adc_dma_half(DMA_HandleTypeDef *hdma)
+{
+  HAL_ADC_ConvHalfCpltCallback((ADC_HandleTypeDef *) hdma->Parent);
+}
+
+
+
+
+
+HAL_StatusTypeDef HAL_ADC_Start_DMA(ADC_HandleTypeDef *hadc, uint32_t *pData, uint32_t Length)
+{
+  if (hadc->DMA_Handle == NULL) {
+    return(HAL_ERROR);
+  }
+  hadc->DMA_Handle->XferCpltCallback = Sim_adc_dma_complete;
+  hadc->DMA_Handle->XferHalfCpltCallback = Sim_adc_dma_half;
+  hadc->DMA_Handle->State = HAL_DMA_STATE_BUSY;
+  hadc->DMA_Handle->Instance->CR |= DMA_SxCR_TCIE | DMA_SxCR_TEIE | DMA_SxCR_DMEIE | DMA_SxCR_HTIE;
+  hadc->Instance->CR2 |= ADC_CR2_ADON | ADC_CR2_DMA;
+  hadc->State = HAL_ADC_STATE_REG_BUSY;
+  // The buffer holds half words (right aligned 12 bit results)
+  Sim_adc_start(hadc, (uint16_t *) pData, Length);
+  return(HAL_OK);
+}
+
+
+
+
+
+HAL_StatusTypeDef HAL_ADC_Stop_DMA(ADC_HandleTypeDef *hadc)
+{
+  hadc->Instance->CR2 &= ~(ADC_CR2_ADON | ADC_CR2_DMA);
+  Sim_adc_stop();
+  HAL_DMA_Abort(hadc->DMA_Handle);
+  hadc->State = HAL_ADC_STATE_READY;
+  return(HAL_OK);
+}
+
+
+
+
+
+/* RTC -----------------------------------------------------------------------*/
+__weak void HAL_RTC_MspInit(RTC_HandleTypeDef *hrtc)
+{
+}
+
+
+
+
+
+__weak void HAL_RTCEx_WakeUpTimerEventCallback(RTC_HandleTypeDef *hrtc)
+{
+}
+
+
+
+
+
+HAL_StatusTypeDef HAL_RTC_Init(RTC_HandleTypeDef *hrtc)
+{
+  if (hrtc == NULL) {
+    return(HAL_ERROR);
+  }
+  if (hrtc->State == HAL_RTC_STATE_RESET) {
+    hrtc->Lock = HAL_UNLOCKED;
+    HAL_RTC_MspInit(hrtc);
+  }
+  // Init mode: the calendar keeps its value, the prescalers restart
+  hrtc->Instance->PRER = (hrtc->Init.AsynchPrediv << RTC_PRER_PREDIV_A_Pos) | hrtc->Init.SynchPrediv;
+  MODIFY_REG(hrtc->Instance->CR, RTC_CR_FMT | RTC_CR_OSEL | RTC_CR_POL,
+             hrtc->Init.HourFormat | hrtc->Init.OutPut | hrtc->Init.OutPutPolarity);
+  Sim_rtc_set(Sim_rtc_seconds());
+  Sim_stats.rtc_sets--;
+  hrtc->State = HAL_RTC_STATE_READY;
+  return(HAL_OK);
+}
+
+
+
+
+
+HAL_StatusTypeDef HAL_RTC_WaitForSynchro(RTC_HandleTypeDef *hrtc)
+{
+  // As the HAL: clear RSF, then wait for the next shadow copy with a
+  // timeout on HAL_GetTick(). The virtual clock moves uwTick even with
+  // the SysTick interrupt masked: with the tick frozen on the real core
+  // (PRIMASK set, SysTick suspended) a stuck RSF fails the run instead
+  uint8_t frozen = (Sim_primask != 0) || ((SysTick->CTRL & SysTick_CTRL_TICKINT_Msk) == 0);
+  uint64_t deadline = Sim_now() + RTC_TIMEOUT_VALUE * SIM_NS_PER_MS;
+  uint32_t tickstart = HAL_GetTick();
+
+  hrtc->Instance->ISR &= (uint32_t) RTC_RSF_MASK;
+  while ((hrtc->Instance->ISR & RTC_ISR_RSF) == 0) {
+    if (frozen) {
+      if (Sim_now() > deadline) {
+        fprintf(stderr, "sim: HAL_RTC_WaitForSynchro() hung at %.3f s, no RSF and the HAL tick frozen\n",
+                (double) Sim_now() / SIM_NS_PER_S);
+        abort();
+      }
+    } else if ((HAL_GetTick() - tickstart) > RTC_TIMEOUT_VALUE) {
+      return(HAL_TIMEOUT);
+    }
+    __NOP();
+  }
+  return(HAL_OK);
+}
+
+
+
+
+
+HAL_StatusTypeDef HAL_RTC_SetTime(RTC_HandleTypeDef *hrtc, RTC_TimeTypeDef *sTime, uint32_t Format)
+{
+  uint32_t hours = sTime->Hours;
+  uint32_t minutes = sTime->Minutes;
+  uint32_t seconds = sTime->Seconds;
+  int64_t now = Sim_rtc_seconds();
+
+  if (Format == RTC_FORMAT_BCD) {
+    hours = RTC_Bcd2ToByte(hours);
+    minutes = RTC_Bcd2ToByte(minutes);
+    seconds = RTC_Bcd2ToByte(seconds);
+  }
+  if (hours > 23 || minutes > 59 || seconds > 59) {
+    return(HAL_ERROR);
+  }
+  // Same day, new time of day
+  Sim_rtc_set(now - (now % 86400) + hours * 3600 + minutes * 60 + seconds);
+  MODIFY_REG(hrtc->Instance->CR, RTC_CR_BKP, sTime->StoreOperation);
+  return(HAL_OK);
+}
+
+
+
+
+
+HAL_StatusTypeDef HAL_RTC_SetDate(RTC_HandleTypeDef *hrtc, RTC_DateTypeDef *sDate, uint32_t Format)
+{
+  uint32_t year = sDate->Year;
+  uint32_t month = sDate->Month;
+  uint32_t date = sDate->Date;
+  int64_t now = Sim_rtc_seconds();
+  int64_t days = 0;
+
+  if (Format == RTC_FORMAT_BCD) {
+    year = RTC_Bcd2ToByte(year);
+    month = RTC_Bcd2ToByte(month);
+    date = RTC_Bcd2ToByte(date);
+  }
+  if (year > 99 || month < 1 || month > 12 || date < 1 || date > 31) {
+    return(HAL_ERROR);
+  }
+  // Same time of day, new day (the week day is computed by the model)
+  days = Sim_days_from_civil((int32_t) (2000 + year), (uint8_t) month, (uint8_t) date) -
+         Sim_days_from_civil(2000, 1, 1);
+  Sim_rtc_set(days * 86400 + (now % 86400));
+  return(HAL_OK);
+}
+
+
+
+
+
+HAL_StatusTypeDef HAL_RTC_GetTime(RTC_HandleTypeDef *hrtc, RTC_TimeTypeDef *sTime, uint32_t Format)
+{
+  uint32_t tr = hrtc->Instance->TR & RTC_TR_RESERVED_MASK;
+
+  sTime->SubSeconds = hrtc->Instance->SSR & RTC_SSR_SS;
+  sTime->SecondFraction = hrtc->Instance->PRER & RTC_PRER_PREDIV_S;
+  sTime->Hours = (uint8_t) ((tr & (RTC_TR_HT | RTC_TR_HU)) >> RTC_TR_HU_Pos);
+  sTime->Minutes = (uint8_t) ((tr & (RTC_TR_MNT | RTC_TR_MNU)) >> RTC_TR_MNU_Pos);
+  sTime->Seconds = (uint8_t) (tr & (RTC_TR_ST | RTC_TR_SU));
+  sTime->TimeFormat = (uint8_t) ((tr & RTC_TR_PM) >> RTC_TR_PM_Pos);
+  if (Format == RTC_FORMAT_BIN) {
+    sTime->Hours = RTC_Bcd2ToByte(sTime->Hours);
+    sTime->Minutes = RTC_Bcd2ToByte(sTime->Minutes);
+    sTime->Seconds = RTC_Bcd2ToByte(sTime->Seconds);
+  }
+  return(HAL_OK);
+}
+
+
+
+
+
+HAL_StatusTypeDef HAL_RTC_GetDate(RTC_HandleTypeDef *hrtc, RTC_DateTypeDef *sDate, uint32_t Format)
+{
+  uint32_t dr = hrtc->Instance->DR & RTC_DR_RESERVED_MASK;
+
+  sDate->Year = (uint8_t) ((dr & (RTC_DR_YT | RTC_DR_YU)) >> RTC_DR_YU_Pos);
+  sDate->Month = (uint8_t) ((dr & (RTC_DR_MT | RTC_DR_MU)) >> RTC_DR_MU_Pos);
+  sDate->Date = (uint8_t) (dr & (RTC_DR_DT | RTC_DR_DU));
+  sDate->WeekDay = (uint8_t) ((dr & RTC_DR_WDU) >> RTC_DR_WDU_Pos);
+  if (Format == RTC_FORMAT_BIN) {
+    sDate->Year = RTC_Bcd2ToByte(sDate->Year);
+    sDate->Month = RTC_Bcd2ToByte(sDate->Month);
+    sDate->Date = RTC_Bcd2ToByte(sDate->Date);
+  }
+  return(HAL_OK);
+}
+
+
+
+
+
+uint8_t RTC_Bcd2ToByte(uint8_t number)
+{
+  return((uint8_t) (((number >> 4) * 10) + (number & 0x0F)));
+}
+
+
+
+
+
+uint8_t RTC_ByteToBcd2(uint8_t number)
+{
+  return((uint8_t) (((number / 10) << 4) | (number % 10)));
+}
+
+
+
+
+
+HAL_StatusTypeDef HAL_RTCEx_SetWakeUpTimer_IT(RTC_HandleTypeDef *hrtc, uint32_t WakeUpCounter, uint32_t WakeUpClock)
+{
+  hrtc->Instance->CR &= ~(RTC_CR_WUTE | RTC_CR_WUTIE);
+  hrtc->Instance->ISR &= ~RTC_ISR_WUTF;
+  hrtc->Instance->WUTR = WakeUpCounter;
+  MODIFY_REG(hrtc->Instance->CR, RTC_CR_WUCKSEL, WakeUpClock);
+  // EXTI line 22, rising edge
+  EXTI->IMR |= RTC_EXTI_LINE_WAKEUPTIMER_EVENT;
+  EXTI->RTSR |= RTC_EXTI_LINE_WAKEUPTIMER_EVENT;
+  hrtc->Instance->CR |= RTC_CR_WUTIE | RTC_CR_WUTE;
+  Sim_rtc_wakeup_arm();
+  return(HAL_OK);
+}
+
+
+
+
+
+HAL_StatusTypeDef HAL_RTCEx_DeactivateWakeUpTimer(RTC_HandleTypeDef *hrtc)
+{
+  hrtc->Instance->CR &= ~(RTC_CR_WUTE | RTC_CR_WUTIE);
+  Sim_rtc_wakeup_arm();
+  return(HAL_OK);
+}
+
+
+
+
+
+void HAL_RTCEx_WakeUpTimerIRQHandler(RTC_HandleTypeDef *hrtc)
+{
+  if (hrtc->Instance->ISR & RTC_ISR_WUTF) {
+    hrtc->Instance->ISR &= ~RTC_ISR_WUTF;
+    HAL_RTCEx_WakeUpTimerEventCallback(hrtc);
+  }
+  EXTI->PR &= ~RTC_EXTI_LINE_WAKEUPTIMER_EVENT;
+  hrtc->State = HAL_RTC_STATE_READY;
+}
+
+
+
+
+
+HAL_StatusTypeDef HAL_RTCEx_SetSynchroShift(RTC_HandleTypeDef *hrtc, uint32_t ShiftAdd1S, uint32_t ShiftSubFS)
+{
+  if (ShiftSubFS > RTC_SHIFTR_SUBFS || (hrtc->Instance->CR & RTC_CR_REFCKON)) {
+    return(HAL_ERROR);
+  }
+  Sim_rtc_shift(ShiftAdd1S == RTC_SHIFTADD1S_SET, ShiftSubFS);
+  return(HAL_OK);
+}
+
+
+
+
+
+void HAL_RTCEx_BKUPWrite(RTC_HandleTypeDef *hrtc, uint32_t BackupRegister, uint32_t Data)
+{
+  (&hrtc->Instance->BKP0R)[BackupRegister] = Data;
+}
+
+
+
+
+
+uint32_t HAL_RTCEx_BKUPRead(RTC_HandleTypeDef *hrtc, uint32_t BackupRegister)
+{
+  return((&hrtc->Instance->BKP0R)[BackupRegister]);
+}
+
+
+
+
+
+/* PWR -----------------------------------------------------------------------*/
+void HAL_PWR_EnterSTOPMode(uint32_t Regulator, uint8_t STOPEntry)
+{
+  MODIFY_REG(PWR->CR, PWR_CR_PDDS | PWR_CR_LPDS, Regulator);
+  Sim_stop_mode();
+}
+
+
+
+
+
+void HAL_PWREx_EnableFlashPowerDown(void)
+{
+  PWR->CR |= PWR_CR_FPDS;
+}
+
+
+
+
+
+/* FLASH ---------------------------------------------------------------------*/
+HAL_StatusTypeDef HAL_FLASH_Unlock(void)
+{
+  FLASH->CR &= ~FLASH_CR_LOCK;
+  return(HAL_OK);
+}
+
+
+
+
+
+HAL_StatusTypeDef HAL_FLASH_Lock(void)
+{
+  FLASH->CR |= FLASH_CR_LOCK;
+  return(HAL_OK);
+}
+
+
+
+
+
+HAL_StatusTypeDef HAL_FLASH_Program(uint32_t TypeProgram, uint32_t Address, uint64_t Data)
+{
+  static const uint8_t sizes[4] = {1, 2, 4, 8};
+
+  if ((FLASH->CR & FLASH_CR_LOCK) || TypeProgram > FLASH_TYPEPROGRAM_DOUBLEWORD ||
+      Address < SIM_FLASH_BASE || Address + sizes[TypeProgram] > SIM_FLASH_BASE + SIM_FLASH_SIZE) {
+    return(HAL_ERROR);
+  }
+  Sim_flash_program(Address, &Data, sizes[TypeProgram]);
+  return(HAL_OK);
+}
+
+
+
+
+
+HAL_StatusTypeDef HAL_FLASHEx_Erase(FLASH_EraseInitTypeDef *pEraseInit, uint32_t *SectorError)
+{
+  uint32_t first = (pEraseInit->TypeErase == FLASH_TYPEERASE_MASSERASE) ? 0 : pEraseInit->Sector;
+  uint32_t count = (pEraseInit->TypeErase == FLASH_TYPEERASE_MASSERASE) ? FLASH_SECTOR_TOTAL : pEraseInit->NbSectors;
+
+  if (FLASH->CR & FLASH_CR_LOCK) {
+    return(HAL_ERROR);
+  }
+  for (uint32_t s = first; s < first + count; s++) {
+    Sim_flash_erase(s);
+  }
+  *SectorError = 0xFFFFFFFFU;
+  return(HAL_OK);
+}
@@ -0,0 +1,464 @@
+/**
+  ******************************************************************************
+  * @file           : sim_main.c
+  * @brief          : Scenarios of the host simulation: each one runs the whole
+  *                   firmware in a child process, on a virtual clock
+  ******************************************************************************
+  * @attention
+  *
+  * Copyright (c) 2023 Nicolò Campanini.
+  * All rights reserved.
+  *
+  * This software is licensed under terms that can be found in the LICENSE file
+  * in the root directory of this software component.
+  * If no LICENSE file comes with this software, it is provided AS-IS.
+  *
+  ******************************************************************************
+  */
+
+#include "sim.h"
+#include "profiler.h"
+#include "latency_trace.h"
+#include "nixie_display.h"
+#include "power.h"
+#include "nixie_usage.h"
+#include <signal.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+
+
+
+
+// Default length of the soak run, in days (--days to change it)
+#define SIM_SOAK_DAYS 7
+// Wall clock guard of one scenario: a hung firmware loop fails the run
+#define SIM_GUARD_S 30
+#define SIM_GUARD_S_PER_DAY 20
+
+// The RTC is set from the fix and the time since its UTC second, with the
+// receiver latency of the firmware default (100 ms, the scenarios have 80
+// to 150): that difference, then up to one display tick to the latch
+#define SIM_TOLERANCE_MS 100
+
+// The new second must be latched within one display tick of its RTC edge
+#define SIM_LATCH_MAX_US (1000000 / NIXIE_TICKS_PER_SECOND + 1000)
+
+// Power accounting of the firmware against the virtual clock: the Stop
+// time within this share of the simulated one (the firmware measures it
+// on the RTC, in ms steps), all the states within it of the run
+#define SIM_POWER_TOLERANCE_PERMILLE 5
+
+// Cathode on-time counters of the firmware against the time each cathode
+// was latched on the lit tubes: whole seconds on both sides, and the
+// edges of the lit time (night ramps) a tick apart
+#define SIM_USAGE_TOLERANCE_S 2
+#define SIM_USAGE_TOLERANCE_S_PER_DAY 1
+
+// Night window of the default schedule, local minutes
+#define SIM_NIGHT_OFF (23 * 60 + 30)
+#define SIM_NIGHT_ON (7 * 60)
+
+// Saturday of the night-week scenario: on at 09:00, off half an hour
+// after the sunset
+const Sim_night_day_t Sim_night_saturday = {.weekday = 6, .on_min = 9 * 60, .off_after_sunset_min = 30};
+
+// Commands typed on the console of the boot scenario, once synced
+#define SIM_CONSOLE_SCRIPT "help\r\nconfig\r\nget tz_offset\r\nset brightness 200\r\nset animation 9\r\n" \
+                           "bogus\r\nprof\r\nsched\r\ntrace\r\nisr\r\nsave\r\nkv\r\nwdog\r\nload\r\nclock\r\n" \
+                           "clock bench\r\nusage\r\ntest digits\r\n"
+
+Sim_scenario_t Sim_scenarios[] = {
+  {
+    // Cold start (backup domain lost) on a summer morning, GPS fix after 40 s
+    .name = "boot", .start_utc = 1781510400,   // 2026-06-15 08:00 UTC
+    .duration_s = 2 * 3600, .gps_latency_ms = 80, .gps_ttff_s = 40,
+    .light = 2000, .tolerance_ms = SIM_TOLERANCE_MS, .night_off_min = SIM_NIGHT_OFF, .night_on_min = SIM_NIGHT_ON,
+    .console_at_s = 60, .console = SIM_CONSOLE_SCRIPT,
+    .console_expect = {"night_off=1410", "tz_offset=3600", "brightness=200", "out of range", "unknown command",
+                       "prof gps_parse n=", "sched console n=", "trace edge_to_latch n=", "saved", "kv gen=1 keys=13",
+                       "wdog resets=0 reason=0x00000000 loop=", "load cpu 1s=", "isr deferred runs=",
+                       "clock profile=normal base=normal bursts=", "clock burst sysclk=84000000 from=normal switch_us=",
+                       "usage commits=0 failures=0 saturated=0"}
+  },
+  {
+    // CET to CEST on 2027-03-28 01:00 UTC, across the night
+    .name = "dst-spring", .start_utc = 1806148800,   // 2027-03-27 12:00 UTC
+    .duration_s = 36 * 3600, .rtc_kept = 1, .rtc_ppm = 5, .gps_latency_ms = 120,
+    .light = 1500, .tolerance_ms = SIM_TOLERANCE_MS, .night_off_min = SIM_NIGHT_OFF, .night_on_min = SIM_NIGHT_ON
+  },
+  {
+    // CEST to CET on 2026-10-25 01:00 UTC
+    .name = "dst-autumn", .start_utc = 1792843200,   // 2026-10-24 12:00 UTC
+    .duration_s = 36 * 3600, .rtc_kept = 1, .rtc_ppm = -5, .gps_latency_ms = 120,
+    .light = 1500, .tolerance_ms = SIM_TOLERANCE_MS, .night_off_min = SIM_NIGHT_OFF, .night_on_min = SIM_NIGHT_ON
+  },
+  {
+    // Receiver unplugged for two days, then an hour without fix: the RTC
+    // (20 ppm fast) keeps the time alone and is pulled back after. Later,
+    // nine seconds of week rollover dates must not reach the RTC.
+    .name = "outage", .start_utc = 1793610000,   // 2026-11-02 09:00 UTC
+    .duration_s = 4 * 86400, .rtc_kept = 1, .rtc_ppm = 20, .gps_latency_ms = 150,
+    .outages = {{6 * 3600, 2 * 86400, SIM_GPS_SILENT}, {3 * 86400, 3600, SIM_GPS_NOFIX},
+                {3 * 86400 + 7200, 9, SIM_GPS_ROLLOVER}}, .outage_count = 3,
+    .light = 1000, .tolerance_ms = SIM_TOLERANCE_MS, .night_off_min = SIM_NIGHT_OFF, .night_on_min = SIM_NIGHT_ON
+  },
+  {
+    // LSE failing for a few seconds in the night: the wakeups from Stop
+    // find no RSF, must not hang on it and leave a blackbox event. The
+    // power accounting of the night is read on the console after.
+    .name = "lse-stall", .start_utc = 1796158800,   // 2026-12-01 21:00 UTC
+    .duration_s = 11 * 3600, .rtc_kept = 1, .rtc_ppm = 10, .gps_latency_ms = 100,
+    .rsf_stuck_s = 4 * 3600, .rsf_stuck_duration_s = 3,
+    .light = 1500, .tolerance_ms = SIM_TOLERANCE_MS, .night_off_min = SIM_NIGHT_OFF, .night_on_min = SIM_NIGHT_ON,
+    .console_at_s = 10 * 3600 + 60, .console = "bbox\r\npower\r\n", .console_expect = {"rtc_sync", "power duty="}
+  },
+  {
+    // A weekend with its own Saturday window, set and saved on the console:
+    // lit from 09:00 to half an hour after the sunset, the other days as
+    // the default. The sun times of the firmware checked on a whole year.
+    .name = "night-week", .start_utc = 1789128000,   // 2026-09-11 12:00 UTC, a Friday
+    .duration_s = 3 * 86400, .rtc_kept = 1, .rtc_ppm = 3, .gps_latency_ms = 100,
+    .light = 1500, .tolerance_ms = SIM_TOLERANCE_MS, .night_off_min = SIM_NIGHT_OFF, .night_on_min = SIM_NIGHT_ON,
+    .night_day = &Sim_night_saturday, .console_at_s = 60,
+    .console = "night sat on fixed 540\r\nnight sat off sunset 30\r\nnight sat on sunset 900\r\nnight xyz\r\n"
+               "save\r\nconfig\r\nnight\r\n",
+    .console_expect = {"night sat enabled=1 on=fixed:540 off=sunset:30", "out of range", "unknown day", "saved",
+                       "latitude=4546", "longitude=919", "night state=on saved_min=", "night sun enabled=1 on=fixed:420"}
+  },
+  {
+    // Autumn to spring, both DST switches, with the backup domain kept: a
+    // week without the receiver in the winter, the RTC alone on the time.
+    // Half an hour of host time, run on its own (ctest -C Long -L long).
+    .name = "winter", .start_utc = 1792497600,   // 2026-10-20 12:00 UTC
+    .duration_s = 163 * 86400, .rtc_kept = 1, .rtc_ppm = 12, .gps_latency_ms = 110,
+    .outages = {{20 * 86400, 3600, SIM_GPS_NOFIX}, {70 * 86400, 7 * 86400, SIM_GPS_SILENT},
+                {140 * 86400 + 7200, 9, SIM_GPS_ROLLOVER}}, .outage_count = 3,
+    .light = 1800, .tolerance_ms = SIM_TOLERANCE_MS, .night_off_min = SIM_NIGHT_OFF, .night_on_min = SIM_NIGHT_ON,
+    .console_at_s = 163 * 86400 - 3600, .console = "wdog\r\nusage\r\nbbox\r\n",
+    .console_expect = {"wdog resets=0", "failures=0 saturated=0"}, .named_only = 1
+  },
+  {
+    // Long run from a cold start, slow LSE and a few outages
+    .name = "soak", .start_utc = 1767603600,   // 2026-01-05 09:00 UTC
+    .duration_s = SIM_SOAK_DAYS * 86400, .rtc_ppm = -15, .gps_latency_ms = 100, .gps_ttff_s = 90,
+    .outages = {{2 * 86400, 6 * 3600, SIM_GPS_SILENT}, {3 * 86400 + 12 * 3600, 86400, SIM_GPS_SILENT},
+                {5 * 86400 + 3600, 7200, SIM_GPS_NOFIX}}, .outage_count = 3,
+    .light = 2500, .tolerance_ms = SIM_TOLERANCE_MS, .night_off_min = SIM_NIGHT_OFF, .night_on_min = SIM_NIGHT_ON
+  }
+};
+#define SIM_SCENARIOS (sizeof(Sim_scenarios) / sizeof(Sim_scenarios[0]))
+
+const char *Sim_trace_names[TRACE_KINDS] = {"idle->parse", "parse->RTC", "edge->latch"};
+
+
+
+
+
+uint32_t Sim_expected_dst_changes(const Sim_scenario_t *_scenario)
+{
+  // Switches of the rule inside the run, hour by hour
+  uint32_t changes = 0;
+  int32_t offset = Sim_local_offset_s(_scenario->start_utc);
+
+  for (uint32_t h = 1; h <= _scenario->duration_s / 3600; h++) {
+    int32_t next = Sim_local_offset_s(_scenario->start_utc + (int64_t) h * 3600);
+    changes += (next != offset);
+    offset = next;
+  }
+  return(changes);
+}
+
+
+
+
+
+void Sim_verbose_write(const char *_text, uint16_t _length)
+{
+  // Text_write_t of the firmware dumps
+  fprintf(stderr, "%s: ", Sim_scenario->name);
+  fwrite(_text, 1, _length, stderr);
+}
+
+
+
+
+
+int Sim_run_scenario(const Sim_scenario_t *_scenario)
+{
+  // Child process: fresh firmware RAM and registers for every scenario
+  Sim_display_stats_t display;
+  Trace_stats_t trace[TRACE_KINDS];
+  Power_stats_t power;
+  double power_stop_s = 0;
+  double power_total_s = 0;
+  double sim_stop_s = 0;
+  uint16_t duty = 0;
+  uint32_t expected_dst = Sim_expected_dst_changes(_scenario);
+  uint32_t usage[NIXIE_TUBES * NIXIE_DIGITS];
+  uint32_t usage_total = 0;
+  uint32_t shown_total = 0;
+  uint32_t usage_max_diff = 0;
+  uint32_t sun_error_min = 0;
+  uint32_t sun_failed = 0;
+  struct timespec start, end;
+  double wall = 0;
+  int reason = 0;
+  int failures = 0;
+
+  alarm(SIM_GUARD_S + SIM_GUARD_S_PER_DAY * (_scenario->duration_s / 86400 + 1));
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  reason = Sim_run_firmware(_scenario);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  wall = (double) (end.tv_sec - start.tv_sec) + (double) (end.tv_nsec - start.tv_nsec) / 1e9;
+  Sim_display_get_stats(&display);
+  Power_get_stats(&power);
+  duty = Power_duty_permille();
+  power_stop_s = (double) power.stop_us / 1e6;
+  power_total_s = (double) (power.run_us + power.sleep_us + power.stop_us) / 1e6;
+  sim_stop_s = (double) Sim_stats.stop_ns / SIM_NS_PER_S;
+  // Pipeline probes of the firmware, on its own dump (counts only: the
+  // firmware code runs in no virtual time)
+  if (_scenario->verbose) {
+    Prof_dump(Sim_verbose_write);
+    Trace_dump(Sim_verbose_write);
+  }
+
+  printf("%-11s %6.1f h virtual in %6.2f s (x%.0f)\n", _scenario->name, _scenario->duration_s / 3600.0, wall,
+         _scenario->duration_s / (wall > 0 ? wall : 1e-9));
+  printf("  display: %lu checks, %lu failed, max error %ld ms, %lu unsynced, %lu in sequences, %lu dark,"
+         " %lu night errors, %lu calendar errors, %lu ghost frames, %lu/%lu DST changes\n",
+         (unsigned long) display.checks, (unsigned long) display.failed, (long) display.max_error_ms,
+         (unsigned long) display.unsynced, (unsigned long) display.sequences, (unsigned long) display.dark,
+         (unsigned long) display.night_failed, (unsigned long) display.calendar_failed,
+         (unsigned long) display.ghost_frames,
+         (unsigned long) display.dst_changes, (unsigned long) expected_dst);
+  printf("  firmware: %lu events, %lu interrupts, %lu stops (%.1f%% of the time), %lu RTC writes,"
+         " %lu SPI frames, %lu bytes received, %lu lost, %lu flash erases\n",
+         (unsigned long) Sim_stats.events, (unsigned long) Sim_stats.interrupts, (unsigned long) Sim_stats.stops,
+         100.0 * (double) Sim_stats.stop_ns / ((double) _scenario->duration_s * SIM_NS_PER_S),
+         (unsigned long) Sim_stats.rtc_sets, (unsigned long) Sim_stats.spi_frames,
+         (unsigned long) Sim_stats.rx_bytes, (unsigned long) Sim_stats.rx_lost,
+         (unsigned long) Sim_stats.flash_erases);
+  printf("  latency:");
+  for (uint8_t k = 0; k < TRACE_KINDS; k++) {
+    Trace_get_stats(k, &trace[k]);
+    printf(" %s avg %lu us max %lu us (%lu)%s", Sim_trace_names[k], (unsigned long) Trace_avg_us(&trace[k]),
+           (unsigned long) trace[k].max_us, (unsigned long) trace[k].count, (k < TRACE_KINDS - 1) ? "," : "\n");
+  }
+
+  Nixie_usage_read_all(usage);
+  for (uint8_t i = 0; i < NIXIE_TUBES * NIXIE_DIGITS; i++) {
+    uint32_t shown = (uint32_t) (display.shown_ns[i / NIXIE_DIGITS][i % NIXIE_DIGITS] / SIM_NS_PER_S);
+    uint32_t diff = (usage[i] > shown) ? usage[i] - shown : shown - usage[i];
+
+    usage_total += usage[i];
+    shown_total += shown;
+    usage_max_diff = (diff > usage_max_diff) ? diff : usage_max_diff;
+  }
+  printf("  usage: %lu cathode-seconds counted, %lu shown, max difference %lu s\n", (unsigned long) usage_total,
+         (unsigned long) shown_total, (unsigned long) usage_max_diff);
+  printf("  power: stop %.1f s (simulated %.1f s), %.1f s accounted, duty %u permille, average %lu uA\n",
+         power_stop_s, sim_stop_s, power_total_s, duty, (unsigned long) Power_average_current_uA());
+
+  // What the tubes showed, then the hardware rules the firmware must keep
+  if (reason != 1) {
+    printf("  FAIL: the firmware reset the core\n");
+    failures++;
+  }
+  if (display.checks == 0 || display.failed > 0) {
+    printf("  FAIL: time shown on the tubes\n");
+    failures++;
+  }
+  if (display.calendar_failed > 0) {
+    printf("  FAIL: RTC date\n");
+    failures++;
+  }
+  if (display.night_failed > 0) {
+    printf("  FAIL: night schedule\n");
+    failures++;
+  }
+  if (display.ghost_frames > 0) {
+    printf("  FAIL: more than one cathode on in a tube\n");
+    failures++;
+  }
+  if (display.dst_changes != expected_dst) {
+    printf("  FAIL: DST changes\n");
+    failures++;
+  }
+  if (trace[TRACE_EDGE_TO_LATCH].count == 0 || trace[TRACE_EDGE_TO_LATCH].max_us > SIM_LATCH_MAX_US) {
+    printf("  FAIL: second edge to latch latency\n");
+    failures++;
+  }
+  if (Sim_stats.rx_framing > 0) {
+    printf("  FAIL: USART baud rate off the line one\n");
+    failures++;
+  }
+  for (uint8_t e = 0; e < SIM_CONSOLE_EXPECTS && _scenario->console_expect[e] != NULL; e++) {
+    if (strstr(Sim_console_output(), _scenario->console_expect[e]) == NULL) {
+      printf("  FAIL: console output without \"%s\"\n", _scenario->console_expect[e]);
+      failures++;
+    }
+  }
+  // Estimates of the firmware against the virtual clock
+  if (power_stop_s > sim_stop_s * (1000 + SIM_POWER_TOLERANCE_PERMILLE) / 1000 + 1 ||
+      power_stop_s < sim_stop_s * (1000 - SIM_POWER_TOLERANCE_PERMILLE) / 1000 - 1) {
+    printf("  FAIL: Stop time\n");
+    failures++;
+  }
+  if (power_total_s < (double) _scenario->duration_s * (1000 - SIM_POWER_TOLERANCE_PERMILLE) / 1000 ||
+      power_total_s > (double) _scenario->duration_s * (1000 + SIM_POWER_TOLERANCE_PERMILLE) / 1000) {
+    printf("  FAIL: time accounted to the power states\n");
+    failures++;
+  }
+  if (duty > 1000 - (uint16_t) (sim_stop_s * 1000 / _scenario->duration_s)) {
+    printf("  FAIL: duty cycle\n");
+    failures++;
+  }
+  if (usage_max_diff > SIM_USAGE_TOLERANCE_S + SIM_USAGE_TOLERANCE_S_PER_DAY * (_scenario->duration_s / 86400)) {
+    printf("  FAIL: cathode on-time counters\n");
+    failures++;
+  }
+  if (_scenario->night_day != NULL) {
+    sun_failed = Sim_sun_check(&sun_error_min);
+    printf("  sun: sunrise/sunset max error %lu min at the default location, %lu days off\n",
+           (unsigned long) sun_error_min, (unsigned long) sun_failed);
+    if (sun_failed > 0) {
+      printf("  FAIL: sunrise/sunset times\n");
+      failures++;
+    }
+  }
+  if (Sim_stats.flash_overwrites > 0) {
+    printf("  FAIL: flash programmed without erase\n");
+    failures++;
+  }
+  fflush(stdout);
+  return(failures ? 1 : 0);
+}
+
+
+
+
+
+pid_t Sim_start_scenario(const Sim_scenario_t *_scenario, int *_output)
+{
+  // Child process with its report on a pipe: the scenarios run in parallel
+  int fds[2];
+  pid_t pid = 0;
+
+  if (pipe(fds) != 0) {
+    perror("sim: pipe");
+    return(-1);
+  }
+  fflush(stdout);
+  pid = fork();
+  if (pid < 0) {
+    perror("sim: fork");
+    close(fds[0]);
+    close(fds[1]);
+    return(-1);
+  }
+  if (pid == 0) {
+    close(fds[0]);
+    dup2(fds[1], STDOUT_FILENO);
+    close(fds[1]);
+    _exit(Sim_run_scenario(_scenario));
+  }
+  close(fds[1]);
+  *_output = fds[0];
+  return(pid);
+}
+
+
+
+
+
+int Sim_finish_scenario(const Sim_scenario_t *_scenario, pid_t _pid, int _output)
+{
+  // Report in the scenario order, whatever finishes first
+  char buffer[4096];
+  ssize_t length = 0;
+  int status = 0;
+
+  if (_pid < 0) {
+    return(1);
+  }
+  while ((length = read(_output, buffer, sizeof(buffer))) > 0) {
+    fwrite(buffer, 1, (size_t) length, stdout);
+  }
+  close(_output);
+  waitpid(_pid, &status, 0);
+  if (WIFSIGNALED(status)) {
+    printf("%-11s FAIL: %s\n", _scenario->name,
+           (WTERMSIG(status) == SIGALRM) ? "wall clock guard expired" : strsignal(WTERMSIG(status)));
+    return(1);
+  }
+  return(WEXITSTATUS(status) != 0);
+}
+
+
+
+
+
+void Sim_usage(const char *_program)
+{
+  fprintf(stderr, "usage: %s [--list] [--scenario NAME] [--days N] [-v]\n", _program);
+}
+
+
+
+
+
+int main(int argc, char **argv)
+{
+  const char *only = NULL;
+  pid_t pids[SIM_SCENARIOS] = {0};
+  int outputs[SIM_SCENARIOS] = {0};
+  uint8_t verbose = 0;
+  int failed = 0;
+  int run = 0;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--list") == 0) {
+      for (uint8_t s = 0; s < SIM_SCENARIOS; s++) {
+        printf("%-11s %6.1f h%s\n", Sim_scenarios[s].name, Sim_scenarios[s].duration_s / 3600.0,
+               Sim_scenarios[s].named_only ? " (--scenario only)" : "");
+      }
+      return(0);
+    } else if (strcmp(argv[i], "--scenario") == 0 && i + 1 < argc) {
+      only = argv[++i];
+    } else if (strcmp(argv[i], "--days") == 0 && i + 1 < argc) {
+      Sim_scenarios[SIM_SCENARIOS - 1].duration_s = (uint32_t) (atof(argv[++i]) * 86400);
+    } else if (strcmp(argv[i], "-v") == 0) {
+      verbose = 1;
+    } else {
+      Sim_usage(argv[0]);
+      return(2);
+    }
+  }
+
+  Sim_map_memory();
+
+  for (uint8_t s = 0; s < SIM_SCENARIOS; s++) {
+    if ((only == NULL && Sim_scenarios[s].named_only) ||
+        (only != NULL && strcmp(only, Sim_scenarios[s].name) != 0)) {
+      continue;
+    }
+    Sim_scenarios[s].verbose = verbose;
+    pids[s] = Sim_start_scenario(&Sim_scenarios[s], &outputs[s]);
+    run++;
+  }
+  for (uint8_t s = 0; s < SIM_SCENARIOS; s++) {
+    if (pids[s] != 0) {
+      failed += Sim_finish_scenario(&Sim_scenarios[s], pids[s], outputs[s]);
+    }
+  }
+
+  if (run == 0) {
+    fprintf(stderr, "sim: no scenario named %s\n", only);
+    return(2);
+  }
+  printf("%d of %d scenarios passed\n", run - failed, run);
+  return(failed ? 1 : 0);
+}
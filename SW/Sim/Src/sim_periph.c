@@ -0,0 +1,928 @@
+/**
+  ******************************************************************************
+  * @file           : sim_periph.c
+  * @brief          : Peripheral models of the host simulation: RTC, timers,
+  *                   ADC with DMA, SPI, USART reception and flash
+  ******************************************************************************
+  * @attention
+  *
+  * Copyright (c) 2023 Nicolò Campanini.
+  * All rights reserved.
+  *
+  * This software is licensed under terms that can be found in the LICENSE file
+  * in the root directory of this software component.
+  * If no LICENSE file comes with this software, it is provided AS-IS.
+  *
+  ******************************************************************************
+  */
+
+#include "sim.h"
+
+
+
+
+
+// Seconds from 1970-01-01 to 2000-01-01, the RTC calendar origin
+#define SIM_RTC_EPOCH 946684800LL
+
+// RTC: the calendar is a tick count (1 / (PREDIV_S + 1) s) since 2000-01-01,
+// running (1 + ppm) faster than the true time from the last write
+int64_t Sim_rtc_base_ticks = 0;
+uint64_t Sim_rtc_base_ns = 0;
+uint32_t Sim_rtc_prediv_s = 255;
+int64_t Sim_rtc_second = -1;
+uint64_t Sim_rtc_set_ns = 0;
+int32_t Sim_rtc_ppm = 0;
+// Window without shadow register copies (LSE failing)
+uint64_t Sim_rsf_stuck_from = SIM_NEVER;
+uint64_t Sim_rsf_stuck_until = SIM_NEVER;
+// RTC wakeup timer, on the true time scale
+uint64_t Sim_wakeup_next = SIM_NEVER;
+uint64_t Sim_wakeup_period = 0;
+
+// Timers with an update interrupt
+typedef struct{
+  TIM_TypeDef *tim;
+  IRQn_Type irq;
+  uint32_t cr1;                  // Configuration seen at the last sync
+  uint32_t dier;
+  uint32_t psc;
+  uint32_t arr;
+  uint32_t rcr;
+  uint64_t period;
+  uint64_t next;
+} Sim_timer_t;
+
+Sim_timer_t Sim_timers[] = {
+  {TIM1, TIM1_UP_TIM10_IRQn},
+  {TIM2, TIM2_IRQn},
+  {TIM11, TIM1_TRG_COM_TIM11_IRQn}
+};
+#define SIM_TIMERS (sizeof(Sim_timers) / sizeof(Sim_timers[0]))
+#define SIM_TIMER_ADC 1
+
+// ADC: conversions triggered by the TIM2 update, moved by the DMA
+ADC_HandleTypeDef *Sim_adc_hadc = NULL;
+uint32_t Sim_adc_half = 0;
+uint64_t Sim_adc_next = SIM_NEVER;
+uint32_t Sim_noise = 12345;
+
+// DMA streams: the memory address doesn't fit M0AR on a 64 bit host
+typedef struct{
+  uint8_t *memory;
+  uint32_t length;
+  uint32_t position;
+} Sim_dma_stream_t;
+
+Sim_dma_stream_t Sim_dma_streams[16];
+const IRQn_Type Sim_dma_irqs[16] = {
+  DMA1_Stream0_IRQn, DMA1_Stream1_IRQn, DMA1_Stream2_IRQn, DMA1_Stream3_IRQn,
+  DMA1_Stream4_IRQn, DMA1_Stream5_IRQn, DMA1_Stream6_IRQn, DMA1_Stream7_IRQn,
+  DMA2_Stream0_IRQn, DMA2_Stream1_IRQn, DMA2_Stream2_IRQn, DMA2_Stream3_IRQn,
+  DMA2_Stream4_IRQn, DMA2_Stream5_IRQn, DMA2_Stream6_IRQn, DMA2_Stream7_IRQn
+};
+const uint8_t Sim_dma_shifts[4] = {0, 6, 16, 22};
+
+// SPI transfer in progress
+SPI_HandleTypeDef *Sim_spi_hspi = NULL;
+uint8_t Sim_spi_data[64];
+uint16_t Sim_spi_size = 0;
+uint64_t Sim_spi_done = SIM_NEVER;
+uint8_t Sim_spi_complete = 0;
+
+// Independent watchdog: on the LSI, counting in Stop too
+uint64_t Sim_iwdg_expiry = SIM_NEVER;
+
+// USART1 receive line: bytes on the wire, delivered as their stop bit ends
+typedef struct{
+  uint64_t start;
+  uint64_t end;
+  uint32_t baud;
+  uint8_t byte;
+} Sim_rx_byte_t;
+
+UART_HandleTypeDef *Sim_uart_huart = NULL;
+Sim_rx_byte_t Sim_rx_queue[SIM_RX_QUEUE_SIZE];
+uint16_t Sim_rx_head = 0;
+uint16_t Sim_rx_count = 0;
+// Idle line detection: after the last delivered byte, and at the end of
+// the run of back to back bytes at the head of the queue
+uint64_t Sim_rx_idle = SIM_NEVER;
+uint64_t Sim_rx_run_idle = SIM_NEVER;
+
+
+
+
+
+void Sim_periph_reset(const Sim_scenario_t *_scenario)
+{
+  Sim_rtc_ppm = _scenario->rtc_ppm;
+  Sim_rtc_prediv_s = 255;
+  Sim_rtc_base_ns = 0;
+  Sim_rtc_set_ns = 0;
+  Sim_rtc_second = -1;
+  Sim_wakeup_next = SIM_NEVER;
+  Sim_wakeup_period = 0;
+  Sim_rsf_stuck_from = SIM_NEVER;
+  Sim_rsf_stuck_until = SIM_NEVER;
+  if (_scenario->rsf_stuck_duration_s > 0) {
+    Sim_rsf_stuck_from = (uint64_t) _scenario->rsf_stuck_s * SIM_NS_PER_S;
+    Sim_rsf_stuck_until = Sim_rsf_stuck_from + (uint64_t) _scenario->rsf_stuck_duration_s * SIM_NS_PER_S;
+  }
+
+  // Backup domain: calendar reset value, or still running on time
+  if (_scenario->rtc_kept) {
+    RTC->PRER = (127 << RTC_PRER_PREDIV_A_Pos) | Sim_rtc_prediv_s;
+    RTC->ISR = RTC_ISR_INITS;
+    RTC->BKP0R = 0x32F2;
+    Sim_rtc_base_ticks = (_scenario->start_utc - SIM_RTC_EPOCH) * (Sim_rtc_prediv_s + 1);
+  } else {
+    RTC->PRER = 0x007F00FF;
+    Sim_rtc_base_ticks = 0;
+  }
+  Sim_rtc_update(0);
+
+  for (uint8_t t = 0; t < SIM_TIMERS; t++) {
+    Sim_timers[t].cr1 = 0;
+    Sim_timers[t].dier = 0;
+    Sim_timers[t].next = SIM_NEVER;
+  }
+  Sim_adc_hadc = NULL;
+  Sim_adc_next = SIM_NEVER;
+  memset(Sim_dma_streams, 0, sizeof(Sim_dma_streams));
+  Sim_spi_hspi = NULL;
+  Sim_spi_done = SIM_NEVER;
+  Sim_spi_complete = 0;
+  Sim_uart_huart = NULL;
+  Sim_rx_head = 0;
+  Sim_rx_count = 0;
+  Sim_rx_idle = SIM_NEVER;
+  Sim_rx_run_idle = SIM_NEVER;
+  Sim_iwdg_expiry = SIM_NEVER;
+}
+
+
+
+
+
+uint64_t Sim_scale(uint64_t _count, uint64_t _num, uint64_t _den)
+{
+  // _count * _num / _den without overflow
+  return((uint64_t) (((unsigned __int128) _count * _num) / _den));
+}
+
+
+
+
+
+uint8_t Sim_bcd(uint32_t _value)
+{
+  return((uint8_t) (((_value / 10) << 4) | (_value % 10)));
+}
+
+
+
+
+
+int64_t Sim_rtc_ticks(uint64_t _now)
+{
+  // LSE running ppm fast (or slow) compared with the true time
+  return(Sim_rtc_base_ticks +
+         (int64_t) Sim_scale(_now - Sim_rtc_base_ns, (uint64_t) (1000000 + Sim_rtc_ppm) * (Sim_rtc_prediv_s + 1),
+                             SIM_NS_PER_S * 1000000));
+}
+
+
+
+
+
+void Sim_rtc_update(uint64_t _now)
+{
+  int64_t ticks = Sim_rtc_ticks(_now);
+  int64_t second = ticks / (Sim_rtc_prediv_s + 1);
+
+  RTC->SSR = Sim_rtc_prediv_s - (uint32_t) (ticks % (Sim_rtc_prediv_s + 1));
+  // The shadow registers are always in sync, but RSF cleared by the
+  // firmware stays so while the LSE is failing
+  RTC->ISR |= RTC_ISR_INITS;
+  if (_now < Sim_rsf_stuck_from || _now >= Sim_rsf_stuck_until) {
+    RTC->ISR |= RTC_ISR_RSF;
+  }
+
+  if (second != Sim_rtc_second) {
+    int64_t days = second / 86400 + SIM_RTC_EPOCH / 86400;
+    uint32_t time = (uint32_t) (second % 86400);
+    int32_t year = 0;
+    uint8_t month = 0;
+    uint8_t day = 0;
+    // 1970-01-01 was a Thursday, ISO weekday 4
+    uint8_t weekday = (uint8_t) (((days + 3) % 7) + 1);
+
+    Sim_civil_from_days(days, &year, &month, &day);
+    RTC->TR = ((uint32_t) Sim_bcd(time / 3600) << RTC_TR_HU_Pos) |
+              ((uint32_t) Sim_bcd((time / 60) % 60) << RTC_TR_MNU_Pos) |
+              ((uint32_t) Sim_bcd(time % 60) << RTC_TR_SU_Pos);
+    RTC->DR = ((uint32_t) Sim_bcd((uint32_t) (year - 2000)) << RTC_DR_YU_Pos) |
+              ((uint32_t) weekday << RTC_DR_WDU_Pos) |
+              ((uint32_t) Sim_bcd(month) << RTC_DR_MU_Pos) |
+              ((uint32_t) Sim_bcd(day) << RTC_DR_DU_Pos);
+    Sim_rtc_second = second;
+  }
+}
+
+
+
+
+
+void Sim_rtc_set(int64_t _seconds)
+{
+  // Writing the calendar restarts the synchronous prescaler
+  Sim_rtc_prediv_s = (RTC->PRER & RTC_PRER_PREDIV_S) ? (RTC->PRER & RTC_PRER_PREDIV_S) : 255;
+  Sim_rtc_base_ns = Sim_now();
+  Sim_rtc_base_ticks = _seconds * (Sim_rtc_prediv_s + 1);
+  Sim_rtc_set_ns = Sim_now();
+  Sim_rtc_second = -1;
+  Sim_stats.rtc_sets++;
+  Sim_rtc_update(Sim_now());
+}
+
+
+
+
+
+void Sim_rtc_shift(uint8_t _add1s, uint32_t _subfs)
+{
+  // Shift of the synchronous prescaler: one second added, then a fraction
+  // of it subtracted. Applied at once, the hardware takes one RTCCLK.
+  int64_t ticks = Sim_rtc_ticks(Sim_now());
+
+  Sim_rtc_base_ns = Sim_now();
+  Sim_rtc_base_ticks = ticks + (_add1s ? Sim_rtc_prediv_s + 1 : 0) - _subfs;
+  Sim_rtc_second = -1;
+  Sim_rtc_update(Sim_now());
+}
+
+
+
+
+
+int64_t Sim_rtc_seconds()
+{
+  return(Sim_rtc_ticks(Sim_now()) / (Sim_rtc_prediv_s + 1));
+}
+
+
+
+
+
+uint64_t Sim_rtc_last_set()
+{
+  return(Sim_rtc_set_ns);
+}
+
+
+
+
+
+void Sim_rtc_wakeup_arm()
+{
+  uint32_t clock = RTC->CR & RTC_CR_WUCKSEL;
+  uint64_t counts = (RTC->WUTR & RTC_WUTR_WUT) + 1;
+  uint64_t period = 0;
+
+  if ((RTC->CR & RTC_CR_WUTE) == 0) {
+    Sim_wakeup_next = SIM_NEVER;
+    return;
+  }
+
+  // ck_spre (1 Hz), with the 17th bit for WUCKSEL = 11x, or RTCCLK / 16..2
+  if (clock & RTC_CR_WUCKSEL_2) {
+    if (clock & RTC_CR_WUCKSEL_1) {
+      counts += 0x10000;
+    }
+    period = counts * SIM_NS_PER_S;
+  } else {
+    period = Sim_scale(counts, (16 >> (clock & 0x3)) * SIM_NS_PER_S, LSE_VALUE);
+  }
+  Sim_wakeup_period = Sim_scale(period, 1000000, (uint64_t) (1000000 + Sim_rtc_ppm));
+  Sim_wakeup_next = Sim_now() + Sim_wakeup_period;
+}
+
+
+
+
+
+uint32_t Sim_dma_index(DMA_Stream_TypeDef *_stream)
+{
+  uintptr_t base = (uintptr_t) _stream;
+
+  if (base >= DMA2_BASE) {
+    return(8 + (base - DMA2_Stream0_BASE) / 0x18);
+  }
+  return((base - DMA1_Stream0_BASE) / 0x18);
+}
+
+
+
+
+
+volatile uint32_t *Sim_dma_isr(uint32_t _index)
+{
+  DMA_TypeDef *dma = (_index >= 8) ? DMA2 : DMA1;
+
+  return(((_index & 7) < 4) ? &dma->LISR : &dma->HISR);
+}
+
+
+
+
+
+void Sim_dma_start(DMA_HandleTypeDef *_hdma, uint8_t *_memory, uint32_t _length)
+{
+  uint32_t index = Sim_dma_index(_hdma->Instance);
+
+  Sim_dma_streams[index].memory = _memory;
+  Sim_dma_streams[index].length = _length;
+  Sim_dma_streams[index].position = 0;
+  _hdma->Instance->NDTR = _length;
+  _hdma->Instance->CR |= DMA_SxCR_EN;
+}
+
+
+
+
+
+void Sim_dma_stop(DMA_HandleTypeDef *_hdma)
+{
+  _hdma->Instance->CR &= ~DMA_SxCR_EN;
+}
+
+
+
+
+
+void Sim_dma_write(DMA_Stream_TypeDef *_stream, uint16_t _value)
+{
+  // One peripheral request: store the item, count down NDTR, raise the flags
+  uint32_t index = Sim_dma_index(_stream);
+  Sim_dma_stream_t *s = &Sim_dma_streams[index];
+  uint32_t shift = Sim_dma_shifts[index & 3];
+  uint32_t flags = 0;
+
+  if ((_stream->CR & DMA_SxCR_EN) == 0 || s->memory == NULL) {
+    return;
+  }
+
+  if ((_stream->CR & DMA_SxCR_MSIZE) == DMA_MDATAALIGN_HALFWORD) {
+    ((uint16_t *) s->memory)[s->position] = _value;
+  } else {
+    s->memory[s->position] = (uint8_t) _value;
+  }
+  s->position++;
+  _stream->NDTR = s->length - s->position;
+
+  if (s->position == s->length / 2) {
+    flags |= DMA_FLAG_HTIF0_4;
+  }
+  if (s->position == s->length) {
+    flags |= DMA_FLAG_TCIF0_4;
+    s->position = 0;
+    if (_stream->CR & DMA_SxCR_CIRC) {
+      _stream->NDTR = s->length;
+    } else {
+      _stream->CR &= ~DMA_SxCR_EN;
+    }
+  }
+
+  if (flags) {
+    *Sim_dma_isr(index) |= flags << shift;
+    if (((flags & DMA_FLAG_HTIF0_4) && (_stream->CR & DMA_SxCR_HTIE)) ||
+        ((flags & DMA_FLAG_TCIF0_4) && (_stream->CR & DMA_SxCR_TCIE))) {
+      Sim_pend_irq(Sim_dma_irqs[index]);
+    }
+  }
+}
+
+
+
+
+
+void Sim_dma_irq(DMA_HandleTypeDef *_hdma)
+{
+  // HAL_DMA_IRQHandler() for the half and full transfer events
+  uint32_t index = Sim_dma_index(_hdma->Instance);
+  uint32_t shift = Sim_dma_shifts[index & 3];
+  volatile uint32_t *isr = Sim_dma_isr(index);
+
+  if ((*isr & (DMA_FLAG_HTIF0_4 << shift)) && (_hdma->Instance->CR & DMA_SxCR_HTIE)) {
+    *isr &= ~(DMA_FLAG_HTIF0_4 << shift);
+    if (_hdma->XferHalfCpltCallback != NULL) {
+      _hdma->XferHalfCpltCallback(_hdma);
+    }
+  }
+  if ((*isr & (DMA_FLAG_TCIF0_4 << shift)) && (_hdma->Instance->CR & DMA_SxCR_TCIE)) {
+    *isr &= ~(DMA_FLAG_TCIF0_4 << shift);
+    if ((_hdma->Instance->CR & DMA_SxCR_CIRC) == 0) {
+      _hdma->Instance->CR &= ~(DMA_SxCR_TCIE | DMA_SxCR_HTIE | DMA_SxCR_TEIE | DMA_SxCR_DMEIE);
+      _hdma->State = HAL_DMA_STATE_READY;
+      _hdma->Lock = HAL_UNLOCKED;
+    }
+    if (_hdma->XferCpltCallback != NULL) {
+      _hdma->XferCpltCallback(_hdma);
+    }
+  }
+}
+
+
+
+
+
+void Sim_timer_sync(Sim_timer_t *_timer, uint64_t _now)
+{
+  TIM_TypeDef *tim = _timer->tim;
+  uint8_t changed = (tim->PSC != _timer->psc) || (tim->ARR != _timer->arr) || (tim->RCR != _timer->rcr);
+  uint8_t started = (tim->CR1 & TIM_CR1_CEN) && !(_timer->cr1 & TIM_CR1_CEN);
+
+  if (changed || started || (tim->EGR & TIM_EGR_UG)) {
+    _timer->psc = tim->PSC;
+    _timer->arr = tim->ARR;
+    _timer->rcr = tim->RCR;
+    _timer->period = Sim_scale((uint64_t) (_timer->psc + 1) * (_timer->arr + 1) * ((_timer->rcr & 0xFF) + 1),
+                               SIM_NS_PER_S, Sim_timer_clock_hz(tim));
+  }
+
+  // Update generation: counters restart, UIF is set unless URS
+  if (tim->EGR & TIM_EGR_UG) {
+    tim->EGR &= ~TIM_EGR_UG;
+    _timer->next = _now + _timer->period;
+    if ((tim->CR1 & TIM_CR1_URS) == 0) {
+      tim->SR |= TIM_SR_UIF;
+      if (tim->DIER & TIM_DIER_UIE) {
+        Sim_pend_irq(_timer->irq);
+      }
+    }
+  } else if (started) {
+    _timer->next = _now + _timer->period;
+  } else if (changed && _timer->next != SIM_NEVER) {
+    // New prescaler and period from the next update on
+    _timer->next = (_timer->next > _now) ? _timer->next : _now + _timer->period;
+  }
+
+  if ((tim->CR1 & TIM_CR1_CEN) == 0) {
+    _timer->next = SIM_NEVER;
+  }
+  _timer->cr1 = tim->CR1;
+  _timer->dier = tim->DIER;
+}
+
+
+
+
+
+void Sim_periph_sync()
+{
+  uint64_t now = Sim_now();
+  uint64_t adc_period = Sim_timers[SIM_TIMER_ADC].period;
+
+  for (uint8_t t = 0; t < SIM_TIMERS; t++) {
+    Sim_timer_sync(&Sim_timers[t], now);
+  }
+
+  // Watchdog start and reload. KR is write-only on the chip: here the last
+  // key written reads back, the reload ending the start sequence included.
+  if (IWDG->KR == 0xCCCC || IWDG->KR == 0xAAAA) {
+    IWDG->KR = 0;
+    Sim_iwdg_expiry = now + Sim_scale((uint64_t) (4 << (IWDG->PR & IWDG_PR_PR)) * ((IWDG->RLR & IWDG_RLR_RL) + 1),
+                                      SIM_NS_PER_S, LSI_VALUE);
+  }
+
+  // The ADC follows the trigger timer
+  if (Sim_adc_hadc != NULL && Sim_adc_next != SIM_NEVER && Sim_timers[SIM_TIMER_ADC].period != adc_period) {
+    Sim_adc_next = now + Sim_adc_half * Sim_timers[SIM_TIMER_ADC].period;
+  }
+  if (Sim_adc_hadc != NULL && Sim_adc_next == SIM_NEVER && Sim_timers[SIM_TIMER_ADC].next != SIM_NEVER) {
+    Sim_adc_next = now + Sim_adc_half * Sim_timers[SIM_TIMER_ADC].period;
+  }
+}
+
+
+
+
+
+void Sim_rx_update_run()
+{
+  // End of the back to back bytes at the head, plus one idle frame
+  uint16_t i = 0;
+  uint64_t end = 0;
+
+  if (Sim_rx_count == 0) {
+    Sim_rx_run_idle = SIM_NEVER;
+    return;
+  }
+  end = Sim_rx_queue[Sim_rx_head].end;
+  for (i = 1; i < Sim_rx_count; i++) {
+    Sim_rx_byte_t *b = &Sim_rx_queue[(Sim_rx_head + i) % SIM_RX_QUEUE_SIZE];
+    if (b->start >= end + 10 * SIM_NS_PER_S / b->baud) {
+      break;
+    }
+    end = b->end;
+  }
+  Sim_rx_run_idle = end + 10 * SIM_NS_PER_S / Sim_rx_queue[Sim_rx_head].baud;
+}
+
+
+
+
+
+void Sim_rx_deliver(uint64_t _now)
+{
+  // Bytes whose stop bit ended by _now, with the state the firmware left
+  USART_TypeDef *usart = USART1;
+  uint8_t delivered = 0;
+
+  while (Sim_rx_count > 0 && Sim_rx_queue[Sim_rx_head].end <= _now) {
+    Sim_rx_byte_t *b = &Sim_rx_queue[Sim_rx_head];
+    uint8_t byte = b->byte;
+
+    Sim_rx_head = (Sim_rx_head + 1) % SIM_RX_QUEUE_SIZE;
+    Sim_rx_count--;
+    delivered = 1;
+
+    if (Sim_is_stopped() || Sim_uart_huart == NULL ||
+        (usart->CR1 & (USART_CR1_UE | USART_CR1_RE)) != (USART_CR1_UE | USART_CR1_RE)) {
+      Sim_stats.rx_lost++;
+      continue;
+    }
+
+    // Sampling clock against the line: outside the tolerance the byte is garbage
+    if (usart->BRR != 0) {
+      // Oversampling by 16: BRR is USARTDIV in 12.4 fixed point
+      uint64_t baud = Sim_pclk2_hz() / usart->BRR;
+      uint64_t error = (baud > b->baud) ? baud - b->baud : b->baud - baud;
+      if (error * 1000 > (uint64_t) b->baud * SIM_UART_BAUD_TOLERANCE_PERMILLE) {
+        Sim_stats.rx_framing++;
+        usart->SR |= USART_SR_FE;
+        byte ^= 0xA5;
+        if (usart->CR3 & USART_CR3_EIE) {
+          Sim_pend_irq(USART1_IRQn);
+        }
+      }
+    }
+
+    Sim_stats.rx_bytes++;
+    if ((usart->CR3 & USART_CR3_DMAR) && Sim_uart_huart->hdmarx != NULL &&
+        (Sim_uart_huart->hdmarx->Instance->CR & DMA_SxCR_EN)) {
+      Sim_dma_write(Sim_uart_huart->hdmarx->Instance, byte);
+    } else {
+      // No reception running: the byte waits in DR and is overrun
+      if (usart->SR & USART_SR_RXNE) {
+        usart->SR |= USART_SR_ORE;
+      }
+      usart->SR |= USART_SR_RXNE;
+      usart->DR = byte;
+      Sim_stats.rx_lost++;
+    }
+    Sim_rx_idle = b->end + 10 * SIM_NS_PER_S / b->baud;
+  }
+
+  if (delivered) {
+    Sim_rx_update_run();
+  }
+}
+
+
+
+
+
+void Sim_uart_attach(UART_HandleTypeDef *_huart)
+{
+  if (_huart->Instance == USART1) {
+    Sim_uart_huart = _huart;
+  }
+}
+
+
+
+
+
+void Sim_uart_push(const char *_data, uint16_t _length, uint64_t _start_ns, uint32_t _baud)
+{
+  // 8N1: ten bit times per byte, back to back
+  uint64_t frame = 10 * SIM_NS_PER_S / _baud;
+
+  for (uint16_t i = 0; i < _length && Sim_rx_count < SIM_RX_QUEUE_SIZE; i++) {
+    Sim_rx_byte_t *b = &Sim_rx_queue[(Sim_rx_head + Sim_rx_count) % SIM_RX_QUEUE_SIZE];
+    b->start = _start_ns + i * frame;
+    b->end = b->start + frame;
+    b->baud = _baud;
+    b->byte = (uint8_t) _data[i];
+    Sim_rx_count++;
+  }
+  Sim_rx_update_run();
+}
+
+
+
+
+
+void Sim_spi_start(SPI_HandleTypeDef *_hspi, uint8_t *_data, uint16_t _size)
+{
+  // Eight SCK periods per byte, SCK = PCLK1 / 2^(BR + 1)
+  uint32_t prescaler = 2U << ((_hspi->Instance->CR1 & SPI_CR1_BR) >> SPI_CR1_BR_Pos);
+
+  if (_size > sizeof(Sim_spi_data)) {
+    _size = sizeof(Sim_spi_data);
+  }
+  memcpy(Sim_spi_data, _data, _size);
+  Sim_spi_size = _size;
+  Sim_spi_hspi = _hspi;
+  Sim_spi_done = Sim_now() + Sim_scale((uint64_t) _size * 8 * prescaler, SIM_NS_PER_S, Sim_pclk1_hz());
+  Sim_stats.spi_frames++;
+}
+
+
+
+
+
+uint8_t Sim_spi_take_complete(SPI_HandleTypeDef *_hspi)
+{
+  if (Sim_spi_complete && _hspi == Sim_spi_hspi) {
+    Sim_spi_complete = 0;
+    return(1);
+  }
+  return(0);
+}
+
+
+
+
+
+void Sim_adc_start(ADC_HandleTypeDef *_hadc, uint16_t *_buffer, uint32_t _length)
+{
+  Sim_adc_hadc = _hadc;
+  Sim_adc_half = _length / 2;
+  Sim_dma_start(_hadc->DMA_Handle, (uint8_t *) _buffer, _length);
+  Sim_adc_next = SIM_NEVER;
+  Sim_periph_sync();
+}
+
+
+
+
+
+void Sim_adc_stop()
+{
+  if (Sim_adc_hadc != NULL) {
+    Sim_dma_stop(Sim_adc_hadc->DMA_Handle);
+  }
+  Sim_adc_hadc = NULL;
+  Sim_adc_next = SIM_NEVER;
+}
+
+
+
+
+
+uint16_t Sim_adc_value()
+{
+  // Light level with a few counts of noise, clamped to 12 bits
+  int32_t value = 0;
+
+  Sim_noise = Sim_noise * 1103515245 + 12345;
+  value = (int32_t) Sim_scenario->light + (int32_t) ((Sim_noise >> 16) % (2 * SIM_ADC_NOISE + 1)) - SIM_ADC_NOISE;
+  if (value < 0) {
+    value = 0;
+  }
+  if (value > 4095) {
+    value = 4095;
+  }
+  return((uint16_t) value);
+}
+
+
+
+
+
+uint16_t Sim_adc_sample()
+{
+  uint16_t value = Sim_adc_value();
+
+  ADC1->DR = value;
+  return(value);
+}
+
+
+
+
+
+void Sim_adc_convert(uint32_t _count)
+{
+  // One conversion per trigger: up to the next half or full buffer mark the
+  // results go straight to memory, the last one is a DMA request (NDTR, flags)
+  DMA_Stream_TypeDef *stream = Sim_adc_hadc->DMA_Handle->Instance;
+  Sim_dma_stream_t *s = &Sim_dma_streams[Sim_dma_index(stream)];
+
+  while (_count > 0 && (stream->CR & DMA_SxCR_EN) && s->memory != NULL) {
+    uint32_t mark = (s->position < s->length / 2) ? s->length / 2 : s->length;
+    while (_count > 1 && s->position + 1 < mark) {
+      ((uint16_t *) s->memory)[s->position++] = Sim_adc_value();
+      _count--;
+    }
+    Sim_dma_write(stream, Sim_adc_sample());
+    _count--;
+  }
+}
+
+
+
+
+
+void Sim_flash_program(uint32_t _address, const void *_data, uint8_t _size)
+{
+  // Programming can only clear bits
+  volatile uint8_t *flash = (volatile uint8_t *) (uintptr_t) _address;
+  const uint8_t *data = _data;
+  uint8_t overwrite = 0;
+
+  for (uint8_t i = 0; i < _size; i++) {
+    if ((flash[i] & data[i]) != data[i]) {
+      overwrite = 1;
+    }
+    flash[i] &= data[i];
+  }
+  Sim_stats.flash_overwrites += overwrite;
+}
+
+
+
+
+
+void Sim_flash_erase(uint32_t _sector)
+{
+  // STM32F401xC: four 16K, one 64K, then 128K sectors
+  uint32_t address = 0;
+  uint32_t size = 0;
+
+  if (_sector < 4) {
+    address = SIM_FLASH_BASE + _sector * 0x4000;
+    size = 0x4000;
+  } else if (_sector == 4) {
+    address = SIM_FLASH_BASE + 0x10000;
+    size = 0x10000;
+  } else {
+    address = SIM_FLASH_BASE + 0x20000 + (_sector - 5) * 0x20000;
+    size = 0x20000;
+  }
+  if (address + size <= SIM_FLASH_BASE + SIM_FLASH_SIZE) {
+    memset((void *) (uintptr_t) address, 0xFF, size);
+    Sim_stats.flash_erases++;
+  }
+}
+
+
+
+
+
+uint64_t Sim_periph_next()
+{
+  uint64_t next = (Sim_iwdg_expiry < Sim_wakeup_next) ? Sim_iwdg_expiry : Sim_wakeup_next;
+
+  // The RTC and the IWDG keep running in Stop, everything else on the buses is frozen
+  if (Sim_is_stopped()) {
+    if (Sim_rx_count > 0 && (EXTI->IMR & EXTI_IMR_MR7) && (EXTI->FTSR & EXTI_FTSR_TR7)) {
+      uint64_t start = Sim_rx_queue[Sim_rx_head].start;
+      next = (start < next) ? start : next;
+    }
+    return(next);
+  }
+
+  for (uint8_t t = 0; t < SIM_TIMERS; t++) {
+    if ((Sim_timers[t].dier & TIM_DIER_UIE) && Sim_timers[t].next < next) {
+      next = Sim_timers[t].next;
+    }
+  }
+  if (Sim_adc_next < next) {
+    next = Sim_adc_next;
+  }
+  if (Sim_spi_done < next) {
+    next = Sim_spi_done;
+  }
+  // No idle line if the next byte starts within the frame: the run end covers it
+  if (Sim_rx_idle < next && (Sim_rx_count == 0 || Sim_rx_queue[Sim_rx_head].start >= Sim_rx_idle)) {
+    next = Sim_rx_idle;
+  }
+  if (Sim_rx_run_idle < next) {
+    next = Sim_rx_run_idle;
+  }
+  return(next);
+}
+
+
+
+
+
+void Sim_periph_advance(uint64_t _now)
+{
+  // The line moves on whatever the core does
+  Sim_rx_deliver(_now);
+}
+
+
+
+
+
+void Sim_periph_fire(uint64_t _now)
+{
+  if (Sim_iwdg_expiry <= _now) {
+    Sim_watchdog_reset();
+  }
+
+  // RTC wakeup: flag, EXTI line 22, interrupt
+  if (Sim_wakeup_next <= _now) {
+    Sim_wakeup_next += Sim_wakeup_period;
+    RTC->ISR |= RTC_ISR_WUTF;
+    EXTI->PR |= RTC_EXTI_LINE_WAKEUPTIMER_EVENT;
+    if (EXTI->IMR & RTC_EXTI_LINE_WAKEUPTIMER_EVENT) {
+      Sim_pend_irq(RTC_WKUP_IRQn);
+    }
+  }
+
+  if (Sim_is_stopped()) {
+    // Start bit on PB7: EXTI line 7 wakes the core, the byte itself is lost
+    if (Sim_rx_count > 0 && Sim_rx_queue[Sim_rx_head].start <= _now &&
+        (EXTI->IMR & EXTI_IMR_MR7) && (EXTI->FTSR & EXTI_FTSR_TR7)) {
+      Sim_rx_head = (Sim_rx_head + 1) % SIM_RX_QUEUE_SIZE;
+      Sim_rx_count--;
+      Sim_stats.rx_lost++;
+      Sim_rx_update_run();
+      EXTI->PR |= EXTI_PR_PR7;
+      Sim_pend_irq(EXTI9_5_IRQn);
+    }
+    return;
+  }
+
+  for (uint8_t t = 0; t < SIM_TIMERS; t++) {
+    Sim_timer_t *timer = &Sim_timers[t];
+    if (timer->next <= _now) {
+      timer->next += timer->period;
+      timer->tim->SR |= TIM_SR_UIF;
+      if (timer->tim->DIER & TIM_DIER_UIE) {
+        Sim_pend_irq(timer->irq);
+      }
+    }
+  }
+
+  // Half a buffer of conversions, one per trigger
+  if (Sim_adc_next <= _now) {
+    Sim_adc_next += Sim_adc_half * Sim_timers[SIM_TIMER_ADC].period;
+    if (Sim_adc_hadc != NULL) {
+      Sim_adc_convert(Sim_adc_half);
+    }
+  }
+
+  if (Sim_spi_done <= _now) {
+    Sim_spi_done = SIM_NEVER;
+    for (uint16_t i = 0; i < Sim_spi_size; i++) {
+      Sim_display_shift(Sim_spi_data[i]);
+    }
+    Sim_spi_complete = 1;
+    Sim_spi_hspi->Instance->SR |= SPI_SR_TXE;
+    Sim_pend_irq(SPI2_IRQn);
+  }
+
+  // Line idle for one frame after the last byte
+  if (Sim_rx_idle <= _now) {
+    Sim_rx_idle = SIM_NEVER;
+    USART1->SR |= USART_SR_IDLE;
+    if (USART1->CR1 & USART_CR1_IDLEIE) {
+      Sim_pend_irq(USART1_IRQn);
+    }
+  }
+  if (Sim_rx_run_idle <= _now) {
+    // Delivered by the advance, Sim_rx_idle is due now
+    Sim_rx_update_run();
+  }
+}
+
+
+
+
+
+void Sim_periph_resume(uint64_t _stopped_ns)
+{
+  // The bus clocks restart where they stopped
+  for (uint8_t t = 0; t < SIM_TIMERS; t++) {
+    if (Sim_timers[t].next != SIM_NEVER) {
+      Sim_timers[t].next += _stopped_ns;
+    }
+  }
+  if (Sim_adc_next != SIM_NEVER) {
+    Sim_adc_next += _stopped_ns;
+  }
+  if (Sim_spi_done != SIM_NEVER) {
+    Sim_spi_done += _stopped_ns;
+  }
+  if (Sim_rx_idle != SIM_NEVER) {
+    Sim_rx_idle += _stopped_ns;
+  }
+}
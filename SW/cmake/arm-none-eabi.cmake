@@ -0,0 +1,30 @@
+##############################################################################
+# Toolchain of the firmware: GNU Arm Embedded, Cortex-M4F of the STM32F401
+#
+#   cmake --preset firmware-size
+#
+# Copyright (c) 2023 Nicolò Campanini.
+##############################################################################
+
+set(CMAKE_SYSTEM_NAME Generic)
+set(CMAKE_SYSTEM_PROCESSOR arm)
+
+set(NIXIE_TOOLCHAIN_PREFIX arm-none-eabi-)
+set(CMAKE_C_COMPILER ${NIXIE_TOOLCHAIN_PREFIX}gcc)
+set(CMAKE_ASM_COMPILER ${NIXIE_TOOLCHAIN_PREFIX}gcc)
+set(CMAKE_OBJCOPY ${NIXIE_TOOLCHAIN_PREFIX}objcopy CACHE FILEPATH "")
+set(CMAKE_SIZE ${NIXIE_TOOLCHAIN_PREFIX}size CACHE FILEPATH "")
+# nm with the LTO plugin: reads the symbols of the LTO objects too
+set(NIXIE_NM ${NIXIE_TOOLCHAIN_PREFIX}gcc-nm CACHE FILEPATH "")
+
+# No host startup files: the compiler checks build a library
+set(CMAKE_TRY_COMPILE_TARGET_TYPE STATIC_LIBRARY)
+
+set(NIXIE_CPU_FLAGS "-mcpu=cortex-m4 -mthumb -mfpu=fpv4-sp-d16 -mfloat-abi=hard")
+set(CMAKE_C_FLAGS_INIT "${NIXIE_CPU_FLAGS}")
+set(CMAKE_ASM_FLAGS_INIT "${NIXIE_CPU_FLAGS} -x assembler-with-cpp")
+set(CMAKE_EXE_LINKER_FLAGS_INIT "${NIXIE_CPU_FLAGS} --specs=nano.specs --specs=nosys.specs")
+
+set(CMAKE_FIND_ROOT_PATH_MODE_PROGRAM NEVER)
+set(CMAKE_FIND_ROOT_PATH_MODE_LIBRARY ONLY)
+set(CMAKE_FIND_ROOT_PATH_MODE_INCLUDE ONLY)
@@ -0,0 +1,71 @@
+##############################################################################
+# Hand-written Cortex-M4 code through an ARM assembler, on the host:
+#
+#   cmake -DMC=<llvm-mc> -DSOURCES=<Core/Src> -DSTARTUP=<startup .s>
+#         -DOUTPUT=<directory> -P arm_asm_check.cmake
+#
+# The inline assembly of the naked handlers (__asm volatile blocks, only
+# built for __arm__) and the startup file are assembled for the STM32F401
+# core. The host build never sees them: a wrong mnemonic, an IT block or a
+# register the core doesn't have would only come out with the toolchain.
+#
+#   asm <file> ok
+#
+# Copyright (c) 2023 Nicolò Campanini.
+##############################################################################
+
+cmake_minimum_required(VERSION 3.21)
+
+foreach(variable MC SOURCES STARTUP OUTPUT)
+  if(NOT DEFINED ${variable})
+    message(FATAL_ERROR "arm_asm_check: ${variable} not set")
+  endif()
+endforeach()
+
+set(mc_options -triple=thumbv7em-none-eabi -mcpu=cortex-m4 -filetype=obj)
+file(MAKE_DIRECTORY ${OUTPUT})
+set(failed 0)
+
+function(assemble _input _object)
+  execute_process(COMMAND ${MC} ${mc_options} -o ${_object} ${_input}
+                  RESULT_VARIABLE result ERROR_VARIABLE errors)
+  if(NOT result EQUAL 0 OR NOT errors STREQUAL "")
+    message(SEND_ERROR "arm_asm_check: ${_input}\n${errors}")
+    set(failed 1 PARENT_SCOPE)
+  else()
+    message(STATUS "asm ${_input} ok")
+  endif()
+endfunction()
+
+# One file per block: the lines of its string literals, "\n" ended
+file(GLOB sources ${SOURCES}/*.c)
+set(blocks 0)
+foreach(source IN LISTS sources)
+  file(READ ${source} text)
+  string(REGEX MATCHALL "__asm volatile\\([^;]*\\)" asm_blocks "${text}")
+  set(index 0)
+  foreach(block IN LISTS asm_blocks)
+    get_filename_component(name ${source} NAME_WE)
+    set(asm_file ${OUTPUT}/${name}_${index}.s)
+    set(asm ".syntax unified\n.thumb\n")
+    string(REGEX MATCHALL "\"[^\"]*\"" literals "${block}")
+    foreach(literal IN LISTS literals)
+      string(REGEX REPLACE "^\"(.*)\"$" "\\1" literal "${literal}")
+      string(REPLACE "\\n" "\n" literal "${literal}")
+      string(APPEND asm "${literal}")
+    endforeach()
+    file(WRITE ${asm_file} "${asm}\n")
+    assemble(${asm_file} ${OUTPUT}/${name}_${index}.o)
+    math(EXPR index "${index} + 1")
+    math(EXPR blocks "${blocks} + 1")
+  endforeach()
+endforeach()
+if(blocks EQUAL 0)
+  message(FATAL_ERROR "arm_asm_check: no __asm volatile block in ${SOURCES}")
+endif()
+
+assemble(${STARTUP} ${OUTPUT}/startup.o)
+
+if(failed)
+  message(FATAL_ERROR "arm_asm_check: assembly failed")
+endif()
@@ -0,0 +1,71 @@
+##############################################################################
+# Size report of the image of an older commit, the reference of the deltas:
+#
+#   cmake -DGIT=<git> -DREF=<commit> -DSOURCE_DIR=<SW> -DWORK=<directory>
+#         -DTOOLCHAIN=<toolchain file> -DPROFILE=<size|speed> -DLTO=<ON|OFF>
+#         -DOUTPUT=<report> -P origin_image.cmake
+#
+# Core, Drivers and the linker script come from the commit, the build and
+# its scripts from the working tree: the two images are built by the same
+# rules, with the same compiler, profile and LTO, and differ by the sources
+# only. The commit doesn't need a build of its own (the first one only had
+# the .cproject of STM32CubeIDE).
+#
+# The output is the size report of cmake/size_report.cmake, headed by the
+# commit, which size_report.cmake reads back as ORIGIN.
+#
+# Copyright (c) 2023 Nicolò Campanini.
+##############################################################################
+
+cmake_minimum_required(VERSION 3.21)
+
+foreach(variable GIT REF SOURCE_DIR WORK TOOLCHAIN PROFILE LTO OUTPUT)
+  if(NOT DEFINED ${variable})
+    message(FATAL_ERROR "origin_image: ${variable} not set")
+  endif()
+endforeach()
+
+# The commit and where SW sits in the repository
+execute_process(COMMAND ${GIT} -C ${SOURCE_DIR} rev-parse --show-toplevel
+                OUTPUT_VARIABLE top OUTPUT_STRIP_TRAILING_WHITESPACE RESULT_VARIABLE result)
+if(NOT result EQUAL 0)
+  message(FATAL_ERROR "origin_image: ${SOURCE_DIR} is not in a git repository")
+endif()
+execute_process(COMMAND ${GIT} -C ${SOURCE_DIR} rev-parse --show-prefix
+                OUTPUT_VARIABLE prefix OUTPUT_STRIP_TRAILING_WHITESPACE)
+execute_process(COMMAND ${GIT} -C ${top} rev-parse --short --verify ${REF}^{commit}
+                OUTPUT_VARIABLE commit OUTPUT_STRIP_TRAILING_WHITESPACE RESULT_VARIABLE result)
+if(NOT result EQUAL 0)
+  message(FATAL_ERROR "origin_image: no commit ${REF}")
+endif()
+
+# Sources of the commit, build of the working tree
+set(tree ${WORK}/SW)
+file(REMOVE_RECURSE ${WORK})
+file(MAKE_DIRECTORY ${tree})
+execute_process(COMMAND ${GIT} -C ${top} archive --format=tar --output=${WORK}/sources.tar
+                        ${commit}:${prefix} Core Drivers STM32F401CCUX_FLASH.ld
+                RESULT_VARIABLE result)
+if(NOT result EQUAL 0)
+  message(FATAL_ERROR "origin_image: git archive of ${commit} failed")
+endif()
+execute_process(COMMAND ${CMAKE_COMMAND} -E tar xf ${WORK}/sources.tar WORKING_DIRECTORY ${tree})
+file(COPY ${SOURCE_DIR}/CMakeLists.txt ${SOURCE_DIR}/cmake DESTINATION ${tree})
+
+execute_process(COMMAND ${CMAKE_COMMAND} -S ${tree} -B ${WORK}/build
+                        -DCMAKE_TOOLCHAIN_FILE=${TOOLCHAIN}
+                        -DNIXIE_PROFILE=${PROFILE} -DNIXIE_LTO=${LTO}
+                RESULT_VARIABLE result)
+if(NOT result EQUAL 0)
+  message(FATAL_ERROR "origin_image: configuring the image of ${commit} failed")
+endif()
+execute_process(COMMAND ${CMAKE_COMMAND} --build ${WORK}/build --target nixie_clock
+                RESULT_VARIABLE result)
+if(NOT result EQUAL 0)
+  message(FATAL_ERROR "origin_image: building the image of ${commit} failed")
+endif()
+
+file(READ ${WORK}/build/nixie_clock.size.txt report)
+string(REGEX REPLACE "^# [^\n]*\n" "" report "${report}")
+file(WRITE ${OUTPUT} "# Size report of ${commit}, ${PROFILE} profile\n${report}")
+message(STATUS "Origin ${commit}: ${OUTPUT}")
@@ -0,0 +1,200 @@
+##############################################################################
+# Flash and RAM report of the firmware image, run after the link:
+#
+#   cmake -DELF=<image> -DOBJECTS=<list file> -DNM=<nm> -DSIZE=<size>
+#         [-DORIGIN=<report>] -DOUTPUT=<report> -P size_report.cmake
+#
+# The sections come from size -A. The modules are found from the symbols:
+# every symbol of the image is charged to the object that defines it (with
+# LTO the map file only knows the partitions), the rest to (libraries).
+# Functions inlined by the compiler are charged to their callers.
+#
+#   section <name> <bytes>
+#   total flash=<bytes> ram=<bytes> stack=<bytes>
+#   module <name> text=<bytes> rodata=<bytes> data=<bytes> bss=<bytes> flash=<bytes> ram=<bytes>
+#
+# With the report of an older image, ORIGIN (cmake/origin_image.cmake),
+# the differences from it follow, negative for a reduction, for every
+# module that changed:
+#
+#   origin <commit>
+#   delta flash=<bytes> ram=<bytes> stack=<bytes>
+#   delta module <name> flash=<bytes> ram=<bytes>
+#
+# Copyright (c) 2023 Nicolò Campanini.
+##############################################################################
+
+cmake_minimum_required(VERSION 3.21)
+
+foreach(variable ELF OBJECTS NM SIZE OUTPUT)
+  if(NOT DEFINED ${variable})
+    message(FATAL_ERROR "size_report: ${variable} not set")
+  endif()
+endforeach()
+
+# Sections in the flash, in the RAM, or in both (.data: its copy and itself)
+set(flash_sections .isr_vector .text .rodata .ARM.extab .ARM .preinit_array .init_array .fini_array .data)
+set(ram_sections .data .bss .noinit)
+# The stack reservation of the linker script
+set(stack_sections ._user_heap_stack)
+
+execute_process(COMMAND ${SIZE} -A ${ELF} OUTPUT_VARIABLE size_output RESULT_VARIABLE result)
+if(NOT result EQUAL 0)
+  message(FATAL_ERROR "size_report: ${SIZE} failed on ${ELF}")
+endif()
+
+set(report "# Size report of ${ELF}\n")
+set(flash 0)
+set(ram 0)
+set(stack 0)
+string(REPLACE "\n" ";" size_lines "${size_output}")
+foreach(line IN LISTS size_lines)
+  if(NOT line MATCHES "^(\\.[^ ]+) +([0-9]+) +[0-9]+")
+    continue()
+  endif()
+  set(section ${CMAKE_MATCH_1})
+  set(bytes ${CMAKE_MATCH_2})
+  if(section IN_LIST flash_sections)
+    math(EXPR flash "${flash} + ${bytes}")
+  endif()
+  if(section IN_LIST ram_sections)
+    math(EXPR ram "${ram} + ${bytes}")
+  endif()
+  if(section IN_LIST stack_sections)
+    math(EXPR stack "${stack} + ${bytes}")
+  endif()
+  if(section IN_LIST flash_sections OR section IN_LIST ram_sections OR section IN_LIST stack_sections)
+    string(APPEND report "section ${section} ${bytes}\n")
+  endif()
+endforeach()
+string(APPEND report "total flash=${flash} ram=${ram} stack=${stack}\n")
+
+# Owner of every symbol defined by the objects of the image
+file(STRINGS ${OBJECTS} objects)
+set(modules "")
+foreach(object IN LISTS objects)
+  get_filename_component(module ${object} NAME)
+  string(REGEX REPLACE "\\.(c|s)(\\.obj|\\.o)?$" "" module ${module})
+  list(APPEND modules ${module})
+  execute_process(COMMAND ${NM} --defined-only ${object} OUTPUT_VARIABLE nm_output ERROR_QUIET)
+  string(REPLACE "\n" ";" nm_lines "${nm_output}")
+  foreach(line IN LISTS nm_lines)
+    if(line MATCHES "^[0-9a-fA-F]* *[A-Za-z] ([A-Za-z_][A-Za-z0-9_]*)$")
+      if(NOT DEFINED owner_${CMAKE_MATCH_1})
+        set(owner_${CMAKE_MATCH_1} ${module})
+      endif()
+    endif()
+  endforeach()
+endforeach()
+list(APPEND modules "(libraries)")
+list(REMOVE_DUPLICATES modules)
+list(SORT modules)
+foreach(module IN LISTS modules)
+  foreach(kind text rodata data bss)
+    set(${kind}_${module} 0)
+  endforeach()
+endforeach()
+
+# Symbols of the image, their compiler suffixes (.lto_priv.0, .constprop.0,
+# .isra.0) removed
+execute_process(COMMAND ${NM} --print-size ${ELF} OUTPUT_VARIABLE nm_output RESULT_VARIABLE result)
+if(NOT result EQUAL 0)
+  message(FATAL_ERROR "size_report: ${NM} failed on ${ELF}")
+endif()
+string(REPLACE "\n" ";" nm_lines "${nm_output}")
+foreach(line IN LISTS nm_lines)
+  if(NOT line MATCHES "^[0-9a-fA-F]+ ([0-9a-fA-F]+) ([A-Za-z]) ([A-Za-z_][A-Za-z0-9_]*)")
+    continue()
+  endif()
+  set(symbol ${CMAKE_MATCH_3})
+  set(type ${CMAKE_MATCH_2})
+  math(EXPR bytes "0x${CMAKE_MATCH_1}")
+  if(type MATCHES "^[TtWw]$")
+    set(kind text)
+  elseif(type MATCHES "^[Rr]$")
+    set(kind rodata)
+  elseif(type MATCHES "^[Dd]$")
+    set(kind data)
+  elseif(type MATCHES "^[BbC]$")
+    set(kind bss)
+  else()
+    continue()
+  endif()
+  if(DEFINED owner_${symbol})
+    set(module ${owner_${symbol}})
+  else()
+    set(module "(libraries)")
+  endif()
+  math(EXPR ${kind}_${module} "${${kind}_${module}} + ${bytes}")
+endforeach()
+
+foreach(module IN LISTS modules)
+  math(EXPR module_flash "${text_${module}} + ${rodata_${module}} + ${data_${module}}")
+  math(EXPR module_ram "${data_${module}} + ${bss_${module}}")
+  string(APPEND report "module ${module} text=${text_${module}} rodata=${rodata_${module}} "
+                       "data=${data_${module}} bss=${bss_${module}} flash=${module_flash} ram=${module_ram}\n")
+endforeach()
+
+# Signed difference, "+" for a growth
+macro(delta _value _origin _out)
+  math(EXPR ${_out} "${_value} - ${_origin}")
+  if(${_out} GREATER 0)
+    set(${_out} "+${${_out}}")
+  endif()
+endmacro()
+
+if(DEFINED ORIGIN AND EXISTS ${ORIGIN})
+  set(origin_commit "")
+  set(origin_modules "")
+  file(STRINGS ${ORIGIN} origin_lines)
+  foreach(line IN LISTS origin_lines)
+    if(line MATCHES "^# Size report of ([^,]+)")
+      set(origin_commit ${CMAKE_MATCH_1})
+    elseif(line MATCHES "^total flash=([0-9]+) ram=([0-9]+) stack=([0-9]+)$")
+      set(origin_flash ${CMAKE_MATCH_1})
+      set(origin_ram ${CMAKE_MATCH_2})
+      set(origin_stack ${CMAKE_MATCH_3})
+    elseif(line MATCHES "^module ([^ ]+) .* flash=([0-9]+) ram=([0-9]+)$")
+      list(APPEND origin_modules ${CMAKE_MATCH_1})
+      set(origin_flash_${CMAKE_MATCH_1} ${CMAKE_MATCH_2})
+      set(origin_ram_${CMAKE_MATCH_1} ${CMAKE_MATCH_3})
+    endif()
+  endforeach()
+  if(NOT DEFINED origin_flash)
+    message(FATAL_ERROR "size_report: no total in ${ORIGIN}")
+  endif()
+
+  delta(${flash} ${origin_flash} delta_flash)
+  delta(${ram} ${origin_ram} delta_ram)
+  delta(${stack} ${origin_stack} delta_stack)
+  string(APPEND report "origin ${origin_commit}\n")
+  string(APPEND report "delta flash=${delta_flash} ram=${delta_ram} stack=${delta_stack}\n")
+  set(all_modules ${modules} ${origin_modules})
+  list(REMOVE_DUPLICATES all_modules)
+  list(SORT all_modules)
+  foreach(module IN LISTS all_modules)
+    foreach(kind flash ram)
+      if(NOT DEFINED origin_${kind}_${module})
+        set(origin_${kind}_${module} 0)
+      endif()
+    endforeach()
+    if(module IN_LIST modules)
+      math(EXPR module_flash "${text_${module}} + ${rodata_${module}} + ${data_${module}}")
+      math(EXPR module_ram "${data_${module}} + ${bss_${module}}")
+    else()
+      set(module_flash 0)
+      set(module_ram 0)
+    endif()
+    delta(${module_flash} ${origin_flash_${module}} delta_module_flash)
+    delta(${module_ram} ${origin_ram_${module}} delta_module_ram)
+    if(NOT delta_module_flash EQUAL 0 OR NOT delta_module_ram EQUAL 0)
+      string(APPEND report "delta module ${module} flash=${delta_module_flash} ram=${delta_module_ram}\n")
+    endif()
+  endforeach()
+endif()
+
+file(WRITE ${OUTPUT} "${report}")
+message(STATUS "Size report: flash ${flash} bytes, RAM ${ram} bytes, stack ${stack} bytes (${OUTPUT})")
+if(DEFINED delta_flash)
+  message(STATUS "Against ${origin_commit}: flash ${delta_flash} bytes, RAM ${delta_ram} bytes, stack ${delta_stack} bytes")
+endif()
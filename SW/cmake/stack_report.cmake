@@ -0,0 +1,257 @@
+##############################################################################
+# Worst-case stack report of the firmware image, run after the link:
+#
+#   cmake -DOBJECTS=<list file> -DSOURCES=<Core dir> -DELF=<image> -DNM=<nm>
+#         -DOUTPUT=<report> -P stack_report.cmake
+#
+# Reads the call graph files that -fcallgraph-info=su writes next to each
+# object (frame of every function, calls between them), and the sources
+# for the roots:
+#   tasks      main(), and the tasks of Sched_register() run by Sched_run()
+#   deferred   Deferred_post() in Core/Src, run by PendSV_Handler()
+#   handlers   the vectors of Core/Startup, at the priority given by
+#              HAL_NVIC_SetPriority() (TICK_INT_PRIORITY for SysTick)
+#
+#   task|deferred|isr <name> [prio=<n>] <bytes> <call path> [<flags>]
+#   thread <bytes>         main(), or Sched_run() with the deepest task
+#   level <prio> <bytes>   deepest handler of the priority, with the frame
+#                          the hardware stacks (104 bytes with the FPU)
+#   total <bytes> available=<bytes> reserved=<bytes>
+#
+# The total nests one handler per priority level over the thread: a bound,
+# if the flags are clear. Flags: indirect (call through a pointer, not
+# followed), unknown (function without a call graph, e.g. newlib), dynamic
+# (alloca or a variable length array), recursive. The call graph is the
+# one of the compiler, before LTO: inlining at the link is not seen.
+#
+# Copyright (c) 2023 Nicolò Campanini.
+##############################################################################
+
+cmake_minimum_required(VERSION 3.21)
+
+foreach(variable OBJECTS SOURCES ELF NM OUTPUT)
+  if(NOT DEFINED ${variable})
+    message(FATAL_ERROR "stack_report: ${variable} not set")
+  endif()
+endforeach()
+
+# Exception frame with the FPU state, and the handlers that end in a reset
+set(exception_frame 104)
+set(fault_handlers NMI_Handler HardFault_Handler MemManage_Handler BusFault_Handler UsageFault_Handler)
+
+# Call graph
+set(functions "")
+file(STRINGS ${OBJECTS} objects)
+foreach(object IN LISTS objects)
+  string(REGEX REPLACE "\\.(obj|o)$" ".ci" graph ${object})
+  if(NOT EXISTS ${graph})
+    continue()
+  endif()
+  file(STRINGS ${graph} lines)
+  foreach(line IN LISTS lines)
+    # Local and weak functions are titled <source>:<name>: by the name
+    # only, so that calls to a weak callback reach its override
+    string(REGEX REPLACE "\"[^\" ]+\\.c:" "\"" line "${line}")
+    if(line MATCHES "^node: { title: \"([^\"]+)\" label: \"[^\"]*\\\\n([0-9]+) bytes \\(([a-z,]+)\\)")
+      set(name ${CMAKE_MATCH_1})
+      list(APPEND functions ${name})
+      # Same name in two modules: the larger frame
+      if(NOT DEFINED frame_${name} OR CMAKE_MATCH_2 GREATER frame_${name})
+        set(frame_${name} ${CMAKE_MATCH_2})
+      endif()
+      if(CMAKE_MATCH_3 MATCHES "dynamic")
+        set(own_flags_${name} dynamic)
+      endif()
+    elseif(line MATCHES "^edge: { sourcename: \"([^\"]+)\" targetname: \"([^\"]+)\"")
+      list(APPEND calls_${CMAKE_MATCH_1} ${CMAKE_MATCH_2})
+    endif()
+  endforeach()
+endforeach()
+list(REMOVE_DUPLICATES functions)
+if(functions STREQUAL "")
+  message(FATAL_ERROR "stack_report: no call graph files next to the objects (-fcallgraph-info=su)")
+endif()
+
+# Deepest path from a function: its frame plus the deepest callee. The
+# results are global properties, shared by the nested calls.
+function(stack_depth _name)
+  get_property(known GLOBAL PROPERTY depth_${_name} SET)
+  if(known)
+    return()
+  endif()
+  if(_name STREQUAL "__indirect_call")
+    set_property(GLOBAL PROPERTY depth_${_name} 0)
+    set_property(GLOBAL PROPERTY path_${_name} "")
+    set_property(GLOBAL PROPERTY flags_${_name} indirect)
+    return()
+  endif()
+  if(NOT DEFINED frame_${_name})
+    set_property(GLOBAL PROPERTY depth_${_name} 0)
+    set_property(GLOBAL PROPERTY path_${_name} ${_name})
+    set_property(GLOBAL PROPERTY flags_${_name} unknown)
+    set_property(GLOBAL APPEND PROPERTY unknown_functions ${_name})
+    return()
+  endif()
+  # A call back into the path: counted once, flagged
+  set_property(GLOBAL PROPERTY depth_${_name} 0)
+  set_property(GLOBAL PROPERTY path_${_name} ${_name})
+  set_property(GLOBAL PROPERTY flags_${_name} recursive)
+
+  set(deepest 0)
+  set(deepest_path "")
+  set(flags ${own_flags_${_name}})
+  foreach(callee IN LISTS calls_${_name})
+    stack_depth(${callee})
+    get_property(depth GLOBAL PROPERTY depth_${callee})
+    get_property(path GLOBAL PROPERTY path_${callee})
+    get_property(callee_flags GLOBAL PROPERTY flags_${callee})
+    if(depth GREATER deepest OR deepest_path STREQUAL "")
+      set(deepest ${depth})
+      set(deepest_path "${path}")
+    endif()
+    list(APPEND flags ${callee_flags})
+  endforeach()
+  math(EXPR depth "${frame_${_name}} + ${deepest}")
+  list(REMOVE_DUPLICATES flags)
+  set_property(GLOBAL PROPERTY depth_${_name} ${depth})
+  set_property(GLOBAL PROPERTY path_${_name} ${_name} ${deepest_path})
+  set_property(GLOBAL PROPERTY flags_${_name} "${flags}")
+endfunction()
+
+# Roots from the sources
+set(tasks main)
+set(deferred "")
+set(vectors "")
+file(GLOB startups ${SOURCES}/Startup/*.s)
+foreach(startup IN LISTS startups)
+  file(STRINGS ${startup} lines REGEX "^ *\\.word +[A-Za-z0-9_]+Handler( |$)")
+  foreach(line IN LISTS lines)
+    string(REGEX REPLACE ".*\\.word +([A-Za-z0-9_]+).*" "\\1" line "${line}")
+    list(APPEND vectors ${line})
+  endforeach()
+endforeach()
+file(GLOB sources ${SOURCES}/Src/*.c)
+foreach(source IN LISTS sources)
+  file(READ ${source} text)
+  string(REGEX MATCHALL "Sched_register\\([A-Z_]+, *[A-Za-z0-9_]+" matches "${text}")
+  foreach(match IN LISTS matches)
+    string(REGEX REPLACE ".*, *" "" match ${match})
+    list(APPEND tasks ${match})
+  endforeach()
+  string(REGEX MATCHALL "Deferred_post\\([A-Za-z0-9_]+," matches "${text}")
+  foreach(match IN LISTS matches)
+    string(REGEX REPLACE ".*\\(|,$" "" match ${match})
+    list(APPEND deferred ${match})
+  endforeach()
+  string(REGEX MATCHALL "HAL_NVIC_SetPriority\\([A-Za-z0-9_]+_IRQn, *[0-9]+" matches "${text}")
+  foreach(match IN LISTS matches)
+    string(REGEX MATCH "\\(([A-Za-z0-9_]+)_IRQn, *([0-9]+)" match ${match})
+    set(priority_${CMAKE_MATCH_1}_IRQHandler ${CMAKE_MATCH_2})
+    set(priority_${CMAKE_MATCH_1}_Handler ${CMAKE_MATCH_2})
+  endforeach()
+endforeach()
+file(STRINGS ${SOURCES}/Inc/stm32f4xx_hal_conf.h tick_priority REGEX "define +TICK_INT_PRIORITY")
+if(tick_priority MATCHES "TICK_INT_PRIORITY +([0-9]+)")
+  set(priority_SysTick_Handler ${CMAKE_MATCH_1})
+endif()
+list(REMOVE_DUPLICATES tasks)
+list(REMOVE_DUPLICATES deferred)
+
+macro(report_line _kind _name _extra)
+  stack_depth(${_name})
+  get_property(depth_${_name} GLOBAL PROPERTY depth_${_name})
+  get_property(path GLOBAL PROPERTY path_${_name})
+  get_property(flags GLOBAL PROPERTY flags_${_name})
+  string(REPLACE ";" ">" path "${path}")
+  string(REPLACE ";" "," flags "${flags}")
+  string(APPEND report "${_kind} ${_name} ${_extra}${depth_${_name}} ${path} ${flags}\n")
+endmacro()
+
+set(report "# Stack report of ${ELF}, bytes\n")
+
+# Thread: main(), and the tasks Sched_run() calls through their pointer
+set(deepest_task 0)
+foreach(task IN LISTS tasks)
+  report_line(task ${task} "")
+  if(NOT task STREQUAL "main" AND depth_${task} GREATER deepest_task)
+    set(deepest_task ${depth_${task}})
+  endif()
+endforeach()
+stack_depth(Sched_run)
+get_property(depth_scheduler GLOBAL PROPERTY depth_Sched_run)
+math(EXPR thread "${frame_main} + ${depth_scheduler} + ${deepest_task}")
+if(depth_main GREATER thread)
+  set(thread ${depth_main})
+endif()
+
+# Work run by PendSV
+set(deepest_deferred 0)
+foreach(work IN LISTS deferred)
+  report_line(deferred ${work} "")
+  if(depth_${work} GREATER deepest_deferred)
+    set(deepest_deferred ${depth_${work}})
+  endif()
+endforeach()
+
+# Handlers, the deepest of each priority
+set(levels "")
+foreach(function IN LISTS functions)
+  if(NOT function IN_LIST vectors)
+    continue()
+  endif()
+  if(function IN_LIST fault_handlers)
+    set(priority fault)
+  elseif(DEFINED priority_${function})
+    set(priority ${priority_${function}})
+  else()
+    set(priority none)
+  endif()
+  report_line(isr ${function} "prio=${priority} ")
+  set(depth ${depth_${function}})
+  if(function STREQUAL "PendSV_Handler")
+    math(EXPR depth "${depth} + ${deepest_deferred}")
+  endif()
+  if(NOT priority STREQUAL "none")
+    list(APPEND levels ${priority})
+    if(NOT DEFINED level_${priority} OR depth GREATER level_${priority})
+      set(level_${priority} ${depth})
+    endif()
+  endif()
+endforeach()
+list(REMOVE_DUPLICATES levels)
+list(SORT levels COMPARE NATURAL)
+
+string(APPEND report "thread ${thread}\n")
+set(total ${thread})
+foreach(level IN LISTS levels)
+  math(EXPR level_${level} "${level_${level}} + ${exception_frame}")
+  math(EXPR total "${total} + ${level_${level}}")
+  string(APPEND report "level ${level} ${level_${level}}\n")
+endforeach()
+
+# Room of the image: from the guard to the end of the RAM
+set(available 0)
+execute_process(COMMAND ${NM} ${ELF} OUTPUT_VARIABLE symbols)
+if(symbols MATCHES "([0-9a-fA-F]+) [A-Za-z] _estack_guard\n")
+  set(guard ${CMAKE_MATCH_1})
+  if(symbols MATCHES "([0-9a-fA-F]+) [A-Za-z] _estack\n")
+    math(EXPR available "0x${CMAKE_MATCH_1} - 0x${guard}")
+  endif()
+endif()
+set(reserved 0)
+if(symbols MATCHES "([0-9a-fA-F]+) [A-Za-z] _Min_Stack_Size\n")
+  math(EXPR reserved "0x${CMAKE_MATCH_1}")
+endif()
+string(APPEND report "total ${total} available=${available} reserved=${reserved}\n")
+
+get_property(unknown_functions GLOBAL PROPERTY unknown_functions)
+list(REMOVE_DUPLICATES unknown_functions)
+list(SORT unknown_functions)
+string(REPLACE ";" " " unknown_functions "${unknown_functions}")
+string(APPEND report "# unknown: ${unknown_functions}\n")
+
+file(WRITE ${OUTPUT} "${report}")
+message(STATUS "Stack report: worst case ${total} bytes, ${available} available (${OUTPUT})")
+if(available GREATER 0 AND total GREATER available)
+  message(WARNING "Worst case stack ${total} bytes over the ${available} bytes available")
+endif()